@@ -0,0 +1,1522 @@
+#include "eir.h"
+
+#include "string_util.h"
+
+#include <sqlite3.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <queue>
+#include <map>
+#include <set>
+#include <regex>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <paludis/util/join.hh>
+#include <paludis/util/tokeniser.hh>
+
+using namespace eir;
+
+/*
+ * Native replacement for scripts/bantracker.pl, using the same database
+ * tables and the same per-channel settings. Only SQLite is supported.
+ */
+
+namespace
+{
+    SettingHandle<std::string> bantracker_dsn("bantracker_dsn");
+    SettingHandle<bool> enable_logging("bantracker_enable_logging");
+
+    std::string irclc(std::string s)
+    {
+        for (std::string::iterator c = s.begin(); c != s.end(); ++c)
+            *c = cistring::tolowertab[(unsigned char)*c];
+        return s;
+    }
+
+    const char *mode_type(char mode)
+    {
+        switch (mode)
+        {
+            case 'b': return "ban";
+            case 'q': return "quiet";
+            case 'r': return "restricted";
+            case 'm': return "moderated";
+            case 'z': return "reduced moderation";
+            case 'n': return "no external send";
+            case 't': return "protect topic";
+            case 's': return "secret";
+            case 'Q': return "block forwarded users";
+            case 'i': return "invite only";
+            case 'c': return "filter colours";
+            case 'C': return "block ctcp";
+            case 'o': return "operator";
+            case 'v': return "voice";
+        }
+        return 0;
+    }
+
+    char mode_letter(const std::string & type)
+    {
+        static const char letters[] = "bqrmzntsQicCov";
+        for (const char *l = letters; *l; ++l)
+            if (type == mode_type(*l))
+                return *l;
+        return 0;
+    }
+
+    // The dircbot-style times bantracker has always taken: ~1d12h, with
+    // bare numbers in minutes.
+    time_t calc_time(const std::string & spec)
+    {
+        time_t total = 0;
+        std::string::size_type p = (!spec.empty() && spec[0] == '~') ? 1 : 0;
+        while (p < spec.size() && isdigit((unsigned char)spec[p]))
+        {
+            time_t n = 0;
+            while (p < spec.size() && isdigit((unsigned char)spec[p]))
+                n = n * 10 + (spec[p++] - '0');
+
+            char unit = p < spec.size() ? spec[p] : 'm';
+            switch (unit)
+            {
+                case 's': total += n; break;
+                case 'h': total += n * 3600; break;
+                case 'd': total += n * 86400; break;
+                case 'w': total += n * 604800; break;
+                case 'M': total += n * 2629800; break;
+                case 'y': total += n * 31557600; break;
+                default:  total += n * 60; break;
+            }
+            if (p < spec.size() && strchr("smhdwMy", unit))
+                ++p;
+        }
+        return total;
+    }
+
+    std::string format_date(time_t t)
+    {
+        char buf[32];
+        tm time;
+        gmtime_r(&t, &time);
+        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &time);
+        return buf;
+    }
+
+    // SQL LIKE, as the Perl queries used it: % and _ wildcards, ASCII case
+    // folded.
+    bool like(const char *pattern, const char *s)
+    {
+        for (; *pattern; ++pattern, ++s)
+        {
+            if (*pattern == '%')
+            {
+                for (; ; ++s)
+                {
+                    if (like(pattern + 1, s))
+                        return true;
+                    if (!*s)
+                        return false;
+                }
+            }
+            if (!*s || (*pattern != '_' && tolower((unsigned char)*pattern) != tolower((unsigned char)*s)))
+                return false;
+        }
+        return !*s;
+    }
+
+    bool regex_match(const std::string & re, const std::string & s)
+    {
+        if (re.empty())
+            return false;
+        try
+        {
+            return std::regex_search(s, std::regex(re));
+        }
+        catch (std::regex_error &)
+        {
+            return false;
+        }
+    }
+
+    // The database file, from a DBI dsn ("dbi:SQLite:dbname=...") or a plain path.
+    std::string database_path(const std::string & dsn)
+    {
+        std::string::size_type p = dsn.find("dbname=");
+        if (p != std::string::npos)
+            return dsn.substr(p + 7, dsn.find(';', p) - p - 7);
+        if (dsn.compare(0, 4, "dbi:") == 0)
+            return dsn.substr(dsn.rfind(':') + 1);
+        return dsn;
+    }
+
+    typedef std::vector<std::string> Row;
+    typedef std::vector<Row> Rows;
+
+    /*
+     * The database, used only from a thread of its own. Statements are
+     * queued; whatever has built up by the time the thread gets to it runs
+     * as one transaction, so a busy channel's log costs a commit per batch
+     * rather than per line. Results come back through the worker pool's
+     * completion queue once the transaction has committed, or failed to.
+     */
+    class BanDatabase
+    {
+        public:
+            // Given the new row's id, or 0 if it wasn't written.
+            typedef std::function<void (long long)> InsertDone;
+            typedef std::function<void (const Rows &)> QueryDone;
+
+        private:
+            struct Job
+            {
+                std::string sql;
+                Row params;
+                InsertDone inserted;
+                QueryDone rows;
+            };
+
+            sqlite3 *_db;
+            std::map<std::string, sqlite3_stmt *> _statements;
+
+            std::mutex _lock;
+            std::condition_variable _wake;
+            std::deque<Job> _jobs;
+            bool _stopping, _busy;
+            std::condition_variable _idle;
+
+            WorkerPool::Token _token;
+
+            // Results change the tracker's tables, which every bot shares.
+            SharedLock & _tables;
+
+            std::thread _thread;
+
+            void complete(WorkerPool::Job f)
+            {
+                SharedLock *tables = &_tables;
+                WorkerPool::get_instance()->complete([f, tables] () {
+                    std::lock_guard<SharedLock> guard(*tables);
+                    f();
+                }, _token);
+            }
+
+            void fail(const std::string & what)
+            {
+                std::string error = what + ": " + sqlite3_errmsg(_db);
+                complete([error] () {
+                    Logger::get_instance()->Log(0, 0, Logger::Warning, "bantracker: " + error);
+                });
+            }
+
+            sqlite3_stmt *statement(const std::string & sql)
+            {
+                std::map<std::string, sqlite3_stmt *>::iterator it = _statements.find(sql);
+                if (it != _statements.end())
+                    return it->second;
+
+                sqlite3_stmt *stmt = 0;
+                if (sqlite3_prepare_v2(_db, sql.c_str(), -1, &stmt, 0) != SQLITE_OK)
+                    return 0;
+                _statements.insert(std::make_pair(sql, stmt));
+                return stmt;
+            }
+
+            struct Result
+            {
+                InsertDone inserted;
+                long long id;
+                QueryDone rows;
+                Rows data;
+            };
+
+            // Every job with a callback gets a result, whether it worked or
+            // not, so that nobody is left waiting for one.
+            void run(const Job & job, std::vector<Result> & results)
+            {
+                Result result = { job.inserted, 0, job.rows, Rows() };
+
+                sqlite3_stmt *stmt = statement(job.sql);
+                if (!stmt)
+                    fail("Couldn't prepare " + job.sql);
+                else
+                {
+                    for (std::size_t i = 0; i < job.params.size(); ++i)
+                        sqlite3_bind_text(stmt, i + 1, job.params[i].c_str(), job.params[i].size(), SQLITE_TRANSIENT);
+
+                    int rc;
+                    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+                    {
+                        if (!job.rows)
+                            continue;
+                        Row row;
+                        for (int i = 0; i < sqlite3_column_count(stmt); ++i)
+                        {
+                            const unsigned char *text = sqlite3_column_text(stmt, i);
+                            row.push_back(text ? reinterpret_cast<const char *>(text) : "");
+                        }
+                        result.data.push_back(row);
+                    }
+                    if (rc != SQLITE_DONE)
+                        fail("Couldn't run " + job.sql);
+                    else if (job.inserted)
+                        result.id = sqlite3_last_insert_rowid(_db);
+
+                    sqlite3_reset(stmt);
+                    sqlite3_clear_bindings(stmt);
+                }
+
+                if (result.inserted || result.rows)
+                    results.push_back(result);
+            }
+
+            void writer()
+            {
+                while (true)
+                {
+                    std::deque<Job> batch;
+                    {
+                        std::unique_lock<std::mutex> guard(_lock);
+                        _busy = false;
+                        _idle.notify_all();
+                        _wake.wait(guard, [this] () { return _stopping || !_jobs.empty(); });
+                        if (_jobs.empty())
+                            return;
+                        batch.swap(_jobs);
+                        _busy = true;
+                    }
+
+                    std::vector<Result> results;
+                    sqlite3_exec(_db, "BEGIN", 0, 0, 0);
+                    for (std::deque<Job>::iterator it = batch.begin(); it != batch.end(); ++it)
+                        run(*it, results);
+                    if (sqlite3_exec(_db, "COMMIT", 0, 0, 0) != SQLITE_OK)
+                    {
+                        fail("Couldn't commit");
+                        sqlite3_exec(_db, "ROLLBACK", 0, 0, 0);
+                        for (std::vector<Result>::iterator it = results.begin(); it != results.end(); ++it)
+                            it->id = 0;
+                    }
+
+                    for (std::vector<Result>::iterator it = results.begin(); it != results.end(); ++it)
+                    {
+                        if (it->inserted)
+                        {
+                            InsertDone f = it->inserted;
+                            long long id = it->id;
+                            complete([f, id] () { f(id); });
+                        }
+                        else
+                        {
+                            QueryDone f = it->rows;
+                            Rows rows = it->data;
+                            complete([f, rows] () { f(rows); });
+                        }
+                    }
+                }
+            }
+
+            void queue(const Job & job)
+            {
+                {
+                    std::lock_guard<std::mutex> guard(_lock);
+                    _jobs.push_back(job);
+                }
+                _wake.notify_one();
+            }
+
+        public:
+            BanDatabase(const std::string & path, SharedLock & tables)
+                : _db(0), _stopping(false), _busy(false), _token(WorkerPool::new_token()), _tables(tables)
+            {
+                if (sqlite3_open(path.c_str(), &_db) != SQLITE_OK)
+                {
+                    std::string error = _db ? sqlite3_errmsg(_db) : "out of memory";
+                    sqlite3_close(_db);
+                    throw ConfigurationError("Couldn't open bantracker database " + path + ": " + error);
+                }
+                sqlite3_busy_timeout(_db, 5000);
+
+                // As doc/bantracker/schema-sqlite3.sql, for a new database.
+                sqlite3_exec(_db,
+                    "CREATE TABLE IF NOT EXISTS bans (i INTEGER PRIMARY KEY, channel VARCHAR, setter VARCHAR, "
+                    "mask VARCHAR, isSet BOOL, setDate DATETIME, reason VARCHAR, action INTEGER, "
+                    "actionDate DATETIME, \"affected\" TEXT, unbanner TEXT, unbanDate DATETIME, type varchar, "
+                    "nagged integer);"
+                    "CREATE TABLE IF NOT EXISTS log (i INTEGER PRIMARY KEY, channel VARCHAR, sender VARCHAR, "
+                    "command VARCHAR, data VARCHAR, date DATETIME);",
+                    0, 0, 0);
+
+                _thread = std::thread(&BanDatabase::writer, this);
+            }
+
+            ~BanDatabase()
+            {
+                {
+                    std::lock_guard<std::mutex> guard(_lock);
+                    _stopping = true;
+                }
+                _wake.notify_one();
+                _thread.join();
+                WorkerPool::get_instance()->cancel(_token);
+
+                for (std::map<std::string, sqlite3_stmt *>::iterator it = _statements.begin(); it != _statements.end(); ++it)
+                    sqlite3_finalize(it->second);
+                sqlite3_close(_db);
+            }
+
+            // Waits until everything queued so far has been written. Results
+            // still come back as usual, if there's a reactor left to take
+            // them.
+            void flush()
+            {
+                std::unique_lock<std::mutex> guard(_lock);
+                _idle.wait(guard, [this] () { return _jobs.empty() && !_busy; });
+            }
+
+            void execute(const std::string & sql, const Row & params)
+            {
+                Job job = { sql, params, InsertDone(), QueryDone() };
+                queue(job);
+            }
+
+            void insert(const std::string & sql, const Row & params, InsertDone done)
+            {
+                Job job = { sql, params, done, QueryDone() };
+                queue(job);
+            }
+
+            void query(const std::string & sql, const Row & params, QueryDone done)
+            {
+                Job job = { sql, params, InsertDone(), done };
+                queue(job);
+            }
+    };
+
+    const std::string ban_columns =
+        "i, mask, channel, setter, strftime('%s', setDate), reason, affected, action, strftime('%s', actionDate), "
+        "type, nagged FROM bans";
+
+    struct Ban
+    {
+        long long id;
+        std::string mask, channel, setter, reason, affected, type;
+        time_t set_date, action_date;
+        int action, nagged;
+
+        // When this ban is due on the deadline heap; zero if it isn't.
+        time_t deadline;
+
+        // Whose channel it's open on; unset for closed bans read back
+        // from the database.
+        Bot *bot;
+
+        explicit Ban(const Row & r)
+            : id(atoll(r[0].c_str())), mask(r[1]), channel(r[2]), setter(r[3]), reason(r[5]),
+              affected(r[6]), type(r[9]), set_date(atol(r[4].c_str())), action_date(atol(r[8].c_str())),
+              action(atoi(r[7].c_str())), nagged(atoi(r[10].c_str())), deadline(0), bot(0)
+        { }
+
+        Ban()
+            : id(0), set_date(0), action_date(0), action(0), nagged(0), deadline(0), bot(0)
+        { }
+    };
+
+    typedef std::pair<std::string, std::string> BanKey;
+
+    /*
+     * One database, shared by every bot whose bantracker_dsn names it. Ban
+     * ids only mean anything within one, so the open bans and everything
+     * that refers to them by id are kept with it.
+     */
+    struct Tracked
+    {
+        std::shared_ptr<BanDatabase> db;
+
+        std::map<long long, Ban> bans;
+
+        // Bans each setter has yet to comment on, oldest first.
+        std::map<std::string, std::deque<long long> > to_comment;
+
+        typedef std::pair<time_t, long long> Deadline;
+        std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline> > deadlines;
+        EventManager::id deadline_event;
+        time_t deadline_time;
+
+        Tracked() : deadline_event(0), deadline_time(0) { }
+    };
+
+    // Two bots may well be in channels of the same name on different
+    // networks.
+    typedef std::pair<Bot *, std::string> ChannelKey;
+
+    struct ChannelState
+    {
+        Bot *bot;
+        std::string name;
+
+        // Where this channel's bans are kept, once it's been needed. The
+        // channel's open bans are loaded from it then.
+        Tracked *tracked;
+
+        // What the channel's lists hold now, as (type, mask), and the ones
+        // being refilled from 367/728 replies.
+        std::set<BanKey> active, refill_bans, refill_quiets;
+        bool synced;
+
+        // Open bans in the database, and bans whose rows are still being
+        // written. If those are lifted before they're written, the row is
+        // closed as it's written and the count in lifted says so.
+        std::multimap<BanKey, long long> open;
+        std::map<BanKey, int> writing, lifted;
+
+        ChannelState() : bot(0), tracked(0), synced(false) { }
+    };
+}
+
+struct BanTracker : CommandHandlerBase<BanTracker>, Module
+{
+    // Held by the handlers for server lines, which every reactor runs, and
+    // by whatever else they might be running alongside.
+    SharedLock lock;
+
+    // By database path. One that couldn't be opened is left without a db,
+    // and not tried again.
+    std::map<std::string, Tracked> databases;
+
+    // Settings are by channel name alone, as they've always been saved.
+    std::map<std::string, std::map<std::string, std::string> > settings;
+
+    std::map<ChannelKey, ChannelState> channels;
+
+    std::string setting(const std::string & channel, const std::string & name)
+    {
+        std::map<std::string, std::map<std::string, std::string> >::iterator c = settings.find(channel);
+        if (c == settings.end())
+            return "";
+        std::map<std::string, std::string>::iterator s = c->second.find(name);
+        return s == c->second.end() ? "" : s->second;
+    }
+
+    bool enabled(const std::string & channel)
+    {
+        std::string e = setting(channel, "enabled");
+        return !e.empty() && e != "0";
+    }
+
+    Tracked *database(Bot *b)
+    {
+        if (!b)
+            return 0;
+
+        std::lock_guard<SharedLock> guard(lock);
+
+        std::string dsn = bantracker_dsn.get(b);
+        if (dsn.empty())
+            return 0;
+
+        std::string path = database_path(dsn);
+        std::map<std::string, Tracked>::iterator it = databases.find(path);
+        if (it != databases.end())
+            return it->second.db ? &it->second : 0;
+
+        Tracked & t = databases[path];
+        try
+        {
+            t.db.reset(new BanDatabase(path, lock));
+        }
+        catch (ConfigurationError & e)
+        {
+            Logger::get_instance()->Log(b, 0, Logger::Warning, e.message());
+            return 0;
+        }
+        return &t;
+    }
+
+    ChannelState & channel_state(Bot *b, const std::string & channel)
+    {
+        ChannelState & state = channels[ChannelKey(b, channel)];
+        if (!state.bot)
+        {
+            state.bot = b;
+            state.name = channel;
+        }
+        return state;
+    }
+
+    Tracked *tracked(ChannelState & state)
+    {
+        if (state.tracked)
+            return state.tracked;
+        state.tracked = database(state.bot);
+        if (!state.tracked)
+            return 0;
+
+        state.tracked->db->query("SELECT " + ban_columns + " WHERE unbanDate IS NULL AND channel = ?",
+                                 Row(1, state.name),
+                                 std::bind(&BanTracker::load_bans, this, state.bot, state.name, std::placeholders::_1));
+        return state.tracked;
+    }
+
+    void load_bans(Bot *b, std::string channel, const Rows & rows)
+    {
+        std::map<ChannelKey, ChannelState>::iterator state = channels.find(ChannelKey(b, channel));
+        if (state == channels.end() || !state->second.tracked)
+            return;
+        Tracked & t = *state->second.tracked;
+
+        for (Rows::const_iterator it = rows.begin(); it != rows.end(); ++it)
+        {
+            Ban ban(*it);
+            ban.bot = b;
+
+            // Another bot using the same database is tracking it already.
+            if (t.bans.count(ban.id))
+                continue;
+
+            state->second.open.insert(std::make_pair(BanKey(ban.type, ban.mask), ban.id));
+            schedule(t, t.bans[ban.id] = ban);
+        }
+        reschedule(t);
+    }
+
+    // Forgets a ban that's no longer open.
+    void drop_ban(Tracked & t, long long id)
+    {
+        std::map<long long, Ban>::iterator ban = t.bans.find(id);
+        if (ban == t.bans.end())
+            return;
+        std::deque<long long> & pending = t.to_comment[ban->second.setter];
+        pending.erase(std::remove(pending.begin(), pending.end(), id), pending.end());
+        t.bans.erase(ban);
+    }
+
+    std::string describe(const Ban & ban)
+    {
+        std::string text = "\002" + ban.type + "\002[" + paludis::stringify(ban.id) + "]";
+        if (!ban.mask.empty())
+            text += " \002" + ban.mask + "\002";
+        text += " was set on \002" + ban.channel + "\002 by \002" + ban.setter + "\002 on \002" +
+                format_date(ban.set_date) + "\002";
+        if (!ban.reason.empty())
+            text += " with reason \"\002" + ban.reason + "\002\"";
+        if (!ban.affected.empty())
+            text += " It affected " + ban.affected + " and";
+        else
+            text += " and";
+        text += " had an expiry date of \002" + format_date(ban.action_date) + "Z.\002";
+
+        std::string prefix = setting(ban.channel, "urlprefix");
+        if (!prefix.empty())
+        {
+            std::string c;
+            for (std::string::const_iterator it = ban.channel.begin(); it != ban.channel.end(); ++it)
+            {
+                if (isalnum((unsigned char)*it))
+                    c += *it;
+                else
+                {
+                    char buf[4];
+                    snprintf(buf, sizeof(buf), "%%%02X", (unsigned char)*it);
+                    c += buf;
+                }
+            }
+            text += " Log: " + prefix + "?i=" + paludis::stringify(ban.id) + "&ts=" +
+                    paludis::stringify(ban.set_date) + "&c=" + c;
+        }
+        return text;
+    }
+
+    void report(ChannelState & state, const std::string & event, const std::string & text)
+    {
+        std::string target = setting(state.name, "report");
+        if (!target.empty() && lowercase(setting(state.name, "reporton")).find(event) != std::string::npos)
+            state.bot->send("NOTICE " + target + " :" + text);
+    }
+
+    bool bot_is_opped(ChannelState & state)
+    {
+        if (!state.bot->me())
+            return false;
+        Membership::ptr mem = state.bot->me()->find_membership(state.name);
+        return mem && mem->has_mode('o');
+    }
+
+    void send_modes(ChannelState & state, const std::vector<std::pair<char, std::string> > & modes)
+    {
+        Bot *b = state.bot;
+        const std::string & channel = state.name;
+        for (std::size_t i = 0; i < modes.size(); i += 4)
+        {
+            std::string letters, args;
+            for (std::size_t j = i; j < modes.size() && j < i + 4; ++j)
+            {
+                letters += modes[j].first;
+                args += " " + modes[j].second;
+            }
+            b->send("MODE " + channel + " -" + letters + args);
+        }
+    }
+
+    // Expiry
+
+    void schedule(Tracked & t, Ban & ban)
+    {
+        std::string frequency = setting(ban.channel, "frequency");
+        if (!enabled(ban.channel) || frequency.empty())
+        {
+            ban.deadline = 0;
+            return;
+        }
+        ban.deadline = std::max(ban.action_date, time(NULL));
+        t.deadlines.push(Tracked::Deadline(ban.deadline, ban.id));
+    }
+
+    void schedule_channel(ChannelState & state)
+    {
+        if (!state.tracked)
+            return;
+        for (std::multimap<BanKey, long long>::iterator it = state.open.begin(); it != state.open.end(); ++it)
+            schedule(*state.tracked, state.tracked->bans[it->second]);
+        reschedule(*state.tracked);
+    }
+
+    void reschedule(Tracked & t)
+    {
+        if (t.deadlines.empty() || (t.deadline_event && t.deadline_time <= t.deadlines.top().first))
+            return;
+        if (t.deadline_event)
+            EventManager::get_instance()->remove_event(t.deadline_event);
+        t.deadline_time = t.deadlines.top().first;
+        t.deadline_event = EventManager::get_instance()->add_event(t.deadline_time,
+                                std::bind(&BanTracker::run_deadlines, this, &t));
+    }
+
+    void run_deadlines(Tracked *t)
+    {
+        std::lock_guard<SharedLock> guard(lock);
+        t->deadline_event = 0;
+        time_t now = time(NULL);
+
+        std::map<ChannelState *, std::vector<std::pair<char, std::string> > > removals;
+        std::set<ChannelState *> asked_for_ops;
+
+        while (!t->deadlines.empty() && t->deadlines.top().first <= now)
+        {
+            Tracked::Deadline d = t->deadlines.top();
+            t->deadlines.pop();
+
+            std::map<long long, Ban>::iterator it = t->bans.find(d.second);
+            if (it == t->bans.end() || it->second.deadline != d.first)
+                continue;
+            Ban & ban = it->second;
+            std::map<ChannelKey, ChannelState>::iterator c = channels.find(ChannelKey(ban.bot, ban.channel));
+            if (c == channels.end())
+                continue;
+            ChannelState & state = c->second;
+            ban.deadline = 0;
+
+            if (state.synced && !state.active.count(BanKey(ban.type, ban.mask)))
+            {
+                report(state, "rem", "(\0039REM\003) " + describe(ban) + " Ban is no longer set on channel");
+                close_bans(state, BanKey(ban.type, ban.mask), state.bot->nick());
+                continue;
+            }
+
+            if (ban.action == 2 && !bot_is_opped(state))
+            {
+                if (asked_for_ops.insert(&state).second)
+                    state.bot->send("cs op " + ban.channel);
+            }
+            else if (ban.action > 0 && bot_is_opped(state) && mode_letter(ban.type))
+                removals[&state].push_back(std::make_pair(mode_letter(ban.type), ban.mask));
+            else
+            {
+                std::string text = "(\00310EXP\003) " + describe(ban);
+                if (ban.nagged)
+                    text += " This has been nagged " + paludis::stringify(ban.nagged) + " times.";
+                report(state, "exp", text);
+
+                Row params;
+                params.push_back(paludis::stringify(++ban.nagged));
+                params.push_back(paludis::stringify(ban.id));
+                t->db->execute("UPDATE bans SET nagged=? WHERE i=?", params);
+            }
+
+            ban.deadline = now + calc_time(setting(ban.channel, "frequency") + "s");
+            t->deadlines.push(Tracked::Deadline(ban.deadline, ban.id));
+        }
+
+        for (std::map<ChannelState *, std::vector<std::pair<char, std::string> > >::iterator it = removals.begin();
+                it != removals.end(); ++it)
+            send_modes(*it->first, it->second);
+
+        reschedule(*t);
+    }
+
+    void auto_remove_expired(ChannelState & state)
+    {
+        std::vector<std::pair<char, std::string> > modes;
+        time_t now = time(NULL);
+
+        if (state.tracked)
+            for (std::multimap<BanKey, long long>::iterator it = state.open.begin(); it != state.open.end(); ++it)
+            {
+                Ban & ban = state.tracked->bans[it->second];
+                if (ban.action > 0 && ban.action_date < now && mode_letter(ban.type))
+                    modes.push_back(std::make_pair(mode_letter(ban.type), ban.mask));
+            }
+        if (setting(state.name, "ops") != "yes")
+            modes.push_back(std::make_pair('o', state.bot->nick()));
+        send_modes(state, modes);
+    }
+
+    // Ban records
+
+    void close_bans(ChannelState & state, const BanKey & key, const std::string & remover)
+    {
+        if (!state.tracked)
+            return;
+
+        Row params;
+        params.push_back(remover);
+        params.push_back(state.name);
+        params.push_back(key.second);
+        params.push_back(key.first);
+        state.tracked->db->execute("UPDATE bans SET unbanner=?, unbanDate=datetime('now'), isSet='false' "
+                                   "WHERE channel=? AND mask=? AND type=? AND unbanDate IS NULL", params);
+
+        std::pair<std::multimap<BanKey, long long>::iterator, std::multimap<BanKey, long long>::iterator>
+            range = state.open.equal_range(key);
+        for (std::multimap<BanKey, long long>::iterator it = range.first; it != range.second; ++it)
+            drop_ban(*state.tracked, it->second);
+        state.open.erase(range.first, range.second);
+
+        std::map<BanKey, int>::iterator w = state.writing.find(key);
+        if (w != state.writing.end())
+            state.lifted[key] = w->second;
+    }
+
+    void ban_written(Bot *b, std::string channel, BanKey key, Ban ban, std::string nick, long long id)
+    {
+        // The bot may have gone in the meantime.
+        std::map<ChannelKey, ChannelState>::iterator c = channels.find(ChannelKey(b, channel));
+        if (c == channels.end())
+            return;
+        ChannelState & state = c->second;
+        Tracked & t = *state.tracked;
+        ban.id = id;
+
+        if (--state.writing[key] == 0)
+            state.writing.erase(key);
+        std::map<BanKey, int>::iterator lifted = state.lifted.find(key);
+        if (lifted != state.lifted.end())
+        {
+            if (--lifted->second == 0)
+                state.lifted.erase(lifted);
+            return;
+        }
+
+        // The database has said why.
+        if (!id)
+            return;
+
+        state.open.insert(std::make_pair(key, id));
+        schedule(t, t.bans[id] = ban);
+        reschedule(t);
+
+        std::deque<long long> & pending = t.to_comment[ban.setter];
+        pending.push_back(id);
+        if (pending.size() == 1)
+            request_comment(ban, nick);
+
+        std::string text = "(\0034NEW\003) \002" + ban.type + "\002[" + paludis::stringify(id) + "] was set";
+        if (!ban.mask.empty())
+            text += " on \002" + ban.mask + "\002";
+        text += " in \002" + channel + "\002 by \002" + ban.setter + "\002";
+        report(state, "new", text);
+    }
+
+    void request_comment(const Ban & ban, const std::string & nick)
+    {
+        Bot *b = ban.bot;
+        if (!b || nick.empty() || cistring::equal(nick, b->nick()))
+            return;
+        if (nick.size() >= 4 && irclc(nick.substr(nick.size() - 4)) == "serv")
+            return;
+        b->send("PRIVMSG " + nick + " :Please comment on the following: " + describe(ban));
+    }
+
+    // Finds a ban whether or not it's still open; closed ones come from the
+    // database, so f may run later.
+    void with_ban(Tracked *t, long long id, std::function<void (Ban *)> f)
+    {
+        if (!t)
+        {
+            f(0);
+            return;
+        }
+
+        std::map<long long, Ban>::iterator it = t->bans.find(id);
+        if (it != t->bans.end())
+        {
+            f(&it->second);
+            return;
+        }
+
+        t->db->query("SELECT " + ban_columns + " WHERE i = ?", Row(1, paludis::stringify(id)),
+            [f] (const Rows & rows) {
+                if (rows.empty())
+                    f(0);
+                else
+                {
+                    Ban ban(rows[0]);
+                    f(&ban);
+                }
+            });
+    }
+
+    void update_ban(const Message *m, const std::string & sender, std::vector<std::string> args,
+                    std::function<void (std::string)> reply)
+    {
+        if (args.empty() || !isdigit((unsigned char)args[0][0]))
+            return;
+        long long id = atoll(args[0].c_str());
+
+        time_t newtime = 0;
+        int action = -1;
+        std::string reason;
+        std::vector<std::string>::iterator rest = args.begin() + 1;
+        if (rest != args.end())
+        {
+            std::string::size_type tilde = rest->find('~');
+            if (tilde != std::string::npos && tilde <= 1 && (tilde == 0 || strchr("#@%", (*rest)[0])))
+            {
+                newtime = time(NULL) + calc_time(rest->substr(tilde + 1));
+                if (tilde == 1)
+                    action = (*rest)[0] == '#' ? 0 : (*rest)[0] == '@' ? 1 : 2;
+                ++rest;
+            }
+        }
+        reason = paludis::join(rest, args.end(), " ");
+
+        Tracked *t = database(m->bot);
+        with_ban(t, id, [this, t, sender, newtime, action, reason, reply] (Ban *ban) {
+            if (!ban)
+            {
+                reply("No such record.");
+                return;
+            }
+
+            // It may have been written while we were looking it up.
+            std::map<long long, Ban>::iterator open = t->bans.find(ban->id);
+            if (open != t->bans.end())
+                ban = &open->second;
+            if (irclc(sender) != ban->setter && !regex_match(setting(ban->channel, "admins"), sender))
+            {
+                reply("You do not have permission to alter that record.");
+                return;
+            }
+
+            Row params;
+            std::string sql;
+            if (newtime)
+            {
+                ban->action_date = newtime;
+                params.push_back(paludis::stringify(newtime));
+                sql = "actionDate = datetime(?,'unixepoch')";
+            }
+            if (!reason.empty())
+            {
+                ban->reason = reason;
+                params.push_back(reason);
+                sql += std::string(sql.empty() ? "" : ", ") + "reason = ?";
+            }
+            if (action >= 0)
+            {
+                ban->action = action;
+                params.push_back(paludis::stringify(action));
+                sql += std::string(sql.empty() ? "" : ", ") + "action = ?";
+            }
+            if (!sql.empty())
+            {
+                params.push_back(paludis::stringify(ban->id));
+                t->db->execute("UPDATE bans SET " + sql + " WHERE i = ?", params);
+            }
+            if (newtime && t->bans.count(ban->id))
+            {
+                schedule(*t, *ban);
+                reschedule(*t);
+            }
+            reply("Done.");
+        });
+    }
+
+    // IRC events
+
+    void irc_join(const Message *m)
+    {
+        if (!cistring::equal(m->source->name, m->bot->nick()))
+            return;
+        std::lock_guard<SharedLock> guard(lock);
+        std::string channel = irclc(m->source->destination);
+        tracked(channel_state(m->bot, channel));
+        if (enabled(channel))
+            m->bot->send("MODE " + channel + " qb");
+    }
+
+    void irc_list_entry(const Message *m)
+    {
+        // 367 <me> <channel> <mask> ...; 728 <me> <channel> q <mask> ...
+        bool quiet = m->command == "728";
+        if (m->args.size() < (quiet ? 3u : 2u))
+            return;
+        std::lock_guard<SharedLock> guard(lock);
+        ChannelState & state = channel_state(m->bot, irclc(m->args[0]));
+        (quiet ? state.refill_quiets : state.refill_bans).insert(BanKey(quiet ? "quiet" : "ban", m->args[quiet ? 2 : 1]));
+    }
+
+    void irc_list_end(const Message *m)
+    {
+        if (m->args.empty())
+            return;
+        bool quiet = m->command == "729";
+        std::lock_guard<SharedLock> guard(lock);
+        ChannelState & state = channel_state(m->bot, irclc(m->args[0]));
+        std::string type = quiet ? "quiet" : "ban";
+
+        for (std::set<BanKey>::iterator it = state.active.begin(); it != state.active.end(); )
+        {
+            if (it->first == type)
+                state.active.erase(it++);
+            else
+                ++it;
+        }
+        std::set<BanKey> & refill = quiet ? state.refill_quiets : state.refill_bans;
+        state.active.insert(refill.begin(), refill.end());
+        refill.clear();
+        state.synced = true;
+    }
+
+    void irc_modes(const Message *m)
+    {
+        std::lock_guard<SharedLock> guard(lock);
+        std::string channel = irclc(m->source->destination);
+        if (!m->modes || !enabled(channel))
+            return;
+
+        std::string sender = irclc(m->source->raw), nick = m->source->name;
+        std::string trackmodes = setting(channel, "trackmodes");
+        if (regex_match(setting(channel, "ignore"), sender))
+            return;
+
+        ChannelState & state = channel_state(m->bot, channel);
+        Tracked *t = tracked(state);
+
+        for (std::vector<ModeChange>::const_iterator it = m->modes->begin(); it != m->modes->end(); ++it)
+        {
+            const char *type = mode_type(it->mode);
+            if (!type || trackmodes.find(it->mode) == std::string::npos)
+            {
+                if (it->adding && it->mode == 'o' && cistring::equal(it->param, m->bot->nick()))
+                    auto_remove_expired(state);
+                continue;
+            }
+
+            BanKey key(type, it->param);
+            if (it->adding)
+            {
+                state.active.insert(key);
+                if (!t)
+                    continue;
+
+                std::string bantime = setting(channel, "bantime");
+                Ban ban;
+                ban.mask = it->param;
+                ban.channel = channel;
+                ban.setter = sender;
+                ban.type = type;
+                ban.set_date = time(NULL);
+                ban.action_date = ban.set_date + (bantime.empty() ? 86400 : calc_time(bantime));
+                ban.action = atoi(setting(channel, "action").c_str());
+                ban.bot = m->bot;
+
+                Row params;
+                params.push_back(channel);
+                params.push_back(sender);
+                params.push_back(ban.mask);
+                params.push_back(ban.type);
+                params.push_back(paludis::stringify(ban.action));
+                params.push_back(paludis::stringify(ban.action_date));
+                ++state.writing[key];
+                t->db->insert("INSERT INTO bans (channel, setter, mask, type, action, isSet, setDate, actionDate) "
+                              "VALUES (?, ?, ?, ?, ?, 'true', datetime('now'), datetime(?,'unixepoch'))", params,
+                              std::bind(&BanTracker::ban_written, this, m->bot, channel, key, ban, nick,
+                                        std::placeholders::_1));
+            }
+            else
+            {
+                state.active.erase(key);
+
+                std::pair<std::multimap<BanKey, long long>::iterator, std::multimap<BanKey, long long>::iterator>
+                    range = state.open.equal_range(key);
+                for (std::multimap<BanKey, long long>::iterator b = range.first; b != range.second; ++b)
+                    report(state, "rem", "(\0039REM\003) " + describe(t->bans[b->second]) + " It was removed by \002" +
+                           sender + "\002 on \002" + format_date(time(NULL)) + "Z\002");
+                close_bans(state, key, sender);
+            }
+        }
+    }
+
+    void irc_log(const Message *m)
+    {
+        if (!enable_logging.get(m->bot))
+            return;
+
+        std::string sender, command, target, data;
+        std::string::size_type p1 = m->raw.find(' '), p2, p3;
+        if (p1 == std::string::npos)
+            return;
+        sender = m->raw.substr(0, p1);
+        p2 = m->raw.find(' ', p1 + 1);
+        command = m->raw.substr(p1 + 1, p2 - p1 - 1);
+        if (p2 == std::string::npos)
+            return;
+        p3 = m->raw.find(' ', p2 + 1);
+        target = m->raw.substr(p2 + 1, p3 - p2 - 1);
+        if (p3 != std::string::npos)
+            data = m->raw.substr(p3 + 1);
+
+        std::string channel;
+        if (target.size() > 1 && (target[0] == '#' || (target[0] == ':' && target[1] == '#')))
+            channel = irclc(target.substr(target[0] == ':' ? 1 : 0));
+        else if ((command == "332" || command == "333") && !data.empty() && data[0] == '#')
+        {
+            std::string::size_type space = data.find(' ');
+            if (space == std::string::npos)
+                return;
+            channel = irclc(data.substr(0, space));
+            data = data.substr(space + 1);
+            sender = "*SERVER*";
+        }
+        else
+            return;
+
+        std::string logging = setting(channel, "logging");
+        if (logging.empty() || logging == "0")
+            return;
+
+        Tracked *t = database(m->bot);
+        if (!t)
+            return;
+
+        Row params;
+        params.push_back(channel);
+        params.push_back(sender);
+        params.push_back(command);
+        params.push_back(data);
+        t->db->execute("INSERT INTO log (channel, sender, command, data, date) values (?, ?, ?, ?, datetime('now'))", params);
+    }
+
+    // Commands
+
+    bool has_privilege(const Message *m)
+    {
+        return m->source->client && m->source->client->privs().has_privilege("bantracker");
+    }
+
+    // Results may come from the database after the message has gone, so
+    // these take what they need from it up front.
+    void reply_bans(Bot *b, SourcePtr source, bool privileged, const std::vector<const Ban *> & results, bool active_only)
+    {
+        std::string sender = source->raw;
+        int count = 0;
+        for (std::vector<const Ban *>::const_iterator it = results.begin(); it != results.end(); ++it)
+        {
+            const Ban & ban = **it;
+            if (irclc(sender) != ban.setter && !regex_match(setting(ban.channel, "admins"), sender) &&
+                    !regex_match(setting(ban.channel, "query"), sender) && !privileged)
+                continue;
+
+            std::map<ChannelKey, ChannelState>::iterator state = channels.find(ChannelKey(b, ban.channel));
+            bool active = state != channels.end() && state->second.active.count(BanKey(ban.type, ban.mask));
+            if (!active && active_only)
+                continue;
+
+            source->reply(describe(ban) + " It is currently " + (active ? "active." : "inactive."));
+            ++count;
+        }
+        if (count > 1)
+            source->reply("End of results");
+        else if (count == 0)
+            source->reply("No results");
+    }
+
+    void do_query(const Message *m)
+    {
+        if (m->args.empty())
+            return;
+
+        const std::string & command = m->command;
+        const std::string & arg = m->args[0];
+        time_t now = time(NULL);
+        std::vector<const Ban *> results;
+        Tracked *t = database(m->bot);
+
+        if (arg[0] == '#')
+        {
+            std::string channel = irclc(arg), pattern;
+            if (command == "btcheck")
+            {
+                if (m->args.size() < 2)
+                    return;
+                pattern = m->args[1];
+                if (pattern.find_first_of("%@$") == std::string::npos)
+                    pattern += "!%";
+            }
+
+            std::map<ChannelKey, ChannelState>::iterator state = channels.find(ChannelKey(m->bot, channel));
+            if (state != channels.end() && state->second.tracked)
+            {
+                for (std::multimap<BanKey, long long>::iterator it = state->second.open.begin();
+                        it != state->second.open.end(); ++it)
+                {
+                    const Ban & ban = state->second.tracked->bans[it->second];
+                    if ((command == "btpending" && !ban.reason.empty()) ||
+                            (command == "btexpired" && ban.action_date >= now) ||
+                            (command == "btcheck" && !like(pattern.c_str(), ban.mask.c_str())))
+                        continue;
+                    results.push_back(&ban);
+                }
+            }
+        }
+        else if (isdigit((unsigned char)arg[0]))
+        {
+            if (command != "btinfo")
+                return;
+            SourcePtr source = m->source;
+            Bot *b = m->bot;
+            bool privileged = has_privilege(m);
+            with_ban(t, atoll(arg.c_str()), [this, b, source, privileged] (Ban *ban) {
+                reply_bans(b, source, privileged, std::vector<const Ban *>(ban ? 1 : 0, ban), false);
+            });
+            return;
+        }
+        else if (command == "btinfo" || command == "btpending")
+        {
+            std::string pattern = irclc(arg) + "!%";
+            if (t)
+                for (std::map<long long, Ban>::iterator it = t->bans.begin(); it != t->bans.end(); ++it)
+                {
+                    if (command == "btpending" && !it->second.reason.empty())
+                        continue;
+                    if (like(pattern.c_str(), it->second.setter.c_str()))
+                        results.push_back(&it->second);
+                }
+        }
+        else
+            return;
+
+        reply_bans(m->bot, m->source, has_privilege(m), results, true);
+    }
+
+    void do_set(const Message *m)
+    {
+        if (m->args.size() < 2)
+        {
+            m->source->reply("Usage: btset banid [timespec] comment");
+            return;
+        }
+
+        std::string sender = irclc(m->source->raw);
+        if (Tracked *t = database(m->bot))
+        {
+            std::deque<long long> & pending = t->to_comment[sender];
+            pending.erase(std::remove(pending.begin(), pending.end(), atoll(m->args[0].c_str())), pending.end());
+        }
+
+        SourcePtr source = m->source;
+        update_ban(m, sender, m->args, [source] (std::string text) { source->reply(text); });
+    }
+
+    void comment(const Message *m, const std::vector<std::string> & args, bool command)
+    {
+        std::string sender = irclc(m->source->raw);
+        Tracked *t = database(m->bot);
+        if (!t || t->to_comment[sender].empty())
+        {
+            if (command)
+                m->source->reply("You have no bans to comment.");
+            return;
+        }
+
+        std::deque<long long> & pending = t->to_comment[sender];
+        std::vector<std::string> update_args(1, paludis::stringify(pending.front()));
+        update_args.insert(update_args.end(), args.begin(), args.end());
+        pending.pop_front();
+        update_ban(m, sender, update_args, [] (std::string) { });
+
+        if (!pending.empty())
+        {
+            std::map<long long, Ban>::iterator next = t->bans.find(pending.front());
+            if (next != t->bans.end())
+                request_comment(next->second, m->source->name);
+        }
+        else
+            m->source->reply("All your bans are now commented.");
+    }
+
+    void do_comment(const Message *m)
+    {
+        comment(m, m->args, true);
+    }
+
+    // A private message to the bot that isn't a command comments on the
+    // oldest ban the sender still owes a comment for.
+    void private_comment(const Message *m)
+    {
+        if (m->args.empty() || m->bot->supported()->is_channel_name(m->source->destination))
+            return;
+
+        std::vector<std::string> words;
+        paludis::tokenise_whitespace(m->args[0], std::back_inserter(words));
+        if (words.empty())
+            return;
+
+        std::string first = lowercase(words[0]);
+        if (first.compare(0, 2, "bt") == 0)
+            return;
+
+        std::lock_guard<SharedLock> guard(lock);
+        comment(m, words, false);
+    }
+
+    void do_config(const Message *m)
+    {
+        if (!has_privilege(m))
+        {
+            m->source->reply("You are not authorised to configure the bantracker");
+            return;
+        }
+        if (m->args.empty() || m->args[0][0] != '#')
+        {
+            m->source->reply("Usage: btconfig <#channel> [setting] [value]");
+            return;
+        }
+
+        static const char *options[] = { "enabled", "report", "frequency", "admins", "bantime", "ops",
+            "trackmodes", "action", "logging", "reporton", "query", "urlprefix", "ignore", 0 };
+
+        std::string channel = irclc(m->args[0]);
+        std::map<std::string, std::string> & chan = settings[channel];
+
+        if (m->args.size() == 1)
+        {
+            for (std::map<std::string, std::string>::iterator it = chan.begin(); it != chan.end(); ++it)
+                m->source->reply(channel + ": " + it->first + " = " + it->second);
+            if (chan.size() > 1)
+                m->source->reply("End of results.");
+            return;
+        }
+
+        const std::string & name = m->args[1];
+        const char **option = options;
+        while (*option && name != *option)
+            ++option;
+        if (!*option)
+        {
+            std::vector<std::string> all(options, options + sizeof(options) / sizeof(options[0]) - 1);
+            m->source->reply("Unknown setting: " + name + " (available settings: (" +
+                             paludis::join(all.begin(), all.end(), ", ") + ")");
+            return;
+        }
+
+        if (m->args.size() < 3)
+        {
+            m->source->reply(channel + ": " + name + " = " + setting(channel, name));
+            return;
+        }
+
+        if (m->args[2] == "CLEAR")
+        {
+            chan.erase(name);
+            m->source->reply("Cleared " + name + " for " + channel);
+        }
+        else
+        {
+            chan[name] = m->args[2];
+            m->source->reply("Set " + name + " to " + m->args[2] + " for " + channel);
+        }
+
+        if (name == "enabled" || name == "frequency")
+            for (std::map<ChannelKey, ChannelState>::iterator it = channels.begin(); it != channels.end(); ++it)
+                if (it->second.name == channel)
+                    schedule_channel(it->second);
+    }
+
+    void load_settings()
+    {
+        Value v = StorageManager::get_instance()->Load("bantracker");
+        if (v.Type() != Value::kvarray)
+            return;
+
+        settings.clear();
+        for (KeyValueArray::iterator c = v.KV().begin(); c != v.KV().end(); ++c)
+        {
+            if (c->second.Type() != Value::kvarray)
+                continue;
+            for (KeyValueArray::iterator s = c->second.KV().begin(); s != c->second.KV().end(); ++s)
+                if (s->second.Type() != Value::empty)
+                    settings[c->first][s->first] = s->second.String();
+        }
+    }
+
+    void do_saveconfig(const Message *m)
+    {
+        if (!has_privilege(m))
+        {
+            m->source->reply("You are not authorised to configure the bantracker");
+            return;
+        }
+
+        Value v(Value::kvarray);
+        for (std::map<std::string, std::map<std::string, std::string> >::iterator c = settings.begin();
+                c != settings.end(); ++c)
+        {
+            Value chan(Value::kvarray);
+            for (std::map<std::string, std::string>::iterator s = c->second.begin(); s != c->second.end(); ++s)
+                chan[s->first] = s->second;
+            v[c->first] = chan;
+        }
+
+        try
+        {
+            StorageManager::get_instance()->Save(v, "bantracker");
+            m->source->reply("Channel configuration saved");
+        }
+        catch (StorageError &)
+        {
+            m->source->reply("Unable to save channel configuration");
+        }
+    }
+
+    void do_loadconfig(const Message *m)
+    {
+        if (!has_privilege(m))
+        {
+            m->source->reply("You are not authorised to configure the bantracker");
+            return;
+        }
+
+        try
+        {
+            load_settings();
+            m->source->reply("Channel configuration reloaded");
+        }
+        catch (eir::Exception &)
+        {
+            m->source->reply("Unable to load channel configuration");
+        }
+
+        for (std::map<ChannelKey, ChannelState>::iterator it = channels.begin(); it != channels.end(); ++it)
+            schedule_channel(it->second);
+    }
+
+    // A restart execs without unloading anything, so whatever is still
+    // queued would be lost.
+    void shutting_down(const Message *m)
+    {
+        for (std::map<std::string, Tracked>::iterator it = databases.begin(); it != databases.end(); ++it)
+            if (it->second.db)
+                it->second.db->flush();
+        forget(m->bot);
+    }
+
+    // The bot's bans stay open in the database, for whichever bot joins
+    // the channel next.
+    void forget(Bot *b)
+    {
+        for (std::map<ChannelKey, ChannelState>::iterator it = channels.begin(); it != channels.end(); )
+        {
+            if (it->first.first != b)
+            {
+                ++it;
+                continue;
+            }
+            if (it->second.tracked)
+                for (std::multimap<BanKey, long long>::iterator ban = it->second.open.begin();
+                        ban != it->second.open.end(); ++ban)
+                    drop_ban(*it->second.tracked, ban->second);
+            channels.erase(it++);
+        }
+    }
+
+    void do_sync(const Message *m)
+    {
+        m->source->reply("Resyncing Channels");
+        for (Bot::ChannelIterator it = m->bot->begin_channels(); it != m->bot->end_channels(); ++it)
+        {
+            std::string channel = irclc((*it)->name());
+            if (!enabled(channel))
+                continue;
+            ChannelState & state = channel_state(m->bot, channel);
+            state.active.clear();
+            state.synced = false;
+            m->bot->send("MODE " + channel + " qb");
+        }
+    }
+
+    CommandHolder join_id, list_id, quiet_list_id, list_end_id, quiet_list_end_id, modes_id, privmsg_id,
+                  info_id, pending_id, expired_id, check_id, set_id, comment_id, config_id,
+                  saveconfig_id, loadconfig_id, sync_id, shutdown_id;
+    CommandHolder log_ids[10];
+
+    BanTracker()
+    {
+        try
+        {
+            load_settings();
+        }
+        catch (eir::Exception &)
+        {
+        }
+
+        join_id = add_handler(filter_command_type("JOIN", sourceinfo::RawIrc), &BanTracker::irc_join, true);
+        list_id = add_handler(filter_command_type("367", sourceinfo::RawIrc), &BanTracker::irc_list_entry, true);
+        quiet_list_id = add_handler(filter_command_type("728", sourceinfo::RawIrc), &BanTracker::irc_list_entry, true);
+        list_end_id = add_handler(filter_command_type("368", sourceinfo::RawIrc), &BanTracker::irc_list_end, true);
+        quiet_list_end_id = add_handler(filter_command_type("729", sourceinfo::RawIrc), &BanTracker::irc_list_end, true);
+        modes_id = add_handler(filter_command_type("mode_changes", sourceinfo::Internal), &BanTracker::irc_modes, true);
+        privmsg_id = add_handler(filter_command_type("PRIVMSG", sourceinfo::RawIrc), &BanTracker::private_comment, true);
+
+        info_id = add_handler(filter_command_type("btinfo", sourceinfo::IrcCommand), &BanTracker::do_query);
+        pending_id = add_handler(filter_command_type("btpending", sourceinfo::IrcCommand), &BanTracker::do_query);
+        expired_id = add_handler(filter_command_type("btexpired", sourceinfo::IrcCommand), &BanTracker::do_query);
+        check_id = add_handler(filter_command_type("btcheck", sourceinfo::IrcCommand), &BanTracker::do_query);
+        set_id = add_handler(filter_command_type("btset", sourceinfo::IrcCommand), &BanTracker::do_set);
+        comment_id = add_handler(filter_command_type("btcomment", sourceinfo::IrcCommand), &BanTracker::do_comment);
+        config_id = add_handler(filter_command_type("btconfig", sourceinfo::IrcCommand), &BanTracker::do_config);
+        saveconfig_id = add_handler(filter_command_type("btsaveconfig", sourceinfo::IrcCommand), &BanTracker::do_saveconfig);
+        loadconfig_id = add_handler(filter_command_type("btloadconfig", sourceinfo::IrcCommand), &BanTracker::do_loadconfig);
+        sync_id = add_handler(filter_command_type("btsync", sourceinfo::IrcCommand), &BanTracker::do_sync);
+        shutdown_id = add_handler(filter_command_type("shutting_down", sourceinfo::Internal), &BanTracker::shutting_down);
+
+        static const char *logged[] = { "PRIVMSG", "NOTICE", "JOIN", "PART", "QUIT", "MODE", "TOPIC", "332", "333", "353" };
+        for (int i = 0; i < 10; ++i)
+            log_ids[i] = add_handler(filter_command_type(logged[i], sourceinfo::RawIrc), &BanTracker::irc_log, true);
+    }
+
+    ~BanTracker()
+    {
+        for (std::map<std::string, Tracked>::iterator it = databases.begin(); it != databases.end(); ++it)
+            if (it->second.deadline_event)
+                EventManager::get_instance()->remove_event(it->second.deadline_event);
+    }
+};
+
+MODULE_CLASS(BanTracker)
@@ -7,6 +7,7 @@ MODULES = \
 	  userlist \
 	  voicebot \
 	  whoami \
+	  $(ENABLE_BANTRACKER) \
 	  core/channel \
 	  core/ctcp \
 	  core/die \
@@ -26,6 +27,8 @@ storage/json_CXXFLAGS = -Ilibjson
 storage/json_LDFLAGS = -Wl,-rpath,$(LIBDIR)
 storage/json_LIBRARIES = libjson/json
 
+bantracker_LDFLAGS = $(SQLITE_LIBS) -lpthread
+
 SUBDIRS = $(ENABLE_PERL)
 
 CXXFLAGS = -Isrc -fPIC
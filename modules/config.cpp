@@ -9,18 +9,18 @@ struct Config : CommandHandlerBase<Config>, Module
     {
         if (m->args.empty())
         {
-            m->source.error("I need a setting name");
+            m->source->error("I need a setting name");
             return;
         }
 
         Bot::SettingsIterator it1 = m->bot->find_setting(m->args[0]);
         if (it1 != m->bot->end_settings())
         {
-            m->source.reply(m->args[0] + " for " + m->bot->name() + " is " + (std::string)it1->second);
+            m->source->reply(m->args[0] + " for " + m->bot->name() + " is " + (std::string)it1->second);
             return;
         }
 
-        m->source.error("Can't find setting " + m->args[0]);
+        m->source->error("Can't find setting " + m->args[0]);
     }
 
     CommandHolder _id;
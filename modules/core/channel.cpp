@@ -1,9 +1,17 @@
 #include "eir.h"
 #include "handler.h"
+#include "string_util.h"
 
 #include <functional>
+#include <cstdlib>
+#include <chrono>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
 
 #include <paludis/util/tokeniser.hh>
+#include <paludis/util/stringify.hh>
 
 #include <paludis/util/wrapped_forward_iterator-impl.hh>
 
@@ -20,13 +28,130 @@ struct ChannelHandler : CommandHandlerBase<ChannelHandler>, Module
     void handle_account(const Message *);
     void handle_who_reply(const Message *);
     void handle_whox_reply(const Message *);
+    void handle_end_of_who(const Message *);
+    void handle_connect(const Message *);
+    void handle_batch(const Message *);
+    void handle_incoming(const Message *);
+    void handle_shutdown(const Message *);
+
+    struct WhoReply
+    {
+        std::string channel, nick, user, host, flags, account;
+        // Whether account is what the server says, rather than unknown.
+        bool has_account;
+    };
+    void who_reply(Bot *, const WhoReply &);
+    void apply_who_replies(Bot *, std::string, const std::vector<WhoReply> &, bool prune = false);
+
+    // After joining, each channel's membership is filled in with a WHO.
+    // Those are queued and only a few are left outstanding at once, so that
+    // joining many channels doesn't flood the server or our send queue.
+    struct SyncState
+    {
+        enum ChannelState { joined, who_pending, synced };
+
+        std::map<std::string, ChannelState, cistring::is_less> channels;
+        std::deque<std::string> who_queue;
+        unsigned int pending;
+
+        std::map<std::string, std::vector<WhoReply>, cistring::is_less> who_replies;
+
+        bool in_progress;
+        std::chrono::steady_clock::time_point started;
+
+        // When each outstanding WHO was sent, and how many times each
+        // channel's has been. A WHO with no 315 after who_timeout seconds
+        // is sent again, up to max_who_attempts times in all.
+        enum { max_who_attempts = 3 };
+        std::map<std::string, time_t, cistring::is_less> who_sent;
+        std::map<std::string, unsigned int, cistring::is_less> who_attempts;
+        EventManager::id who_timer;
+
+        // On reconnecting, what was known from before is kept but marked
+        // unverified. Each channel is checked against its WHO once we're
+        // back in it, and only what differs is changed; channels we don't
+        // get back into are forgotten once the sync is over.
+        std::set<std::string, cistring::is_less> unverified;
+        EventManager::id unverified_timer;
+
+        SyncState() : pending(0), in_progress(false), who_timer(0), unverified_timer(0) { }
+    };
+    unsigned int sync_slot;
+
+    void sync_joined(Bot *, std::string);
+    void sync_forget(Bot *, std::string);
+    void sync_pump(Bot *);
+    void sync_finish(Bot *, std::string, bool complete);
+    void who_timeout(Bot *);
+    void handle_resumed(const Message *);
+    void arm_who_timer(Bot *);
+    SettingHandle<int> who_concurrency, who_timeout_secs;
+
+    // With warm_reconnect off, as it is unless set, everything is forgotten
+    // on reconnecting and rebuilt from scratch.
+    SettingHandle<int> warm_reconnect;
+    void forget_channel(Bot *, Channel::ptr);
+    void forget_unverified(Bot *);
+    void unverified_timeout(Bot *);
+
+    // QUITs caused by a netsplit are held back and applied together, along
+    // with a single netsplit event, once something other than another such
+    // QUIT arrives or a second has passed. Users lost that way are
+    // remembered so that their JOINs can be reported as a netjoin.
+    struct SplitState
+    {
+        std::string servers;
+        std::vector<Client::ptr> quitting;
+
+        struct Lost
+        {
+            std::string servers;
+            time_t when;
+        };
+        std::map<std::string, Lost, cistring::is_less> lost;
+
+        // Returning nicks, by the servers they were split from.
+        std::map<std::string, std::vector<std::string> > returning;
+
+        EventManager::id timer;
+
+        SplitState() : timer(0) { }
+    };
+    unsigned int split_slot;
+
+    void split_quit(Bot *, Client::ptr, std::string);
+    void split_returned(Bot *, std::string);
+    void split_flush(Bot *);
+    void split_timeout(Bot *);
+    void split_remove(Bot *, std::string, const std::vector<Client::ptr> &);
+
+    // Each bot's sync and split state is kept on the bot, and only used from
+    // its own reactor, so finding it takes no lock.
+    template <typename T_>
+    static T_ & state_for(Bot *b, unsigned int slot)
+    {
+        Bot::Slot & s = b->slot(slot);
+        if (!s)
+            s = std::make_shared<T_>();
+        return *static_cast<T_ *>(s.get());
+    }
+
+    template <typename T_>
+    static T_ *find_state(Bot *b, unsigned int slot)
+    {
+        return static_cast<T_ *>(b->slot(slot).get());
+    }
 
     ChannelHandler();
+    ~ChannelHandler();
 
-    CommandHolder join_id, part_id, quit_id, names_id, nick_id, account_id, who_id, whox_id, kick_id;
+    CommandHolder join_id, part_id, quit_id, names_id, nick_id, account_id, who_id, whox_id, kick_id,
+                  endofwho_id, connect_id, resumed_id, netsplit_id, netjoin_id, incoming_id, shutdown_id;
 };
 
 ChannelHandler::ChannelHandler()
+    : sync_slot(Bot::new_slot()), who_concurrency("who_concurrency", 3), who_timeout_secs("who_timeout", 60),
+      warm_reconnect("warm_reconnect", 0), split_slot(Bot::new_slot())
 {
     join_id = add_handler(filter_command_type("JOIN", sourceinfo::RawIrc), &ChannelHandler::handle_join);
     part_id = add_handler(filter_command_type("PART", sourceinfo::RawIrc), &ChannelHandler::handle_part);
@@ -37,23 +162,243 @@ ChannelHandler::ChannelHandler()
     who_id = add_handler(filter_command_type("352", sourceinfo::RawIrc), &ChannelHandler::handle_who_reply);
     whox_id = add_handler(filter_command_type("354", sourceinfo::RawIrc), &ChannelHandler::handle_whox_reply);
     kick_id = add_handler(filter_command_type("KICK", sourceinfo::RawIrc), &ChannelHandler::handle_kick);
+    endofwho_id = add_handler(filter_command_type("315", sourceinfo::RawIrc), &ChannelHandler::handle_end_of_who);
+    connect_id = add_handler(filter_command_type("001", sourceinfo::RawIrc), &ChannelHandler::handle_connect);
+    resumed_id = add_handler(filter_command_type("resumed", sourceinfo::Internal), &ChannelHandler::handle_resumed);
+    netsplit_id = add_handler(filter_command_type("batch_netsplit", sourceinfo::Internal), &ChannelHandler::handle_batch);
+    netjoin_id = add_handler(filter_command_type("batch_netjoin", sourceinfo::Internal), &ChannelHandler::handle_batch);
+    incoming_id = add_handler(filter_command_type("server_incoming", sourceinfo::Internal), &ChannelHandler::handle_incoming);
+    shutdown_id = add_handler(filter_command_type("shutting_down", sourceinfo::Internal), &ChannelHandler::handle_shutdown);
 }
 
-namespace
+ChannelHandler::~ChannelHandler()
 {
-    Client::ptr find_or_create_client(Bot *b, std::string nick, std::string user, std::string host)
+    for (BotManager::iterator it = BotManager::get_instance()->begin(); it != BotManager::get_instance()->end(); ++it)
     {
-        Client::ptr c = b->find_client(nick);
+        if (SplitState *s = find_state<SplitState>(it->second, split_slot))
+            if (s->timer)
+                EventManager::get_instance()->remove_event(s->timer);
+        if (SyncState *s = find_state<SyncState>(it->second, sync_slot))
+        {
+            if (s->who_timer)
+                EventManager::get_instance()->remove_event(s->who_timer);
+            if (s->unverified_timer)
+                EventManager::get_instance()->remove_event(s->unverified_timer);
+        }
+    }
+    Bot::clear_slot(split_slot);
+    Bot::clear_slot(sync_slot);
+}
 
-        if(!c)
+void ChannelHandler::sync_joined(Bot *b, std::string chname)
+{
+    SyncState & s = state_for<SyncState>(b, sync_slot);
+
+    if (!s.in_progress)
+    {
+        s.in_progress = true;
+        s.started = std::chrono::steady_clock::now();
+    }
+
+    s.channels[chname] = SyncState::joined;
+    s.who_queue.push_back(chname);
+
+    // Carried across a restart's handoff, so that the next image knows the
+    // membership it's given may be partial.
+    if (Channel::ptr ch = b->find_channel(chname))
+        ch->set_attr("who_sync", 1);
+
+    sync_pump(b);
+}
+
+void ChannelHandler::sync_forget(Bot *b, std::string chname)
+{
+    SyncState & s = state_for<SyncState>(b, sync_slot);
+
+    auto it = s.channels.find(chname);
+    if (it == s.channels.end())
+        return;
+
+    if (it->second == SyncState::who_pending)
+        --s.pending;
+    s.channels.erase(it);
+    s.who_replies.erase(chname);
+    s.who_sent.erase(chname);
+    s.who_attempts.erase(chname);
+
+    for (auto q = s.who_queue.begin(); q != s.who_queue.end(); )
+    {
+        if (cistring::equal(*q, chname))
+            q = s.who_queue.erase(q);
+        else
+            ++q;
+    }
+
+    sync_pump(b);
+}
+
+void ChannelHandler::sync_pump(Bot *b)
+{
+    SyncState & s = state_for<SyncState>(b, sync_slot);
+
+    unsigned int concurrency = who_concurrency.get(b) > 0 ? who_concurrency.get(b) : 1;
+
+    while (s.pending < concurrency && !s.who_queue.empty())
+    {
+        std::string chname = s.who_queue.front();
+        s.who_queue.pop_front();
+
+        auto it = s.channels.find(chname);
+        if (it == s.channels.end() || it->second != SyncState::joined)
+            continue;
+
+        std::string who_command = "WHO " + chname;
+        if (b->use_account_tracking())
+            who_command += " %cnuhaft,524";
+        b->send(who_command);
+
+        it->second = SyncState::who_pending;
+        ++s.pending;
+        s.who_sent[chname] = time(NULL);
+        ++s.who_attempts[chname];
+        if (!s.who_timer)
+            arm_who_timer(b);
+    }
+
+    if (s.in_progress && s.pending == 0 && s.who_queue.empty())
+    {
+        s.in_progress = false;
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - s.started;
+        Logger::get_instance()->Log(b, NULL, Logger::Info,
+                "Channel sync complete: " + paludis::stringify(s.channels.size()) + " channels in " +
+                paludis::stringify(elapsed.count()) + "s");
+
+        // Every JOIN was sent ahead of the last WHO, so anything not back
+        // by now isn't coming back.
+        forget_unverified(b);
+    }
+}
+
+void ChannelHandler::arm_who_timer(Bot *b)
+{
+    SyncState & s = state_for<SyncState>(b, sync_slot);
+
+    if (s.who_timer)
+        EventManager::get_instance()->remove_event(s.who_timer);
+    s.who_timer = 0;
+
+    if (s.who_sent.empty())
+        return;
+
+    time_t first = s.who_sent.begin()->second;
+    for (auto it = s.who_sent.begin(); it != s.who_sent.end(); ++it)
+        first = std::min(first, it->second);
+
+    s.who_timer = EventManager::get_instance()->add_event(first + std::max(who_timeout_secs.get(b), 1),
+                std::bind(&ChannelHandler::who_timeout, this, b));
+}
+
+void ChannelHandler::who_timeout(Bot *b)
+{
+    // We're running from the timer, so it mustn't be removed underneath us.
+    SyncState & s = state_for<SyncState>(b, sync_slot);
+    s.who_timer = 0;
+
+    time_t due = time(NULL) - std::max(who_timeout_secs.get(b), 1);
+    std::vector<std::string> late;
+    for (auto it = s.who_sent.begin(); it != s.who_sent.end(); ++it)
+        if (it->second <= due)
+            late.push_back(it->first);
+
+    for (std::vector<std::string>::iterator name = late.begin(); name != late.end(); ++name)
+    {
+        if (s.who_attempts[*name] >= SyncState::max_who_attempts)
         {
-            c.reset(new Client(b, nick, user, host));
-            b->add_client(c);
+            Logger::get_instance()->Log(b, NULL, Logger::Warning,
+                    "No end of WHO for " + *name + " after " + paludis::stringify(s.who_attempts[*name]) +
+                    " tries; using what arrived");
+            sync_finish(b, *name, false);
+            continue;
         }
 
-        return c;
+        Logger::get_instance()->Log(b, NULL, Logger::Warning, "No end of WHO for " + *name + "; asking again");
+        s.channels[*name] = SyncState::joined;
+        --s.pending;
+        s.who_sent.erase(*name);
+        s.who_replies.erase(*name);
+        s.who_queue.push_back(*name);
     }
 
+    sync_pump(b);
+    arm_who_timer(b);
+}
+
+void ChannelHandler::forget_channel(Bot *b, Channel::ptr ch)
+{
+    LazyContext ctx("Forgetting channel ", ch->name());
+
+    std::vector<Client::ptr> lonely;
+
+    Channel::MemberIterator member = ch->begin_members();
+    while (member != ch->end_members())
+    {
+        Membership::ptr p = *member++;
+        Client::ptr c = p->client;
+        c->leave_chan(p);
+        if (c->begin_channels() == c->end_channels() && c != b->me())
+            lonely.push_back(c);
+    }
+
+    b->remove_channel(ch);
+
+    for (std::vector<Client::ptr>::iterator it = lonely.begin(); it != lonely.end(); ++it)
+        b->remove_client(*it);
+}
+
+void ChannelHandler::forget_unverified(Bot *b)
+{
+    SyncState & s = state_for<SyncState>(b, sync_slot);
+
+    if (s.unverified_timer)
+    {
+        EventManager::get_instance()->remove_event(s.unverified_timer);
+        s.unverified_timer = 0;
+    }
+
+    if (s.unverified.empty())
+        return;
+
+    std::set<std::string, cistring::is_less> unverified;
+    unverified.swap(s.unverified);
+
+    unsigned int forgotten = 0;
+    for (auto it = unverified.begin(); it != unverified.end(); ++it)
+    {
+        Channel::ptr ch = b->find_channel(*it);
+        if (!ch)
+            continue;
+        forget_channel(b, ch);
+        ++forgotten;
+    }
+
+    if (forgotten)
+        Logger::get_instance()->Log(b, NULL, Logger::Info,
+                "Forgot " + paludis::stringify(forgotten) + " channels not rejoined after reconnecting");
+}
+
+void ChannelHandler::unverified_timeout(Bot *b)
+{
+    // We're running from the timer, so it mustn't be removed underneath us.
+    SyncState & s = state_for<SyncState>(b, sync_slot);
+    s.unverified_timer = 0;
+
+    // If nothing was rejoined at all, no sync will ever finish to do this.
+    if (!s.in_progress)
+        forget_unverified(b);
+}
+
+namespace
+{
     Client::ptr find_or_create_client(Bot *b, std::string name, std::string nuh)
     {
         Client::ptr c = b->find_client(name);
@@ -79,7 +424,7 @@ namespace
                 host = nuh.substr(at + 1, std::string::npos);
             }
 
-            c.reset(new Client(b, nick, user, host));
+            c = Client::create(b, nick, user, host);
             b->add_client(c);
         }
 
@@ -88,11 +433,11 @@ namespace
 
     Client::ptr find_or_create_client(const Message *m)
     {
-        Client::ptr c = m->source.client;
+        Client::ptr c = m->source->client;
         if (c)
             return c;
 
-        return find_or_create_client(m->bot, m->source.name, m->source.raw);
+        return find_or_create_client(m->bot, m->source->name, m->source->raw);
     }
 
     Channel::ptr find_or_create_channel(Bot *b, std::string name)
@@ -101,7 +446,7 @@ namespace
 
         if (!ch)
         {
-            ch.reset(new Channel(name));
+            ch = Channel::create(b, name);
             b->add_channel(ch);
         }
         return ch;
@@ -109,7 +454,7 @@ namespace
 
     Channel::ptr find_or_create_channel(const Message *m)
     {
-        return find_or_create_channel(m->bot, m->source.destination);
+        return find_or_create_channel(m->bot, m->source->destination);
     }
 
     void client_leaving_channel(Bot *b, Client::ptr c, Channel::ptr ch)
@@ -146,7 +491,7 @@ namespace
 
 void ChannelHandler::handle_join(const Message *m)
 {
-    Context ctx("Processing join for " + m->source.name + " to " + m->source.destination);
+    LazyContext ctx("Processing join for ", m->source->name, " to ", m->source->destination);
 
     Client::ptr c = find_or_create_client(m);
     Channel::ptr ch = find_or_create_channel(m);
@@ -156,14 +501,10 @@ void ChannelHandler::handle_join(const Message *m)
 
     c->join_chan(ch);
 
-    if (m->source.name == m->bot->nick())
-    {
-        std::string who_command = "WHO " + m->source.destination;
-        if (m->bot->use_account_tracking())
-            who_command += " %cnuhaft,524";
-
-        m->bot->send(who_command);
-    }
+    if (m->source->name == m->bot->nick())
+        sync_joined(m->bot, ch->name());
+    else
+        split_returned(m->bot, c->nick());
 }
 
 void ChannelHandler::handle_names_reply(const Message *m)
@@ -174,11 +515,12 @@ void ChannelHandler::handle_names_reply(const Message *m)
     std::string chname = m->args[1];
     std::vector<std::string> nicks;
 
-    Context ctx("Processing NAMES reply for " + chname);
+    LazyContext ctx("Processing NAMES reply for ", chname);
 
     paludis::tokenise_whitespace(m->args[2], std::back_inserter(nicks));
 
     Channel::ptr ch = find_or_create_channel(m->bot, chname);
+    ch->reserve_members(ch->member_count() + nicks.size());
 
     for (std::vector<std::string>::iterator it = nicks.begin(), ite = nicks.end();
             it != ite; ++it)
@@ -188,24 +530,110 @@ void ChannelHandler::handle_names_reply(const Message *m)
     }
 }
 
-static void who_reply_common(const Message *m,
-                             std::string chname, std::string nick, std::string user, std::string hostname,
-                             std::string flags, std::string account)
+void ChannelHandler::who_reply(Bot *b, const WhoReply & r)
 {
-    Context ctx("Processing WHO reply for " + chname + " (" + nick + ")");
-    Client::ptr c = find_or_create_client(m->bot, nick, user, hostname);
+    SyncState & s = state_for<SyncState>(b, sync_slot);
 
-    if (m->bot->use_account_tracking() && !account.empty())
-        c->set_account(account);
+    // Replies to our own sync WHO are held until the 315 and applied
+    // together; anything else is applied as it comes.
+    auto it = s.channels.find(r.channel);
+    if (it != s.channels.end() && it->second == SyncState::who_pending)
+    {
+        s.who_replies[r.channel].push_back(r);
+        return;
+    }
 
-    Channel::ptr ch = find_or_create_channel(m->bot, chname);
-    Membership::ptr member = c->join_chan(ch);
+    std::vector<WhoReply> one(1, r);
+    apply_who_replies(b, r.channel, one);
+}
+
+// With prune, the replies are the whole channel, and members they don't
+// mention are taken to have left.
+void ChannelHandler::apply_who_replies(Bot *b, std::string chname, const std::vector<WhoReply> & replies, bool prune)
+{
+    LazyContext ctx("Processing WHO replies for ", chname);
+
+    Channel::ptr ch = find_or_create_channel(b, chname);
+    ch->reserve_members(ch->member_count() + replies.size());
+
+    bool tracking = b->use_account_tracking();
+    const ISupport *supported = b->supported();
 
-    for (std::string::iterator ch = flags.begin(); ch != flags.end(); ++ch)
+    // Known clients are updated quietly, and only those that changed have
+    // their privileges recalculated, once each at the end rather than per
+    // reply.
+    std::vector<Client::ptr> changed;
+    std::set<Membership *> seen;
+
+    for (std::vector<WhoReply>::const_iterator r = replies.begin(); r != replies.end(); ++r)
     {
-        char c = m->bot->supported()->get_prefix_mode(*ch);
-        if (c && !member->has_mode(c))
-            member->modes += c;
+        Client::ptr c = b->find_client(r->nick);
+
+        if (!c)
+        {
+            c = Client::create(b, r->nick, r->user, r->host);
+            if (tracking && !r->account.empty())
+                c->set_account(r->account, false);
+            b->add_client(c);
+        }
+        else
+        {
+            bool differs = false;
+            if (tracking && r->has_account && c->account() != r->account)
+            {
+                c->set_account(r->account, false);
+                differs = true;
+            }
+            if (c->user() != r->user || c->host() != r->host)
+            {
+                c->change_host(r->user, r->host, false);
+                differs = true;
+            }
+            if (differs)
+                changed.push_back(c);
+        }
+
+        Membership::ptr member = c->join_chan(ch);
+        seen.insert(member.get());
+
+        // WHO shows only the highest prefix a member has. If that's what we
+        // already thought, keep whatever else we knew of.
+        uint32_t bits = 0;
+        for (std::string::const_iterator f = r->flags.begin(); f != r->flags.end(); ++f)
+        {
+            char mode = supported->get_prefix_mode(*f);
+            if (mode)
+                bits |= uint32_t(1) << supported->prefix_mode_index(mode);
+        }
+        if ((bits & -bits) != (member->mode_bits & -member->mode_bits))
+            member->mode_bits = bits;
+    }
+
+    if (prune)
+    {
+        std::vector<Client::ptr> lonely;
+
+        Channel::MemberIterator member = ch->begin_members();
+        while (member != ch->end_members())
+        {
+            Membership::ptr p = *member++;
+            if (seen.count(p.get()))
+                continue;
+
+            Client::ptr c = p->client;
+            c->leave_chan(p);
+            if (c->begin_channels() == c->end_channels() && c != b->me())
+                lonely.push_back(c);
+        }
+
+        for (std::vector<Client::ptr>::iterator it = lonely.begin(); it != lonely.end(); ++it)
+            b->remove_client(*it);
+    }
+
+    for (std::vector<Client::ptr>::iterator it = changed.begin(); it != changed.end(); ++it)
+    {
+        Message recalc(b, "recalculate_client_privileges", sourceinfo::Internal, *it);
+        CommandRegistry::get_instance()->dispatch(&recalc);
     }
 }
 
@@ -220,7 +648,8 @@ void ChannelHandler::handle_who_reply(const Message *m)
                 nick = m->args[4],
                 flags = m->args[5];
 
-    who_reply_common(m, chname, nick, user, hostname, flags, "*");
+    // Plain WHO doesn't say; "*" is the protocol's "no account", never a name.
+    who_reply(m->bot, WhoReply{chname, nick, user, hostname, flags, "*", false});
 }
 
 void ChannelHandler::handle_whox_reply(const Message *m)
@@ -242,17 +671,20 @@ void ChannelHandler::handle_whox_reply(const Message *m)
     if (account == "0")
         account = "";
 
-    who_reply_common(m, chname, nick, user, host, flags, account);
+    who_reply(m->bot, WhoReply{chname, nick, user, host, flags, account, true});
 }
 
 void ChannelHandler::handle_part(const Message *m)
 {
-    Context ctx("Processing part for " + m->source.name + " from " + m->source.destination);
+    LazyContext ctx("Processing part for ", m->source->name, " from ", m->source->destination);
 
-    Client::ptr c = m->source.client;
+    Client::ptr c = m->source->client;
     Bot *b = m->bot;
 
-    Channel::ptr ch = b->find_channel(m->source.destination);
+    Channel::ptr ch = b->find_channel(m->source->destination);
+
+    if (ch && c && c == b->me())
+        sync_forget(b, ch->name());
 
     client_leaving_channel(b, c, ch);
 }
@@ -262,54 +694,376 @@ void ChannelHandler::handle_kick(const Message *m)
     if (m->args.empty())
         return;
 
-    Context ctx("Processing kick for " + m->args[0] + " from " + m->source.destination);
+    LazyContext ctx("Processing kick for ", m->args[0], " from ", m->source->destination);
 
     Bot *b = m->bot;
 
     Client::ptr c = b->find_client(m->args[0]);
-    Channel::ptr ch = b->find_channel(m->source.destination);
+    Channel::ptr ch = b->find_channel(m->source->destination);
+
+    if (ch && c && c == b->me())
+        sync_forget(b, ch->name());
 
     client_leaving_channel(b, c, ch);
 }
 
 void ChannelHandler::handle_quit(const Message *m)
 {
-    Context ctx("Handling quit from " + m->source.name);
+    LazyContext ctx("Handling quit from ", m->source->name);
 
-    Client::ptr c = m->source.client;
+    Client::ptr c = m->source->client;
     Bot *b = m->bot;
 
     if (!c)
         return;
 
-    for (Client::ChannelIterator chi = c->begin_channels(), che = c->end_channels();
-            chi != che; )
-        c->leave_chan(*chi++);
+    if (m->is_netsplit_quit())
+    {
+        split_quit(b, c, m->source->destination);
+        return;
+    }
 
+    c->leave_all_chans();
     b->remove_client(c);
 
     Logger::get_instance()->Log(b, c, Logger::Debug, "QUIT: " + c->nick());
 }
 
+void ChannelHandler::split_quit(Bot *b, Client::ptr c, std::string servers)
+{
+    SplitState & s = state_for<SplitState>(b, split_slot);
+
+    if (!s.quitting.empty() && s.servers != servers)
+        split_flush(b);
+
+    s.servers = servers;
+    s.quitting.push_back(c);
+
+    if (!s.timer)
+        s.timer = EventManager::get_instance()->add_event(time(NULL) + 1,
+                    std::bind(&ChannelHandler::split_timeout, this, b));
+}
+
+void ChannelHandler::split_returned(Bot *b, std::string nick)
+{
+    SplitState & s = state_for<SplitState>(b, split_slot);
+
+    auto it = s.lost.find(nick);
+    if (it == s.lost.end())
+        return;
+
+    s.returning[it->second.servers].push_back(it->first);
+    s.lost.erase(it);
+
+    if (!s.timer)
+        s.timer = EventManager::get_instance()->add_event(time(NULL) + 1,
+                    std::bind(&ChannelHandler::split_timeout, this, b));
+}
+
+void ChannelHandler::split_remove(Bot *b, std::string servers, const std::vector<Client::ptr> & clients)
+{
+    LazyContext ctx("Processing netsplit ", servers);
+
+    SplitState & s = state_for<SplitState>(b, split_slot);
+    time_t now = time(NULL);
+
+    // Tell everyone first, while the clients can still be looked up.
+    Message split(b, "netsplit", sourceinfo::Internal);
+    split.args.reserve(clients.size() + 2);
+    std::string::size_type space = servers.find(' ');
+    split.args.push_back(servers.substr(0, space));
+    split.args.push_back(space == std::string::npos ? "" : servers.substr(space + 1));
+    for (std::vector<Client::ptr>::const_iterator c = clients.begin(); c != clients.end(); ++c)
+        split.args.push_back((*c)->nick());
+    CommandRegistry::get_instance()->dispatch(&split);
+
+    for (std::vector<Client::ptr>::const_iterator c = clients.begin(); c != clients.end(); ++c)
+    {
+        // The same client may have been named twice; only remove it once.
+        if (b->find_client((*c)->nick()) != *c)
+            continue;
+
+        (*c)->leave_all_chans();
+        b->remove_client(*c);
+
+        SplitState::Lost & l = s.lost[(*c)->nick()];
+        l.servers = servers;
+        l.when = now;
+    }
+
+    Logger::get_instance()->Log(b, NULL, Logger::Debug,
+            "Netsplit " + servers + ": " + paludis::stringify(clients.size()) + " clients");
+
+    // Anyone who hasn't come back within an hour isn't going to be
+    // recognised as part of a netjoin anyway.
+    for (auto it = s.lost.begin(); it != s.lost.end(); )
+    {
+        if (it->second.when + 3600 < now)
+            s.lost.erase(it++);
+        else
+            ++it;
+    }
+}
+
+void ChannelHandler::split_flush(Bot *b)
+{
+    SplitState & s = state_for<SplitState>(b, split_slot);
+
+    if (s.timer)
+    {
+        EventManager::get_instance()->remove_event(s.timer);
+        s.timer = 0;
+    }
+
+    if (!s.quitting.empty())
+    {
+        std::vector<Client::ptr> quitting;
+        quitting.swap(s.quitting);
+        split_remove(b, s.servers, quitting);
+    }
+
+    if (!s.returning.empty())
+    {
+        std::map<std::string, std::vector<std::string> > returning;
+        returning.swap(s.returning);
+
+        for (auto it = returning.begin(); it != returning.end(); ++it)
+        {
+            Message join(b, "netjoin", sourceinfo::Internal);
+            std::string::size_type space = it->first.find(' ');
+            join.args.push_back(it->first.substr(0, space));
+            join.args.push_back(space == std::string::npos ? "" : it->first.substr(space + 1));
+            join.args.insert(join.args.end(), it->second.begin(), it->second.end());
+            CommandRegistry::get_instance()->dispatch(&join);
+        }
+    }
+}
+
+void ChannelHandler::split_timeout(Bot *b)
+{
+    // We're running from the timer, so it mustn't be removed underneath us.
+    state_for<SplitState>(b, split_slot).timer = 0;
+    split_flush(b);
+}
+
+void ChannelHandler::handle_incoming(const Message *m)
+{
+    // Looked up without being made, since most bots never see a split.
+    SplitState *state = find_state<SplitState>(m->bot, split_slot);
+    if (!state)
+        return;
+
+    SplitState & s = *state;
+    if (s.quitting.empty() && s.returning.empty())
+        return;
+
+    // server_incoming doesn't carry the command, so find it in the raw line.
+    std::string::size_type p1 = 0;
+    if (!m->raw.empty() && m->raw[0] == ':')
+        p1 = m->raw.find(' ') + 1;
+    std::string command = m->raw.substr(p1, m->raw.find(' ', p1) - p1);
+
+    // Split QUITs keep accumulating, and returning users' JOINs are
+    // usually followed by the server restoring their modes. BATCH lines
+    // change nothing, and the end of a netsplit or netjoin batch is left
+    // to its batch_ event.
+    if (cistring::equal(command, "BATCH"))
+        return;
+    else if (cistring::equal(command, "QUIT"))
+    {
+        Message quit(*m, command, sourceinfo::RawIrc);
+        if (quit.is_netsplit_quit() && (s.quitting.empty() || quit.source->destination == s.servers))
+            return;
+    }
+    else if (s.quitting.empty() && (cistring::equal(command, "JOIN") || cistring::equal(command, "MODE")))
+        return;
+
+    split_flush(m->bot);
+}
+
 void ChannelHandler::handle_nick(const Message *m)
 {
-    Context ctx("Handling nick change from " + m->source.name);
+    LazyContext ctx("Handling nick change from ", m->source->name);
 
-    if(!m->source.client)
+    if(!m->source->client)
         return;
-    std::string newnick(m->source.destination);
-    m->source.client->change_nick(newnick);
+    std::string newnick(m->source->destination);
+    m->source->client->change_nick(newnick);
 }
 
 void ChannelHandler::handle_account(const Message *m)
 {
-    Context ctx("Handling account change from " + m->source.name);
+    LazyContext ctx("Handling account change from ", m->source->name);
 
-    if (!m->source.client)
+    if (!m->source->client)
         return;
 
-    std::string newaccount(m->source.destination);
-    m->source.client->set_account(newaccount);
+    std::string newaccount(m->source->destination);
+    m->source->client->set_account(newaccount);
+}
+
+void ChannelHandler::handle_end_of_who(const Message *m)
+{
+    if (m->args.empty())
+        return;
+
+    Bot *b = m->bot;
+    SyncState & s = state_for<SyncState>(b, sync_slot);
+
+    auto it = s.channels.find(m->args[0]);
+    if (it == s.channels.end() || it->second != SyncState::who_pending)
+        return;
+
+    sync_finish(b, it->first, true);
+    sync_pump(b);
+}
+
+// With complete unset, the replies may be partial, so nobody missing from
+// them is dropped.
+void ChannelHandler::sync_finish(Bot *b, std::string chname, bool complete)
+{
+    SyncState & s = state_for<SyncState>(b, sync_slot);
+
+    s.channels[chname] = SyncState::synced;
+    --s.pending;
+    if (Channel::ptr ch = b->find_channel(chname))
+        ch->set_attr("who_sync", 0);
+    s.who_sent.erase(chname);
+    s.who_attempts.erase(chname);
+
+    bool prune = s.unverified.erase(chname) && complete;
+
+    auto replies = s.who_replies.find(chname);
+    if (replies != s.who_replies.end())
+    {
+        apply_who_replies(b, chname, replies->second, prune);
+        s.who_replies.erase(replies);
+    }
+    else if (prune)
+        apply_who_replies(b, chname, std::vector<WhoReply>(), true);
+
+    Message synced(b, "channel_synced", sourceinfo::Internal);
+    synced.args.push_back(chname);
+    CommandRegistry::get_instance()->dispatch(&synced);
+}
+
+void ChannelHandler::handle_batch(const Message *m)
+{
+    if (!m->batch)
+        return;
+
+    LazyContext ctx("Processing ", m->command);
+
+    Bot *b = m->bot;
+
+    // The QUITs have been collected as they came; now we know there are no
+    // more.
+    if (m->command == "batch_netsplit")
+    {
+        split_flush(b);
+        return;
+    }
+
+    // The returning users' JOINs have been applied already. The batch says
+    // where they came from, whatever we remembered, and takes in anyone we
+    // didn't know had gone.
+    SplitState & s = state_for<SplitState>(b, split_slot);
+    s.returning.clear();
+    if (s.timer && s.quitting.empty())
+    {
+        EventManager::get_instance()->remove_event(s.timer);
+        s.timer = 0;
+    }
+
+    std::set<std::string, cistring::is_less> seen;
+    Message join(b, "netjoin", sourceinfo::Internal);
+    join.args = m->args;
+    join.args.resize(2);
+    for (std::vector<Message>::const_iterator it = m->batch->begin(); it != m->batch->end(); ++it)
+        if (it->command == "JOIN" && seen.insert(it->source->name).second)
+            join.args.push_back(it->source->name);
+    CommandRegistry::get_instance()->dispatch(&join);
+}
+
+// A sync still going when the previous image handed over went with it, along
+// with any replies it was holding, so those channels are asked about again.
+void ChannelHandler::handle_resumed(const Message *m)
+{
+    Bot *b = m->bot;
+    std::vector<Channel::ptr> channels(b->begin_channels(), b->end_channels());
+    for (std::vector<Channel::ptr>::iterator it = channels.begin(); it != channels.end(); ++it)
+        if ((*it)->attr("who_sync") == 1)
+        {
+            Logger::get_instance()->Log(b, NULL, Logger::Debug, "Finishing the sync of " + (*it)->name());
+            sync_joined(b, (*it)->name());
+        }
+}
+
+void ChannelHandler::handle_connect(const Message *m)
+{
+    Bot *b = m->bot;
+
+    // Anything outstanding belonged to the previous connection.
+    SyncState & sync_state = state_for<SyncState>(b, sync_slot);
+    if (sync_state.who_timer)
+        EventManager::get_instance()->remove_event(sync_state.who_timer);
+    if (sync_state.unverified_timer)
+        EventManager::get_instance()->remove_event(sync_state.unverified_timer);
+    sync_state = SyncState();
+
+    // What we knew from before, if anything, is either kept to be checked
+    // or thrown away now.
+    if (b->channel_count() > 0)
+    {
+        std::vector<Channel::ptr> channels(b->begin_channels(), b->end_channels());
+
+        if (warm_reconnect.get(b))
+        {
+            for (std::vector<Channel::ptr>::iterator it = channels.begin(); it != channels.end(); ++it)
+                sync_state.unverified.insert((*it)->name());
+            sync_state.unverified_timer = EventManager::get_instance()->add_event(time(NULL) + 60,
+                        std::bind(&ChannelHandler::unverified_timeout, this, b));
+        }
+        else
+        {
+            for (std::vector<Channel::ptr>::iterator it = channels.begin(); it != channels.end(); ++it)
+                forget_channel(b, *it);
+        }
+    }
+
+    // We may have come back under another nick.
+    if (b->me() && !m->source->destination.empty() && b->me()->nick() != m->source->destination
+            && !b->find_client(m->source->destination))
+        b->me()->change_nick(m->source->destination);
+
+    SplitState & s = state_for<SplitState>(m->bot, split_slot);
+    if (s.timer)
+        EventManager::get_instance()->remove_event(s.timer);
+    s = SplitState();
+}
+
+// A bot that's going away takes its sync, what it had yet to verify after
+// reconnecting and any held netsplit with it, and leaves no timer behind to
+// fire for it.
+void ChannelHandler::handle_shutdown(const Message *m)
+{
+    Bot *b = m->bot;
+
+    if (SyncState *s = find_state<SyncState>(b, sync_slot))
+    {
+        if (s->who_timer)
+            EventManager::get_instance()->remove_event(s->who_timer);
+        if (s->unverified_timer)
+            EventManager::get_instance()->remove_event(s->unverified_timer);
+        b->slot(sync_slot).reset();
+    }
+
+    if (SplitState *s = find_state<SplitState>(b, split_slot))
+    {
+        if (s->timer)
+            EventManager::get_instance()->remove_event(s->timer);
+        b->slot(split_slot).reset();
+    }
 }
 
 MODULE_CLASS(ChannelHandler)
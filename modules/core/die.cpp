@@ -8,19 +8,19 @@ struct Die : CommandHandlerBase<Die>, Module
 {
     void die(const Message *m)
     {
-        m->source.reply("Bye bye...");
-        Logger::get_instance()->Log(m->bot, m->source.client, Logger::Command, "DIE");
-        Logger::get_instance()->Log(m->bot, m->source.client, Logger::Admin, "DIE from " + m->source.raw);
-        m->bot->disconnect("Shutting down (" + m->source.name + ")");
+        m->source->reply("Bye bye...");
+        Logger::get_instance()->Log(m->bot, m->source->client, Logger::Command, "DIE");
+        Logger::get_instance()->Log(m->bot, m->source->client, Logger::Admin, "DIE from " + m->source->raw);
+        m->bot->disconnect("Shutting down (" + m->source->name + ")");
         dispatch_internal_message(m->bot, "shutting_down");
-        throw DieException(m->source.client->nuh());
+        throw DieException(m->source->client->nuh());
     }
     void restart(const Message *m)
     {
-        m->source.reply("Restarting...");
-        Logger::get_instance()->Log(m->bot, m->source.client, Logger::Command, "RESTART");
-        Logger::get_instance()->Log(m->bot, m->source.client, Logger::Admin, "RESTART from " + m->source.raw);
-        m->bot->disconnect("Restarting (" + m->source.name + ")");
+        m->source->reply("Restarting...");
+        Logger::get_instance()->Log(m->bot, m->source->client, Logger::Command, "RESTART");
+        Logger::get_instance()->Log(m->bot, m->source->client, Logger::Admin, "RESTART from " + m->source->raw);
+        // The connection is handed to the restarted image, not closed.
         dispatch_internal_message(m->bot, "shutting_down");
         throw RestartException();
     }
@@ -10,7 +10,7 @@ struct ErrorHandler : CommandHandlerBase<ErrorHandler>, Module
     {
         // ERROR is a strange command without a destination.
         // What we parse as the destination string is actually the error string.
-        throw DisconnectedException(m->source.destination);
+        throw DisconnectedException(m->source->destination);
     }
     CommandHolder id;
 
@@ -4,68 +4,187 @@
 
 #include <paludis/util/tokeniser.hh>
 
+#include <cstdlib>
+
 using namespace eir;
 
 struct JoinChannels : CommandHandlerBase<JoinChannels>, Module
 {
-    std::list<std::string> bot_channels;
+    // Each bot's channels, from its own config file and join commands, are
+    // kept on the bot.
+    typedef std::list<std::string> ChannelList;
+    unsigned int channels_slot;
+
+    ChannelList & bot_channels(Bot *b)
+    {
+        Bot::Slot & slot = b->slot(channels_slot);
+        if (!slot)
+            slot = std::make_shared<ChannelList>();
+        return *static_cast<ChannelList *>(slot.get());
+    }
+
+    // Whether a bot has yet to join its channels since connecting, and the
+    // timer that joins them if the end of the MOTD never comes.
+    struct JoinState
+    {
+        bool awaiting;
+        EventManager::id timer;
+
+        JoinState() : awaiting(false), timer(0) { }
+    };
+    unsigned int join_slot;
+
+    JoinState & join_state(Bot *b)
+    {
+        Bot::Slot & slot = b->slot(join_slot);
+        if (!slot)
+            slot = std::make_shared<JoinState>();
+        return *static_cast<JoinState *>(slot.get());
+    }
 
     void add_channel(const Message *m)
     {
         if (m->args.empty())
         {
-            m->source.error("I need a channel name to join");
+            m->source->error("I need a channel name to join");
             return;
         }
+        if (!m->bot)
+            return;
 
-        bot_channels.push_back(m->args[0]);
+        bot_channels(m->bot).push_back(m->args[0]);
         if (m->bot && m->bot->connected())
             m->bot->send("JOIN " + m->args[0]);
 
-        m->source.reply("Added channel " + m->args[0]);
+        m->source->reply("Added channel " + m->args[0]);
 
-        Logger::get_instance()->Log(m->bot, m->source.client, Logger::Info, "Adding channel " + m->args[0]);
-        if (m->source.client)
-            Logger::get_instance()->Log(m->bot, m->source.client, Logger::Command, m->raw);
+        Logger::get_instance()->Log(m->bot, m->source->client, Logger::Info, "Adding channel " + m->args[0]);
+        if (m->source->client)
+            Logger::get_instance()->Log(m->bot, m->source->client, Logger::Command, m->raw);
     }
 
     void remove_channel(const Message *m)
     {
         if (m->args.empty())
         {
-            m->source.reply("Part where?");
+            m->source->reply("Part where?");
             return;
         }
+        if (!m->bot)
+            return;
 
-        for (std::list<std::string>::iterator it = bot_channels.begin();
-                it != bot_channels.end(); ++it)
-        {
-            if (*it == m->args[0])
-                bot_channels.erase(it++);
-        }
+        bot_channels(m->bot).remove(m->args[0]);
 
         if (m->bot && m->bot->connected())
             m->bot->send("PART " + m->args[0]);
 
-        m->source.reply("Removed channel " + m->args[0]);
+        m->source->reply("Removed channel " + m->args[0]);
 
-        Logger::get_instance()->Log(m->bot, m->source.client, Logger::Info, "Removing channel " + m->args[0]);
-        if (m->source.client)
-            Logger::get_instance()->Log(m->bot, m->source.client, Logger::Command, m->raw);
+        Logger::get_instance()->Log(m->bot, m->source->client, Logger::Info, "Removing channel " + m->args[0]);
+        if (m->source->client)
+            Logger::get_instance()->Log(m->bot, m->source->client, Logger::Command, m->raw);
     }
 
-    void on_connect(const Message *m)
+    // How many channels the server will accept in one JOIN, or 0 if it
+    // doesn't say.
+    static unsigned int join_targets(Bot *b)
     {
-        for (std::list<std::string>::iterator it = bot_channels.begin();
-                it != bot_channels.end(); ++it)
+        std::pair<bool, std::string> targmax = b->supported()->get_value("TARGMAX");
+        if (!targmax.first)
+            return 0;
+
+        std::string::size_type idx = targmax.second.find("JOIN:");
+        if (idx == std::string::npos)
+            return 0;
+        return atoi(targmax.second.c_str() + idx + 5);
+    }
+
+    // Joins everything in as few lines as possible, packing channel names
+    // into each JOIN up to the line length and the server's TARGMAX.
+    void join_all(Bot *b)
+    {
+        JoinState & state = join_state(b);
+        if (!state.awaiting)
+            return;
+        state.awaiting = false;
+
+        unsigned int max_targets = join_targets(b);
+        std::string line;
+        unsigned int targets = 0;
+
+        ChannelList & channels = bot_channels(b);
+        for (ChannelList::iterator it = channels.begin(); it != channels.end(); ++it)
         {
-            m->bot->send("JOIN " + *it);
+            // Channels with keys get a line to themselves.
+            if (it->find(' ') != std::string::npos)
+            {
+                b->send("JOIN " + *it);
+                continue;
+            }
+
+            if (!line.empty() && (line.size() + 1 + it->size() > 510 ||
+                                  (max_targets && targets >= max_targets)))
+            {
+                b->send(line);
+                line.clear();
+                targets = 0;
+            }
+
+            line += line.empty() ? "JOIN " : ",";
+            line += *it;
+            ++targets;
         }
+
+        if (!line.empty())
+            b->send(line);
     }
 
-    CommandHolder addch_id, join_id, rmch_id, part_id, conn_id;
+    void cancel_timer(JoinState & state)
+    {
+        if (state.timer)
+            EventManager::get_instance()->remove_event(state.timer);
+        state.timer = 0;
+    }
+
+    void on_connect(const Message *m)
+    {
+        // TARGMAX isn't known until 005, so hold off until the end of the
+        // MOTD -- or a few seconds, in case that never comes.
+        JoinState & state = join_state(m->bot);
+        state.awaiting = true;
+
+        cancel_timer(state);
+        state.timer = EventManager::get_instance()->add_event(time(NULL) + 10,
+                    std::bind(&JoinChannels::join_timeout, this, m->bot));
+    }
+
+    void join_timeout(Bot *b)
+    {
+        // We're running from the timer, so it mustn't be removed underneath us.
+        join_state(b).timer = 0;
+        join_all(b);
+    }
+
+    void on_end_of_motd(const Message *m)
+    {
+        cancel_timer(join_state(m->bot));
+        join_all(m->bot);
+    }
+
+    // A bot that's going away leaves no timer behind to join for it.
+    void on_shutdown(const Message *m)
+    {
+        Bot::Slot & slot = m->bot->slot(join_slot);
+        if (!slot)
+            return;
+        cancel_timer(*static_cast<JoinState *>(slot.get()));
+        slot.reset();
+    }
+
+    CommandHolder addch_id, join_id, rmch_id, part_id, conn_id, motd_id, nomotd_id, shutdown_id;
 
     JoinChannels()
+        : channels_slot(Bot::new_slot()), join_slot(Bot::new_slot())
     {
         addch_id = add_handler(filter_command("channel").source_type(sourceinfo::ConfigFile),
                                 &JoinChannels::add_channel);
@@ -75,6 +194,24 @@ struct JoinChannels : CommandHandlerBase<JoinChannels>, Module
                                 &JoinChannels::remove_channel);
         conn_id = add_handler(filter_command("001").source_type(sourceinfo::RawIrc),
                                 &JoinChannels::on_connect);
+        motd_id = add_handler(filter_command("376").source_type(sourceinfo::RawIrc),
+                                &JoinChannels::on_end_of_motd);
+        nomotd_id = add_handler(filter_command("422").source_type(sourceinfo::RawIrc),
+                                &JoinChannels::on_end_of_motd);
+        shutdown_id = add_handler(filter_command_type("shutting_down", sourceinfo::Internal),
+                                &JoinChannels::on_shutdown);
+    }
+
+    ~JoinChannels()
+    {
+        for (BotManager::iterator it = BotManager::get_instance()->begin(); it != BotManager::get_instance()->end(); ++it)
+        {
+            Bot::Slot & slot = it->second->slot(join_slot);
+            if (slot)
+                cancel_timer(*static_cast<JoinState *>(slot.get()));
+        }
+        Bot::clear_slot(join_slot);
+        Bot::clear_slot(channels_slot);
     }
 };
 
@@ -6,71 +6,95 @@ using namespace eir;
 
 struct ModeParser : CommandHandlerBase<ModeParser>, Module
 {
-    void check_mode_changes(const Message *m)
+    // The old one-event-per-letter interface, only built for those who
+    // still listen to it.
+    void dispatch_legacy(const Message *m, const ModeChange & change, bool mode_change, bool mode_letter)
     {
-        if (m->args.size() < 2)
-            return;
-
-        Message m2(*m, "mode " + m->args[1], sourceinfo::Internal);
-        m2.args.push_back(m->args[0]);
-        if (m->args.size() >= 3)
-            m2.args.push_back(m->args[2]);
-
-        CommandRegistry::get_instance()->dispatch(&m2);
-
-        if (m->bot->supported()->get_mode_type(m->args[1][0]) == ISupport::prefix_mode &&
-                m->args.size() >= 3)
+        Message m2(*m, "mode_change", sourceinfo::Internal);
+        m2.args.push_back(change.adding ? "add" : "remove");
+        m2.args.push_back(std::string(1, change.mode));
+        m2.raw = std::string("mode_change ") + m2.args[0] + " " + m2.args[1];
+        if (!change.param.empty())
         {
-            // Prefix mode -- update the client's Membership list.
-            Client::ptr c = m->bot->find_client(m->args[2]);
-            if (!c)
-                return;
+            m2.raw += " " + change.param;
+            m2.args.push_back(change.param);
+        }
 
-            Membership::ptr mem = c->find_membership(m->source.destination);
-            if (!mem)
-                return;
+        if (mode_change)
+            CommandRegistry::get_instance()->dispatch(&m2);
 
-            if (m->args[0] == "add" && !mem->has_mode(m->args[1][0]))
-                mem->modes += m->args[1][0];
-            else if (m->args[0] == "remove" && mem->has_mode(m->args[1][0]))
-                mem->modes.erase(mem->modes.find(m->args[1][0]));
+        if (mode_letter)
+        {
+            Message m3(m2, "mode " + m2.args[1], sourceinfo::Internal);
+            m3.args.push_back(m2.args[0]);
+            if (!change.param.empty())
+                m3.args.push_back(change.param);
+            CommandRegistry::get_instance()->dispatch(&m3);
         }
     }
 
     void parse_mode(const Message *m)
     {
-        if (! m->bot->supported()->is_channel_name(m->source.destination))
+        const ISupport *supported = m->bot->supported();
+
+        if (! supported->is_channel_name(m->source->destination) || m->args.empty())
             return;
 
+        std::shared_ptr<std::vector<ModeChange> > changes = std::make_shared<std::vector<ModeChange> >();
+
         std::vector<std::string>::const_iterator nextarg = m->args.begin();
-        std::string modes = *nextarg++;
+        const std::string & modes = *nextarg++;
+        changes->reserve(modes.size());
 
-        int dir = 0;
-        for ( std::string::iterator ch = modes.begin(); ch != modes.end(); ++ch)
+        bool adding = true;
+        for (std::string::const_iterator ch = modes.begin(); ch != modes.end(); ++ch)
         {
             if (*ch == '+')
-                dir = 1;
+                adding = true;
             else if (*ch == '-')
-                dir = -1;
+                adding = false;
             else
             {
-                Message m2(*m, "mode_change", sourceinfo::Internal);
+                ModeChange change = { adding, *ch, "" };
+                if (supported->mode_has_param(*ch, adding) && nextarg != m->args.end())
+                    change.param = *nextarg++;
+                changes->push_back(change);
+            }
+        }
 
-                m2.args.push_back(dir > 0 ? "add" : "remove");
-                m2.args.push_back(std::string(1, *ch));
-                m2.raw = std::string("mode_change ") + m2.args[0] + " " + m2.args[1];
+        CommandRegistry *registry = CommandRegistry::get_instance();
+        bool legacy_mode_change = registry->has_handlers("mode_change");
 
-                if (m->bot->supported()->mode_has_param(*ch, dir>0))
-                {
-                    m2.raw += " " + *nextarg;
-                    m2.args.push_back(*nextarg++);
-                }
+        for (std::vector<ModeChange>::const_iterator it = changes->begin(); it != changes->end(); ++it)
+        {
+            bool legacy_letter = registry->has_handlers("mode " + std::string(1, it->mode));
+            if (legacy_mode_change || legacy_letter)
+                dispatch_legacy(m, *it, legacy_mode_change, legacy_letter);
 
-                CommandRegistry::get_instance()->dispatch(&m2);
+            if (supported->get_mode_type(it->mode) != ISupport::prefix_mode || it->param.empty())
+                continue;
 
-                check_mode_changes(&m2);
-            }
+            // Prefix mode -- update the client's Membership list.
+            Client::ptr c = m->bot->find_client(it->param);
+            if (!c)
+                continue;
+
+            Membership::ptr mem = c->find_membership(m->source->destination);
+            if (!mem)
+                continue;
+
+            if (it->adding)
+                mem->add_mode(it->mode);
+            else
+                mem->remove_mode(it->mode);
         }
+
+        // Everything at once, after the channel state has been updated.
+        Message m2(*m, "mode_changes", sourceinfo::Internal);
+        m2.args = m->args;
+        m2.raw = m->raw;
+        m2.modes = changes;
+        registry->dispatch(&m2);
     }
 
     CommandHolder mode_id;
@@ -11,7 +11,7 @@ struct Ponger : CommandHandlerBase<Ponger>, Module
 
     void pong(const eir::Message *m)
     {
-        std::string response("PONG :" + m->source.destination);
+        std::string response("PONG :" + m->source->destination);
         m->bot->send(response);
     }
 
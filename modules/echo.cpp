@@ -7,7 +7,7 @@ struct echo : CommandHandlerBase<echo>, Module
 {
     void do_echo(const Message *m)
     {
-        m->source.reply(m->args.at(0));
+        m->source->reply(m->args.at(0));
     }
 
     CommandHolder _id;
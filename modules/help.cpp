@@ -21,26 +21,24 @@ struct helper : CommandHandlerBase<helper>, Module
         Value& help_root = GlobalSettingsManager::get_instance()->get("help_root");
         if (help_root.Type() != Value::kvarray)
         {
-            m->source.error("No help has been defined");
+            m->source->error("No help has been defined");
             return;
         }
 
         Value& help_topic = help_root[topic];
         if (help_topic.Type() != Value::kvarray ||
              ( !!help_topic["priv"] &&
-               (!m->source.client || !m->source.client->privs().has_privilege(help_topic["priv"]))))
+               (!m->source->client || !m->source->client->privs().has_privilege(help_topic["priv"]))))
         {
-            m->source.error("No help for '" + topic + "'.");
+            m->source->error("No help for '" + topic + "'.");
             return;
         }
 
-        if (!m->source.reply_func)
-            return;
-
         std::list<std::string> reply;
         paludis::tokenise<paludis::delim_kind::AnyOfTag, paludis::delim_mode::DelimiterTag>
                     (help_topic["text"], "\r\n", "", std::back_inserter(reply));
-        std::for_each(reply.begin(), reply.end(), m->source.reply_func);
+        for (std::list<std::string>::iterator it = reply.begin(); it != reply.end(); ++it)
+            m->source->reply(*it);
     }
 
     void do_help_index(const Message *m)
@@ -50,12 +48,12 @@ struct helper : CommandHandlerBase<helper>, Module
         for (KeyValueArray::iterator it = help_index.KV().begin(); it != help_index.KV().end(); ++it)
         {
             if (it->second.String().empty() ||
-                 (m->source.client && m->source.client->privs().has_privilege(it->second)))
+                 (m->source->client && m->source->client->privs().has_privilege(it->second)))
             {
                 topics.push_back(it->first);
             }
         }
-        m->source.reply("Available help topics are: " + paludis::join(topics.begin(), topics.end(), " "));
+        m->source->reply("Available help topics are: " + paludis::join(topics.begin(), topics.end(), " "));
     }
 
     void help(const Message *m)
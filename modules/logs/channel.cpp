@@ -8,9 +8,10 @@ struct ChannelLogger : public Module
     {
         std::string channel;
 
+        // Lines that aren't any bot's have nowhere to go.
         void Log(Bot *b, Client *c, std::string text)
         {
-            if (b->connected())
+            if (b && b->connected())
                 b->send("PRIVMSG " + channel + " :(" + (c ? c->nick() : "<unknown>") + ") " + text);
         }
 
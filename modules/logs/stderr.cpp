@@ -20,9 +20,10 @@ struct StdErrLogger : public Module
                     text = text.substr(0, p);
             }
 
-            if (b)
-                std::cerr << "[" << b->name() << "] ";
-            std::cerr << text << std::endl;
+            // In one piece, so that lines from different reactors' threads
+            // don't interleave.
+            std::string line = b ? "[" + b->name() + "] " + text + "\n" : text + "\n";
+            std::cerr << line << std::flush;
         }
     };
 
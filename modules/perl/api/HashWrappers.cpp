@@ -18,22 +18,14 @@ int BotClientHash::SCALAR() { return _bot->begin_clients() != _bot->end_clients(
 
 const char* BotClientHash::FIRSTKEY()
 {
-    Bot::ClientIterator it = _bot->begin_clients();
-    if (it == _bot->end_clients())
-        return 0;
-    else
-        return (*it)->nick().c_str();
+    Client::ptr c = _keys.first(_bot->begin_clients(), _bot->end_clients(), _bot->client_count());
+    return c ? c->nick().c_str() : 0;
 }
 
-const char* BotClientHash::NEXTKEY(char *prevnick)
+const char* BotClientHash::NEXTKEY(char *)
 {
-    Bot::ClientIterator it = _bot->find_client_it(prevnick);
-    if (it == _bot->end_clients())
-        return 0;
-    ++it;
-    if (it == _bot->end_clients())
-        return 0;
-    return (*it)->nick().c_str();
+    Client::ptr c = _keys.next();
+    return c ? c->nick().c_str() : 0;
 }
 
 
@@ -44,22 +36,14 @@ int BotChannelHash::SCALAR() { return _bot->begin_channels() != _bot->end_channe
 
 const char* BotChannelHash::FIRSTKEY()
 {
-    Bot::ChannelIterator it = _bot->begin_channels();
-    if (it == _bot->end_channels())
-        return 0;
-    else
-        return (*it)->name().c_str();
+    Channel::ptr c = _keys.first(_bot->begin_channels(), _bot->end_channels(), _bot->channel_count());
+    return c ? c->name().c_str() : 0;
 }
 
-const char* BotChannelHash::NEXTKEY(char *prevname)
+const char* BotChannelHash::NEXTKEY(char *)
 {
-    Bot::ChannelIterator it = _bot->find_channel_it(prevname);
-    if (it == _bot->end_channels())
-        return 0;
-    ++it;
-    if (it == _bot->end_channels())
-        return 0;
-    return (*it)->name().c_str();
+    Channel::ptr c = _keys.next();
+    return c ? c->name().c_str() : 0;
 }
 
 BotSettingsHash::BotSettingsHash(Bot *b)
@@ -124,22 +108,15 @@ int ClientMembershipHash::SCALAR() { return _client->begin_channels() != _client
 
 const char* ClientMembershipHash::FIRSTKEY()
 {
-    Client::ChannelIterator it = _client->begin_channels();
-    if (it == _client->end_channels())
-        return 0;
-    else
-        return (*it)->channel->name().c_str();
+    Channel::ptr c = _keys.first(_client->begin_channels(), _client->end_channels(), 0,
+                                 [] (const Membership::ptr & m) { return Channel::ptr(m->channel); });
+    return c ? c->name().c_str() : 0;
 }
 
-const char* ClientMembershipHash::NEXTKEY(char *prevname)
+const char* ClientMembershipHash::NEXTKEY(char *)
 {
-    Client::ChannelIterator it = _client->find_membership_it(prevname);
-    if (it == _client->end_channels())
-        return 0;
-    ++it;
-    if (it == _client->end_channels())
-        return 0;
-    return (*it)->channel->name().c_str();
+    Channel::ptr c = _keys.next();
+    return c ? c->name().c_str() : 0;
 }
 
 
@@ -150,22 +127,15 @@ int ChannelMembershipHash::SCALAR() { return _channel->begin_members() != _chann
 
 const char* ChannelMembershipHash::FIRSTKEY()
 {
-    Channel::MemberIterator it = _channel->begin_members();
-    if (it == _channel->end_members())
-        return 0;
-    else
-        return (*it)->client->nick().c_str();
+    Client::ptr c = _keys.first(_channel->begin_members(), _channel->end_members(), _channel->member_count(),
+                                [] (const Membership::ptr & m) { return Client::ptr(m->client); });
+    return c ? c->nick().c_str() : 0;
 }
 
-const char* ChannelMembershipHash::NEXTKEY(char *prevname)
+const char* ChannelMembershipHash::NEXTKEY(char *)
 {
-    Channel::MemberIterator it = _channel->find_member_it(prevname);
-    if (it == _channel->end_members())
-        return 0;
-    ++it;
-    if (it == _channel->end_members())
-        return 0;
-    return (*it)->client->nick().c_str();
+    Client::ptr c = _keys.next();
+    return c ? c->nick().c_str() : 0;
 }
 
 
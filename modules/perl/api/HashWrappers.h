@@ -3,14 +3,62 @@
 
 #include "bot.h"
 
+#include <vector>
+
 namespace eir
 {
     namespace perl
     {
+        /*
+         * The entries of a tied hash, taken at FIRSTKEY. Each NEXTKEY is then a
+         * step along the snapshot instead of a fresh lookup of the previous
+         * key, and the iteration isn't upset by changes made during it.
+         *
+         * What's kept is whatever owns the key's text: the client or channel
+         * itself, not a membership, whose ends don't own what they point to.
+         */
+        template <typename Ptr_>
+        class KeySnapshot
+        {
+            std::vector<Ptr_> _items;
+            std::size_t _next;
+
+            public:
+                KeySnapshot() : _next(0) { }
+
+                template <typename It_>
+                Ptr_ first(It_ begin, It_ end, std::size_t size)
+                {
+                    return first(begin, end, size, [] (const Ptr_ & p) { return p; });
+                }
+
+                // With get() giving what to keep for each entry.
+                template <typename It_, typename Get_>
+                Ptr_ first(It_ begin, It_ end, std::size_t size, Get_ get)
+                {
+                    _items.clear();
+                    _items.reserve(size);
+                    for ( ; begin != end; ++begin)
+                        _items.push_back(get(*begin));
+                    _next = 0;
+                    return next();
+                }
+
+                // The returned pointer stays alive until the following call.
+                Ptr_ next()
+                {
+                    if (_next < _items.size())
+                        return _items[_next++];
+                    std::vector<Ptr_>().swap(_items);
+                    _next = 0;
+                    return Ptr_();
+                }
+        };
 
         class BotChannelHash
         {
             Bot *_bot;
+            KeySnapshot<ChannelPtr> _keys;
             public:
                 BotChannelHash(Bot *b);
                 Channel *FETCH(char *nick);
@@ -23,6 +71,7 @@ namespace eir
         class BotClientHash
         {
             Bot *_bot;
+            KeySnapshot<ClientPtr> _keys;
             public:
                 BotClientHash(Bot *b);
                 Client *FETCH(char *nick);
@@ -49,6 +98,7 @@ namespace eir
         class ClientMembershipHash
         {
             Client *_client;
+            KeySnapshot<ChannelPtr> _keys;
             public:
                 ClientMembershipHash(Client *b);
                 Membership *FETCH(char *nick);
@@ -61,6 +111,7 @@ namespace eir
         class ChannelMembershipHash
         {
             Channel *_channel;
+            KeySnapshot<ClientPtr> _keys;
             public:
                 ChannelMembershipHash(Channel *b);
                 Membership *FETCH(char *nick);
@@ -58,6 +58,43 @@ Bot::name()
 Capabilities *
 Bot::capabilities()
 
+SV *
+Bot::client_nicks()
+CODE:
+    AV *ret = newAV();
+    av_extend(ret, THIS->client_count());
+    for (Bot::ClientIterator it = THIS->begin_clients(), end = THIS->end_clients(); it != end; ++it)
+        av_push(ret, newSVpvn((*it)->nick().data(), (*it)->nick().size()));
+    RETVAL = newRV_noinc((SV*)ret);
+OUTPUT:
+    RETVAL
+
+SV *
+Bot::clients()
+CODE:
+    AV *ret = newAV();
+    av_extend(ret, THIS->client_count());
+    for (Bot::ClientIterator it = THIS->begin_clients(), end = THIS->end_clients(); it != end; ++it)
+    {
+        SV *client = newSV(0);
+        sv_setref_pv(client, PerlClassMap<Client*>::name(), (void*)it->get());
+        av_push(ret, client);
+    }
+    RETVAL = newRV_noinc((SV*)ret);
+OUTPUT:
+    RETVAL
+
+SV *
+Bot::channel_names()
+CODE:
+    AV *ret = newAV();
+    av_extend(ret, THIS->channel_count());
+    for (Bot::ChannelIterator it = THIS->begin_channels(), end = THIS->end_channels(); it != end; ++it)
+        av_push(ret, newSVpvn((*it)->name().data(), (*it)->name().size()));
+    RETVAL = newRV_noinc((SV*)ret);
+OUTPUT:
+    RETVAL
+
 
 INCLUDE: clients.xs
 INCLUDE: helpers.xs
@@ -32,12 +32,48 @@ CODE:
 OUTPUT:
     RETVAL
 
+SV *
+Client::channel_names()
+CODE:
+    AV *ret = newAV();
+    for (Client::ChannelIterator it = THIS->begin_channels(), end = THIS->end_channels(); it != end; ++it)
+        av_push(ret, newSVpvn((*it)->channel->name().data(), (*it)->channel->name().size()));
+    RETVAL = newRV_noinc((SV*)ret);
+OUTPUT:
+    RETVAL
+
 
 MODULE = Eir            PACKAGE = Eir::Channel
 
 string
 Channel::name()
 
+SV *
+Channel::member_nicks()
+CODE:
+    AV *ret = newAV();
+    av_extend(ret, THIS->member_count());
+    for (Channel::MemberIterator it = THIS->begin_members(), end = THIS->end_members(); it != end; ++it)
+        av_push(ret, newSVpvn((*it)->client->nick().data(), (*it)->client->nick().size()));
+    RETVAL = newRV_noinc((SV*)ret);
+OUTPUT:
+    RETVAL
+
+SV *
+Channel::members()
+CODE:
+    AV *ret = newAV();
+    av_extend(ret, THIS->member_count());
+    for (Channel::MemberIterator it = THIS->begin_members(), end = THIS->end_members(); it != end; ++it)
+    {
+        SV *member = newSV(0);
+        sv_setref_pv(member, PerlClassMap<Membership*>::name(), (void*)it->get());
+        av_push(ret, member);
+    }
+    RETVAL = newRV_noinc((SV*)ret);
+OUTPUT:
+    RETVAL
+
 MODULE = Eir            PACKAGE = Eir::Membership
 
 Client *
@@ -57,7 +93,7 @@ OUTPUT:
 string
 Membership::modes()
 CODE:
-    RETVAL = THIS->modes;
+    RETVAL = THIS->modes();
 OUTPUT:
     RETVAL
 
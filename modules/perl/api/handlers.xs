@@ -10,10 +10,11 @@ CODE:
         quiet = (bool)SvIV(ST(2));
     if (items > 3)
         order = (Message::Order)SvIV(ST(3));
+    // Our own copy, so the CV can't change or go away under the handler.
+    func = sv_2mortal(newSVsv(func));
     CommandRegistry::id id = CommandRegistry::get_instance()->add_handler(
                                 *filter,
-                                std::bind(call_perl<PerlContext::Void, const char *, SV*, const Message *>,
-                                            aTHX_ "Eir::Init::call_wrapper", func, _1),
+                                PerlHandler(aTHX_ func),
                                 quiet,
                                 order);
     RETVAL = new PerlCommandHolder(aTHX_ id, func);
@@ -25,10 +26,10 @@ MODULE = Eir            PACKAGE = Eir::EventManager
 PerlHolder *
 add_event(int time, SV *func)
 CODE:
+    func = sv_2mortal(newSVsv(func));
     EventManager::id id = EventManager::get_instance()->add_event(
                                 time,
-                                std::bind(call_perl<PerlContext::Void, const char *, SV*>,
-                                            aTHX_ "Eir::Init::call_wrapper", func));
+                                PerlHandler(aTHX_ func));
     RETVAL = new PerlEventHolder(aTHX_ id, func);
 OUTPUT:
     RETVAL
@@ -36,10 +37,10 @@ OUTPUT:
 PerlHolder *
 add_recurring_event(int time, SV *func)
 CODE:
+    func = sv_2mortal(newSVsv(func));
     EventManager::id id = EventManager::get_instance()->add_recurring_event(
                                 time,
-                                std::bind(call_perl<PerlContext::Void, const char *, SV*>,
-                                            aTHX_ "Eir::Init::call_wrapper", func));
+                                PerlHandler(aTHX_ func));
     RETVAL = new PerlEventHolder(aTHX_ id, func);
 OUTPUT:
     RETVAL
@@ -71,6 +71,14 @@ CODE:
 OUTPUT:
     RETVAL
 
+Filter *
+Filter::for_modes(const char *letters)
+CODE:
+    THIS->for_modes(letters);
+    RETVAL = THIS;
+OUTPUT:
+    RETVAL
+
 int
 Filter::match(const Message *m)
 
@@ -129,17 +137,36 @@ CODE:
 OUTPUT:
     RETVAL
 
+SV *
+Message::modes() const
+CODE:
+    AV *ret = newAV();
+    if (THIS->modes)
+    {
+        for (auto it = THIS->modes->begin(); it != THIS->modes->end(); ++it)
+        {
+            HV *change = newHV();
+            hv_store(change, "adding", 6, newSViv(it->adding), 0);
+            hv_store(change, "mode", 4, newSVpvn(&it->mode, 1), 0);
+            hv_store(change, "param", 5, newSVpv(it->param.c_str(), 0), 0);
+            av_push(ret, newRV_noinc((SV*)change));
+        }
+    }
+    RETVAL = newRV_noinc((SV*)ret);
+OUTPUT:
+    RETVAL
+
 SV *
 Message::source() const
 CODE:
     HV *ret = newHV();
-    hv_store(ret, "type", 4, newSViv(THIS->source.type), 0);
+    hv_store(ret, "type", 4, newSViv(THIS->source_type), 0);
     SV *client = newSV(0);
-    sv_setref_pv(client, "Eir::Client", THIS->source.client.get());
+    sv_setref_pv(client, "Eir::Client", THIS->source->client.get());
     hv_store(ret, "client", 6, client, 0);
-    hv_store(ret, "name", 4, newSVpv(THIS->source.name.c_str(), 0), 0);
-    hv_store(ret, "raw", 3, newSVpv(THIS->source.raw.c_str(), 0), 0);
-    hv_store(ret, "destination", 11, newSVpv(THIS->source.destination.c_str(), 0), 0);
+    hv_store(ret, "name", 4, newSVpv(THIS->source->name.c_str(), 0), 0);
+    hv_store(ret, "raw", 3, newSVpv(THIS->source->raw.c_str(), 0), 0);
+    hv_store(ret, "destination", 11, newSVpv(THIS->source->destination.c_str(), 0), 0);
 
     RETVAL = newRV_noinc((SV*)ret);
 OUTPUT:
@@ -148,13 +175,13 @@ OUTPUT:
 void
 Message::error(const char *str) const
 CODE:
-    THIS->source.error(str);
+    THIS->source->error(str);
 
 
 void
 Message::reply(const char *str) const
 CODE:
-    THIS->source.reply(str);
+    THIS->source->reply(str);
 
 
 MODULE = Eir            PACKAGE = Eir::Source
@@ -72,6 +72,8 @@ sub new {
             $self->requires_privilege($args->{$key});
         } elsif ($key eq 'config') {
             $self->or_config if $args->{$key};
+        } elsif ($key eq 'modes') {
+            $self->for_modes($args->{$key});
         }
     }
     return $self;
@@ -23,6 +23,9 @@ use lib "$FindBin::Bin/../api";
 
 our %Scripts;
 
+# Installed once. Script calls, here and from C++, only arm the timer.
+$SIG{ALRM} = sub { die "Script used too much running time"; };
+
 sub package_name_ify {
     my ($filename) = @_;
 
@@ -104,13 +107,11 @@ sub do_eval {
 
 sub call_wrapper {
     my $sub = shift;
-    my $saved_alarm=$SIG{ALRM};
-    $SIG{ALRM} = sub { die "Script used too much running time"; };
+    my $outer = alarm 0;
+    alarm($outer || 1);
     eval {
-        alarm 1;
         &$sub(@_);
     };
-    alarm 0;
-    $SIG{ALRM} = $saved_alarm;
+    alarm 0 unless $outer;
     die $@ if $@;
 }
@@ -2,15 +2,30 @@
 
 #include "eir.h"
 #include "handler.h"
+#include "modules.h"
+#include "storage.h"
 
 #include <EXTERN.h>
 #include <perl.h>
 
 #include <dlfcn.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <atomic>
 
 #include "definitions.h"
 
 #include <paludis/util/join.hh>
+#include <paludis/util/stringify.hh>
+#include <paludis/util/destringify.hh>
 
 using namespace eir;
 
@@ -21,43 +36,802 @@ using namespace eir;
 // Defined in perlxsi.c, generated at build time
 extern "C" void xs_init(pTHX);
 
+extern char **environ;
+
+namespace
+{
+    /*
+     * eir and a script host talk in frames: a four-byte length in network
+     * order, then that many bytes of type and payload.
+     *
+     *   I  to host    <state>                what to mirror, then the script
+     *   L  to host    <bot>\n<line>          a line from the server
+     *   U  to host                           unload the script and exit
+     *   R  from host  empty, or !<error>     the result of loading the script
+     *   S  from host  <bot>\n<line>          a line for eir to send
+     *   W  from host  <type>\n<bot>\n<text>  something the script logged
+     */
+    void append_frame(std::string & buf, char type, const std::string & payload)
+    {
+        uint32_t len = htonl(payload.size() + 1);
+        buf.append(reinterpret_cast<const char *>(&len), 4);
+        buf += type;
+        buf += payload;
+    }
+
+    // Reads the frame at pos, if it's all there, and moves pos past it.
+    bool next_frame(const std::string & buf, std::string::size_type & pos, char & type, std::string & payload)
+    {
+        if (buf.size() - pos < 5)
+            return false;
+
+        uint32_t len;
+        memcpy(&len, buf.data() + pos, 4);
+        len = ntohl(len);
+        if (len == 0 || buf.size() - pos - 4 < len)
+            return false;
+
+        type = buf[pos + 4];
+        payload.assign(buf, pos + 5, len - 1);
+        pos += 4 + len;
+        return true;
+    }
+
+    std::string take_field(std::string & payload)
+    {
+        std::string::size_type nl = payload.find('\n');
+        std::string field = payload.substr(0, nl);
+        payload.erase(0, nl == std::string::npos ? nl : nl + 1);
+        return field;
+    }
+
+    bool write_all(int fd, const std::string & data)
+    {
+        std::string::size_type done = 0;
+        while (done < data.size())
+        {
+            ssize_t n = write(fd, data.data() + done, data.size() - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            done += n;
+        }
+        return true;
+    }
+
+    std::string escape_tag_value(const std::string & value)
+    {
+        std::string ret;
+        ret.reserve(value.size());
+        for (std::string::const_iterator c = value.begin(); c != value.end(); ++c)
+        {
+            switch (*c)
+            {
+                case ';':  ret += "\\:"; break;
+                case ' ':  ret += "\\s"; break;
+                case '\r': ret += "\\r"; break;
+                case '\n': ret += "\\n"; break;
+                case '\\': ret += "\\\\"; break;
+                default:   ret += *c;
+            }
+        }
+        return ret;
+    }
+
+    // The line as the server sent it, tags and all.
+    std::string server_line(const Message *m)
+    {
+        if (m->tags.empty())
+            return m->raw;
+
+        std::string line(1, '@');
+        for (std::map<std::string, std::string>::const_iterator it = m->tags.begin(); it != m->tags.end(); ++it)
+        {
+            if (it != m->tags.begin())
+                line += ';';
+            line += it->first;
+            if (!it->second.empty())
+                line += '=' + escape_tag_value(it->second);
+        }
+        return line + ' ' + m->raw;
+    }
+
+    // How much may wait for a host to read it, besides the state it starts
+    // from, before it's restarted to catch up.
+    const std::string::size_type max_host_queue = 1024 * 1024;
+
+    // What a host loads, of what eir has: storage, and what keeps the
+    // clients, channels and privileges it mirrors as they are in eir.
+    // Nothing that acts on what it sees.
+    const char * const host_modules[] = {
+        "storage/json.so", "core/channel.so", "core/mode.so",
+        "privileges.so", "privs/account.so", "privs/hostmask.so"
+    };
+
+    struct PendingHost
+    {
+        std::string filename, bot;
+        // Null when restarting a host, rather than starting one for someone.
+        SourcePtr source;
+        unsigned long restarts;
+    };
+
+    struct HostedScript
+    {
+        std::string filename, bot;
+        pid_t pid;
+        int fd;
+
+        // Frames waiting for the host to read them, and those it has sent
+        // that haven't been handled yet.
+        std::string outbuf, inbuf;
+
+        // Whoever asked for the script, until the host says how loading went.
+        SourcePtr load_source;
+
+        // On the main reactor: always reading, and writing while there's
+        // anything in outbuf.
+        Reactor::SourceId read_source, write_source;
+
+        // Set from whichever reactor found it too far behind; it's restarted
+        // from the main one.
+        bool behind;
+
+        std::string::size_type queue_limit, peak_queue;
+        unsigned long forwarded, sent, restarts;
+    };
+}
+
 struct PerlModule : CommandHandlerBase<PerlModule>, Module
 {
     PerlInterpreter *my_perl;
     void *libperl_handle;
 
+    // Scripts run out of process, each in a fresh copy of eir that mirrors
+    // the bots' state: it starts from a snapshot of it, then keeps it up to
+    // date from the same server lines, using only the modules that track
+    // state. Its output goes back to eir to send, so a script that blocks
+    // only delays itself. The hosts' sockets are all served by the main
+    // reactor; other reactors only queue lines for them.
+    std::list<HostedScript> hosts;
+    std::vector<PendingHost> pending_hosts;
+    std::vector<pid_t> exiting_hosts;
+    bool service_pending;
+    EventManager::id reap_id;
+
+    // Every reactor forwards its lines to the hosts. Most of the time there
+    // are none, which they can see from the count without taking the lock;
+    // it's kept in step with hosts, which only grows between passes.
+    SharedLock hosts_lock;
+    std::atomic<unsigned int> host_count;
+    WorkerPool::Token token;
+
+    // ModuleRegistry makes the name this was loaded as the trace owner
+    // while creating it; hosts load it under the same name.
+    std::string module_name;
+
+    // In a script host: the connection to eir, what's been read from it,
+    // the trace owner of the hosted script, the bot that asked for it, and
+    // the mirrored bots. Otherwise -1 and empty.
+    int host_fd;
+    Reactor::SourceId host_source;
+    std::string host_inbuf, host_owner, host_bot;
+    std::vector<std::shared_ptr<Bot> > mirrors;
+
+    bool acting_for_script() const
+    {
+        return host_owner == TraceOwner::current();
+    }
+
+    struct HostLogDestination : LogDestination
+    {
+        PerlModule *module;
+        Logger::Type type;
+
+        void Log(Bot *b, Client *, std::string text)
+        {
+            if (!module->acting_for_script())
+                return;
+            std::string frame;
+            append_frame(frame, 'W', paludis::stringify(type) + "\n" + (b ? b->name() : "") + "\n" + text);
+            write_all(module->host_fd, frame);
+        }
+
+        HostLogDestination(PerlModule *m, Logger::Type t) : module(m), type(t) { }
+    };
+
+    struct HostLogBackend : LogBackend
+    {
+        PerlModule *module;
+
+        LogDestination *create_destination(std::string type)
+        {
+            return new HostLogDestination(module, paludis::destringify<Logger::Type>(type));
+        }
+
+        HostLogBackend(PerlModule *m) : module(m) { }
+    };
+
     void do_script_load(const Message *m)
     {
         if (m->args.empty())
         {
-            m->source.error("I need a file name to load.");
+            m->source->error("I need a file name to load.");
             return;
         }
+        TraceOwner owner("perl:" + m->args[0]);
         call_perl<PerlContext::Void>(aTHX_ "Eir::Init::load_script", m->args[0], m, 1);
-        m->source.reply("Successfully loaded " + m->args[0]);
+        m->source->reply("Successfully loaded " + m->args[0]);
     }
 
     void do_script_unload(const Message *m)
     {
         if (m->args.empty())
         {
-            m->source.error("I need a file name to unload.");
+            m->source->error("I need a file name to unload.");
+            return;
+        }
+        std::unique_lock<SharedLock> guard(hosts_lock);
+        for (std::list<HostedScript>::iterator it = hosts.begin(); it != hosts.end(); ++it)
+        {
+            if (it->filename != m->args[0])
+                continue;
+
+            // Whatever's still queued goes first, if it fits; the host exits
+            // once it has unloaded the script.
+            append_frame(it->outbuf, 'U', "");
+            flush_host(*it);
+            close_host(*it);
+            host_exiting(it->pid);
+            hosts.erase(it);
+            host_count = hosts.size();
+            m->source->reply("Successfully unloaded " + m->args[0]);
             return;
         }
+        guard.unlock();
         call_perl<PerlContext::Void>(aTHX_ "Eir::Init::unload_script", m->args[0], m);
-        m->source.reply("Successfully unloaded " + m->args[0]);
+        m->source->reply("Successfully unloaded " + m->args[0]);
     }
 
     void do_script_exec(const Message *m)
     {
         if (m->args.empty())
         {
-            m->source.error("I can't execute nothing.");
+            m->source->error("I can't execute nothing.");
             return;
         }
         call_perl<PerlContext::Void>(aTHX_ "Eir::Init::do_eval", 
                                         paludis::join(m->args.begin(), m->args.end()," "), m);
-        m->source.reply("Done.");
+        m->source->reply("Done.");
+    }
+
+    void do_script_host(const Message *m)
+    {
+        if (m->args.empty())
+        {
+            m->source->error("I need a file name to load.");
+            return;
+        }
+        std::lock_guard<SharedLock> guard(hosts_lock);
+        for (std::list<HostedScript>::iterator it = hosts.begin(); it != hosts.end(); ++it)
+        {
+            if (it->filename == m->args[0])
+            {
+                m->source->error(m->args[0] + " is already loaded.");
+                return;
+            }
+        }
+
+        // Starting from the main loop, rather than here, means a host started
+        // from the config file sees all of it.
+        PendingHost p = { m->args[0], m->bot->name(), m->source, 0 };
+        pending_hosts.push_back(p);
+        wake();
+    }
+
+    void do_script_hosts(const Message *m)
+    {
+        std::lock_guard<SharedLock> guard(hosts_lock);
+        if (hosts.empty())
+        {
+            m->source->reply("No scripts are running out of process.");
+            return;
+        }
+        for (std::list<HostedScript>::iterator it = hosts.begin(); it != hosts.end(); ++it)
+            m->source->reply(it->filename + ": pid " + paludis::stringify(it->pid) +
+                    ", " + paludis::stringify(it->outbuf.size()) + " bytes queued (peak " +
+                    paludis::stringify(it->peak_queue) + "), " + paludis::stringify(it->forwarded) +
+                    " lines forwarded, " + paludis::stringify(it->sent) + " sent, " +
+                    paludis::stringify(it->restarts) + " restarts");
+    }
+
+    void forward_line(const Message *m)
+    {
+        if (!host_count)
+            return;
+
+        std::lock_guard<SharedLock> guard(hosts_lock);
+        if (hosts.empty())
+            return;
+
+        std::string frame;
+        append_frame(frame, 'L', m->bot->name() + "\n" + server_line(m));
+
+        for (std::list<HostedScript>::iterator it = hosts.begin(); it != hosts.end(); ++it)
+        {
+            if (it->behind)
+                continue;
+            // A host that missed a line would no longer mirror eir, so one
+            // that's too far behind starts again from how things are now.
+            if (it->outbuf.size() + frame.size() > it->queue_limit)
+            {
+                Logger::get_instance()->Log(m->bot, 0, Logger::Warning,
+                        "Script host for " + it->filename + " isn't keeping up; restarting it");
+                it->behind = true;
+                continue;
+            }
+            it->outbuf += frame;
+            ++it->forwarded;
+            if (it->outbuf.size() > it->peak_queue)
+                it->peak_queue = it->outbuf.size();
+        }
+        wake();
+    }
+
+    // Everything received in one pass of a reactor's loop is written to the
+    // hosts together, from the main reactor, once it's done. Whatever
+    // doesn't fit is written as the hosts make room for it.
+    void wake()
+    {
+        if (service_pending)
+            return;
+        service_pending = true;
+        Reactor::main()->post(std::bind(&PerlModule::service_hosts, this), token);
+    }
+
+    void service_hosts()
+    {
+        std::lock_guard<SharedLock> guard(hosts_lock);
+        service_pending = false;
+
+        for (std::list<HostedScript>::iterator it = hosts.begin(); it != hosts.end(); )
+        {
+            if (!it->behind)
+            {
+                flush_host(*it++);
+                continue;
+            }
+            PendingHost p = { it->filename, it->bot, SourcePtr(), it->restarts + 1 };
+            pending_hosts.push_back(p);
+            stop_host(*it);
+            it = hosts.erase(it);
+            host_count = hosts.size();
+        }
+
+        if (!pending_hosts.empty())
+            Reactor::main()->post_exclusive(std::bind(&PerlModule::start_pending_hosts, this), token);
+    }
+
+    // Hosts start from a snapshot of every bot taken here, between passes
+    // with the other reactors stopped, and are sent every line from then on.
+    void start_pending_hosts()
+    {
+        std::lock_guard<SharedLock> guard(hosts_lock);
+        std::vector<PendingHost> starting;
+        starting.swap(pending_hosts);
+        for (std::vector<PendingHost>::iterator it = starting.begin(); it != starting.end(); ++it)
+            start_host(*it);
+    }
+
+    HostedScript *find_host(int fd)
+    {
+        for (std::list<HostedScript>::iterator it = hosts.begin(); it != hosts.end(); ++it)
+            if (it->fd == fd)
+                return &*it;
+        return 0;
+    }
+
+    // The hosts' sources are the main reactor's, so whatever adds or
+    // removes them runs on its thread, or in an ExclusiveSection.
+
+    void flush_host(HostedScript & h)
+    {
+        while (!h.outbuf.empty())
+        {
+            ssize_t n = send(h.fd, h.outbuf.data(), h.outbuf.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            h.outbuf.erase(0, n);
+        }
+
+        if (h.outbuf.empty())
+        {
+            h.queue_limit = max_host_queue;
+            if (h.write_source)
+                Reactor::main()->remove_source(h.write_source);
+            h.write_source = 0;
+        }
+        else if (!h.write_source)
+            h.write_source = Reactor::main()->add_source(h.fd,
+                    std::bind(&PerlModule::host_writable, this, h.fd), true);
+    }
+
+    void host_writable(int fd)
+    {
+        std::lock_guard<SharedLock> guard(hosts_lock);
+        if (HostedScript *h = find_host(fd))
+            flush_host(*h);
+    }
+
+    void host_readable(int fd)
+    {
+        std::lock_guard<SharedLock> guard(hosts_lock);
+        for (std::list<HostedScript>::iterator it = hosts.begin(); it != hosts.end(); ++it)
+        {
+            if (it->fd != fd)
+                continue;
+            if (read_host(*it))
+                return;
+
+            if (it->load_source)
+                it->load_source->error("The script host for " + it->filename + " exited before loading it.");
+            Logger::get_instance()->Log(BotManager::get_instance()->find(it->bot), 0, Logger::Warning,
+                    "Script host for " + it->filename + " exited");
+            close_host(*it);
+            host_exiting(it->pid);
+            hosts.erase(it);
+            host_count = hosts.size();
+            return;
+        }
+    }
+
+    void close_host(HostedScript & h)
+    {
+        Reactor::main()->remove_source(h.read_source);
+        if (h.write_source)
+            Reactor::main()->remove_source(h.write_source);
+        close(h.fd);
+    }
+
+    void stop_host(HostedScript & h)
+    {
+        close_host(h);
+        kill(h.pid, SIGTERM);
+        host_exiting(h.pid);
+    }
+
+    // Hosts that have been told to go are waited for until they have.
+    void host_exiting(pid_t pid)
+    {
+        exiting_hosts.push_back(pid);
+        if (!reap_id)
+            reap_id = add_event(time(NULL) + 1, &PerlModule::reap_hosts);
+    }
+
+    void reap_hosts()
+    {
+        std::lock_guard<SharedLock> guard(hosts_lock);
+        reap_id = 0;
+
+        for (std::vector<pid_t>::iterator it = exiting_hosts.begin(); it != exiting_hosts.end(); )
+        {
+            if (waitpid(*it, 0, WNOHANG) != 0)
+                it = exiting_hosts.erase(it);
+            else
+                ++it;
+        }
+
+        if (!exiting_hosts.empty())
+            reap_id = add_event(time(NULL) + 1, &PerlModule::reap_hosts);
+    }
+
+    void handle_host_frame(HostedScript & h, char type, std::string & payload)
+    {
+        switch (type)
+        {
+            case 'S':
+            {
+                Bot *b = BotManager::get_instance()->find(take_field(payload));
+                if (b && b->connected())
+                {
+                    b->send(payload);
+                    ++h.sent;
+                }
+                break;
+            }
+            case 'W':
+            {
+                Logger::Type t = paludis::destringify<Logger::Type>(take_field(payload));
+                Bot *b = BotManager::get_instance()->find(take_field(payload));
+                Logger::get_instance()->Log(b, 0, t, "[" + h.filename + "] " + payload);
+                break;
+            }
+            case 'R':
+                if (!h.load_source)
+                {
+                    if (!payload.empty())
+                        Logger::get_instance()->Log(BotManager::get_instance()->find(h.bot), 0, Logger::Warning,
+                                "Couldn't reload " + h.filename + " in its restarted host: " + payload.substr(1));
+                    break;
+                }
+                if (payload.empty())
+                    h.load_source->reply("Successfully loaded " + h.filename);
+                else
+                    h.load_source->error(payload.substr(1));
+                h.load_source.reset();
+                break;
+        }
+    }
+
+    // False once the host has gone away.
+    bool read_host(HostedScript & h)
+    {
+        bool open = true;
+        char buf[65536];
+        while (true)
+        {
+            ssize_t n = recv(h.fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n > 0)
+                h.inbuf.append(buf, n);
+            else
+            {
+                open = n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+                break;
+            }
+        }
+
+        std::string::size_type pos = 0;
+        char type;
+        std::string payload;
+        while (next_frame(h.inbuf, pos, type, payload))
+            handle_host_frame(h, type, payload);
+        h.inbuf.erase(0, pos);
+
+        return open;
+    }
+
+    void report(const PendingHost & p, const std::string & text)
+    {
+        if (p.source)
+            p.source->error(text);
+        else
+            Logger::get_instance()->Log(BotManager::get_instance()->find(p.bot), 0, Logger::Warning, text);
+    }
+
+    // What a host needs to mirror eir: every bot, with its settings and what
+    // it has seen, the privileges from eir's config files, and which modules
+    // and storage to load to keep it all up to date.
+    Value host_state(const PendingHost & p)
+    {
+        Value state(Value::kvarray), modules(Value::array), bots(Value::kvarray), privileges(Value::array);
+        state["script"] = p.filename;
+        state["bot"] = p.bot;
+        state["storage"] = StorageManager::get_instance()->default_backend();
+
+        for (unsigned int i = 0; i < sizeof(host_modules) / sizeof(host_modules[0]); ++i)
+            if (ModuleRegistry::get_instance()->is_loaded(host_modules[i]))
+                modules.push_back(host_modules[i]);
+        state["modules"] = modules;
+
+        for (BotManager::iterator it = BotManager::get_instance()->begin(); it != BotManager::get_instance()->end(); ++it)
+        {
+            Value bot(Value::kvarray), settings(Value::kvarray);
+            bot["state"] = it->second->state();
+            for (Bot::SettingsIterator s = it->second->begin_settings(); s != it->second->end_settings(); ++s)
+                settings[s->first] = s->second;
+            bot["settings"] = settings;
+            bots[it->first] = bot;
+        }
+        state["bots"] = bots;
+
+        // The others are in storage, which the host reads for itself.
+        Value & entries = GlobalSettingsManager::get_instance()->get("privileges");
+        if (entries.Type() == Value::array)
+            for (ValueArray::iterator it = entries.Array().begin(); it != entries.Array().end(); ++it)
+                if ((*it)["is_config"])
+                    privileges.push_back(*it);
+        state["privileges"] = privileges;
+
+        return state;
+    }
+
+    void start_host(const PendingHost & p)
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+        {
+            report(p, std::string("Couldn't start a script host: ") + strerror(errno));
+            return;
+        }
+
+        // The host is a new image, not a copy of this one with its threads
+        // gone. Between the fork and the exec the child may do no more than
+        // async-signal-safe calls, so everything it needs is made here.
+        std::string name = "eir [" + p.filename + "]";
+        std::vector<std::string> env_strings;
+        for (char **e = environ; *e; ++e)
+            if (strncmp(*e, "EIR_HELPER=", 11) != 0 && strncmp(*e, "EIR_SCRIPT_HOST=", 16) != 0)
+                env_strings.push_back(*e);
+        env_strings.push_back("EIR_HELPER=" + module_name);
+        env_strings.push_back("EIR_SCRIPT_HOST=" + paludis::stringify(fds[1]));
+
+        std::vector<char *> env;
+        for (std::vector<std::string>::iterator it = env_strings.begin(); it != env_strings.end(); ++it)
+            env.push_back(const_cast<char *>(it->c_str()));
+        env.push_back(0);
+        char *argv[] = { const_cast<char *>(name.c_str()), 0 };
+
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            report(p, std::string("Couldn't start a script host: ") + strerror(errno));
+            close(fds[0]);
+            close(fds[1]);
+            return;
+        }
+        if (pid == 0)
+        {
+            fcntl(fds[1], F_SETFD, 0);
+            execve("/proc/self/exe", argv, &env[0]);
+            _exit(127);
+        }
+        close(fds[1]);
+
+        HostedScript h;
+        h.filename = p.filename;
+        h.bot = p.bot;
+        h.pid = pid;
+        h.fd = fds[0];
+        h.load_source = p.source;
+        h.read_source = Reactor::main()->add_source(h.fd, std::bind(&PerlModule::host_readable, this, h.fd));
+        h.write_source = 0;
+        h.behind = false;
+        append_frame(h.outbuf, 'I', serialise(host_state(p)));
+        h.queue_limit = max_host_queue + h.outbuf.size();
+        h.peak_queue = h.outbuf.size();
+        h.forwarded = h.sent = 0;
+        h.restarts = p.restarts;
+        hosts.push_back(h);
+        host_count = hosts.size();
+        flush_host(hosts.back());
+    }
+
+    // The script host's side, from here on.
+
+    void read_eir()
+    {
+        char buf[65536];
+        ssize_t n = read(host_fd, buf, sizeof(buf));
+        if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN))
+            _exit(0);
+        if (n > 0)
+            host_inbuf.append(buf, n);
+
+        std::string::size_type pos = 0;
+        char type;
+        std::string payload;
+        while (next_frame(host_inbuf, pos, type, payload))
+            handle_eir_frame(type, payload);
+        host_inbuf.erase(0, pos);
+    }
+
+    void handle_eir_frame(char type, std::string & payload)
+    {
+        if (type == 'I')
+            host_init(payload);
+        else if (type == 'L')
+        {
+            Bot *b = BotManager::get_instance()->find(take_field(payload));
+            if (!b)
+                return;
+            // Anything that goes wrong has already been reported by whoever
+            // it went wrong for, and eir itself is handling this line too.
+            try
+            {
+                b->process_line(payload);
+            }
+            catch (std::exception &)
+            {
+            }
+        }
+        else if (type == 'U')
+        {
+            Message m(BotManager::get_instance()->find(host_bot), "unloadscript", sourceinfo::Internal);
+            const Message *mp = &m;
+            TraceOwner owner(host_owner.c_str());
+            try
+            {
+                call_perl<PerlContext::Void>(aTHX_ "Eir::Init::unload_script", host_owner.substr(5), mp);
+            }
+            catch (eir::Exception &)
+            {
+            }
+            _exit(0);
+        }
+    }
+
+    // Sets up the mirror eir described, then loads the script into it. None
+    // of eir's files are ours to write; what the script sends, logs or
+    // saves goes through eir instead.
+    void host_init(const std::string & payload)
+    {
+        std::string result;
+        try
+        {
+            Value state = unserialise(payload);
+            host_owner = "perl:" + state["script"].String();
+            host_bot = state["bot"].String();
+
+            Logger *logger = Logger::get_instance();
+            logger->register_backend("scripthost", new HostLogBackend(this));
+            const Logger::Type types[] = { Logger::Info, Logger::Warning, Logger::Admin, Logger::Command, Logger::Privs };
+            for (unsigned int i = 0; i < sizeof(types) / sizeof(types[0]); ++i)
+                logger->add_destination("scripthost", paludis::stringify(types[i]), types[i]);
+
+            Bot::redirect_output([this] (Bot *b, const std::string & line) {
+                if (!acting_for_script())
+                    return;
+                std::string frame;
+                append_frame(frame, 'S', b->name() + "\n" + line);
+                write_all(host_fd, frame);
+            });
+            StorageManager::get_instance()->filter_saves([this] (const std::string &) {
+                return acting_for_script();
+            });
+
+            Value & modules = state["modules"];
+            for (ValueArray::iterator it = modules.begin(); it != modules.end(); ++it)
+                ModuleRegistry::get_instance()->load(it->String());
+            if (!state["storage"].String().empty())
+                StorageManager::get_instance()->default_backend(state["storage"].String());
+
+            for (KeyValueArray::iterator it = state["bots"].KV().begin(); it != state["bots"].KV().end(); ++it)
+            {
+                std::shared_ptr<Bot> b = std::make_shared<Bot>(it->first, it->second["state"]);
+                for (KeyValueArray::iterator s = it->second["settings"].KV().begin();
+                        s != it->second["settings"].KV().end(); ++s)
+                    b->add_setting(s->first, s->second);
+                mirrors.push_back(b);
+            }
+
+            // As eir's config files gave them, to whichever bot's they came
+            // from, so that the privileges module recalculates its clients.
+            Value & privileges = state["privileges"];
+            for (ValueArray::iterator it = privileges.begin(); it != privileges.end(); ++it)
+            {
+                Bot *b = BotManager::get_instance()->find((*it)["bot"].String());
+                if (!b)
+                    b = BotManager::get_instance()->find(host_bot);
+                if (!b)
+                    continue;
+                Message m(b, "privilege", sourceinfo::ConfigFile);
+                m.args.push_back((*it)["type"].String());
+                m.args.push_back((*it)["match"].String());
+                if (!(*it)["channel"].String().empty())
+                    m.args.push_back((*it)["channel"].String());
+                m.args.push_back((*it)["priv"].String());
+                CommandRegistry::get_instance()->dispatch(&m);
+            }
+
+            Message m(BotManager::get_instance()->find(host_bot), "hostscript", sourceinfo::Internal);
+            const Message *mp = &m;
+            TraceOwner owner(host_owner.c_str());
+            call_perl<PerlContext::Void>(aTHX_ "Eir::Init::load_script", host_owner.substr(5), mp);
+        }
+        catch (eir::Exception & e)
+        {
+            result = "!" + e.message();
+        }
+        catch (paludis::Exception & e)
+        {
+            result = "!" + e.message();
+        }
+
+        std::string frame;
+        append_frame(frame, 'R', result);
+        if (!write_all(host_fd, frame) || !result.empty())
+            _exit(1);
     }
 
     void startup()
@@ -104,27 +878,60 @@ struct PerlModule : CommandHandlerBase<PerlModule>, Module
             dlclose(libperl_handle);
     }
 
-    CommandHolder load_id, unload_id, exec_id;
+    CommandHolder load_id, unload_id, exec_id, host_id, hosts_id, incoming_id;
 
     PerlModule()
-        : my_perl(0)
+        : my_perl(0), service_pending(false), reap_id(0), host_count(0), token(WorkerPool::new_token()), module_name(TraceOwner::current()),
+          host_fd(-1), host_source(0)
     {
         startup();
+
+        // Started by another eir, as the host for one of its scripts.
+        if (const char *env = getenv("EIR_SCRIPT_HOST"))
+        {
+            host_fd = atoi(env);
+            unsetenv("EIR_SCRIPT_HOST");
+            fcntl(host_fd, F_SETFD, FD_CLOEXEC);
+            host_source = Reactor::main()->add_source(host_fd, std::bind(&PerlModule::read_eir, this));
+            return;
+        }
+
         load_id = add_handler(filter_command_privilege("loadscript", "admin").or_config(),
                 &PerlModule::do_script_load);
         unload_id = add_handler(filter_command_privilege("unloadscript", "admin").or_config(),
                 &PerlModule::do_script_unload);
         exec_id = add_handler(filter_command_privilege("execscript", "admin"),
                 &PerlModule::do_script_exec);
+        host_id = add_handler(filter_command_privilege("hostscript", "admin").or_config(),
+                &PerlModule::do_script_host);
+        hosts_id = add_handler(filter_command_privilege("scripthosts", "admin"),
+                &PerlModule::do_script_hosts);
+        incoming_id = add_handler(filter_command_type("server_incoming", sourceinfo::Internal),
+                &PerlModule::forward_line);
     }
 
     ~PerlModule()
     {
+        WorkerPool::get_instance()->cancel(token);
+        if (reap_id)
+            EventManager::get_instance()->remove_event(reap_id);
+        if (host_source)
+            Reactor::main()->remove_source(host_source);
+
+        for (std::list<HostedScript>::iterator it = hosts.begin(); it != hosts.end(); ++it)
+        {
+            close_host(*it);
+            exiting_hosts.push_back(it->pid);
+        }
+        for (std::vector<pid_t>::iterator it = exiting_hosts.begin(); it != exiting_hosts.end(); ++it)
+        {
+            kill(*it, SIGTERM);
+            waitpid(*it, 0, 0);
+        }
+
+        mirrors.clear();
         shutdown();
     }
 };
 
 MODULE_CLASS(PerlModule)
-
-
-
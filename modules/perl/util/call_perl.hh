@@ -5,7 +5,10 @@
 #include <perl.h>
 
 #include "exceptions.h"
+#include "reactor.h"
+#include "trace.h"
 #include <vector>
+#include <unistd.h>
 
 enum class PerlContext {
     Void,
@@ -51,6 +54,26 @@ namespace call_perl_internals
 {
     typedef std::vector<SV*> sv_list;
 
+    // There's one interpreter, so only one reactor may be in it at a time.
+    inline eir::SharedLock & interpreter_lock()
+    {
+        static eir::SharedLock lock;
+        return lock;
+    }
+
+    // Takes the interpreter for this thread. XS code finds it through the
+    // thread's context rather than being passed it, and a reactor other
+    // than the one that made it won't have one until it's set.
+    struct InInterpreter
+    {
+        std::lock_guard<eir::SharedLock> guard;
+
+        InInterpreter(PerlInterpreter *perl) : guard(interpreter_lock())
+        {
+            PERL_SET_CONTEXT(perl);
+        }
+    };
+
     template <typename _First>
     void push_perl_args(pTHX_ sv_list& arglist, _First arg)
     {
@@ -74,6 +97,16 @@ namespace call_perl_internals
         return call_sv(func, flags);
     }
 
+    inline std::string trace_name(const char *name)
+    {
+        return name;
+    }
+
+    inline std::string trace_name(SV *)
+    {
+        return "<code ref>";
+    }
+
     template <PerlContext context>
     struct PerlCallAttrs
     {
@@ -133,6 +166,11 @@ template <PerlContext _C, typename _Func, typename... ArgTypes>
 typename call_perl_internals::PerlCallAttrs<_C>::ReturnType
 call_perl(pTHX_ _Func func, ArgTypes... args)
 {
+    call_perl_internals::InInterpreter in_interpreter(my_perl);
+    eir::TraceSpan span("perl", "call_perl");
+    if (span.active())
+        span.arg("function", call_perl_internals::trace_name(func));
+
     call_perl_internals::sv_list arglist;
     call_perl_internals::push_perl_args(aTHX_ arglist, args...);
     bool _Eval = true;
@@ -172,4 +210,103 @@ call_perl(pTHX_ _Func func, ArgTypes... args)
     return call_perl_internals::PerlCallAttrs<_C>::extract_return_value(returnlist);
 }
 
+namespace call_perl_internals
+{
+    // The Message SV handed to Perl handlers, kept across handlers and
+    // rebuilt only when the message changes.
+    struct MessageCache
+    {
+        const eir::Message *message;
+        SV *sv;
+        int depth;
+    };
+
+    inline MessageCache & message_cache()
+    {
+        static MessageCache cache = { 0, 0, 0 };
+        return cache;
+    }
+
+    inline SV *message_sv(pTHX_ MessageCache & cache, const eir::Message *m)
+    {
+        // A handler further up the stack still has the shared SV in its @_.
+        if (cache.depth > 0)
+            return sv_from(aTHX_ m);
+
+        if (!cache.sv)
+            cache.sv = newSV(0);
+
+        if (cache.message != m || !SvROK(cache.sv) || !SvOBJECT(SvRV(cache.sv))
+                || SvIV(SvRV(cache.sv)) != PTR2IV(m))
+        {
+            sv_setref_pv(cache.sv, PerlClassMap<const eir::Message *>::name(), (void*)m);
+            cache.message = m;
+        }
+        return cache.sv;
+    }
+}
+
+/*
+ * A Perl sub registered as a command or event handler. Code refs are
+ * resolved to their CV once, here; the run-time limit and error
+ * translation are done in C rather than by Eir::Init::call_wrapper.
+ * Handlers for server lines are called from every reactor, taking turns
+ * in the one interpreter.
+ */
+class PerlHandler
+{
+    PerlInterpreter *_perl;
+    SV *_callee;
+
+    void call(const eir::Message *m)
+    {
+        call_perl_internals::InInterpreter in_interpreter(_perl);
+        PerlInterpreter *my_perl = _perl;
+        eir::TraceSpan span("perl", "call_handler");
+
+        call_perl_internals::MessageCache & cache = call_perl_internals::message_cache();
+
+        dSP;
+        ENTER;
+        SAVETMPS;
+        PUSHMARK(SP);
+        if (m)
+            XPUSHs(call_perl_internals::message_sv(aTHX_ cache, m));
+        PUTBACK;
+
+        // If we're inside another script call, its limit applies.
+        unsigned int outer = alarm(0);
+        alarm(outer ? outer : 1);
+
+        ++cache.depth;
+        call_sv(_callee, G_VOID | G_DISCARD | G_EVAL);
+        --cache.depth;
+
+        if (!outer)
+            alarm(0);
+
+        if (SvTRUE(ERRSV))
+        {
+            std::string error(SvPV_nolen(ERRSV));
+            FREETMPS;
+            LEAVE;
+            throw eir::PerlException(error);
+        }
+
+        FREETMPS;
+        LEAVE;
+    }
+
+    public:
+        // The caller keeps func alive for as long as this is registered.
+        PerlHandler(pTHX_ SV *func)
+            : _perl(aTHX),
+              _callee(SvROK(func) && SvTYPE(SvRV(func)) == SVt_PVCV ? SvRV(func) : func)
+        {
+        }
+
+        void operator() (const eir::Message *m) { call(m); }
+        void operator() () { call(0); }
+};
+
 #endif
@@ -11,7 +11,8 @@ struct PrivilegeHandler : CommandHandlerBase<PrivilegeHandler>, Module
     Value & priv_entries() { return GlobalSettingsManager::get_instance()->get("privileges"); }
     Value & priv_types() { return GlobalSettingsManager::get_instance()->get("privilege_types"); }
 
-    Value make_priv_entry(std::string type, std::string match, std::string channel, std::string priv, bool config = false)
+    Value make_priv_entry(std::string type, std::string match, std::string channel, std::string priv,
+                          bool config = false, std::string bot = "")
     {
         Value v(Value::kvarray);
         v["type"] = type;
@@ -19,14 +20,35 @@ struct PrivilegeHandler : CommandHandlerBase<PrivilegeHandler>, Module
         v["channel"] = channel;
         v["priv"] = priv;
         v["is_config"] = config;
+        if (config && !bot.empty())
+            v["bot"] = bot;
         return v;
     }
 
+    // Config entries belong to the bot whose config file added them.
+    static PrivilegeRule make_rule(Value & entry)
+    {
+        PrivilegeRule r = { entry["type"], entry["match"], entry["channel"], entry["priv"], "" };
+        KeyValueArray::iterator owner = entry.KV().find("bot");
+        if (owner != entry.KV().end())
+            r.bot = owner->second.String();
+        return r;
+    }
+
+    // The index is rebuilt whenever entries are removed; adding appends to it.
+    void rebuild_index()
+    {
+        PrivilegeIndex *index = PrivilegeIndex::get_instance();
+        index->clear_rules();
+        for (auto it = priv_entries().begin(); it != priv_entries().end(); ++it)
+            index->add_rule(make_rule(*it));
+    }
+
     void add_privilege_entry(const Message *m)
     {
         if (m->args.size() < 3)
         {
-            m->source.error("Need three arguments for " + m->command);
+            m->source->error("Need three arguments for " + m->command);
             return;
         }
 
@@ -39,27 +61,30 @@ struct PrivilegeHandler : CommandHandlerBase<PrivilegeHandler>, Module
             channel = *it++;
 
         // Now that we've decided what arguments are what, we can check channel-specific privileges
-        if (m->source.type != sourceinfo::ConfigFile
-            && (!m->source.client || !m->source.client->privs().has_privilege(channel, "admin")))
+        if (m->source_type != sourceinfo::ConfigFile
+            && (!m->source->client || !m->source->client->privs().has_privilege(channel, "admin")))
         {
             return;
         }
 
         if (priv_types()[type] != 1)
         {
-            m->source.error("Privilege type " + type + " not recognised");
+            m->source->error("Privilege type " + type + " not recognised");
             return;
         }
 
         for( ; it != m->args.end(); ++it)
         {
-            priv_entries().push_back(make_priv_entry(type, match, channel, *it, m->source.type == sourceinfo::ConfigFile));
+            Value entry = make_priv_entry(type, match, channel, *it, m->source_type == sourceinfo::ConfigFile,
+                                          m->bot ? m->bot->name() : "");
+            priv_entries().push_back(entry);
+            PrivilegeIndex::get_instance()->add_rule(make_rule(entry));
             std::string reply = "Added privilege " + *it;
             if (!channel.empty())
                 reply += " in " + channel;
             reply += " for " + match + " (" + type + ")";
-            m->source.reply(reply);
-            Logger::get_instance()->Log(m->bot, m->source.client, Logger::Admin, reply);
+            m->source->reply(reply);
+            Logger::get_instance()->Log(m->bot, m->source->client, Logger::Admin, reply);
         }
 
         recalculate_privileges(m);
@@ -69,7 +94,7 @@ struct PrivilegeHandler : CommandHandlerBase<PrivilegeHandler>, Module
     {
         if (m->args.size() < 2)
         {
-            m->source.error("Need two arguments for " + m->command);
+            m->source->error("Need two arguments for " + m->command);
             return;
         }
 
@@ -88,9 +113,9 @@ struct PrivilegeHandler : CommandHandlerBase<PrivilegeHandler>, Module
         }
 
         // Now that we've decided what arguments are what, we can check channel-specific privileges
-        if (!m->source.client || !m->source.client->privs().has_privilege(channel, "admin"))
+        if (!m->source->client || !m->source->client->privs().has_privilege(channel, "admin"))
         {
-            m->source.error("goat");
+            m->source->error("goat");
             return;
         }
 
@@ -102,21 +127,23 @@ struct PrivilegeHandler : CommandHandlerBase<PrivilegeHandler>, Module
             {
                 if ((*it)["is_config"])
                 {
-                    m->source.error("Privilege " + (*it)["priv"] + " for " + (*it)["match"] +
+                    m->source->error("Privilege " + (*it)["priv"] + " for " + (*it)["match"] +
                             " is defined in the configuration file and must be removed there.");
                     ++it;
                     continue;
                 }
 
-                Logger::get_instance()->Log(m->bot, m->source.client, Logger::Admin,
+                Logger::get_instance()->Log(m->bot, m->source->client, Logger::Admin,
                                             "Removing privilege " + (*it)["priv"] + " from " + (*it)["match"]);
-                m->source.reply("Removing privilege " + (*it)["priv"] + " from " + (*it)["match"]);
+                m->source->reply("Removing privilege " + (*it)["priv"] + " from " + (*it)["match"]);
                 it = priv_entries().erase(it);
             }
             else
                 ++it;
         }
 
+        rebuild_index();
+
         recalculate_privileges(m);
     }
 
@@ -126,7 +153,7 @@ struct PrivilegeHandler : CommandHandlerBase<PrivilegeHandler>, Module
         if (m->args.size() > 0 && m->args[0][0] == '#')
             channel = m->args[0];
 
-        if (!m->source.client || !m->source.client->privs().has_privilege(channel, "admin"))
+        if (!m->source->client || !m->source->client->privs().has_privilege(channel, "admin"))
             return;
 
         std::map<std::string, std::string> response, c_response;
@@ -147,24 +174,27 @@ struct PrivilegeHandler : CommandHandlerBase<PrivilegeHandler>, Module
 
         for (auto it = c_response.begin(); it != c_response.end(); ++it)
         {
-            m->source.reply(" - " + it->first + " has privileges " + it->second + "(config)");
+            m->source->reply(" - " + it->first + " has privileges " + it->second + "(config)");
         }
         for (auto it = response.begin(); it != response.end(); ++it)
         {
-            m->source.reply(" - " + it->first + " has privileges " + it->second);
+            m->source->reply(" - " + it->first + " has privileges " + it->second);
         }
     }
 
     void set_client_privileges(Bot *b, Client::ptr c)
     {
         c->privs().clear();
+        PrivilegeIndex::get_instance()->apply(*c);
+
+        // For privilege types that aren't indexed.
         Message calc_client_privs(b, "calculate_client_privileges", sourceinfo::Internal, c);
         CommandRegistry::get_instance()->dispatch(&calc_client_privs);
     }
 
     void set_client_privileges_from(const Message *m)
     {
-        set_client_privileges(m->bot, m->source.client);
+        set_client_privileges(m->bot, m->source->client);
     }
 
     void recalculate_privileges(const Message *m)
@@ -173,20 +203,33 @@ struct PrivilegeHandler : CommandHandlerBase<PrivilegeHandler>, Module
             set_client_privileges(m->bot, *it);
     }
 
-    void clear_conf_privileges(const Message *)
+    // Only what the rehashing bot's own config file added; other bots in
+    // the process keep theirs. With no message, all config entries go.
+    void clear_conf_privileges(const Message *m)
     {
+        Bot *bot = m ? m->bot : 0;
         Value new_privs(Value::array);
         std::copy_if(priv_entries().Array().begin(), priv_entries().Array().end(), std::back_inserter(new_privs.Array()),
-                [](Value & v) -> bool { return !(v["is_config"]); });
+                [bot](Value & v) -> bool {
+                    if (!(v["is_config"]))
+                        return true;
+                    if (!bot)
+                        return false;
+                    KeyValueArray::iterator owner = v.KV().find("bot");
+                    return owner != v.KV().end() && owner->second.String() != bot->name();
+                });
         priv_entries() = new_privs;
+        rebuild_index();
     }
 
-    CommandHolder add_id, add2_id, remove_id, client_id, recalc_id, clear_id, list_id;
+    CommandHolder add_id, add2_id, remove_id, client_id, recalc_client_id, recalc_id, clear_id, list_id;
 
     PrivilegeHandler()
     {
         client_id = add_handler(filter_command_type("new_client",sourceinfo::Internal),
                                 &PrivilegeHandler::set_client_privileges_from);
+        recalc_client_id = add_handler(filter_command_type("recalculate_client_privileges", sourceinfo::Internal),
+                                &PrivilegeHandler::set_client_privileges_from);
         add_id = add_handler(filter_command_type("privilege", sourceinfo::ConfigFile),
                                 &PrivilegeHandler::add_privilege_entry);
         recalc_id = add_handler(filter_command_type("recalculate_privileges", sourceinfo::Internal),
@@ -221,6 +264,11 @@ struct PrivilegeHandler : CommandHandlerBase<PrivilegeHandler>, Module
         // And set privs to auto-save
         StorageManager::get_instance()->auto_save(&priv_entries(), "privileges");
     }
+
+    ~PrivilegeHandler()
+    {
+        PrivilegeIndex::get_instance()->clear_rules();
+    }
 };
 
 MODULE_CLASS(PrivilegeHandler)
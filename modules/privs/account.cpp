@@ -1,35 +1,46 @@
 #include "eir.h"
 #include "handler.h"
-#include "match.h"
+
+#include <unordered_map>
 
 using namespace eir;
 
-struct AccountPrivilege : CommandHandlerBase<AccountPrivilege>, Module
+struct AccountPrivilege : Module
 {
-    Value * _cache_priv_entries;
     Value * _cache_priv_types;
-    Value & priv_entries() { if (!_cache_priv_entries) _cache_priv_entries = &GlobalSettingsManager::get_instance()->get("privileges"); return *_cache_priv_entries; }
     Value & priv_types() { if (!_cache_priv_types) _cache_priv_types = &GlobalSettingsManager::get_instance()->get("privilege_types"); return *_cache_priv_types; }
 
-    void calculate_account_privileges(const Message *m)
+    struct Matcher : PrivilegeMatcher
     {
-        for (auto it = priv_entries().begin(); it != priv_entries().end(); ++it)
+        std::unordered_multimap<std::string, const PrivilegeRule *> by_account;
+
+        void add_rule(const PrivilegeRule *r)
         {
-            if ((*it)["type"] == "account" &&
-                (*it)["match"] == m->source.client->account())
-            {
-                m->source.client->privs().add_privilege((*it)["channel"], (*it)["priv"]);
-            }
+            by_account.insert(std::make_pair(r->match, r));
         }
-    }
 
-    CommandHolder calc_handler;
+        void clear_rules()
+        {
+            by_account.clear();
+        }
+
+        void find_rules(const Client & c, std::vector<const PrivilegeRule *> & found)
+        {
+            if (c.account().empty())
+                return;
+
+            auto range = by_account.equal_range(c.account());
+            for (auto it = range.first; it != range.second; ++it)
+                found.push_back(it->second);
+        }
+    };
+
+    PrivilegeMatcherHolder matcher;
 
     AccountPrivilege()
-        : _cache_priv_entries(0), _cache_priv_types(0)
+        : _cache_priv_types(0)
     {
-        calc_handler = add_handler(filter_command_type("calculate_client_privileges", sourceinfo::Internal),
-                                    &AccountPrivilege::calculate_account_privileges);
+        matcher = PrivilegeIndex::get_instance()->register_matcher("account", new Matcher);
 
         priv_types()["account"] = 1;
     }
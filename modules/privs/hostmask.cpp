@@ -1,35 +1,91 @@
 #include "eir.h"
 #include "handler.h"
 #include "match.h"
+#include "string_util.h"
+
+#include <unordered_map>
 
 using namespace eir;
 
 struct HostmaskPrivilege : CommandHandlerBase<HostmaskPrivilege>, Module
 {
-    Value * _cache_priv_entries;
     Value * _cache_priv_types;
-    Value & priv_entries() { if (!_cache_priv_entries) _cache_priv_entries = &GlobalSettingsManager::get_instance()->get("privileges"); return *_cache_priv_entries; }
     Value & priv_types() { if (!_cache_priv_types) _cache_priv_types = &GlobalSettingsManager::get_instance()->get("privilege_types"); return *_cache_priv_types; }
 
-    void calculate_hostmask_privileges(const Message *m)
+    // Most host entries are of the form *!user@host or *@host, and a nick
+    // change can't affect whether they match.
+    static bool depends_on_nick(const std::string & mask)
     {
-        for (auto it = priv_entries().begin(); it != priv_entries().end(); ++it)
+        return !(mask.size() >= 1 && mask[0] == '*' &&
+                 (mask.size() == 1 || mask[1] == '!' || mask[1] == '@'));
+    }
+
+    struct Matcher : PrivilegeMatcher
+    {
+        // Rules whose host part has no wildcards are looked up by host; only
+        // the rest need to be tried against every client.
+        std::unordered_multimap<std::string, const PrivilegeRule *,
+                                cistring::hasher, cistring::is_equal> by_host;
+        std::vector<const PrivilegeRule *> wildcard;
+        unsigned int nick_dependent;
+
+        Matcher() : nick_dependent(0)
+        { }
+
+        void add_rule(const PrivilegeRule *r)
+        {
+            std::string::size_type at = r->match.rfind('@');
+            if (at != std::string::npos && r->match.find_first_of("*?\\", at) == std::string::npos)
+                by_host.insert(std::make_pair(r->match.substr(at + 1), r));
+            else
+                wildcard.push_back(r);
+
+            if (depends_on_nick(r->match))
+                ++nick_dependent;
+        }
+
+        void clear_rules()
         {
-            if ((*it)["type"] == "host" &&
-                match((*it)["match"], m->source.client->nuh()))
-            {
-                m->source.client->privs().add_privilege((*it)["channel"], (*it)["priv"]);
-            }
+            by_host.clear();
+            wildcard.clear();
+            nick_dependent = 0;
         }
+
+        void find_rules(const Client & c, std::vector<const PrivilegeRule *> & found)
+        {
+            const std::string & nuh = c.nuh();
+
+            auto range = by_host.equal_range(c.host());
+            for (auto it = range.first; it != range.second; ++it)
+                if (match(it->second->match, nuh))
+                    found.push_back(it->second);
+
+            for (auto it = wildcard.begin(); it != wildcard.end(); ++it)
+                if (match((*it)->match, nuh))
+                    found.push_back(*it);
+        }
+    };
+
+    Matcher *_matcher;
+    PrivilegeMatcherHolder matcher;
+
+    void nick_changed(const Message *m)
+    {
+        if (!m->source->client || !_matcher->nick_dependent)
+            return;
+
+        Message recalc(m->bot, "recalculate_client_privileges", sourceinfo::Internal, m->source->client);
+        CommandRegistry::get_instance()->dispatch(&recalc);
     }
 
-    CommandHolder calc_handler;
+    CommandHolder nick_handler;
 
     HostmaskPrivilege()
-        : _cache_priv_entries(0), _cache_priv_types(0)
+        : _cache_priv_types(0), _matcher(new Matcher)
     {
-        calc_handler = add_handler(filter_command_type("calculate_client_privileges", sourceinfo::Internal),
-                                    &HostmaskPrivilege::calculate_hostmask_privileges);
+        matcher = PrivilegeIndex::get_instance()->register_matcher("host", _matcher);
+        nick_handler = add_handler(filter_command_type("nick_changed", sourceinfo::Internal),
+                                    &HostmaskPrivilege::nick_changed);
 
         priv_types()["host"] = 1;
     }
@@ -13,7 +13,7 @@ struct SnoteHandler : CommandHandlerBase<SnoteHandler>, Module
             return;
 
         // We're only interested in notices from a server
-        if (m->source.raw.find(".") == std::string::npos)
+        if (m->source->raw.find(".") == std::string::npos)
             return;
 
         std::string text = m->args[0];
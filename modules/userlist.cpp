@@ -12,8 +12,8 @@ struct UserLister : CommandHandlerBase<UserLister>, Module
 
         unsigned int modeindex = 0;
 
-        if (m->bot->supported()->is_channel_name(m->source.destination))
-            channelname = m->source.destination;
+        if (m->bot->supported()->is_channel_name(m->source->destination))
+            channelname = m->source->destination;
 
         if (!m->args.empty() && m->bot->supported()->is_channel_name(m->args[0]))
         {
@@ -23,7 +23,7 @@ struct UserLister : CommandHandlerBase<UserLister>, Module
 
         if (channelname.empty())
         {
-            m->source.error("I need a channel name");
+            m->source->error("I need a channel name");
             return;
         }
 
@@ -31,7 +31,7 @@ struct UserLister : CommandHandlerBase<UserLister>, Module
 
         if (!ch)
         {
-            m->source.error("I don't seem to be in that channel.");
+            m->source->error("I don't seem to be in that channel.");
             return;
         }
 
@@ -45,9 +45,9 @@ struct UserLister : CommandHandlerBase<UserLister>, Module
         }
 
         if (reply.empty())
-            m->source.reply("<nothing>");
+            m->source->reply("<nothing>");
         else
-            m->source.reply(reply);
+            m->source->reply(reply);
     }
 
     CommandHolder _id;
@@ -12,6 +12,11 @@ using namespace std::placeholders;
 #include "times.h"
 
 #include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <memory>
+
+#include "string_util.h"
 
 #include "help.h"
 
@@ -20,6 +25,14 @@ namespace
     const std::string default_time_fmt("%F %T");
     const std::string default_expiry("1d");
 
+    SettingHandle<std::string> voicebot_channel("voicebot_channel"),
+                               voicebot_admin_channel("voicebot_admin_channel"),
+                               voice_time_format("voice_time_format", default_time_fmt);
+    // Set to anything at all, "0" included, to turn revoicing on.
+    SettingHandle<std::string> enable_revoicing("voicebot_enable_revoicing");
+    SettingHandle<time_t> default_voice_expiry("default_voice_expiry", parse_time(default_expiry)),
+                          revoice_expiry("revoice_expiry", parse_time(default_expiry));
+
     std::string format_time(Bot *b, time_t t)
     {
         if (t == 0)
@@ -30,21 +43,19 @@ namespace
         localtime_r(&t, &time);
         strftime(datebuf,
                  sizeof(datebuf),
-                 b->get_setting_with_default("voice_time_format", default_time_fmt).c_str(),
+                 voice_time_format.get(b).c_str(),
                  &time);
         return std::string(datebuf);
     }
 
     time_t get_default_expiry(Bot *b)
     {
-        std::string time = b->get_setting_with_default("default_voice_expiry", default_expiry);
-        return parse_time(time);
+        return default_voice_expiry.get(b);
     }
 
     time_t get_revoice_expiry(Bot *b)
     {
-        std::string time = b->get_setting_with_default("revoice_expiry", default_expiry);
-        return parse_time(time);
+        return revoice_expiry.get(b);
     }
 
     const char *help_voicebot =
@@ -100,6 +111,218 @@ namespace
         return v;
     }
 
+    bool has_account(const std::string & account)
+    {
+        return !account.empty() && account != "*" && account != "0";
+    }
+
+    /*
+     * The lost voices list, indexed for lookup on JOIN and NICK. Entries
+     * whose mask has a literal host (full nick!user@host masks and cloaks)
+     * are hashed by host, gateway masks with a wildcarded session suffix by
+     * the host up to that suffix, and entries recorded with an account by
+     * account too. Only masks that
+     * fit none of those need to be tried one by one.
+     *
+     * The Value array stays the persisted form; each entry knows its slot,
+     * and removal moves the last element into the gap.
+     */
+    class RevoiceCache
+    {
+        public:
+            struct Entry
+            {
+                std::string mask, account;
+                time_t expires;
+                std::size_t slot;
+                std::multimap<time_t, Entry *>::iterator expiry;
+            };
+
+        private:
+            typedef std::unordered_multimap<std::string, Entry *, cistring::hasher, cistring::is_equal> Index;
+
+            Value & _list;
+            std::vector<std::unique_ptr<Entry> > _slots;
+            std::unordered_map<std::string, Entry *> _by_mask;
+            Index _by_account, _by_host, _by_gateway;
+            std::vector<Entry *> _wildcard;
+            std::multimap<time_t, Entry *> _by_expiry;
+
+            static bool literal(const std::string & s, std::string::size_type from, std::string::size_type to)
+            {
+                std::string::size_type p = s.find_first_of("*?", from);
+                return p == std::string::npos || p >= to;
+            }
+
+            // Which of the host tables a mask belongs in, if any.
+            Index *table_for(const std::string & mask, std::string & key)
+            {
+                std::string::size_type at = mask.rfind('@');
+                if (at == std::string::npos)
+                    return 0;
+
+                if (literal(mask, at + 1, mask.size()))
+                {
+                    key = mask.substr(at + 1);
+                    return &_by_host;
+                }
+
+                std::string::size_type len = mask.size();
+                if (len > at + 3 && mask.compare(len - 2, 2, "/*") == 0 && literal(mask, at + 1, len - 2))
+                {
+                    key = mask.substr(at + 1, len - at - 3);
+                    return &_by_gateway;
+                }
+
+                return 0;
+            }
+
+            static void unindex(Index & index, const std::string & key, Entry *e)
+            {
+                auto range = index.equal_range(key);
+                for (auto it = range.first; it != range.second; ++it)
+                {
+                    if (it->second == e)
+                    {
+                        index.erase(it);
+                        return;
+                    }
+                }
+            }
+
+            void index(Entry *e)
+            {
+                _by_mask[e->mask] = e;
+
+                std::string key;
+                if (Index *table = table_for(e->mask, key))
+                    table->insert(std::make_pair(key, e));
+                else
+                    _wildcard.push_back(e);
+
+                if (!e->account.empty())
+                    _by_account.insert(std::make_pair(e->account, e));
+
+                e->expiry = e->expires ? _by_expiry.insert(std::make_pair(e->expires, e)) : _by_expiry.end();
+            }
+
+            void candidates(const Index & index, const std::string & key, std::vector<Entry *> & out)
+            {
+                auto range = index.equal_range(key);
+                for (auto it = range.first; it != range.second; ++it)
+                    if (std::find(out.begin(), out.end(), it->second) == out.end())
+                        out.push_back(it->second);
+            }
+
+        public:
+            RevoiceCache(Value & list)
+                : _list(list)
+            { }
+
+            // Rebuilds the index from the persisted list.
+            void load()
+            {
+                _slots.clear();
+                _by_mask.clear();
+                _by_account.clear();
+                _by_host.clear();
+                _by_gateway.clear();
+                _wildcard.clear();
+                _by_expiry.clear();
+
+                for (ValueArray::iterator it = _list.begin(); it != _list.end(); ++it)
+                {
+                    std::unique_ptr<Entry> e(new Entry);
+                    e->mask = (*it)["mask"].String();
+                    if (it->KV().find("account") != it->KV().end())
+                        e->account = (*it)["account"].String();
+                    e->expires = (*it)["expires"].Int();
+                    e->slot = _slots.size();
+                    index(e.get());
+                    _slots.push_back(std::move(e));
+                }
+            }
+
+            bool contains(const std::string & mask) const
+            {
+                return _by_mask.find(mask) != _by_mask.end();
+            }
+
+            void add(std::string bot, std::string mask, std::string account, time_t expires)
+            {
+                Value v = lostvoiceentry(bot, mask, expires);
+                if (!account.empty())
+                    v["account"] = account;
+                _list.push_back(v);
+
+                std::unique_ptr<Entry> e(new Entry);
+                e->mask = mask;
+                e->account = account;
+                e->expires = expires;
+                e->slot = _slots.size();
+                index(e.get());
+                _slots.push_back(std::move(e));
+            }
+
+            void remove(Entry *e)
+            {
+                std::string key;
+                if (Index *table = table_for(e->mask, key))
+                    unindex(*table, key, e);
+                else
+                    _wildcard.erase(std::find(_wildcard.begin(), _wildcard.end(), e));
+
+                if (!e->account.empty())
+                    unindex(_by_account, e->account, e);
+                if (e->expiry != _by_expiry.end())
+                    _by_expiry.erase(e->expiry);
+                auto m = _by_mask.find(e->mask);
+                if (m != _by_mask.end() && m->second == e)
+                    _by_mask.erase(m);
+
+                std::size_t slot = e->slot, last = _slots.size() - 1;
+                ValueArray & array = _list.Array();
+                if (slot != last)
+                {
+                    array[slot] = array[last];
+                    _slots[slot] = std::move(_slots[last]);
+                    _slots[slot]->slot = slot;
+                }
+                array.pop_back();
+                _slots.pop_back();
+            }
+
+            // The entries that would revoice this client.
+            void find(Client::ptr c, std::vector<Entry *> & out)
+            {
+                const std::string & host = c->host();
+                candidates(_by_host, host, out);
+
+                std::string::size_type slash = host.rfind('/');
+                if (slash != std::string::npos)
+                    candidates(_by_gateway, host.substr(0, slash), out);
+
+                // Host-indexed masks can still differ in the nick or user part.
+                const std::string & nuh = c->nuh();
+                out.erase(std::remove_if(out.begin(), out.end(),
+                            [&nuh](Entry *e) { return !mask_match(e->mask, nuh); }),
+                          out.end());
+
+                if (has_account(c->account()))
+                    candidates(_by_account, c->account(), out);
+
+                for (auto it = _wildcard.begin(); it != _wildcard.end(); ++it)
+                    if (mask_match((*it)->mask, nuh) && std::find(out.begin(), out.end(), *it) == out.end())
+                        out.push_back(*it);
+            }
+
+            void expire(time_t now)
+            {
+                while (!_by_expiry.empty() && _by_expiry.begin()->first < now)
+                    remove(_by_expiry.begin()->second);
+            }
+    };
+
     struct Removed
     {
         bool operator() (const Value& v)
@@ -119,12 +342,17 @@ namespace
 struct voicebot : CommandHandlerBase<voicebot>, Module
 {
     Value &dnv, &old, &lostvoices;
+    RevoiceCache revoices;
+
+    // The lists are shared by every bot, and the lost voices change on every
+    // join, part and quit in a voiced channel.
+    SharedLock lock;
 
     void do_add(const Message *m)
     {
         if (m->args.empty())
         {
-            m->source.error("Need at least one argument");
+            m->source->error("Need at least one argument");
             return;
         }
 
@@ -145,7 +373,7 @@ struct voicebot : CommandHandlerBase<voicebot>, Module
 
         if (reason.empty())
         {
-            m->source.error("You need to specify a reason.");
+            m->source->error("You need to specify a reason.");
             return;
         }
 
@@ -158,22 +386,22 @@ struct voicebot : CommandHandlerBase<voicebot>, Module
         {
             if (mask_match((*it)["mask"], mask))
             {
-                m->source.reply("Mask already matched by " + (*it)["mask"]);
+                m->source->reply("Mask already matched by " + (*it)["mask"]);
                 return;
             }
         }
 
-        dnv.push_back(voiceentry(m->bot->name(), mask, m->source.name, reason, time(NULL), expires));
-        m->source.reply("Added " + mask);
+        dnv.push_back(voiceentry(m->bot->name(), mask, m->source->name, reason, time(NULL), expires));
+        m->source->reply("Added " + mask);
 
-        Logger::get_instance()->Log(m->bot, m->source.client, Logger::Command, "ADD " + mask);
+        Logger::get_instance()->Log(m->bot, m->source->client, Logger::Command, "ADD " + mask);
     }
 
     void do_change(const Message *m)
     {
         if (m->args.empty())
         {
-            m->source.error("Need at least one argument");
+            m->source->error("Need at least one argument");
             return;
         }
 
@@ -205,20 +433,20 @@ struct voicebot : CommandHandlerBase<voicebot>, Module
                 if (!reason.empty())
                     (*it)["reason"] = reason;
                 found = true;
-                m->source.reply("Updated " + (*it)["mask"]);
+                m->source->reply("Updated " + (*it)["mask"]);
             }
         }
         if (!found)
-            m->source.reply("No entry matches " + mask);
+            m->source->reply("No entry matches " + mask);
 
-        Logger::get_instance()->Log(m->bot, m->source.client, Logger::Command, "CHANGE " + mask);
+        Logger::get_instance()->Log(m->bot, m->source->client, Logger::Command, "CHANGE " + mask);
     }
 
     void do_remove(const Message *m)
     {
         if (m->args.empty())
         {
-            m->source.error("Need at least one argument");
+            m->source->error("Need at least one argument");
             return;
         }
 
@@ -232,7 +460,7 @@ struct voicebot : CommandHandlerBase<voicebot>, Module
             if (mask_match(mask, (*it)["mask"]))
             {
                 Bot *bot = BotManager::get_instance()->find((*it)["bot"]);
-                m->source.reply("Removing " + (*it)["mask"] + " (" + (*it)["reason"] + ") " +
+                m->source->reply("Removing " + (*it)["mask"] + " (" + (*it)["reason"] + ") " +
                         "(added by " + (*it)["setter"] + " on " + format_time(bot, (*it)["set"].Int()) + ")");
 
                 old.push_back(*it);
@@ -242,7 +470,7 @@ struct voicebot : CommandHandlerBase<voicebot>, Module
 
         do_removals(dnv);
 
-        Logger::get_instance()->Log(m->bot, m->source.client, Logger::Command, "REMOVE " + mask);
+        Logger::get_instance()->Log(m->bot, m->source->client, Logger::Command, "REMOVE " + mask);
     }
 
     void do_list(const Message *m)
@@ -250,12 +478,12 @@ struct voicebot : CommandHandlerBase<voicebot>, Module
         for (ValueArray::iterator it = dnv.begin(); it != dnv.end(); ++it)
         {
             Bot *bot = BotManager::get_instance()->find((*it)["bot"]);
-            m->source.reply((*it)["mask"] + " (" + (*it)["reason"] + ") (added by " + 
+            m->source->reply((*it)["mask"] + " (" + (*it)["reason"] + ") (added by " + 
                     (*it)["setter"] + " on " + format_time(bot, (*it)["set"].Int()) +
                     ", expires " + format_time(bot, (*it)["expires"].Int()) + ")");
         }
 
-        m->source.reply("*** End of DNV list");
+        m->source->reply("*** End of DNV list");
     }
 
     void build_voice_lists(Channel::ptr channel, 
@@ -286,17 +514,17 @@ struct voicebot : CommandHandlerBase<voicebot>, Module
 
     void do_check(const Message *m)
     {
-        std::string channelname = m->bot->get_setting("voicebot_channel");
+        std::string channelname = voicebot_channel.get(m->bot);
         if (channelname.empty())
         {
-            m->source.error("voicebot_channel not defined.");
+            m->source->error("voicebot_channel not defined.");
             return;
         }
 
         Channel::ptr channel = m->bot->find_channel(channelname);
         if (!channel)
         {
-            m->source.error("Couldn't find channel " + channelname);
+            m->source->error("Couldn't find channel " + channelname);
             return;
         }
 
@@ -304,23 +532,23 @@ struct voicebot : CommandHandlerBase<voicebot>, Module
 
         build_voice_lists(channel, &tovoice, &tonotvoice);
 
-        m->source.reply("Needing voice: " + paludis::join(tovoice.begin(), tovoice.end(), " "));
-        m->source.reply("Not voicing: " + paludis::join(tonotvoice.begin(), tonotvoice.end(), " "));
+        m->source->reply("Needing voice: " + paludis::join(tovoice.begin(), tovoice.end(), " "));
+        m->source->reply("Not voicing: " + paludis::join(tonotvoice.begin(), tonotvoice.end(), " "));
     }
 
     void do_voice(const Message *m)
     {
-        std::string channelname = m->bot->get_setting("voicebot_channel");
+        std::string channelname = voicebot_channel.get(m->bot);
         if (channelname.empty())
         {
-            m->source.error("voicebot_channel not defined.");
+            m->source->error("voicebot_channel not defined.");
             return;
         }
 
         Channel::ptr channel = m->bot->find_channel(channelname);
         if (!channel)
         {
-            m->source.error("Couldn't find channel " + channelname);
+            m->source->error("Couldn't find channel " + channelname);
             return;
         }
 
@@ -344,14 +572,14 @@ struct voicebot : CommandHandlerBase<voicebot>, Module
             m->bot->send(voicecommand);
         }
 
-        Logger::get_instance()->Log(m->bot, m->source.client, Logger::Command, "VOICE");
+        Logger::get_instance()->Log(m->bot, m->source->client, Logger::Command, "VOICE");
     }
 
     void do_match(const Message *m)
     {
         if (m->args.empty())
         {
-            m->source.error("Need one argument");
+            m->source->error("Need one argument");
             return;
         }
 
@@ -369,12 +597,19 @@ struct voicebot : CommandHandlerBase<voicebot>, Module
             if (mask_match((*it)["mask"], mask))
             {
                 Bot *bot = BotManager::get_instance()->find((*it)["bot"]);
-                m->source.reply((*it)["mask"] + " (" + (*it)["reason"] + ") (added by " +
+                m->source->reply((*it)["mask"] + " (" + (*it)["reason"] + ") (added by " +
                     (*it)["setter"] + " on " + format_time(bot, (*it)["set"].Int()) +
                     ", expires " + format_time(bot, (*it)["expires"].Int()) + ")");
             }
 
-        m->source.reply("*** End of DNV matches for " + mask);
+        m->source->reply("*** End of DNV matches for " + mask);
+    }
+
+    // Expiry tells bots on other reactors about it, so is done between
+    // passes with the others stopped.
+    void expiry_due()
+    {
+        Reactor::current()->post_exclusive(std::bind(&voicebot::check_expiry, this), token);
     }
 
     void check_expiry()
@@ -388,7 +623,7 @@ struct voicebot : CommandHandlerBase<voicebot>, Module
                 Bot *bot = BotManager::get_instance()->find((*it)["bot"]);
                 std::string adminchan;
                 if (bot)
-                    adminchan = bot->get_setting("voicebot_admin_channel");
+                    adminchan = voicebot_admin_channel.get(bot);
 
                 if (bot && !adminchan.empty())
                     bot->send("NOTICE " + adminchan + " :Removing expired entry " +
@@ -399,16 +634,9 @@ struct voicebot : CommandHandlerBase<voicebot>, Module
                 (*it)["removed"] = 1;
             }
         }
-        for (ValueArray::iterator it = lostvoices.begin(); it != lostvoices.end(); ++it)
-        {
-            if ((*it)["expires"].Int() != 0 && (*it)["expires"].Int() < currenttime)
-            {
-                (*it)["removed"] = 1;
-            }
-        }
+        revoices.expire(currenttime);
 
         do_removals(dnv);
-        do_removals(lostvoices);
     }
 
     void load_list(Value & v, std::string name)
@@ -440,6 +668,7 @@ struct voicebot : CommandHandlerBase<voicebot>, Module
         load_list(dnv, "donotvoice");
         load_list(old, "expireddonotvoice");
         load_list(lostvoices, "lostvoices");
+        revoices.load();
     }
 
     std::string build_revoice_mask (Client::ptr c)
@@ -455,125 +684,121 @@ struct voicebot : CommandHandlerBase<voicebot>, Module
 
     */
 
-        if (c->host().find("/") == std::string::npos)
+        const std::string & host = c->host();
+        std::string::size_type slash = host.rfind('/');
+
+        if (slash == std::string::npos)
         {
             // normal user, return full nuh
             return c->nuh();
-        } else if (c->host().find("gateway/tor-sasl/") == 0) {
+        } else if (host.compare(0, 17, "gateway/tor-sasl/") == 0) {
             // tor-sasl user, return *!*@cloak
-            return "*!*@" + c->host();
-        } else if (c->host().find("gateway/") == 0 ||
-                   c->host().find("conference/") == 0 ||
-                   c->host().find("nat/") == 0 )
+            return "*!*@" + host;
+        } else if (host.compare(0, 8, "gateway/") == 0 ||
+                   host.compare(0, 11, "conference/") == 0 ||
+                   host.compare(0, 4, "nat/") == 0 )
         {
             // gateway user
-            std::string suffix=c->nuh().substr(c->nuh().find_last_of("/"));
-            if (suffix=="/session" || suffix.substr(0,3) == "/x-" || suffix.substr(0,4)== "/ip.")
+            if (host.compare(slash, std::string::npos, "/session") == 0 ||
+                host.compare(slash, 3, "/x-") == 0 || host.compare(slash, 4, "/ip.") == 0)
             {
                 // strip session ID
-                return c->nuh().substr(0,c->nuh().find_last_of("/")) + "/*";
+                return c->nick() + "!" + c->user() + "@" + host.substr(0, slash) + "/*";
             } else {
                 // got an unrecognised suffix - don't return a revoice mask
                 return "";
             }
         } else {
             // cloaked user, return *!*@cloak
-            return "*!*@" + c->host();
+            return "*!*@" + host;
         }
     }
 
+    void queue_revoices(Bot *bot, Client::ptr c, const std::string & channelname)
+    {
+        std::lock_guard<SharedLock> guard(lock);
+        std::vector<RevoiceCache::Entry *> found;
+        revoices.find(c, found);
+        if (found.empty())
+            return;
+
+        for (auto it = found.begin(); it != found.end(); ++it)
+        {
+            Logger::get_instance()->Log(bot, NULL, Logger::Debug, "*** Matched lost voice for " + c->nuh() + "(" + (*it)->mask + ")");
+            revoices.remove(*it);
+        }
 
+        Logger::get_instance()->Log(bot, NULL, Logger::Debug, "*** Queueing revoice for " + c->nick());
+        std::weak_ptr<Client> w(c);
+        add_event(time(NULL)+5, std::bind(revoice, bot, w, channelname));
+    }
 
     void irc_join(const Message *m)
     {
-        std::string revoicing = m->bot->get_setting_with_default("voicebot_enable_revoicing", "");
-        std::string channelname = m->bot->get_setting("voicebot_channel");
-
-        if (revoicing.empty())
+        if (enable_revoicing.get(m->bot).empty())
             return;
-        if (m->source.name == m->bot->nick())
+
+        std::string channelname = voicebot_channel.get(m->bot);
+
+        if (m->source->name == m->bot->nick())
             return;
-        if (m->source.destination != channelname)
+        if (m->source->destination != channelname)
             return;
 
-        for (ValueArray::iterator it = lostvoices.begin(); it != lostvoices.end(); ++it)
-        {
-            if (mask_match((*it)["mask"], m->source.raw))
-            {
-                Client::ptr c = m->bot->find_client(m->source.name);
-                if (c)
-                {
-                    std::weak_ptr<Client> w(c);
-                    Logger::get_instance()->Log(m->bot, NULL, Logger::Debug, "*** Matched lost voice for " + m->source.raw + "(" + (*it)["mask"] + ")");
-                    Logger::get_instance()->Log(m->bot, NULL, Logger::Debug, "*** Queueing revoice for " + m->source.name);
-                    add_event(time(NULL)+5, std::bind(revoice, m->bot, w, channelname));
-                    (*it)["removed"]=1;
-                }
-            }
-        }
-        do_removals(lostvoices);
+        Client::ptr c = m->bot->find_client(m->source->name);
+        if (c)
+            queue_revoices(m->bot, c, channelname);
     }
 
     void irc_nick(const Message *m)
     {
-        std::string revoicing = m->bot->get_setting_with_default("voicebot_enable_revoicing", "");
-        std::string channelname = m->bot->get_setting("voicebot_channel");
-
-        if (revoicing.empty())
+        if (enable_revoicing.get(m->bot).empty())
             return;
-        if (!m->source.client)
+
+        std::string channelname = voicebot_channel.get(m->bot);
+
+        if (!m->source->client)
             return;
-        if (m->source.name == m->bot->nick())
+        if (m->source->name == m->bot->nick())
             return;
 
-        for (ValueArray::iterator it = lostvoices.begin(); it != lostvoices.end(); ++it)
-        {
-            if (mask_match((*it)["mask"], m->source.client->nuh()))
-            {
-                std::weak_ptr<Client> w(m->source.client);
-                Logger::get_instance()->Log(m->bot, NULL, Logger::Debug, "*** Matched lost voice for " + m->source.raw + "(" + (*it)["mask"] + ")");
-                Logger::get_instance()->Log(m->bot, NULL, Logger::Debug, "*** Queueing revoice for " + m->source.destination );
-                add_event(time(NULL)+5, std::bind(revoice, m->bot, w, channelname));
-                (*it)["removed"]=1;
-            }
-        }
-        do_removals(lostvoices);
+        queue_revoices(m->bot, m->source->client, channelname);
     }
 
     void irc_depart (const Message *m)
     {
-        std::string revoicing = m->bot->get_setting_with_default("voicebot_enable_revoicing", "");
-        std::string channelname = m->bot->get_setting("voicebot_channel");
-
-        if (revoicing.empty())
+        if (enable_revoicing.get(m->bot).empty())
             return;
-        if (!m->source.client)
+
+        std::string channelname = voicebot_channel.get(m->bot);
+
+        if (!m->source->client)
             return;
-        if (m->source.name == m->bot->nick())
+        if (m->source->name == m->bot->nick())
             return;
 
         Channel::ptr channel = m->bot->find_channel(channelname);
         if (!channel)
             return;
 
-        Membership::ptr mem = m->source.client->find_membership(channelname);
+        Membership::ptr mem = m->source->client->find_membership(channelname);
         if (mem && mem->has_mode('v')) {
-            if (m->command == "PART" && m->source.destination == channelname )
+            if (m->command == "PART" && m->source->destination == channelname )
             {
                 if (m->args.size() >= 1 && m->args[0].substr(0,9) == "requested")
                 {
                     // user was ejected from the channel with REMOVE
-                    Logger::get_instance()->Log(m->bot, NULL, Logger::Debug, "*** " + m->source.client->nick()  + "was removed from channel - will not revoice");
+                    Logger::get_instance()->Log(m->bot, NULL, Logger::Debug, "*** " + m->source->client->nick()  + "was removed from channel - will not revoice");
                     return;
                 }
             } else if (m->command == "QUIT") {
-                if (!m->source.destination.empty())
+                if (!m->source->destination.empty())
                 {
-                    std::string q = m->source.destination.substr(0,m->source.destination.find(" "));
+                    std::string q = m->source->destination.substr(0,m->source->destination.find(" "));
                     if (q == "Killed" ||  q == "K-Lined" ||  q == "Changing" ||  q == "*.net")
                     {
                         // Abnormal quit - ignore
-                        Logger::get_instance()->Log(m->bot, NULL, Logger::Debug, "*** " + m->source.client->nick()  + "left network abnormally - will not revoice");
+                        Logger::get_instance()->Log(m->bot, NULL, Logger::Debug, "*** " + m->source->client->nick()  + "left network abnormally - will not revoice");
                         return;
                     }
                 }
@@ -582,21 +807,22 @@ struct voicebot : CommandHandlerBase<voicebot>, Module
                 return;
             }
             // User left the channel or network normally while voiced - put them on the lost voices list
-            std::string mask = m->source.raw;
-            mask=build_revoice_mask(m->source.client);
+            std::string mask = m->source->raw;
+            mask=build_revoice_mask(m->source->client);
             if (!mask.empty())
             {
+                std::lock_guard<SharedLock> guard(lock);
                 // check we don't already have this mask
-                for (ValueArray::iterator it = lostvoices.begin(); it != lostvoices.end(); ++it)
+                if (revoices.contains(mask))
                 {
-                    if ((*it)["mask"] == mask)
-                    {
-                        Logger::get_instance()->Log(m->bot, NULL, Logger::Debug, "*** " + mask + " is already on lostvoices list, skipping");
-                        return;
-                    }
+                    Logger::get_instance()->Log(m->bot, NULL, Logger::Debug, "*** " + mask + " is already on lostvoices list, skipping");
+                    return;
                 }
-                lostvoices.push_back(lostvoiceentry(m->bot->name(), mask, get_revoice_expiry(m->bot)+time(NULL)));
-                Logger::get_instance()->Log(m->bot, NULL, Logger::Debug, "*** " + m->source.client->nick() + "(" + mask + ")" + " left " + channelname + " with voice");
+                std::string account = m->source->client->account();
+                if (!has_account(account))
+                    account.clear();
+                revoices.add(m->bot->name(), mask, account, get_revoice_expiry(m->bot)+time(NULL));
+                Logger::get_instance()->Log(m->bot, NULL, Logger::Debug, "*** " + m->source->client->nick() + "(" + mask + ")" + " left " + channelname + " with voice");
             }
         }
     }
@@ -627,6 +853,7 @@ struct voicebot : CommandHandlerBase<voicebot>, Module
 
     CommandHolder add, remove, list, info, check, voice, clear, change, match_client, shutdown, join, part, quit, nick;
     EventHolder check_event;
+    WorkerPool::Token token;
     HelpTopicHolder voicebothelp, voicehelp, checkhelp, matchhelp, addhelp, removehelp, edithelp;
     HelpIndexHolder index;
 
@@ -634,6 +861,7 @@ struct voicebot : CommandHandlerBase<voicebot>, Module
         : dnv(GlobalSettingsManager::get_instance()->get("voicebot:donotvoice")),
           old(GlobalSettingsManager::get_instance()->get("voicebot:expireddonotvoice")),
           lostvoices(GlobalSettingsManager::get_instance()->get("voicebot:lostvoices")),
+          revoices(lostvoices),
           voicebothelp("voicebot", "voiceadmin", help_voicebot),
           voicehelp("voice", "voiceadmin", help_voice),
           checkhelp("check", "voiceadmin", help_check),
@@ -662,7 +890,8 @@ struct voicebot : CommandHandlerBase<voicebot>, Module
         join = add_handler(filter_command_type("JOIN", sourceinfo::RawIrc),&voicebot::irc_join,true);
         nick = add_handler(filter_command_type("NICK", sourceinfo::RawIrc),&voicebot::irc_nick,true);
 
-        check_event = add_recurring_event(60, &voicebot::check_expiry);
+        token = WorkerPool::new_token();
+        check_event = add_recurring_event(60, &voicebot::expiry_due);
 
         StorageManager::get_instance()->auto_save(&dnv, "donotvoice");
         StorageManager::get_instance()->auto_save(&old, "expireddonotvoice");
@@ -670,6 +899,11 @@ struct voicebot : CommandHandlerBase<voicebot>, Module
 
         load_lists();
     }
+
+    ~voicebot()
+    {
+        WorkerPool::get_instance()->cancel(token);
+    }
 };
 
 MODULE_CLASS(voicebot)
@@ -8,24 +8,24 @@ struct Whoami : CommandHandlerBase<Whoami>, Module
 {
     void whoami(const Message *m)
     {
-        if (!m->source.client)
+        if (!m->source->client)
         {
-            m->source.reply("I don't know who you are.");
+            m->source->reply("I don't know who you are.");
             return;
         }
 
-        m->source.reply("You are " + m->source.client->nick());
+        m->source->reply("You are " + m->source->client->nick());
 
-        if (m->source.client->account().empty())
-            m->source.reply("You are not logged in");
+        if (m->source->client->account().empty())
+            m->source->reply("You are not logged in");
         else
-            m->source.reply("You are logged in as " + m->source.client->account());
+            m->source->reply("You are logged in as " + m->source->client->account());
 
         std::string privbuf;
         std::map<std::string, std::string> chanprivbuf;
 
-        for(PrivilegeSet::iterator it = m->source.client->privs().begin();
-                it != m->source.client->privs().end(); ++it)
+        for(PrivilegeSet::iterator it = m->source->client->privs().begin();
+                it != m->source->client->privs().end(); ++it)
         {
             if (it->first.empty())
                 privbuf += it->second + " ";
@@ -34,9 +34,9 @@ struct Whoami : CommandHandlerBase<Whoami>, Module
         }
 
         if (!privbuf.empty())
-            m->source.reply("You have privileges " + privbuf);
+            m->source->reply("You have privileges " + privbuf);
         for (std::map<std::string,std::string>::iterator it = chanprivbuf.begin(); it != chanprivbuf.end(); ++it)
-            m->source.reply("You have privileges " + it->second + "in channel " + it->first);
+            m->source->reply("You have privileges " + it->second + "in channel " + it->first);
     }
 
     CommandHolder _id;
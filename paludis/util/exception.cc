@@ -22,6 +22,7 @@
 #include <paludis/util/join.hh>
 #include <tr1/memory>
 #include <list>
+#include <vector>
 #include <cstdlib>
 #include <iostream>
 
@@ -35,26 +36,65 @@ using namespace paludis;
 
 namespace
 {
-    PALUDIS_TLS std::list<std::string> * context = 0;
+    // Either a plain string, or a deferred context which is rendered only
+    // when someone asks for a backtrace.
+    struct ContextEntry
+    {
+        std::string text;
+        const DeferredContext * deferred;
+
+        std::string render() const
+        {
+            return deferred ? deferred->render() : text;
+        }
+    };
+
+    typedef std::vector<ContextEntry> ContextStack;
+
+    PALUDIS_TLS ContextStack * context = 0;
+
+    void push_context(const std::string & s, const DeferredContext * d)
+    {
+        if (! context)
+        {
+            context = new ContextStack;
+            context->reserve(32);
+        }
+        context->push_back(ContextEntry());
+        context->back().text = s;
+        context->back().deferred = d;
+    }
+
+    void pop_context()
+    {
+        if (! context)
+            throw InternalError(PALUDIS_HERE, "no context");
+        context->pop_back();
+        if (context->empty())
+        {
+            delete context;
+            context = 0;
+        }
+    }
+
+    std::list<std::string> render_context()
+    {
+        std::list<std::string> result;
+        if (context)
+            for (ContextStack::const_iterator i(context->begin()), i_end(context->end()) ; i != i_end ; ++i)
+                result.push_back(i->render());
+        return result;
+    }
 }
 
 Context::Context(const std::string & s)
 {
-    if (! context)
-        context = new std::list<std::string>;
-    context->push_back(s);
+    push_context(s, 0);
 }
 
 Context::~Context()
 {
-    if (! context)
-        throw InternalError(PALUDIS_HERE, "no context");
-    context->pop_back();
-    if (context->empty())
-    {
-        delete context;
-        context = 0;
-    }
+    pop_context();
 }
 
 std::string
@@ -63,7 +103,18 @@ Context::backtrace(const std::string & delim)
     if (! context)
         return "";
 
-    return join(context->begin(), context->end(), delim) + delim;
+    std::list<std::string> c(render_context());
+    return join(c.begin(), c.end(), delim) + delim;
+}
+
+DeferredContext::DeferredContext()
+{
+    push_context("", this);
+}
+
+DeferredContext::~DeferredContext()
+{
+    pop_context();
 }
 
 namespace paludis
@@ -72,10 +123,9 @@ namespace paludis
     {
         std::list<std::string> local_context;
 
-        ContextData()
+        ContextData() :
+            local_context(render_context())
         {
-            if (context)
-                local_context.assign(context->begin(), context->end());
         }
 
         ContextData(const ContextData & other) :
@@ -65,6 +65,37 @@ namespace paludis
             static std::string backtrace(const std::string & delim);
     };
 
+    /**
+     * Backtrace context whose text is only produced if a backtrace is
+     * actually taken. Subclasses implement render(); they must not be
+     * copied, since the context stack refers to them by address.
+     *
+     * \ingroup g_exceptions
+     * \nosubgrouping
+     */
+    class PALUDIS_VISIBLE DeferredContext
+    {
+        private:
+            DeferredContext(const DeferredContext &);
+            const DeferredContext & operator= (const DeferredContext &);
+
+        protected:
+            ///\name Basic operations
+            ///\{
+
+            DeferredContext();
+
+            ~DeferredContext();
+
+            ///\}
+
+        public:
+            /**
+             * Produce our context text.
+             */
+            virtual std::string render() const = 0;
+    };
+
     /**
      * Base exception class.
      *
@@ -35,7 +35,7 @@ Mutex::Mutex() :
     pthread_mutex_init(_mutex, _attr);
 }
 
-Mutex::~Mutex()
+Mutex::~Mutex() noexcept(false)
 {
     int r(0);
     if (0 != ((r = pthread_mutex_destroy(_mutex))))
@@ -60,7 +60,7 @@ Lock::Lock(Mutex & m) :
         throw InternalError(PALUDIS_HERE, "mutex lock failed: " + stringify(strerror(r)));
 }
 
-Lock::~Lock()
+Lock::~Lock() noexcept(false)
 {
     int r(0);
     if (0 != ((r = pthread_mutex_unlock(_mutex->posix_mutex()))))
@@ -85,7 +85,7 @@ TryLock::TryLock(Mutex & m) :
         _mutex = 0;
 }
 
-TryLock::~TryLock()
+TryLock::~TryLock() noexcept(false)
 {
     int r(0);
     if (_mutex)
@@ -105,7 +105,7 @@ Mutex::Mutex()
 {
 }
 
-Mutex::~Mutex()
+Mutex::~Mutex() noexcept(false)
 {
 }
 
@@ -118,7 +118,7 @@ Lock::acquire_then_release_old(Mutex &)
 {
 }
 
-Lock::~Lock()
+Lock::~Lock() noexcept(false)
 {
 }
 
@@ -126,7 +126,7 @@ TryLock::TryLock(Mutex &)
 {
 }
 
-TryLock::~TryLock()
+TryLock::~TryLock() noexcept(false)
 {
 }
 
@@ -61,7 +61,7 @@ namespace paludis
             ///\{
 
             explicit Mutex();
-            ~Mutex();
+            ~Mutex() noexcept(false);
 
             ///\}
 
@@ -94,7 +94,7 @@ namespace paludis
             ///\{
 
             explicit Lock(Mutex &);
-            ~Lock();
+            ~Lock() noexcept(false);
 
             ///\}
 
@@ -131,7 +131,7 @@ namespace paludis
             ///\{
 
             explicit TryLock(Mutex &);
-            ~TryLock();
+            ~TryLock() noexcept(false);
 
             ///\}
 
@@ -0,0 +1,278 @@
+#include "arena.h"
+#include "exceptions.h"
+
+#include <paludis/util/private_implementation_pattern-impl.hh>
+
+#include <new>
+
+using namespace eir;
+using namespace paludis;
+
+namespace
+{
+    const std::size_t granularity = 16;
+    const std::size_t max_pooled_size = 512;
+
+    std::size_t round_up(std::size_t size)
+    {
+        return (size + granularity - 1) & ~(granularity - 1);
+    }
+
+    struct HandleTable
+    {
+        static const uint32_t index_bits = 24;
+        static const uint32_t index_mask = (1u << index_bits) - 1;
+
+        struct Slot
+        {
+            void *object;
+            uint8_t generation;
+        };
+
+        std::vector<Slot> slots;
+        std::vector<uint32_t> free_slots;
+
+        HandleTable()
+        {
+            // Slot zero is reserved so that zero is never a valid handle.
+            Slot s = { 0, 0 };
+            slots.push_back(s);
+        }
+
+        StateArena::Handle add(void *o)
+        {
+            uint32_t index;
+            if (!free_slots.empty())
+            {
+                index = free_slots.back();
+                free_slots.pop_back();
+            }
+            else
+            {
+                index = slots.size();
+                if (index > index_mask)
+                    throw eir::InternalError("Handle table full");
+                Slot s = { 0, 0 };
+                slots.push_back(s);
+            }
+            slots[index].object = o;
+            return (uint32_t(slots[index].generation) << index_bits) | index;
+        }
+
+        void *get(StateArena::Handle h) const
+        {
+            uint32_t index = h & index_mask;
+            if (index == 0 || index >= slots.size())
+                return 0;
+            const Slot & s = slots[index];
+            if (s.generation != (h >> index_bits))
+                return 0;
+            return s.object;
+        }
+
+        void remove(StateArena::Handle h)
+        {
+            if (!get(h))
+                return;
+            Slot & s = slots[h & index_mask];
+            s.object = 0;
+            ++s.generation;
+            free_slots.push_back(h & index_mask);
+        }
+    };
+}
+
+SlabPool::SlabPool(std::size_t block_size, std::size_t blocks_per_slab)
+    : _block_size(round_up(block_size < sizeof(void *) ? sizeof(void *) : block_size)),
+      _blocks_per_slab(blocks_per_slab), _in_use(0), _free(0)
+{
+}
+
+SlabPool::~SlabPool()
+{
+    for (std::vector<char *>::iterator it = _slabs.begin(); it != _slabs.end(); ++it)
+        ::operator delete(*it);
+}
+
+void *SlabPool::allocate()
+{
+    if (!_free)
+    {
+        char *slab = static_cast<char *>(::operator new(_block_size * _blocks_per_slab));
+        _slabs.push_back(slab);
+        for (std::size_t i = _blocks_per_slab; i > 0; --i)
+        {
+            void *block = slab + (i - 1) * _block_size;
+            *static_cast<void **>(block) = _free;
+            _free = block;
+        }
+    }
+
+    void *ret = _free;
+    _free = *static_cast<void **>(ret);
+    ++_in_use;
+    return ret;
+}
+
+void SlabPool::deallocate(void *p)
+{
+    *static_cast<void **>(p) = _free;
+    _free = p;
+    --_in_use;
+}
+
+namespace paludis
+{
+    template <>
+    struct Implementation<StateArena>
+    {
+        // pools[n] serves blocks of n * granularity bytes.
+        std::vector<std::unique_ptr<SlabPool> > pools;
+        std::size_t unpooled;
+
+        HandleTable clients, channels;
+
+        SlabPool *pool_for(std::size_t size)
+        {
+            std::size_t index = round_up(size) / granularity;
+            if (index >= pools.size())
+                pools.resize(index + 1);
+            if (!pools[index])
+                pools[index].reset(new SlabPool(index * granularity));
+            return pools[index].get();
+        }
+
+        Implementation() : unpooled(0)
+        { }
+    };
+}
+
+StateArena::StateArena()
+    : PrivateImplementationPattern<StateArena>(new Implementation<StateArena>)
+{
+}
+
+StateArena::~StateArena()
+{
+}
+
+void *StateArena::allocate(std::size_t size)
+{
+    if (size > max_pooled_size)
+    {
+        _imp->unpooled += size;
+        return ::operator new(size);
+    }
+    return _imp->pool_for(size)->allocate();
+}
+
+void StateArena::deallocate(void *p, std::size_t size)
+{
+    if (size > max_pooled_size)
+    {
+        _imp->unpooled -= size;
+        ::operator delete(p);
+        return;
+    }
+    _imp->pool_for(size)->deallocate(p);
+}
+
+StateArena::Handle StateArena::add_client(Client *c)
+{
+    return _imp->clients.add(c);
+}
+
+void StateArena::remove_client(Handle h)
+{
+    _imp->clients.remove(h);
+}
+
+Client *StateArena::client(Handle h) const
+{
+    return static_cast<Client *>(_imp->clients.get(h));
+}
+
+StateArena::Handle StateArena::add_channel(Channel *c)
+{
+    return _imp->channels.add(c);
+}
+
+void StateArena::remove_channel(Handle h)
+{
+    _imp->channels.remove(h);
+}
+
+Channel *StateArena::channel(Handle h) const
+{
+    return static_cast<Channel *>(_imp->channels.get(h));
+}
+
+std::size_t StateArena::bytes_in_use() const
+{
+    std::size_t ret = _imp->unpooled;
+    for (auto it = _imp->pools.begin(); it != _imp->pools.end(); ++it)
+        if (*it)
+            ret += (*it)->in_use() * (*it)->block_size();
+    return ret;
+}
+
+std::size_t StateArena::bytes_reserved() const
+{
+    std::size_t ret = _imp->unpooled;
+    for (auto it = _imp->pools.begin(); it != _imp->pools.end(); ++it)
+        if (*it)
+            ret += (*it)->capacity() * (*it)->block_size();
+    return ret;
+}
+
+namespace
+{
+    // Stored immediately before each ArenaAllocated object, so that delete
+    // can find its way back to the right pool.
+    struct ArenaHeader
+    {
+        StateArenaPtr arena;
+        std::size_t size;
+    };
+
+    const std::size_t header_size = round_up(sizeof(ArenaHeader));
+}
+
+void *ArenaAllocated::operator new(std::size_t size, const StateArenaPtr & arena)
+{
+    std::size_t total = size + header_size;
+    void *block = arena ? arena->allocate(total) : ::operator new(total);
+    new (block) ArenaHeader{arena, total};
+    return static_cast<char *>(block) + header_size;
+}
+
+void *ArenaAllocated::operator new(std::size_t size)
+{
+    return operator new(size, StateArenaPtr());
+}
+
+void ArenaAllocated::operator delete(void *p, const StateArenaPtr &)
+{
+    operator delete(p);
+}
+
+void ArenaAllocated::operator delete(void *p)
+{
+    if (!p)
+        return;
+
+    void *block = static_cast<char *>(p) - header_size;
+    ArenaHeader *header = static_cast<ArenaHeader *>(block);
+
+    // Take our own reference, since this may be the last thing keeping the
+    // arena alive.
+    StateArenaPtr arena;
+    arena.swap(header->arena);
+    std::size_t size = header->size;
+    header->~ArenaHeader();
+
+    if (arena)
+        arena->deallocate(block, size);
+    else
+        ::operator delete(block);
+}
@@ -0,0 +1,134 @@
+#ifndef arena_h
+#define arena_h
+
+#include <paludis/util/private_implementation_pattern.hh>
+#include <paludis/util/instantiation_policy.hh>
+
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+namespace eir
+{
+    struct Client;
+    struct Channel;
+
+    /*
+     * Fixed-size block allocator. Blocks are carved out of large slabs and
+     * recycled through a free list; slabs are only returned to the system
+     * when the pool is destroyed.
+     */
+    class SlabPool : private paludis::InstantiationPolicy<SlabPool, paludis::instantiation_method::NonCopyableTag>
+    {
+        private:
+            std::size_t _block_size, _blocks_per_slab, _in_use;
+            std::vector<char *> _slabs;
+            void *_free;
+
+        public:
+            SlabPool(std::size_t block_size, std::size_t blocks_per_slab = 256);
+            ~SlabPool();
+
+            void *allocate();
+            void deallocate(void *);
+
+            std::size_t block_size() const { return _block_size; }
+            std::size_t in_use() const { return _in_use; }
+            std::size_t capacity() const { return _slabs.size() * _blocks_per_slab; }
+    };
+
+    /*
+     * Per-Bot storage for network state. Client, Channel and Membership
+     * objects, their control blocks and their implementation structures are
+     * all allocated from size-keyed slab pools here, and clients and channels
+     * are given small integer handles that stay valid for the lifetime of the
+     * object and are never silently reused for a different one.
+     *
+     * Everything allocated from the arena keeps it alive, so objects which
+     * outlive their Bot are still safe to destroy.
+     */
+    class StateArena : private paludis::PrivateImplementationPattern<StateArena>,
+                       private paludis::InstantiationPolicy<StateArena, paludis::instantiation_method::NonCopyableTag>,
+                       public std::enable_shared_from_this<StateArena>
+    {
+        public:
+            // The low 24 bits index the handle table; the high 8 count how
+            // many times that slot has been reused. Zero is never valid.
+            typedef uint32_t Handle;
+
+            void *allocate(std::size_t size);
+            void deallocate(void *p, std::size_t size);
+
+            Handle add_client(Client *);
+            void remove_client(Handle);
+            Client *client(Handle) const;
+
+            Handle add_channel(Channel *);
+            void remove_channel(Handle);
+            Channel *channel(Handle) const;
+
+            // Bytes currently handed out, and bytes held in slabs.
+            std::size_t bytes_in_use() const;
+            std::size_t bytes_reserved() const;
+
+            StateArena();
+            ~StateArena();
+    };
+
+    typedef std::shared_ptr<StateArena> StateArenaPtr;
+
+    /*
+     * Standard allocator drawing from a StateArena, for use with
+     * std::allocate_shared.
+     */
+    template <typename T_>
+    struct ArenaAllocator
+    {
+        typedef T_ value_type;
+
+        StateArenaPtr arena;
+
+        ArenaAllocator(StateArenaPtr a) : arena(a) { }
+
+        template <typename U_>
+        ArenaAllocator(const ArenaAllocator<U_> & other) : arena(other.arena) { }
+
+        T_ *allocate(std::size_t n)
+        {
+            return static_cast<T_ *>(arena->allocate(n * sizeof(T_)));
+        }
+
+        void deallocate(T_ *p, std::size_t n)
+        {
+            arena->deallocate(p, n * sizeof(T_));
+        }
+    };
+
+    template <typename T_, typename U_>
+    bool operator== (const ArenaAllocator<T_> & l, const ArenaAllocator<U_> & r)
+    {
+        return l.arena == r.arena;
+    }
+
+    template <typename T_, typename U_>
+    bool operator!= (const ArenaAllocator<T_> & l, const ArenaAllocator<U_> & r)
+    {
+        return l.arena != r.arena;
+    }
+
+    /*
+     * Base for objects created with new (arena) T(...). The usual delete
+     * returns the memory to whichever arena it came from. A null arena falls
+     * back to the global heap.
+     */
+    struct ArenaAllocated
+    {
+        static void *operator new(std::size_t size, const StateArenaPtr & arena);
+        static void *operator new(std::size_t size);
+        static void operator delete(void *p, const StateArenaPtr &);
+        static void operator delete(void *p);
+    };
+}
+
+#endif
@@ -4,6 +4,9 @@
 #include "handler.h"
 
 #include "server.h"
+#include "reactor.h"
+#include "handoff.h"
+#include "trace.h"
 
 #include <paludis/util/wrapped_forward_iterator-impl.hh>
 #include <paludis/util/member_iterator-impl.hh>
@@ -27,6 +30,20 @@ using namespace paludis;
 template class paludis::WrappedForwardIterator<Bot::ClientIteratorTag, const Client::ptr>;
 template class paludis::WrappedForwardIterator<Bot::ChannelIteratorTag, const Channel::ptr>;
 template class paludis::WrappedForwardIterator<Bot::SettingsIteratorTag, const std::pair<const std::string, Value> >;
+template class paludis::WrappedForwardIterator<BotManager::IteratorTag, const std::pair<const std::string, Bot *> >;
+
+std::atomic<unsigned long> Bot::_settings_generation(1);
+
+namespace
+{
+    Bot::OutputRedirect output_redirect;
+
+    std::atomic<unsigned int> next_slot(0);
+
+    // Slots are cleared from destructors that may run at exit, after the
+    // bots and BotManager have gone; with no bots there's nothing to clear.
+    std::atomic<unsigned int> live_bots(0);
+}
 
 namespace paludis
 {
@@ -48,8 +65,17 @@ namespace paludis
 
         std::string _name;
 
+        // Where the bot runs, and the token for what's posted to it there.
+        Reactor *reactor;
+        WorkerPool::Token token;
+
         std::shared_ptr<Server> _server;
-        std::string _host, _port, _nick, _pass;
+        Connector::ServerList _servers;
+        std::string _nick, _pass;
+
+        StateArenaPtr _arena;
+
+        std::vector<Bot::Slot> _slots;
 
         Client::ptr _me;
 
@@ -86,14 +112,30 @@ namespace paludis
 
         void handle_message(std::string);
 
+        // BATCHes the server has opened but not yet closed, by reference tag.
+        // Messages are only kept for batches someone handles as a whole.
+        struct OpenBatch
+        {
+            std::string type, parent;
+            std::vector<std::string> params;
+            std::shared_ptr<std::vector<Message> > messages;
+        };
+        typedef std::map<std::string, OpenBatch> BatchMap;
+        BatchMap _batches;
+
+        void add_to_batch(std::string ref, const Message &);
+        void end_batch(std::string ref);
+
         CommandHolder set_handler;
         void handle_set(const Message *);
 
         void connect(std::string host, std::string port, std::string nick, std::string pass)
         {
-            _server.reset(new Server(std::bind(&Implementation<Bot>::handle_message, this, _1), bot));
-            _host = host;
-            _port = port;
+            _server.reset(new Server(std::bind(&Implementation<Bot>::handle_message, this, _1),
+                                     std::bind(&Implementation<Bot>::server_connected, this, _1),
+                                     std::bind(&Implementation<Bot>::connection_lost, this, _1),
+                                     std::bind(&Implementation<Bot>::connect_failed, this, _1), bot));
+            _servers.assign(1, std::make_pair(host, port));
             _nick = nick;
             _pass = pass;
         }
@@ -102,14 +144,15 @@ namespace paludis
 
         void handle_001(const Message *m)
         {
-            _nick = m->source.destination;
+            _nick = m->source->destination;
             _registered = true;
             nick_in_use_handler = 0;
+            _batches.clear();
         }
 
         void handle_nick(const Message *m) {
-            if (m->source.name == m->bot->nick())
-                _nick = m->source.destination;
+            if (m->source->name == m->bot->nick())
+                _nick = m->source->destination;
         }
 
         void handle_433(const Message *)
@@ -143,6 +186,21 @@ namespace paludis
 
 
         void set_server(const Message *m);
+        void add_fallback_server(const Message *m);
+
+        // A lost connection is retried from the main loop, straight away
+        // and then every reconnect_delay seconds until it works. Not an
+        // EventHolder, since reconnect() replaces its own event.
+        enum { reconnect_delay = 30 };
+        EventManager::id reconnect_id;
+        void server_connected(std::string host);
+        void connection_lost(std::string reason);
+        void connect_failed(std::string reason);
+        void reconnect();
+        void cancel_reconnect();
+
+        Value save_state();
+        void restore_state(const Value &);
 
         std::string config_filename;
         CommandHolder rehash_handler;
@@ -150,10 +208,11 @@ namespace paludis
         void rehash(const Message *m);
 
         Implementation(Bot *b, std::string n)
-            : bot(b), _name(n),
+            : bot(b), _name(n), reactor(Reactor::current() ? Reactor::current() : Reactor::main()),
+              token(WorkerPool::new_token()), _arena(std::make_shared<StateArena>()),
               _clients(512), _channels(512),
               _connected(false),
-              _supported(b), _capabilities(b)
+              _supported(b), _capabilities(b), reconnect_id(0)
         {
             config_filename = ETCDIR "/" + _name + ".conf";
             set_handler = add_handler(filter_command_privilege("set", "admin").from_bot(bot).or_config(),
@@ -169,13 +228,23 @@ namespace paludis
             throttle_handler = add_handler(filter_command_type("throttle", sourceinfo::ConfigFile).from_bot(bot),
                                         &Implementation<Bot>::handle_throttle);
 
-            cap_enabled_handler = add_handler(filter_command_type("cap_enabled", sourceinfo::Internal),
+            cap_enabled_handler = add_handler(filter_command_type("cap_enabled", sourceinfo::Internal).from_bot(bot),
                                         &Implementation<Bot>::cap_enabled);
-            isupport_enabled_handler = add_handler(filter_command_type("isupport_enabled", sourceinfo::Internal),
+            isupport_enabled_handler = add_handler(filter_command_type("isupport_enabled", sourceinfo::Internal).from_bot(bot),
                                         &Implementation<Bot>::isupport_enabled);
 
             _capabilities.request("account-notify");
             _capabilities.request("extended-join");
+            _capabilities.request("message-tags");
+            _capabilities.request("batch");
+            _capabilities.request("server-time");
+
+            ++live_bots;
+        }
+
+        ~Implementation()
+        {
+            --live_bots;
         }
     };
 }
@@ -187,20 +256,80 @@ static void print_cerr(std::string s)
     std::cerr << s << std::endl;
 }
 
-Bot::Bot(std::string botname)
-    : PrivateImplementationPattern<Bot>(new Implementation<Bot> (this, botname))
+void Bot::add_to_manager()
 {
-    Implementation<BotManager>::BotMap::iterator it = BotManager::get_instance()->_imp->bots.find(botname);
+    // A new bot may reuse a dead one's address; don't let handles trust
+    // what they cached for that.
+    settings_changed();
+
+    Implementation<BotManager>::BotMap::iterator it = BotManager::get_instance()->_imp->bots.find(_imp->_name);
     if (it != BotManager::get_instance()->_imp->bots.end())
-        throw InternalError("There's already a bot called " + botname);
+        throw InternalError("There's already a bot called " + _imp->_name);
+
+    BotManager::get_instance()->_imp->bots.insert(make_pair(_imp->_name, this));
+}
 
-    BotManager::get_instance()->_imp->bots.insert(make_pair(botname, this));
+Bot::Bot(std::string botname)
+    : PrivateImplementationPattern<Bot>(new Implementation<Bot> (this, botname))
+{
+    ExclusiveSection exclusive;
+    add_to_manager();
 
-    _imp->load_config(print_cerr, true);
+    try
+    {
+        _imp->load_config(print_cerr, true);
+    }
+    catch (...)
+    {
+        BotManager::get_instance()->_imp->bots.erase(botname);
+        throw;
+    }
 
     dispatch_internal_message(this, "config_loaded");
 }
 
+Bot::Bot(std::string botname, const Value & state)
+    : PrivateImplementationPattern<Bot>(new Implementation<Bot> (this, botname))
+{
+    ExclusiveSection exclusive;
+    add_to_manager();
+
+    _imp->_connected = true;
+    _imp->_registered = true;
+    try
+    {
+        _imp->restore_state(state);
+    }
+    catch (...)
+    {
+        BotManager::get_instance()->_imp->bots.erase(botname);
+        throw;
+    }
+}
+
+unsigned int Bot::new_slot()
+{
+    return next_slot++;
+}
+
+Bot::Slot & Bot::slot(unsigned int index)
+{
+    if (index >= _imp->_slots.size())
+        _imp->_slots.resize(index + 1);
+    return _imp->_slots[index];
+}
+
+void Bot::clear_slot(unsigned int index)
+{
+    if (!live_bots)
+        return;
+
+    ExclusiveSection exclusive;
+    for (BotManager::iterator it = BotManager::get_instance()->begin(); it != BotManager::get_instance()->end(); ++it)
+        if (index < it->second->_imp->_slots.size())
+            it->second->_imp->_slots[index].reset();
+}
+
 void Bot::connect(std::string host, std::string port, std::string nick, std::string pass)
 {
     _imp->connect(host, port, nick, pass);
@@ -208,7 +337,12 @@ void Bot::connect(std::string host, std::string port, std::string nick, std::str
 
 Bot::~Bot()
 {
+    ExclusiveSection exclusive;
+    settings_changed();
     dispatch_internal_message(this, "shutting_down");
+    _imp->cancel_reconnect();
+    WorkerPool::get_instance()->cancel(_imp->token);
+    BotManager::get_instance()->_imp->bots.erase(_imp->_name);
 }
 
 void Implementation<Bot>::set_server(const Message *m)
@@ -221,18 +355,90 @@ void Implementation<Bot>::set_server(const Message *m)
     connect(m->args[0], m->args[1], m->args[2], pass);
 }
 
+void Implementation<Bot>::add_fallback_server(const Message *m)
+{
+    if (!_server)
+        throw ConfigurationError("Must specify a server before fallback servers");
+
+    if (m->args.size() < 2)
+        throw ConfigurationError("fallback_server needs two arguments.");
+
+    _servers.push_back(std::make_pair(m->args[0], m->args[1]));
+}
+
+void Implementation<Bot>::connection_lost(std::string reason)
+{
+    _connected = false;
+    std::cerr << "Reconnecting " << _name << " due to error: " << reason << std::endl;
+    Logger::get_instance()->Log(bot, 0, Logger::Warning, "Disconnected: " + reason);
+    cancel_reconnect();
+    reconnect_id = EventManager::get_instance()->add_event(time(NULL),
+                            std::bind(&Implementation<Bot>::reconnect, this));
+}
+
+// Only now is there anything to register on; a failed attempt never gets
+// here, so on_connect is dispatched once per connection.
+void Implementation<Bot>::server_connected(std::string)
+{
+    _connected = true;
+    _registered = false;
+
+    Message m(bot, "on_connect");
+    CommandRegistry::get_instance()->dispatch(&m);
+
+    std::string ident = bot->get_setting_with_default("ident", "eir");
+    std::string realname = bot->get_setting_with_default("realname", "eir version 0.0.1");
+
+    if (_pass.length() > 0)
+        bot->send("PASS " + _pass);
+
+    bot->send("NICK " + _nick);
+    bot->send("USER " + ident + " * * :" + realname);
+}
+
+void Implementation<Bot>::cancel_reconnect()
+{
+    if (reconnect_id)
+        EventManager::get_instance()->remove_event(reconnect_id);
+    reconnect_id = 0;
+}
+
+void Implementation<Bot>::connect_failed(std::string reason)
+{
+    _connected = false;
+    Logger::get_instance()->Log(bot, 0, Logger::Warning, "Couldn't connect: " + reason);
+    cancel_reconnect();
+    reconnect_id = EventManager::get_instance()->add_event(time(NULL) + reconnect_delay,
+                            std::bind(&Implementation<Bot>::reconnect, this));
+}
+
+void Implementation<Bot>::reconnect()
+{
+    reconnect_id = 0;
+    bot->start();
+}
+
 void Implementation<Bot>::load_config(std::function<void(std::string)> reply_func, bool cold /* = false */)
 {
-    CommandHolder server_id;
+    CommandHolder server_id, fallback_id;
 
     if (cold)
+    {
         server_id = add_handler(filter_command("server").from_bot(bot).source_type(sourceinfo::ConfigFile),
                                 &Implementation<Bot>::set_server);
+        fallback_id = add_handler(filter_command("fallback_server").from_bot(bot).source_type(sourceinfo::ConfigFile),
+                                  &Implementation<Bot>::add_fallback_server);
+    }
 
     std::ifstream fs(config_filename.c_str());
     if (!fs)
         throw ConfigurationError("Couldn't open config file '" + config_filename + "'");
 
+    std::shared_ptr<sourceinfo> source(std::make_shared<sourceinfo>());
+    if (cold)
+        source->reply_func = reply_func;
+    source->error_func = reply_func;
+
     std::string line;
 
     while(std::getline(fs, line))
@@ -243,18 +449,11 @@ void Implementation<Bot>::load_config(std::function<void(std::string)> reply_fun
         if(tokens.empty())
             continue;
 
-        Message m(bot, *tokens.begin());
+        Message m(bot, *tokens.begin(), sourceinfo::ConfigFile, source);
 
         tokens.pop_front();
         std::copy(tokens.begin(), tokens.end(), std::back_inserter(m.args));
 
-        if (cold)
-            m.source.reply_func = reply_func;
-
-        m.source.error_func = reply_func;
-
-        m.source.type = sourceinfo::ConfigFile;
-
         m.raw = line;
 
         CommandRegistry::get_instance()->dispatch(&m, true);
@@ -263,28 +462,113 @@ void Implementation<Bot>::load_config(std::function<void(std::string)> reply_fun
 
 void Implementation<Bot>::rehash(const Message *m)
 {
-    Logger::get_instance()->Log(bot, m->source.client, Logger::Command, "REHASH");
-    Logger::get_instance()->Log(bot, m->source.client, Logger::Admin, "Reloading config file");
+    Logger::get_instance()->Log(bot, m->source->client, Logger::Command, "REHASH");
+    Logger::get_instance()->Log(bot, m->source->client, Logger::Admin, "Reloading config file");
 
     dispatch_internal_message(bot, "clear_lists");
 
-    load_config(m->source.reply_func);
+    load_config(std::bind(&sourceinfo::reply, m->source, _1));
+    Bot::settings_changed();
 
     dispatch_internal_message(bot, "recalculate_privileges");
 
-    m->source.reply("Done.");
+    m->source->reply("Done.");
+}
+
+static std::string unescape_tag_value(const std::string & value)
+{
+    std::string ret;
+    ret.reserve(value.size());
+    for (std::string::size_type i = 0; i < value.size(); ++i)
+    {
+        if (value[i] != '\\')
+        {
+            ret += value[i];
+            continue;
+        }
+        if (++i == value.size())
+            break;
+        switch (value[i])
+        {
+            case ':': ret += ';'; break;
+            case 's': ret += ' '; break;
+            case 'r': ret += '\r'; break;
+            case 'n': ret += '\n'; break;
+            default:  ret += value[i];
+        }
+    }
+    return ret;
+}
+
+// Parses "a=b;c;d=e" (without the leading @) into the given map.
+static void parse_tags(const std::string & tags, std::map<std::string, std::string> & out)
+{
+    std::string::size_type p1 = 0, p2;
+    while (p1 < tags.size())
+    {
+        p2 = tags.find(';', p1);
+        if (p2 == std::string::npos)
+            p2 = tags.size();
+
+        std::string::size_type eq = tags.find('=', p1);
+        if (eq < p2)
+            out[tags.substr(p1, eq - p1)] = unescape_tag_value(tags.substr(eq + 1, p2 - eq - 1));
+        else if (p2 > p1)
+            out[tags.substr(p1, p2 - p1)] = "";
+
+        p1 = p2 + 1;
+    }
+}
+
+void Implementation<Bot>::add_to_batch(std::string ref, const Message & m)
+{
+    // A nested batch's messages belong to the enclosing ones too.
+    for (BatchMap::iterator it = _batches.find(ref); it != _batches.end(); it = _batches.find(it->second.parent))
+    {
+        if (it->second.messages)
+            it->second.messages->push_back(m);
+        if (it->second.parent.empty())
+            break;
+    }
 }
 
-static void notice_to(Bot *b, std::string dest, std::string text)
+void Implementation<Bot>::end_batch(std::string ref)
 {
-    b->send("NOTICE " + dest + " :" + text);
+    BatchMap::iterator it = _batches.find(ref);
+    if (it == _batches.end())
+        return;
+
+    OpenBatch batch = it->second;
+    _batches.erase(it);
+
+    if (!batch.messages)
+        return;
+
+    LazyContext c("Processing batch ", ref);
+    TraceSpan span("irc", "batch", bot);
+    if (span.active())
+        span.arg("type", batch.type);
+
+    // The messages have each been dispatched already; this is for anyone
+    // who'd rather deal with the batch as a whole as well.
+    Message grouped(bot, "batch_" + lowercase(batch.type));
+    std::shared_ptr<sourceinfo> source(std::make_shared<sourceinfo>());
+    source->destination = ref;
+    grouped.source = source;
+    grouped.args = batch.params;
+    grouped.batch = batch.messages;
+    CommandRegistry::get_instance()->dispatch(&grouped);
 }
 
 void Implementation<Bot>::handle_message(std::string line)
 {
-    Context c("Parsing message " + line);
+    LazyContext c("Parsing message ", line);
+
+    TraceSpan line_span("irc", "line", bot);
+    TraceSpan parse_span("irc", "parse", bot);
 
     Message m(bot);
+    std::shared_ptr<sourceinfo> source(std::make_shared<sourceinfo>());
     std::string::size_type p1, p2;
     std::string command;
 
@@ -295,34 +579,42 @@ void Implementation<Bot>::handle_message(std::string line)
     if (*--e == '\r')
         line.erase(e);
 
+    if (line[0] == '@')
+    {
+        p2 = line.find(' ');
+        parse_tags(line.substr(1, p2 - 1), m.tags);
+        p1 = line.find_first_not_of(' ', p2);
+        line.erase(0, p1);
+    }
+
     m.raw = line;
 
     if (line[0] == ':')
     {
         p1 = 1;
         p2 = line.find(' ');
-        m.source.raw = line.substr(p1, p2 - p1);
+        source->raw = line.substr(p1, p2 - p1);
         p1 = p2 + 1;
     }
     else
     {
-        m.source.raw = "";
+        source->raw = "";
         p1 = 0;
     }
 
-    std::string::size_type bang = m.source.raw.find('!');
+    std::string::size_type bang = source->raw.find('!');
     if (bang != std::string::npos)
     {
-        std::string nick = m.source.raw.substr(0, bang);
+        std::string nick = source->raw.substr(0, bang);
         ClientMap::iterator c = _clients.find(nick);
         if (c != _clients.end())
-            m.source.client = c->second;
+            source->client = c->second;
 
-        m.source.name = nick;
+        source->name = nick;
     }
     else
     {
-        m.source.name = m.source.raw;
+        source->name = source->raw;
     }
 
     p2 = line.find(' ', p1);
@@ -330,20 +622,16 @@ void Implementation<Bot>::handle_message(std::string line)
 
     p1 = p2 + 1;
     p2 = line.find(' ', p1);
-    m.source.destination = line.substr(p1, p2 - p1);
+    source->destination = line.substr(p1, p2 - p1);
 
-    if(m.source.destination[0] == ':')
+    if(source->destination[0] == ':')
     {
-        m.source.destination = line.substr(p1 + 1);
+        source->destination = line.substr(p1 + 1);
         p2 = std::string::npos;
     }
 
-    if (m.source.destination.find_first_of("#&") != std::string::npos)
-        m.source.reply_func = std::bind(notice_to, bot, m.source.destination, _1);
-    else
-        m.source.reply_func = std::bind(notice_to, bot, m.source.name, _1);
-
-    m.source.error_func = m.source.reply_func;
+    source->irc_bot = bot;
+    m.source = source;
 
     while(p2 != std::string::npos)
     {
@@ -357,13 +645,44 @@ void Implementation<Bot>::handle_message(std::string line)
         m.args.push_back(line.substr(p1, p2 - p1));
     }
 
+    parse_span.finish();
+    line_span.arg("command", command);
+
     m.command = "server_incoming";
-    m.source.type = sourceinfo::Internal;
+    m.source_type = sourceinfo::Internal;
     CommandRegistry::get_instance()->dispatch(&m);
-    Logger::get_instance()->Log(bot, m.source.client, Logger::Raw, "<-- " + m.raw);
+    Logger::get_instance()->Log(bot, m.source->client, Logger::Raw, "<-- " + m.raw);
     m.command = command;
-    m.source.type = sourceinfo::RawIrc;
+    m.source_type = sourceinfo::RawIrc;
+
+    // Lines in a batch go out as they arrive, batch tag and all, and are
+    // also kept for the batch_<type> event when it closes.
+    std::string in_batch;
+    if (!m.tags.empty())
+    {
+        std::map<std::string, std::string>::iterator tag = m.tags.find("batch");
+        if (tag != m.tags.end() && _batches.count(tag->second))
+            in_batch = tag->second;
+    }
+
+    if (command == "BATCH" && m.source->destination.size() > 1
+            && m.source->destination[0] == '+' && !m.args.empty())
+    {
+        OpenBatch & batch = _batches[m.source->destination.substr(1)];
+        batch.type = m.args[0];
+        batch.parent = in_batch;
+        batch.params.assign(m.args.begin() + 1, m.args.end());
+        if (CommandRegistry::get_instance()->has_handlers("batch_" + lowercase(batch.type)))
+            batch.messages = std::make_shared<std::vector<Message> >();
+    }
+
     CommandRegistry::get_instance()->dispatch(&m);
+
+    if (!in_batch.empty())
+        add_to_batch(in_batch, m);
+
+    if (command == "BATCH" && m.source->destination.size() > 1 && m.source->destination[0] == '-')
+        end_batch(m.source->destination.substr(1));
 }
 
 void Implementation<Bot>::handle_set(const Message *m)
@@ -373,16 +692,17 @@ void Implementation<Bot>::handle_set(const Message *m)
 
     if (m->args.size() < 2)
     {
-        m->source.error("Not enough parameters to SET -- need two");
+        m->source->error("Not enough parameters to SET -- need two");
         return;
     }
 
     _settings[m->args[0]] = m->args[1];
+    Bot::settings_changed();
 
-    if (m->source.client)
-        Logger::get_instance()->Log(bot, m->source.client, Logger::Command,
+    if (m->source->client)
+        Logger::get_instance()->Log(bot, m->source->client, Logger::Command,
                                     "SET " + m->args[0] + " = " + m->args[1]);
-    Logger::get_instance()->Log(bot, m->source.client, Logger::Admin,
+    Logger::get_instance()->Log(bot, m->source->client, Logger::Admin,
                                 "Set " + m->args[0] + " to " + m->args[1]);
 }
 
@@ -401,6 +721,11 @@ const Client::ptr Bot::me() const
     return _imp->_me;
 }
 
+StateArenaPtr Bot::arena() const
+{
+    return _imp->_arena;
+}
+
 bool Bot::connected() const
 {
     return _imp->_connected;
@@ -408,53 +733,233 @@ bool Bot::connected() const
 
 void Bot::disconnect(std::string reason)
 {
+    _imp->cancel_reconnect();
+
     if (_imp->_server)
         _imp->_server->disconnect(reason);
 
     _imp->_connected = false;
 }
 
-void Bot::run()
+void Bot::start()
 {
     if ( ! _imp->_server)
         throw ConfigurationError("No server specified");
 
-    _imp->_server->connect(_imp->_host, _imp->_port);
+    _imp->reactor = Reactor::current();
 
-    _imp->_connected = true;
+    _imp->_connected = false;
     _imp->_registered = false;
 
-    Message m(this, "on_connect");
-    CommandRegistry::get_instance()->dispatch(&m);
+    _imp->_server->connect(_imp->_servers);
+    _imp->_server->start();
+}
+
+Value Implementation<Bot>::save_state()
+{
+    Value clients(Value::array);
+    for (ClientMap::iterator it = _clients.begin(); it != _clients.end(); ++it)
+    {
+        Client::ptr c = it->second;
+        Value client(Value::kvarray), attrs(Value::kvarray);
+        client["nick"] = c->nick();
+        client["user"] = c->user();
+        client["host"] = c->host();
+        client["account"] = c->account();
+        for (Client::AttributeIterator a = c->attr_begin(); a != c->attr_end(); ++a)
+            attrs[a->first] = a->second;
+        client["attrs"] = attrs;
+        clients.push_back(client);
+    }
+
+    Value channels(Value::array);
+    for (ChannelMap::iterator it = _channels.begin(); it != _channels.end(); ++it)
+    {
+        Channel::ptr ch = it->second;
+        Value channel(Value::kvarray), attrs(Value::kvarray), members(Value::array);
+        channel["name"] = ch->name();
+        for (Channel::AttributeIterator a = ch->attr_begin(); a != ch->attr_end(); ++a)
+            attrs[a->first] = a->second;
+        channel["attrs"] = attrs;
+        for (Channel::MemberIterator m = ch->begin_members(); m != ch->end_members(); ++m)
+        {
+            Value member(Value::kvarray);
+            member["nick"] = (*m)->client->nick();
+            member["modes"] = (*m)->modes();
+            members.push_back(member);
+        }
+        channel["members"] = members;
+        channels.push_back(channel);
+    }
+
+    Value state(Value::kvarray);
+    state["nick"] = _nick;
+    state["isupport"] = _supported.save();
+    state["caps"] = _capabilities.save();
+    state["clients"] = clients;
+    state["channels"] = channels;
+    return state;
+}
+
+void Implementation<Bot>::restore_state(const Value & state)
+{
+    _nick = Handoff::get_string(state, "nick", _nick);
+    _supported.restore(Handoff::get(state, "isupport"));
+    _capabilities.restore(Handoff::get(state, "caps"));
+
+    const Value & clients = Handoff::get(state, "clients");
+    if (clients.Type() == Value::array)
+        for (ValueArray::const_iterator it = clients.Array().begin(); it != clients.Array().end(); ++it)
+        {
+            Client::ptr c = Client::create(bot, Handoff::get_string(*it, "nick"),
+                                           Handoff::get_string(*it, "user"), Handoff::get_string(*it, "host"));
+            std::string account = Handoff::get_string(*it, "account");
+            if (!account.empty())
+                c->set_account(account, false);
+
+            const Value & attrs = Handoff::get(*it, "attrs");
+            if (attrs.Type() == Value::kvarray)
+                for (KeyValueArray::const_iterator a = attrs.KV().begin(); a != attrs.KV().end(); ++a)
+                    c->set_attr(a->first, a->second);
+
+            // Privileges are worked out afresh, from the new image's rules.
+            bot->add_client(c);
+        }
+
+    const Value & channels = Handoff::get(state, "channels");
+    if (channels.Type() == Value::array)
+        for (ValueArray::const_iterator it = channels.Array().begin(); it != channels.Array().end(); ++it)
+        {
+            Channel::ptr ch = Channel::create(bot, Handoff::get_string(*it, "name"));
+            bot->add_channel(ch);
+
+            const Value & attrs = Handoff::get(*it, "attrs");
+            if (attrs.Type() == Value::kvarray)
+                for (KeyValueArray::const_iterator a = attrs.KV().begin(); a != attrs.KV().end(); ++a)
+                    ch->set_attr(a->first, a->second);
+
+            const Value & members = Handoff::get(*it, "members");
+            if (members.Type() != Value::array)
+                continue;
+
+            ch->reserve_members(members.Array().size());
+            for (ValueArray::const_iterator m = members.Array().begin(); m != members.Array().end(); ++m)
+            {
+                ClientMap::iterator c = _clients.find(Handoff::get_string(*m, "nick"));
+                if (c == _clients.end())
+                    continue;
+
+                Membership::ptr member = c->second->join_chan(ch);
+                std::string modes = Handoff::get_string(*m, "modes");
+                for (std::string::iterator mode = modes.begin(); mode != modes.end(); ++mode)
+                    member->add_mode(*mode);
+            }
+        }
+}
 
-    std::string ident = get_setting_with_default("ident", "eir");
-    std::string realname = get_setting_with_default("realname", "eir version 0.0.1");
+Value Bot::hand_off()
+{
+    if (!_imp->_connected || !_imp->_registered || !_imp->_server)
+        return Value();
 
-    if (_imp->_pass.length() > 0)
-        send("PASS " + _imp->_pass);
+    Value server = _imp->_server->release();
+    if (server.KV().empty())
+        return Value();
 
-    send("NICK " + _imp->_nick);
-    send("USER " + ident + " * * :" + realname);
+    Value state = _imp->save_state();
+    state["server"] = server;
+
+    _imp->cancel_reconnect();
+    _imp->_connected = false;
+    return state;
+}
 
-    _imp->_server->run();
+Value Bot::state()
+{
+    return _imp->save_state();
+}
+
+void Bot::resume(const Value & state)
+{
+    if ( ! _imp->_server)
+        throw ConfigurationError("No server specified");
+
+    _imp->reactor = Reactor::current();
+
+    _imp->_server->adopt(Handoff::get(state, "server"));
+
+    _imp->_connected = true;
+    _imp->_registered = true;
+
+    _imp->restore_state(state);
+
+    Logger::get_instance()->Log(this, 0, Logger::Info, "Resumed connection with " +
+            paludis::stringify(client_count()) + " clients in " + paludis::stringify(channel_count()) + " channels");
+
+    _imp->_server->start();
+
+    dispatch_internal_message(this, "resumed");
+}
+
+void Bot::discard(const Value & state, std::string reason)
+{
+    Server::discard(Handoff::get(state, "server"), reason);
+}
+
+Reactor *Bot::reactor() const
+{
+    return _imp->reactor;
 }
 
 void Bot::send(std::string line)
 {
-    if (!_imp->_connected || !_imp->_server)
-        throw NotConnectedException();
+    if (!_imp->reactor->in_thread())
+    {
+        _imp->reactor->post(std::bind(&Bot::send, this, line), _imp->token);
+        return;
+    }
 
     std::string::size_type idx = line.find_first_of("\r\n");
     if (idx != std::string::npos)
         line.erase(idx);
 
+    if (output_redirect)
+    {
+        output_redirect(this, line);
+        return;
+    }
+
+    if (!_imp->_connected || !_imp->_server)
+        throw NotConnectedException();
+
     Logger::get_instance()->Log(this, NULL, Logger::Raw, "--> " + line);
 
     _imp->_server->send(line);
 }
 
+void Bot::redirect_output(OutputRedirect f)
+{
+    output_redirect = f;
+}
+
+void Bot::process_line(std::string line)
+{
+    if (!_imp->reactor->in_thread())
+    {
+        _imp->reactor->post(std::bind(&Bot::process_line, this, line), _imp->token);
+        return;
+    }
+
+    _imp->handle_message(line);
+}
+
 // Client stuff
 
+std::size_t Bot::client_count() const
+{
+    return _imp->_clients.size();
+}
+
 Bot::ClientIterator Bot::begin_clients()
 {
     return second_iterator(_imp->_clients.begin());
@@ -480,7 +985,7 @@ Client::ptr Bot::find_client(std::string nick)
 
 std::pair<Bot::ClientIterator, bool> Bot::add_client(Client::ptr c)
 {
-    Context ctx("Adding client " + c->nick());
+    LazyContext ctx("Adding client ", c->nick());
 
     // Bit of a hack this...
     if (!_imp->_me && c->nick() == nick())
@@ -498,7 +1003,7 @@ std::pair<Bot::ClientIterator, bool> Bot::add_client(Client::ptr c)
 
 unsigned long Bot::remove_client(Client::ptr c)
 {
-    Context ctx("Removing client " + c->nick());
+    LazyContext ctx("Removing client ", c->nick());
 
     Message m(this, "client_remove", sourceinfo::Internal, c);
     CommandRegistry::get_instance()->dispatch(&m);
@@ -506,8 +1011,35 @@ unsigned long Bot::remove_client(Client::ptr c)
     return _imp->_clients.erase(c->nick());
 }
 
+void Bot::rename_client(Client::ptr c, std::string oldnick)
+{
+    LazyContext ctx("Renaming client ", oldnick, " to ", c->nick());
+
+    // Nicks are unique on the server, so anyone we still have under the
+    // new one has gone without our noticing.
+    Implementation<Bot>::ClientMap::iterator it = _imp->_clients.find(c->nick());
+    if (it != _imp->_clients.end() && it->second != c)
+    {
+        Client::ptr stale = it->second;
+        Logger::get_instance()->Log(this, stale, Logger::Debug, "Dropping stale client " + stale->nick());
+        stale->leave_all_chans();
+        remove_client(stale);
+    }
+
+    it = _imp->_clients.find(oldnick);
+    if (it != _imp->_clients.end() && it->second == c)
+        _imp->_clients.erase(it);
+
+    _imp->_clients[c->nick()] = c;
+}
+
 // Channel stuff
 
+std::size_t Bot::channel_count() const
+{
+    return _imp->_channels.size();
+}
+
 Bot::ChannelIterator Bot::begin_channels()
 {
     return second_iterator(_imp->_channels.begin());
@@ -533,20 +1065,20 @@ Channel::ptr Bot::find_channel(std::string name)
 
 std::pair<Bot::ChannelIterator, bool> Bot::add_channel(Channel::ptr c)
 {
-    Context ctx("Adding channel " + c->name());
+    LazyContext ctx("Adding channel ", c->name());
     std::pair<Implementation<Bot>::ChannelMap::iterator, bool> res = _imp->_channels.insert(make_pair(c->name(), c));
     return make_pair(second_iterator(res.first), res.second);
 }
 
 unsigned long Bot::remove_channel(Channel::ptr c)
 {
-    Context ctx("Removing channel " + c->name());
+    LazyContext ctx("Removing channel ", c->name());
     return _imp->_channels.erase(c->name());
 }
 
 void Bot::remove_channel(Bot::ChannelIterator c)
 {
-    Context ctx("Removing channel " + (*c)->name());
+    LazyContext ctx("Removing channel ", (*c)->name());
     _imp->_channels.erase(c.underlying_iterator<Implementation<Bot>::ChannelMap::iterator>());
 }
 
@@ -586,18 +1118,21 @@ Value Bot::get_setting_with_default(std::string name, std::string _default)
 std::pair<Bot::SettingsIterator, bool> Bot::add_setting(std::string n, Value s)
 {
     Context ctx("Adding setting " + n + "(" + stringify(s) + ")");
+    settings_changed();
     return _imp->_settings.insert(make_pair(n, s));
 }
 
 unsigned long Bot::remove_setting(std::string n)
 {
     Context ctx("Removing setting " + n);
+    settings_changed();
     return _imp->_settings.erase(n);
 }
 
 void Bot::remove_setting(Bot::SettingsIterator it)
 {
     Context ctx("Removing setting " + it->first);
+    settings_changed();
     _imp->_settings.erase(it.underlying_iterator<Implementation<Bot>::SettingsMap::iterator>());
 }
 
@@ -631,3 +1166,13 @@ Bot *BotManager::find(std::string name)
         return it->second;
     return 0;
 }
+
+BotManager::iterator BotManager::begin()
+{
+    return _imp->bots.begin();
+}
+
+BotManager::iterator BotManager::end()
+{
+    return _imp->bots.end();
+}
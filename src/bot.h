@@ -2,6 +2,9 @@
 #define bot_h
 
 #include <string>
+#include <functional>
+#include <atomic>
+#include <memory>
 
 #include <paludis/util/wrapped_forward_iterator.hh>
 #include <paludis/util/instantiation_policy.hh>
@@ -15,33 +18,80 @@
 
 namespace eir
 {
+    class Reactor;
+
     class Bot : public paludis::PrivateImplementationPattern<Bot>
     {
         public:
             Bot(std::string name);
 
+            // A bot for a process that mirrors another's, such as a script
+            // host. It reads no config file and never connects, and starts
+            // with the clients and channels given by the other's state().
+            Bot(std::string name, const Value & state);
+
             void connect(std::string host, std::string port, std::string nick, std::string pass);
 
             const std::string& nick() const;
             const std::string& name() const;
             const Client::ptr me() const;
 
-            void run();
+            // Storage for this bot's clients, channels and memberships.
+            StateArenaPtr arena() const;
+
+            // Starts connecting, and leaves the connection to the calling
+            // thread's reactor, which is the bot's from then on. If no server
+            // can be reached, it tries again every so often.
+            void start();
+            Reactor *reactor() const;
+
+            // For a restart: gives up a registered connection without
+            // closing it, and describes it along with the clients, channels
+            // and memberships seen on it. The bot is left disconnected.
+            // Returns an empty Value if there's nothing worth handing over.
+            Value hand_off();
+
+            // The clients, channels and memberships, as hand_off() describes
+            // them, for a mirror of this bot.
+            Value state();
+
+            // In place of start(), carries on with a connection handed over
+            // by hand_off() in the image before a restart, then dispatches
+            // "resumed".
+            void resume(const Value &);
+
+            // Quits a handed-over connection that no bot is taking up.
+            static void discard(const Value &, std::string reason);
 
             void disconnect(std::string);
 
             bool connected() const;
 
+            // Both of these are passed to the bot's own reactor when called
+            // from another's thread.
             void send(std::string);
 
+            // Handles a line as though the server had just sent it.
+            void process_line(std::string);
+
+            // Hands every line any bot sends to the given function instead of
+            // its server, connected or not. Used by processes that mirror a
+            // bot's state but mustn't talk to the network themselves.
+            typedef std::function<void (Bot *, const std::string &)> OutputRedirect;
+            static void redirect_output(OutputRedirect);
+
             struct ClientIteratorTag;
             typedef paludis::WrappedForwardIterator<ClientIteratorTag, Client::ptr const> ClientIterator;
             ClientIterator begin_clients();
             ClientIterator end_clients();
             ClientIterator find_client_it(std::string nick);
             Client::ptr find_client(std::string nick);
+            std::size_t client_count() const;
             std::pair<ClientIterator, bool> add_client(Client::ptr c);
             unsigned long remove_client(Client::ptr c);
+            // Re-files a known client under its current nick. Unlike removing
+            // and re-adding it, this doesn't dispatch client_remove/new_client.
+            void rename_client(Client::ptr c, std::string oldnick);
 
             struct ChannelIteratorTag;
             typedef paludis::WrappedForwardIterator<ChannelIteratorTag, Channel::ptr const> ChannelIterator;
@@ -49,6 +99,7 @@ namespace eir
             ChannelIterator end_channels();
             ChannelIterator find_channel_it(std::string name);
             Channel::ptr find_channel(std::string name);
+            std::size_t channel_count() const;
             std::pair<ChannelIterator, bool> add_channel(Channel::ptr c);
             unsigned long remove_channel(Channel::ptr c);
             void remove_channel(ChannelIterator c);
@@ -65,12 +116,35 @@ namespace eir
             unsigned long remove_setting(std::string n);
             void remove_setting(SettingsIterator it);
 
+            // Changes whenever any bot's settings might have; SettingHandle
+            // uses this to know when to look again.
+            static unsigned long settings_generation() { return _settings_generation; }
+            static void settings_changed() { ++_settings_generation; }
+
+            // Room for what others keep for each bot, such as a module's
+            // state for it or a setting's parsed value, so that finding it
+            // needs no map shared between reactors. new_slot() gives an index
+            // to use on every bot. A bot's slots start empty, and are only
+            // for its own reactor to touch, or an ExclusiveSection.
+            typedef std::shared_ptr<void> Slot;
+            static unsigned int new_slot();
+            Slot & slot(unsigned int);
+
+            // Empties a slot on every bot, so that what was kept there is
+            // freed while the code that made it is still loaded.
+            static void clear_slot(unsigned int);
+
             const ISupport *supported() const;
             Capabilities *capabilities();
 
             bool use_account_tracking() const;
 
             ~Bot();
+
+        private:
+            static std::atomic<unsigned long> _settings_generation;
+
+            void add_to_manager();
     };
 
     class BotManager : public paludis::InstantiationPolicy<BotManager,
@@ -81,6 +155,14 @@ namespace eir
             friend class Bot;
 
             Bot *find(std::string name);
+
+            // Every bot, by name.
+            struct IteratorTag;
+            typedef paludis::WrappedForwardIterator<IteratorTag,
+                                        const std::pair<const std::string, Bot *> > iterator;
+            iterator begin();
+            iterator end();
+
             BotManager();
             ~BotManager();
     };
@@ -16,24 +16,25 @@ namespace {
 struct BotCommandHandler : public CommandHandlerBase<BotCommandHandler>
 {
     CommandHolder _id;
+    SettingHandle<std::string> command_chars;
 
     void handle_privmsg(const Message *m)
     {
         std::string line, reply_dest;
-        if (m->source.destination == m->bot->nick())
+        if (m->source->destination == m->bot->nick())
         {
             line = m->args[0];
-            reply_dest = m->source.name;
+            reply_dest = m->source->name;
         }
-        else if (m->bot->get_setting("command_chars").String().find(m->args[0][0]) != std::string::npos)
+        else if (!m->args[0].empty() && command_chars.get(m->bot).find(m->args[0][0]) != std::string::npos)
         {
             line = m->args[0].substr(1);
-            reply_dest = m->source.destination;
+            reply_dest = m->source->destination;
         }
         else if (m->args[0].substr(0, m->args[0].find_first_of(",: ")) == m->bot->nick())
         {
             line = m->args[0].substr(m->args[0].find_first_of(",: ") + 1);
-            reply_dest = m->source.destination;
+            reply_dest = m->source->destination;
         }
         else
             return;
@@ -55,6 +56,7 @@ struct BotCommandHandler : public CommandHandlerBase<BotCommandHandler>
     }
 
     BotCommandHandler()
+        : command_chars("command_chars")
     {
         _id = add_handler(filter_command("PRIVMSG").source_type(sourceinfo::RawIrc),
                           &BotCommandHandler::handle_privmsg);
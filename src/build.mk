@@ -1,12 +1,15 @@
 EXECUTABLES = eir
 
-eir_SOURCES = bot.cpp \
+eir_SOURCES = arena.cpp \
+	    bot.cpp \
 	    bot_command.cpp \
 	    capability.cpp \
 	    client.cpp \
 	    command.cpp \
+	    connector.cpp \
 	    event.cpp \
 	    exceptions.cpp \
+	    handoff.cpp \
 	    logger.cpp \
 	    main.cpp \
 	    match.cpp \
@@ -14,14 +17,18 @@ eir_SOURCES = bot.cpp \
 	    modload.cpp \
 	    modules.cpp \
 	    privilege.cpp \
+	    privilege_index.cpp \
+	    reactor.cpp \
 	    server.cpp \
 	    settings.cpp \
 	    storage.cpp \
 	    string_util.cpp \
 	    supported.cpp \
+	    trace.cpp \
 	    value.cpp \
+	    worker_pool.cpp \
 
-eir_LDFLAGS = -Wl,-export-dynamic -Wl,-rpath,$(LIBDIR)
+eir_LDFLAGS = -pthread -Wl,-export-dynamic -Wl,-rpath,$(LIBDIR)
 ifeq ($(shell uname),FreeBSD)
     eir_LIBRARIES = paludis/util/paludisutil
 else
@@ -1,5 +1,6 @@
 #include "capability.h"
 #include "eir.h"
+#include "handoff.h"
 
 #include <paludis/util/private_implementation_pattern-impl.hh>
 #include <paludis/util/wrapped_forward_iterator-impl.hh>
@@ -129,6 +130,38 @@ void Capabilities::finish()
     }
 }
 
+Value Capabilities::save() const
+{
+    Value ret(Value::kvarray), available(Value::array), enabled(Value::array);
+    for (auto it = _imp->caps_available.begin(); it != _imp->caps_available.end(); ++it)
+        available.push_back(*it);
+    for (auto it = _imp->caps_enabled.begin(); it != _imp->caps_enabled.end(); ++it)
+        enabled.push_back(*it);
+    ret["available"] = available;
+    ret["enabled"] = enabled;
+    return ret;
+}
+
+void Capabilities::restore(const Value & state)
+{
+    const Value & available = Handoff::get(state, "available");
+    if (available.Type() == Value::array)
+        for (auto it = available.Array().begin(); it != available.Array().end(); ++it)
+            _imp->caps_available.insert(it->String());
+
+    const Value & enabled = Handoff::get(state, "enabled");
+    if (enabled.Type() != Value::array)
+        return;
+    for (auto it = enabled.Array().begin(); it != enabled.Array().end(); ++it)
+    {
+        _imp->caps_enabled.insert(it->String());
+
+        Message cap_enabled(_imp->_bot, "cap_enabled", sourceinfo::Internal);
+        cap_enabled.args.push_back(it->String());
+        CommandRegistry::get_instance()->dispatch(&cap_enabled);
+    }
+}
+
 Capabilities::iterator Capabilities::begin_available() const
 {
     return _imp->caps_available.begin();
@@ -6,6 +6,8 @@
 #include <paludis/util/wrapped_forward_iterator.hh>
 #include <string>
 
+#include "value.h"
+
 namespace eir
 {
     class Bot;
@@ -35,6 +37,12 @@ namespace eir
             void hold();
             void finish();
 
+            // What's available and enabled, and taking them back without
+            // negotiating, for carrying them across a restart. Restoring
+            // announces each enabled cap as negotiating it would.
+            Value save() const;
+            void restore(const Value &);
+
             Capabilities(Bot * b);
             ~Capabilities();
     };
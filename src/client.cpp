@@ -11,6 +11,7 @@
 #include <paludis/util/private_implementation_pattern-impl.hh>
 
 #include "string_util.h"
+#include "flat_map.h"
 
 using namespace eir;
 
@@ -19,18 +20,77 @@ template class paludis::WrappedForwardIterator<eir::Channel::MemberIteratorTag,
 template class paludis::WrappedForwardIterator<eir::Client::AttributeIteratorTag, std::pair<const std::string, eir::Value> >;
 template class paludis::WrappedForwardIterator<eir::Channel::AttributeIteratorTag, std::pair<const std::string, eir::Value> >;
 
+namespace
+{
+    typedef cistring::flat_map<Membership *> MembershipIndex;
+
+    const Membership::ptr no_membership;
+
+    // Walks a client's channel list, which owns its memberships, so each
+    // step can hand out a reference to the owning pointer directly.
+    struct ClientListIterator
+    {
+        typedef std::forward_iterator_tag iterator_category;
+        typedef const Membership::ptr value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const Membership::ptr * pointer;
+        typedef const Membership::ptr & reference;
+
+        const Membership::ptr *slot;
+
+        ClientListIterator(const Membership::ptr *s) : slot(s) { }
+
+        reference operator* () const { return *slot; }
+        pointer operator-> () const { return slot; }
+        ClientListIterator & operator++ () { slot = &(*slot)->next_in_client; return *this; }
+        bool operator== (const ClientListIterator & o) const { return slot->get() == o.slot->get(); }
+        bool operator!= (const ClientListIterator & o) const { return ! (*this == o); }
+    };
+
+    // Walks a channel's member list. The owning pointer for each membership
+    // is found through its place in the client list.
+    struct ChannelListIterator
+    {
+        typedef std::forward_iterator_tag iterator_category;
+        typedef const Membership::ptr value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const Membership::ptr * pointer;
+        typedef const Membership::ptr & reference;
+
+        Membership *current;
+
+        ChannelListIterator(Membership *m) : current(m) { }
+
+        reference operator* () const { return *current->client_slot; }
+        pointer operator-> () const { return current->client_slot; }
+        ChannelListIterator & operator++ () { current = current->next_in_channel; return *this; }
+        bool operator== (const ChannelListIterator & o) const { return current == o.current; }
+        bool operator!= (const ChannelListIterator & o) const { return current != o.current; }
+    };
+
+    StateArenaPtr arena_for(Bot *b)
+    {
+        return b ? b->arena() : StateArenaPtr();
+    }
+}
+
 namespace paludis
 {
     template <>
-    struct Implementation<Client>
+    struct Implementation<Client> : public ArenaAllocated
     {
         Bot *bot;
 
+        StateArenaPtr arena;
+        StateArena::Handle handle;
+
         std::string nick, user, host, account;
 
         std::map<std::string, Value> attributes;
 
-        std::map<std::string, Membership::ptr> channels;
+        // Owning head of the list of memberships, and an index into it.
+        Membership::ptr first_channel;
+        MembershipIndex channels;
 
         PrivilegeSet privs;
 
@@ -38,7 +98,7 @@ namespace paludis
         mutable bool nuh_cached;
 
         Implementation(Bot *b, std::string n, std::string u, std::string h)
-            : bot(b), nick(n), user(u), host(h), nuh_cached(false)
+            : bot(b), arena(arena_for(b)), handle(0), nick(n), user(u), host(h), nuh_cached(false)
         { }
     };
 }
@@ -48,6 +108,8 @@ const std::string& Client::user() const { return _imp->user; }
 const std::string& Client::host() const { return _imp->host; }
 const std::string& Client::account() const { return _imp->account; }
 
+Bot *Client::bot() const { return _imp->bot; }
+
 const std::string& Client::nuh() const
 {
     if(_imp->nuh_cached)
@@ -61,27 +123,28 @@ const std::string& Client::nuh() const
 
 void Client::change_nick(std::string newnick)
 {
-    // The correct logic for this is somewhat non-trivial, due to the various
-    // objects that index client objects by nickname. These all need to be
-    // properly updated.
-    //
-    // So, three stages. Remove the old nickname from all such indices, then
-    // change the nickname, then re-add the new nickname.
-    for (auto it = _imp->channels.begin(); it != _imp->channels.end(); ++it)
-        it->second->channel->remove_member(it->second);
-
-    _imp->bot->remove_client(shared_from_this());
+    // The bot and each of our channels index us by nickname. Re-key those
+    // in place; removing and re-adding the client would look to everything
+    // else like one client leaving and a new one arriving.
+    std::string oldnick = _imp->nick;
 
     _imp->nick = newnick;
     _imp->nuh_cached = false;
 
-    _imp->bot->add_client(shared_from_this());
+    // The bot first, since it throws out any stale client that still has
+    // the new nick, and with it that client's place in our channels.
+    _imp->bot->rename_client(shared_from_this(), oldnick);
 
     for (auto it = _imp->channels.begin(); it != _imp->channels.end(); ++it)
-        it->second->channel->add_member(it->second);
+        it->second->channel->rename_member(oldnick, *it->second->client_slot);
+
+    Message m(_imp->bot, "nick_changed", sourceinfo::Internal, shared_from_this());
+    m.args.push_back(oldnick);
+    m.args.push_back(newnick);
+    CommandRegistry::get_instance()->dispatch(&m);
 }
 
-void Client::set_account(std::string accountname)
+void Client::set_account(std::string accountname, bool recalculate)
 {
     // Protocol uses * to mean "no account name", so blank it out if that is found
     if (accountname == "*")
@@ -92,7 +155,29 @@ void Client::set_account(std::string accountname)
         return;
 
     _imp->account = accountname;
-    dispatch_internal_message(_imp->bot, "recalculate_privileges");
+
+    // Only this client's privileges can have changed.
+    if (recalculate)
+    {
+        Message m(_imp->bot, "recalculate_client_privileges", sourceinfo::Internal, shared_from_this());
+        CommandRegistry::get_instance()->dispatch(&m);
+    }
+}
+
+void Client::change_host(std::string newuser, std::string newhost, bool recalculate)
+{
+    if (newuser == _imp->user && newhost == _imp->host)
+        return;
+
+    _imp->user = newuser;
+    _imp->host = newhost;
+    _imp->nuh_cached = false;
+
+    if (recalculate)
+    {
+        Message m(_imp->bot, "recalculate_client_privileges", sourceinfo::Internal, shared_from_this());
+        CommandRegistry::get_instance()->dispatch(&m);
+    }
 }
 
 Client::AttributeIterator Client::attr_begin()
@@ -117,46 +202,60 @@ void Client::set_attr(const std::string &name, const Value &value)
 
 Client::ChannelIterator Client::begin_channels()
 {
-    return second_iterator(_imp->channels.begin());
+    return ClientListIterator(&_imp->first_channel);
 }
 
 Client::ChannelIterator Client::end_channels()
 {
-    return second_iterator(_imp->channels.end());
+    return ClientListIterator(&no_membership);
 }
 
 Membership::ptr Client::find_membership(std::string chname)
 {
-    std::map<std::string, Membership::ptr>::iterator it = _imp->channels.find(chname);
+    MembershipIndex::iterator it = _imp->channels.find(chname);
     if (it == _imp->channels.end())
         return Membership::ptr();
-    return it->second;
+    return *it->second->client_slot;
 }
 
 Client::ChannelIterator Client::find_membership_it(std::string chname)
 {
-    return second_iterator(_imp->channels.find(chname));
+    MembershipIndex::iterator it = _imp->channels.find(chname);
+    if (it == _imp->channels.end())
+        return end_channels();
+    return ClientListIterator(it->second->client_slot);
 }
 
 Membership::ptr Client::join_chan(Channel::ptr c)
 {
-    Context ctx("Adding client " + _imp->nick + " to channel " + c->name());
+    LazyContext ctx("Adding client ", _imp->nick, " to channel ", c->name());
     Membership::ptr m;
 
     if (m = find_membership(c->name()))
         return m;
 
-    m.reset(new Membership(shared_from_this(), c));
+    if (_imp->arena)
+        m = std::allocate_shared<Membership>(ArenaAllocator<Membership>(_imp->arena), this, c.get());
+    else
+        m = std::make_shared<Membership>(this, c.get());
 
     if(c->add_member(m))
-        _imp->channels.insert(make_pair(c->name(), m));
+    {
+        if (_imp->first_channel)
+            _imp->first_channel->client_slot = &m->next_in_client;
+        m->next_in_client = _imp->first_channel;
+        m->client_slot = &_imp->first_channel;
+        _imp->first_channel = m;
+
+        _imp->channels.insert(c->name(), m.get());
+    }
 
     return m;
 }
 
 void Client::leave_chan(Channel::ptr c)
 {
-    Context ctx("Removing client " + _imp->nick + "from channel " + c->name());
+    LazyContext ctx("Removing client ", _imp->nick, " from channel ", c->name());
     Membership::ptr m = find_membership(c->name());
     if (m)
         leave_chan(m);
@@ -169,6 +268,23 @@ void Client::leave_chan(Membership::ptr m)
 
     m->channel->remove_member(m);
     _imp->channels.erase(m->channel->name());
+
+    if (!m->client_slot)
+        return;
+
+    // This may drop the last reference other than the caller's.
+    Membership::ptr *slot = m->client_slot;
+    Membership::ptr next = std::move(m->next_in_client);
+    if (next)
+        next->client_slot = slot;
+    m->client_slot = 0;
+    *slot = std::move(next);
+}
+
+void Client::leave_all_chans()
+{
+    while (Membership::ptr m = _imp->first_channel)
+        leave_chan(m);
 }
 
 PrivilegeSet& Client::privs()
@@ -176,13 +292,38 @@ PrivilegeSet& Client::privs()
     return _imp->privs;
 }
 
+Client::ptr Client::create(Bot *b, std::string n, std::string u, std::string h)
+{
+    if (!b)
+        return std::make_shared<Client>(b, n, u, h);
+    return std::allocate_shared<Client>(ArenaAllocator<Client>(b->arena()), b, n, u, h);
+}
+
 Client::Client(Bot *b, std::string n, std::string u, std::string h)
-    : paludis::PrivateImplementationPattern<Client>(new paludis::Implementation<Client>(b, n, u, h))
+    : paludis::PrivateImplementationPattern<Client>(new (arena_for(b)) paludis::Implementation<Client>(b, n, u, h))
 {
+    if (_imp->arena)
+        _imp->handle = _imp->arena->add_client(this);
 }
 
 Client::~Client()
 {
+    // Anyone still holding a membership finds it detached, rather than
+    // pointing at us.
+    while (Membership::ptr m = _imp->first_channel)
+    {
+        leave_chan(m);
+        m->client = 0;
+        m->channel = 0;
+    }
+
+    if (_imp->arena)
+        _imp->arena->remove_client(_imp->handle);
+}
+
+StateArena::Handle Client::handle() const
+{
+    return _imp->handle;
 }
 
 namespace
@@ -199,16 +340,21 @@ namespace
 namespace paludis
 {
     template <>
-    struct Implementation<Channel>
+    struct Implementation<Channel> : public ArenaAllocated
     {
         std::string name;
 
+        StateArenaPtr arena;
+        StateArena::Handle handle;
+
         std::map<std::string, Value> attributes;
 
-        typedef std::map<std::string, Membership::ptr>::iterator MemberIterator;
-        std::map<std::string, Membership::ptr> members;
+        // Head of the (non-owning) member list, and an index into it.
+        Membership *first_member;
+        MembershipIndex members;
 
-        Implementation(std::string n) : name(n)
+        Implementation(Bot *b, std::string n)
+            : name(n), arena(arena_for(b)), handle(0), first_member(0)
         { }
     };
 }
@@ -220,35 +366,90 @@ const std::string& Channel::name()
 
 Channel::MemberIterator Channel::begin_members()
 {
-    return second_iterator(_imp->members.begin());
+    return ChannelListIterator(_imp->first_member);
 }
 
 Channel::MemberIterator Channel::end_members()
 {
-    return second_iterator(_imp->members.end());
+    return ChannelListIterator(0);
 }
 
 Channel::MemberIterator Channel::find_member_it(std::string nick)
 {
-    return second_iterator(_imp->members.find(nick));
+    MembershipIndex::iterator it = _imp->members.find(nick);
+    return ChannelListIterator(it == _imp->members.end() ? 0 : it->second);
 }
 
 MembershipPtr Channel::find_member(std::string nick)
 {
-    std::map<std::string, Membership::ptr>::iterator it = _imp->members.find(nick);
-    if (it == _imp->members.end())
+    MembershipIndex::iterator it = _imp->members.find(nick);
+    if (it == _imp->members.end() || !it->second->client_slot)
         return Membership::ptr();
-    return it->second;
+    return *it->second->client_slot;
 }
 
 bool Channel::add_member(Membership::ptr m)
 {
-    return _imp->members.insert(std::make_pair(m->client->nick(), m)).second;
+    if (!_imp->members.insert(m->client->nick(), m.get()).second)
+        return false;
+
+    if (_imp->first_member)
+        _imp->first_member->channel_slot = &m->next_in_channel;
+    m->next_in_channel = _imp->first_member;
+    m->channel_slot = &_imp->first_member;
+    _imp->first_member = m.get();
+    return true;
 }
 
 bool Channel::remove_member(Membership::ptr m)
 {
-    return _imp->members.erase(m->client->nick()) != 0;
+    // The list, not the index, says whether it's a member.
+    if (!m->channel_slot)
+        return false;
+
+    MembershipIndex::iterator it = _imp->members.find(m->client->nick());
+    if (it != _imp->members.end() && it->second == m.get())
+        _imp->members.erase(it);
+
+    if (m->next_in_channel)
+        m->next_in_channel->channel_slot = m->channel_slot;
+    *m->channel_slot = m->next_in_channel;
+    m->next_in_channel = 0;
+    m->channel_slot = 0;
+    return true;
+}
+
+std::size_t Channel::member_count() const
+{
+    return _imp->members.size();
+}
+
+void Channel::reserve_members(std::size_t n)
+{
+    _imp->members.reserve(n);
+}
+
+bool Channel::rename_member(std::string oldnick, Membership::ptr m)
+{
+    MembershipIndex::iterator it = _imp->members.find(oldnick);
+    if (it == _imp->members.end() || it->second != m.get())
+        return false;
+    _imp->members.erase(it);
+
+    // Our own place in the member list is unaffected; only the index
+    // changes. Nicks are unique, so whatever else is filed under the new one
+    // is stale, and leaves the channel so the list and index still agree.
+    it = _imp->members.find(m->client->nick());
+    if (it != _imp->members.end() && it->second != m.get() && it->second->client_slot)
+    {
+        Membership::ptr stale = *it->second->client_slot;
+        stale->client->leave_chan(stale);
+    }
+
+    std::pair<MembershipIndex::iterator, bool> res = _imp->members.insert(m->client->nick(), m.get());
+    if (!res.second)
+        res.first->second = m.get();
+    return true;
 }
 
 Channel::AttributeIterator Channel::attr_begin()
@@ -271,11 +472,87 @@ void Channel::set_attr(const std::string &name, const Value &value)
     _imp->attributes[name] = value;
 }
 
+Channel::ptr Channel::create(Bot *b, std::string n)
+{
+    if (!b)
+        return std::make_shared<Channel>(n);
+    return std::allocate_shared<Channel>(ArenaAllocator<Channel>(b->arena()), b, n);
+}
+
+Channel::Channel(Bot *b, std::string n)
+    : paludis::PrivateImplementationPattern<Channel>(new (arena_for(b)) paludis::Implementation<Channel>(b, n))
+{
+    if (_imp->arena)
+        _imp->handle = _imp->arena->add_channel(this);
+}
+
 Channel::Channel(std::string n)
-    : paludis::PrivateImplementationPattern<Channel>(new paludis::Implementation<Channel>(n))
+    : paludis::PrivateImplementationPattern<Channel>(new paludis::Implementation<Channel>(0, n))
 {
 }
 
 Channel::~Channel()
 {
+    // Memberships belong to their clients, so detach them from there.
+    while (_imp->first_member)
+    {
+        Membership::ptr m = *_imp->first_member->client_slot;
+        m->client->leave_chan(m);
+        m->client = 0;
+        m->channel = 0;
+    }
+
+    if (_imp->arena)
+        _imp->arena->remove_channel(_imp->handle);
+}
+
+StateArena::Handle Channel::handle() const
+{
+    return _imp->handle;
+}
+
+namespace
+{
+    int mode_bit(const Membership *m, char mode)
+    {
+        Bot *b = m->client ? m->client->bot() : 0;
+        if (!b)
+            return -1;
+        int i = b->supported()->prefix_mode_index(mode);
+        return i < 32 ? i : -1;
+    }
+}
+
+bool Membership::has_mode(char m) const
+{
+    int i = mode_bit(this, m);
+    return i >= 0 && (mode_bits & (1u << i));
+}
+
+void Membership::add_mode(char m)
+{
+    int i = mode_bit(this, m);
+    if (i >= 0)
+        mode_bits |= 1u << i;
+}
+
+void Membership::remove_mode(char m)
+{
+    int i = mode_bit(this, m);
+    if (i >= 0)
+        mode_bits &= ~(1u << i);
+}
+
+std::string Membership::modes() const
+{
+    std::string ret;
+    Bot *b = client ? client->bot() : 0;
+    if (!b || !mode_bits)
+        return ret;
+
+    std::string prefix_modes = b->supported()->prefix_modes();
+    for (std::string::size_type i = 0; i < prefix_modes.size() && i < 32; ++i)
+        if (mode_bits & (1u << i))
+            ret += prefix_modes[i];
+    return ret;
 }
@@ -3,6 +3,7 @@
 
 #include "privilege.h"
 #include "value.h"
+#include "arena.h"
 
 #include <string>
 #include <memory>
@@ -31,8 +32,14 @@ namespace eir
         const std::string& nuh() const;
         const std::string& account() const;
 
+        Bot *bot() const;
+
         void change_nick(std::string newnick);
-        void set_account(std::string accountname);
+        // Pass recalculate = false to leave recalculating privileges to the
+        // caller, e.g. when setting up a client before adding it to the bot.
+        void set_account(std::string accountname, bool recalculate = true);
+        // Likewise for a new user@host, such as one found on reconnecting.
+        void change_host(std::string newuser, std::string newhost, bool recalculate = true);
 
         struct AttributeIteratorTag;
         typedef paludis::WrappedForwardIterator<AttributeIteratorTag,
@@ -44,12 +51,20 @@ namespace eir
         Value attr(const std::string &);
         void set_attr(const std::string &, const Value &);
 
+        // Clients created this way live in the bot's state arena and are
+        // given a handle; plain construction is still supported.
+        static std::shared_ptr<Client> create(Bot *, std::string, std::string, std::string);
         Client(Bot *, std::string, std::string, std::string);
         ~Client();
 
+        StateArena::Handle handle() const;
+
         MembershipPtr join_chan(ChannelPtr);
         void leave_chan(ChannelPtr);
         void leave_chan(MembershipPtr);
+        // Leaving channels while walking begin_channels() isn't safe; this
+        // is the way to leave them all.
+        void leave_all_chans();
 
         struct ChannelIteratorTag;
         typedef paludis::WrappedForwardIterator<ChannelIteratorTag, const MembershipPtr> ChannelIterator;
@@ -79,6 +94,11 @@ namespace eir
 
         bool add_member(MembershipPtr);
         bool remove_member(MembershipPtr);
+        bool rename_member(std::string oldnick, MembershipPtr);
+
+        std::size_t member_count() const;
+        // Sizes the member index for the given number of members.
+        void reserve_members(std::size_t);
 
         struct AttributeIteratorTag;
         typedef paludis::WrappedForwardIterator<AttributeIteratorTag,
@@ -90,26 +110,72 @@ namespace eir
         Value attr(const std::string &);
         void set_attr(const std::string &, const Value &);
 
+        static std::shared_ptr<Channel> create(Bot *, std::string);
+        Channel(Bot *, std::string);
         Channel(std::string);
         ~Channel();
 
+        StateArena::Handle handle() const;
+
         typedef std::shared_ptr<Channel> ptr;
     };
 
+    /*
+     * Non-owning pointer to one end of a Membership. Clients and channels own
+     * their memberships rather than the other way round; this behaves enough
+     * like the shared_ptr it replaced that existing users don't need to care.
+     */
+    template <typename T_>
+    class StateRef
+    {
+        private:
+            T_ *_p;
+
+        public:
+            StateRef(T_ *p = 0) : _p(p) { }
+
+            T_ *get() const { return _p; }
+            T_ *operator-> () const { return _p; }
+            T_ & operator* () const { return *_p; }
+            explicit operator bool () const { return _p != 0; }
+
+            operator std::shared_ptr<T_> () const
+            {
+                return _p ? _p->shared_from_this() : std::shared_ptr<T_>();
+            }
+
+            bool operator== (const std::shared_ptr<T_> & o) const { return _p == o.get(); }
+            bool operator!= (const std::shared_ptr<T_> & o) const { return _p != o.get(); }
+    };
+
     struct Membership : private paludis::InstantiationPolicy<Membership, paludis::instantiation_method::NonCopyableTag>
     {
-        Client::ptr client;
-        Channel::ptr channel;
+        StateRef<Client> client;
+        StateRef<Channel> channel;
 
-        std::string modes;
+        // Prefix modes (op, voice, ...) held in the channel, one bit for
+        // each mode in the order the server's PREFIX token lists them,
+        // remapped if that changes.
+        uint32_t mode_bits;
 
-        bool has_mode(char m) { return modes.find(m) != std::string::npos; }
+        bool has_mode(char m) const;
+        void add_mode(char m);
+        void remove_mode(char m);
+        std::string modes() const;
 
         typedef std::shared_ptr<Membership> ptr;
 
-        Membership(Client::ptr cl, Channel::ptr ch)
-            : client(cl), channel(ch)
+        Membership(Client *cl, Channel *ch)
+            : client(cl), channel(ch), mode_bits(0), client_slot(0), next_in_channel(0), channel_slot(0)
         { }
+
+        // Intrusive list links, maintained by Client and Channel. Each
+        // membership is owned by the slot in its client's list that points
+        // to it; the channel's list is not owning.
+        ptr next_in_client;
+        ptr *client_slot;
+        Membership *next_in_channel;
+        Membership **channel_slot;
     };
 }
 
@@ -1,13 +1,19 @@
 #include "command.h"
+#include "bot.h"
 #include "exceptions.h"
 #include "logger.h"
+#include "reactor.h"
 #include "string_util.h"
+#include "trace.h"
+#include "worker_pool.h"
 
 #include <paludis/util/instantiation_policy-impl.hh>
 #include <paludis/util/private_implementation_pattern-impl.hh>
 #include <cstring>
 #include <map>
 #include <stdint.h>
+#include <mutex>
+#include <condition_variable>
 
 using namespace eir;
 using namespace paludis;
@@ -16,15 +22,181 @@ template class paludis::InstantiationPolicy<CommandRegistry, paludis::instantiat
 
 namespace
 {
+    // Calls of an async handler running on the worker pool, so that
+    // removing it can wait for them.
+    struct AsyncCalls
+    {
+        std::mutex lock;
+        std::condition_variable idle;
+        int running;
+        WorkerPool::Token token;
+
+        AsyncCalls() : running(0), token(WorkerPool::new_token()) { }
+
+        bool begin()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!*token)
+                return false;
+            ++running;
+            return true;
+        }
+
+        void finished()
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (--running == 0)
+                idle.notify_all();
+        }
+
+        void stop()
+        {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                *token = false;
+                idle.wait(guard, [this] () { return running == 0; });
+            }
+            WorkerPool::get_instance()->cancel(token);
+        }
+    };
+
     struct HandlerMapEntry {
         CommandRegistry::id id;
         Filter filter;
         CommandRegistry::handler handler;
         bool quiet;
-        HandlerMapEntry(CommandRegistry::id i, Filter f, CommandRegistry::handler h, bool q)
-            : id(i), filter(f), handler(h), quiet(q)
+        std::string owner;
+        std::shared_ptr<AsyncCalls> async;
+        HandlerMapEntry(CommandRegistry::id i, Filter f, CommandRegistry::handler h, bool q, std::string o)
+            : id(i), filter(f), handler(h), quiet(q), owner(o)
         { }
     };
+
+    void report_error(const SourcePtr & source, Bot *bot, bool quiet, const std::string & command,
+                      const std::string & message, const std::string & what)
+    {
+        if (!quiet)
+            source->error("I have suffered a terrible failure. (" + message + ") (" + what + ")");
+        Logger::get_instance()->Log(bot, source->client, Logger::Warning,
+                "Error processing message " + command + ": " + message + " (" + what + ")");
+    }
+
+    // A copy of a client that's no part of any bot's state, so that a worker
+    // can read it while the reactor changes the original. It has no bot and
+    // no channels.
+    Client::ptr detached_client(const Client::ptr & c)
+    {
+        if (!c)
+            return c;
+
+        Client::ptr copy = std::make_shared<Client>(static_cast<Bot *>(0), c->nick(), c->user(), c->host());
+        copy->set_account(c->account(), false);
+        for (Client::AttributeIterator it = c->attr_begin(); it != c->attr_end(); ++it)
+            copy->set_attr(it->first, unserialise(serialise(it->second)));
+        for (PrivilegeSet::iterator it = c->privs().begin(); it != c->privs().end(); ++it)
+        {
+            if (it->first.empty())
+                copy->privs().add_privilege(it->second);
+            else
+                copy->privs().add_privilege(it->first, it->second);
+        }
+        return copy;
+    }
+
+    // Replies from a worker thread are sent from the reactor that ran the
+    // command. The copy still holds the original source, so is let go of
+    // there too, wherever its last user drops it.
+    SourcePtr async_source(const SourcePtr & source)
+    {
+        Reactor *origin = Reactor::current();
+        std::shared_ptr<sourceinfo> copy(new sourceinfo(*source), [origin] (sourceinfo *s) {
+            if (!origin || Reactor::current() == origin)
+                delete s;
+            else
+                origin->post([s] () { delete s; });
+        });
+        copy->client = detached_client(source->client);
+        copy->reply_func = [source] (std::string text) {
+            WorkerPool::get_instance()->complete([source, text] () { source->reply(text); });
+        };
+        copy->error_func = [source] (std::string text) {
+            WorkerPool::get_instance()->complete([source, text] () { source->error(text); });
+        };
+        return copy;
+    }
+
+    void dispatch_async(const HandlerMapEntry & he, const Message *m)
+    {
+        std::shared_ptr<Message> copy = std::make_shared<Message>(*m);
+        copy->source = async_source(m->source);
+
+        if (m->batch)
+        {
+            std::map<Client *, Client::ptr> detached;
+            std::shared_ptr<std::vector<Message> > batch = std::make_shared<std::vector<Message> >(*m->batch);
+            for (std::vector<Message>::iterator it = batch->begin(); it != batch->end(); ++it)
+            {
+                Client::ptr & c = detached[it->source->client.get()];
+                if (!c)
+                    c = detached_client(it->source->client);
+                it->rebind_client(c);
+            }
+            copy->batch = batch;
+        }
+
+        std::shared_ptr<AsyncCalls> calls = he.async;
+        CommandRegistry::handler handler = he.handler;
+        std::string owner = he.owner;
+        bool quiet = he.quiet;
+
+        WorkerPool::get_instance()->submit([calls, handler, owner, quiet, copy] () mutable {
+            if (!calls->begin())
+                return;
+
+            {
+                TraceOwner trace_owner(owner.c_str());
+                TraceSpan span("async_handler", copy->command, copy->bot);
+                span.arg("owner", owner);
+
+                try
+                {
+                    handler(copy.get());
+                }
+                catch (eir::Exception &)
+                {
+                    // Rethrown on the reactor's thread, where a fatal one can
+                    // end the loop as it would from an ordinary handler.
+                    std::exception_ptr error = std::current_exception();
+                    WorkerPool::get_instance()->complete([copy, quiet, error] () {
+                        try
+                        {
+                            std::rethrow_exception(error);
+                        }
+                        catch (eir::Exception & e)
+                        {
+                            if (e.fatal())
+                                throw;
+                            report_error(copy->source, copy->bot, quiet, copy->command, e.message(), e.what());
+                        }
+                    });
+                }
+                catch (std::exception & e)
+                {
+                    std::string what = e.what();
+                    WorkerPool::get_instance()->complete([copy, what] () {
+                        copy->source->error("I have suffered a terrible failure. (" + what + ")");
+                        Logger::get_instance()->Log(copy->bot, copy->source->client, Logger::Warning,
+                                "Unknown error processing message " + copy->command + ": " + what);
+                    });
+                }
+            }
+
+            // The handler may be code from a module that's unloaded as soon as
+            // this call is finished.
+            handler = CommandRegistry::handler();
+            calls->finished();
+        }, calls->token);
+    }
 }
 
 namespace paludis
@@ -43,6 +215,16 @@ namespace paludis
         {
             if (he.filter.match(m))
             {
+                if (he.async)
+                {
+                    dispatch_async(he, m);
+                    return;
+                }
+
+                TraceOwner owner(he.owner.c_str());
+                TraceSpan span("handler", m->command, m->bot);
+                span.arg("owner", he.owner);
+
                 try
                 {
                     he.handler(m);
@@ -52,18 +234,14 @@ namespace paludis
                     if (e.fatal() || fatal_errors)
                         throw;
 
-                    if (!(he.quiet))
-                        m->source.error("I have suffered a terrible failure. (" + e.message() + ") (" + e.what() + ")");
-
-                    Logger::get_instance()->Log(m->bot, m->source.client, Logger::Warning,
-                            "Error processing message " + m->command + ": " + e.message() + " (" + e.what() + ")");
+                    report_error(m->source, m->bot, he.quiet, m->command, e.message(), e.what());
                 }
                 catch (std::exception &e)
                 {
                     if (fatal_errors)
                         throw;
-                    m->source.error(std::string("I have suffered a terrible failure. (") + e.what() + ")");
-                    Logger::get_instance()->Log(m->bot, m->source.client, Logger::Warning,
+                    m->source->error(std::string("I have suffered a terrible failure. (") + e.what() + ")");
+                    Logger::get_instance()->Log(m->bot, m->source->client, Logger::Warning,
                             "Unknown error processing message " + m->command + ": " + e.what());
                 }
             }
@@ -82,6 +260,26 @@ CommandRegistry::~CommandRegistry()
 
 void CommandRegistry::dispatch(const Message *m, bool fatal_errors)
 {
+    bool wants_exclusive = m->source_type & ~(sourceinfo::RawIrc | sourceinfo::Internal);
+
+    // A command seen part way through a pass waits for the end of it, so
+    // that the other reactors are stopped between lines rather than in the
+    // middle of handling one.
+    if (wants_exclusive && Reactor::count() > 1 && Reactor::in_pass())
+    {
+        Message copy(*m);
+        Bot *bot = m->bot;
+        std::string botname = bot ? bot->name() : "";
+        Reactor::current()->post_exclusive([copy, bot, botname, fatal_errors] () {
+            if (bot && BotManager::get_instance()->find(botname) != bot)
+                return;
+            CommandRegistry::get_instance()->dispatch(&copy, fatal_errors);
+        });
+        return;
+    }
+
+    ExclusiveSection exclusive(wants_exclusive);
+
     for (int i=0; i < 3; ++i)
     {
         auto range = _imp->_handlers[i].equal_range("");
@@ -98,21 +296,46 @@ void CommandRegistry::dispatch(const Message *m, bool fatal_errors)
     }
 }
 
+bool CommandRegistry::has_handlers(std::string command) const
+{
+    command = lowercase(command);
+    for (int i=0; i < 3; ++i)
+        if (_imp->_handlers[i].find(command) != _imp->_handlers[i].end()
+                || _imp->_handlers[i].find("") != _imp->_handlers[i].end())
+            return true;
+    return false;
+}
+
 CommandRegistry::id CommandRegistry::add_handler(Filter f, const CommandRegistry::handler & h, bool quiet_errors, Message::Order order)
 {
     static uintptr_t next_id = 1;
 
-    Context ctx("Registering new handler");
+    LazyContext ctx("Registering new handler");
+    ExclusiveSection exclusive;
 
     next_id++;
 
     _imp->_handlers[order].insert(std::make_pair(lowercase(f.command()),
-                                    HandlerMapEntry(CommandRegistry::id(next_id) ,f, h, quiet_errors)));
+                                    HandlerMapEntry(CommandRegistry::id(next_id) ,f, h, quiet_errors,
+                                                    TraceOwner::current())));
     return id(next_id);
 }
 
+CommandRegistry::id CommandRegistry::add_async_handler(Filter f, const CommandRegistry::handler & h, bool quiet_errors,
+                                                       Message::Order order)
+{
+    ExclusiveSection exclusive;
+    id i = add_handler(f, h, quiet_errors, order);
+    for (auto it = _imp->_handlers[order].begin(); it != _imp->_handlers[order].end(); ++it)
+        if (it->second.id == i)
+            it->second.async = std::make_shared<AsyncCalls>();
+    return i;
+}
+
 void CommandRegistry::remove_handler(id h)
 {
+    ExclusiveSection exclusive;
+
     for (int i=0; i < 3; ++i)
     {
         for (Implementation<CommandRegistry>::HandlerMap::iterator it = _imp->_handlers[i].begin();
@@ -120,6 +343,8 @@ void CommandRegistry::remove_handler(id h)
         {
             if (it->second.id == h)
             {
+                if (it->second.async)
+                    it->second.async->stop();
                 _imp->_handlers[i].erase(it);
                 break;
             }
@@ -9,6 +9,15 @@
 
 namespace eir
 {
+    /*
+     * Handlers may be added and removed from any reactor's thread. Raw and
+     * internal messages are dispatched on their bot's reactor without
+     * stopping the others, so handlers for them keep whatever they share
+     * between bots under a SharedLock. Commands and config lines, which may
+     * change anything, are dispatched in an ExclusiveSection; one that turns
+     * up part way through a pass of a reactor's loop is dispatched from a
+     * copy at the end of it.
+     */
     class CommandRegistry :
         public paludis::InstantiationPolicy<CommandRegistry, paludis::instantiation_method::SingletonTag>,
         public paludis::PrivateImplementationPattern<CommandRegistry>
@@ -19,7 +28,20 @@ namespace eir
 
             void dispatch(const Message *, bool = false);
 
+            // Whether anything would see this command, counting handlers
+            // that see every message.
+            bool has_handlers(std::string command) const;
+
             id add_handler(Filter, const handler &, bool = false, Message::Order = Message::normal);
+
+            // For handlers that are safe to run off the main thread. Each one
+            // gets its own copy of the message on the worker pool, and must
+            // send, reply or change shared state only through the source's
+            // reply functions or WorkerPool::complete(). The clients in the
+            // copy are detached copies too, with no bot or channels. Removing
+            // one waits for any calls still running.
+            id add_async_handler(Filter, const handler &, bool = false, Message::Order = Message::normal);
+
             void remove_handler(id);
 
             CommandRegistry();
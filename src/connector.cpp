@@ -0,0 +1,434 @@
+#include "connector.h"
+#include "exceptions.h"
+#include "event_internal.h"
+#include "logger.h"
+#include "reactor.h"
+#include "worker_pool.h"
+
+#include <paludis/util/private_implementation_pattern-impl.hh>
+#include <paludis/util/stringify.hh>
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+
+using namespace eir;
+using paludis::Implementation;
+
+namespace
+{
+    typedef std::chrono::steady_clock Clock;
+
+    struct Address
+    {
+        int family;
+        sockaddr_storage addr;
+        socklen_t len;
+        std::string text;
+    };
+    typedef std::vector<Address> AddressList;
+
+    // Runs on the worker pool.
+    std::string resolve(const std::string & host, const std::string & port, AddressList & out)
+    {
+        addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_ADDRCONFIG;
+
+        int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+        if (err != 0)
+            return err == EAI_SYSTEM ? strerror(errno) : gai_strerror(err);
+
+        for (addrinfo *ai = res; ai; ai = ai->ai_next)
+        {
+            Address a;
+            a.family = ai->ai_family;
+            a.len = ai->ai_addrlen;
+            memcpy(&a.addr, ai->ai_addr, ai->ai_addrlen);
+
+            char name[NI_MAXHOST];
+            if (getnameinfo(ai->ai_addr, ai->ai_addrlen, name, sizeof(name), 0, 0, NI_NUMERICHOST) != 0)
+                continue;
+            a.text = a.family == AF_INET6 ? "[" + std::string(name) + "]:" + port : std::string(name) + ":" + port;
+            out.push_back(a);
+        }
+        freeaddrinfo(res);
+
+        if (out.empty())
+            return "No usable addresses";
+        return "";
+    }
+
+    // Every bot's attempts go into this, whichever reactor they're on.
+    struct History
+    {
+        enum Outcome { connected, unknown, failed };
+        struct Record
+        {
+            Outcome outcome;
+            unsigned int ms;
+        };
+
+        std::mutex lock;
+        std::map<std::string, Record> records;
+
+        void record(const std::string & address, Outcome outcome, unsigned int ms)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            Record & r = records[address];
+            r.outcome = outcome;
+            r.ms = ms;
+        }
+
+        Record lookup(const std::string & address)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            std::map<std::string, Record>::iterator it = records.find(address);
+            if (it == records.end())
+            {
+                Record r = { unknown, 0 };
+                return r;
+            }
+            return it->second;
+        }
+    };
+
+    History history;
+
+    struct ByHistory
+    {
+        std::map<std::string, History::Record> records;
+
+        bool operator() (const Address & a, const Address & b)
+        {
+            const History::Record & ra = records[a.text], & rb = records[b.text];
+            if (ra.outcome != rb.outcome)
+                return ra.outcome < rb.outcome;
+            return ra.outcome == History::connected && ra.ms < rb.ms;
+        }
+    };
+
+    // Best first by what happened last time, keeping the resolver's order
+    // otherwise, then alternating between families starting with the best.
+    void order(AddressList & addrs)
+    {
+        ByHistory by_history;
+        for (AddressList::iterator it = addrs.begin(); it != addrs.end(); ++it)
+            by_history.records[it->text] = history.lookup(it->text);
+        std::stable_sort(addrs.begin(), addrs.end(), by_history);
+
+        if (addrs.empty())
+            return;
+
+        AddressList first, other, result;
+        for (AddressList::iterator it = addrs.begin(); it != addrs.end(); ++it)
+            (it->family == addrs.front().family ? first : other).push_back(*it);
+
+        for (std::size_t i = 0; i < first.size() || i < other.size(); ++i)
+        {
+            if (i < first.size())
+                result.push_back(first[i]);
+            if (i < other.size())
+                result.push_back(other[i]);
+        }
+        addrs.swap(result);
+    }
+
+    unsigned int since(Clock::time_point start)
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count();
+    }
+}
+
+namespace paludis
+{
+    template <>
+    struct Implementation<Connector>
+    {
+        // RFC 8305 suggests 250ms between attempts, but events only have
+        // whole seconds, so this is up to one.
+        enum { attempt_delay = 1 };
+
+        struct Attempt
+        {
+            int fd;
+            Reactor::SourceId source;
+            Address address;
+            Clock::time_point started;
+        };
+
+        Connector::ServerList servers;
+        std::size_t next_server;
+        std::string host, port;
+
+        AddressList addresses;
+        std::size_t next_address;
+        std::list<Attempt> attempts;
+        std::string last_error;
+        bool resolving;
+
+        int timeout;
+        EventManager::id attempt_id, timeout_id;
+
+        Connector::Connected connected;
+        Connector::Failed failed;
+        Bot *bot;
+
+        Reactor *reactor;
+        WorkerPool::Token token;
+
+        Implementation(const Connector::ServerList & s, int t, const Connector::Connected & c,
+                       const Connector::Failed & f, Bot *b)
+            : servers(s), next_server(0), next_address(0), resolving(false), timeout(t), attempt_id(0), timeout_id(0),
+              connected(c), failed(f), bot(b), reactor(Reactor::current()), token(WorkerPool::new_token())
+        {
+        }
+
+        void log(Logger::Type type, const std::string & text)
+        {
+            Logger::get_instance()->Log(bot, 0, type, text);
+        }
+
+        void next_host();
+        void resolved(const std::string & error, const AddressList & result);
+        void start_attempt();
+        void writable(int fd);
+        void attempt_due();
+        void timed_out();
+        void give_up(const std::string & reason);
+        void succeed(std::list<Attempt>::iterator);
+        void abandon(bool record);
+        void cancel_events();
+    };
+}
+
+void Implementation<Connector>::next_host()
+{
+    if (next_server >= servers.size())
+    {
+        Connector::Failed f = failed;
+        f(last_error);
+        return;
+    }
+
+    host = servers[next_server].first;
+    port = servers[next_server].second;
+    ++next_server;
+    resolving = true;
+
+    // The timeout covers looking the name up as well as connecting.
+    timeout_id = EventManager::get_instance()->add_event(time(NULL) + timeout,
+                        std::bind(&Implementation<Connector>::timed_out, this));
+
+    // The job mustn't touch this; only the completion, which is dropped if
+    // the Connector has gone or given up on this host by then, may.
+    Implementation<Connector> *self = this;
+    std::string h = host, p = port;
+    WorkerPool::get_instance()->submit([self, h, p] () {
+        AddressList result;
+        std::string error = resolve(h, p, result);
+        WorkerPool::get_instance()->complete([self, error, result] () {
+            self->resolved(error, result);
+        });
+    }, token);
+}
+
+void Implementation<Connector>::resolved(const std::string & error, const AddressList & result)
+{
+    resolving = false;
+    if (!error.empty())
+    {
+        last_error = "Couldn't resolve " + host + ": " + error;
+        if (next_server < servers.size())
+            log(Logger::Warning, last_error);
+        cancel_events();
+        next_host();
+        return;
+    }
+
+    addresses = result;
+    order(addresses);
+    next_address = 0;
+
+    start_attempt();
+}
+
+void Implementation<Connector>::start_attempt()
+{
+    if (attempt_id)
+        EventManager::get_instance()->remove_event(attempt_id);
+    attempt_id = 0;
+
+    while (next_address < addresses.size())
+    {
+        Attempt a;
+        a.source = 0;
+        a.address = addresses[next_address++];
+        a.started = Clock::now();
+
+        a.fd = socket(a.address.family, SOCK_STREAM, 0);
+        if (a.fd < 0)
+        {
+            last_error = a.address.text + ": " + strerror(errno);
+            continue;
+        }
+        fcntl(a.fd, F_SETFL, fcntl(a.fd, F_GETFL, 0) | O_NONBLOCK);
+        fcntl(a.fd, F_SETFD, FD_CLOEXEC);
+
+        log(Logger::Debug, "Trying " + host + " at " + a.address.text);
+
+        if (::connect(a.fd, reinterpret_cast<sockaddr *>(&a.address.addr), a.address.len) == 0)
+        {
+            attempts.push_back(a);
+            succeed(--attempts.end());
+            return;
+        }
+        if (errno != EINPROGRESS)
+        {
+            last_error = a.address.text + ": " + strerror(errno);
+            history.record(a.address.text, History::failed, since(a.started));
+            ::close(a.fd);
+            continue;
+        }
+
+        a.source = reactor->add_source(a.fd, std::bind(&Implementation<Connector>::writable, this, a.fd), true);
+        attempts.push_back(a);
+
+        if (next_address < addresses.size())
+            attempt_id = EventManager::get_instance()->add_event(time(NULL) + attempt_delay,
+                                std::bind(&Implementation<Connector>::attempt_due, this));
+        return;
+    }
+
+    if (attempts.empty())
+        give_up(last_error);
+}
+
+void Implementation<Connector>::writable(int fd)
+{
+    std::list<Attempt>::iterator it = attempts.begin();
+    while (it != attempts.end() && it->fd != fd)
+        ++it;
+    if (it == attempts.end())
+        return;
+
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+        error = errno;
+
+    if (error == 0)
+    {
+        succeed(it);
+        return;
+    }
+
+    last_error = it->address.text + ": " + strerror(error);
+    log(Logger::Debug, "Couldn't connect to " + host + " at " + last_error);
+    history.record(it->address.text, History::failed, since(it->started));
+    reactor->remove_source(it->source);
+    ::close(it->fd);
+    attempts.erase(it);
+
+    // Don't wait for the delay to try the next one.
+    start_attempt();
+}
+
+void Implementation<Connector>::attempt_due()
+{
+    attempt_id = 0;
+    start_attempt();
+}
+
+void Implementation<Connector>::timed_out()
+{
+    timeout_id = 0;
+    give_up("Timed out after " + paludis::stringify(timeout) + " seconds");
+}
+
+void Implementation<Connector>::give_up(const std::string & reason)
+{
+    last_error = "Couldn't connect to " + host + ": " + reason;
+    if (next_server < servers.size())
+        log(Logger::Warning, last_error);
+    if (resolving)
+    {
+        // Don't let this host's answer turn up while trying the next one.
+        WorkerPool::get_instance()->cancel(token);
+        token = WorkerPool::new_token();
+        resolving = false;
+    }
+    abandon(true);
+    cancel_events();
+    next_host();
+}
+
+void Implementation<Connector>::succeed(std::list<Attempt>::iterator it)
+{
+    unsigned int ms = since(it->started);
+    history.record(it->address.text, History::connected, ms);
+    log(Logger::Info, "Connected to " + host + " at " + it->address.text + " in "
+                      + paludis::stringify(ms) + "ms");
+
+    int fd = it->fd;
+    if (it->source)
+        reactor->remove_source(it->source);
+    attempts.erase(it);
+    abandon(false);
+    cancel_events();
+
+    // Last, since it may destroy us.
+    Connector::Connected f = connected;
+    f(fd, host, port);
+}
+
+void Implementation<Connector>::abandon(bool record)
+{
+    for (std::list<Attempt>::iterator it = attempts.begin(); it != attempts.end(); ++it)
+    {
+        if (record)
+            history.record(it->address.text, History::failed, since(it->started));
+        reactor->remove_source(it->source);
+        ::close(it->fd);
+    }
+    attempts.clear();
+}
+
+void Implementation<Connector>::cancel_events()
+{
+    if (attempt_id)
+        EventManager::get_instance()->remove_event(attempt_id);
+    if (timeout_id)
+        EventManager::get_instance()->remove_event(timeout_id);
+    attempt_id = timeout_id = 0;
+}
+
+Connector::Connector(const ServerList & servers, int timeout, const Connected & connected,
+                     const Failed & failed, Bot *bot)
+    : paludis::PrivateImplementationPattern<Connector>(
+            new paludis::Implementation<Connector>(servers, timeout, connected, failed, bot))
+{
+    if (servers.empty())
+        throw ConnectionError("No servers to connect to");
+    _imp->next_host();
+}
+
+Connector::~Connector()
+{
+    WorkerPool::get_instance()->cancel(_imp->token);
+    _imp->abandon(false);
+    _imp->cancel_events();
+}
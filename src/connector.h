@@ -0,0 +1,48 @@
+#ifndef connector_h
+#define connector_h
+
+#include <paludis/util/private_implementation_pattern.hh>
+#include <paludis/util/instantiation_policy.hh>
+
+#include <string>
+#include <vector>
+#include <functional>
+
+namespace eir
+{
+    class Bot;
+
+    /*
+     * Makes a connection without holding up the reactor. Each server's name
+     * is resolved on the worker pool, and its addresses are tried happy
+     * eyeballs style: IPv6 and IPv4 alternately, each attempt started a
+     * moment after the last or as soon as it fails, and the first to connect
+     * wins. If a server can't be both resolved and connected to within the
+     * timeout, the next server in the list is tried.
+     *
+     * How long each address took to connect, or that it didn't, is kept for
+     * the life of the process, and addresses that have connected quickly
+     * before are tried first.
+     */
+    class Connector : public paludis::PrivateImplementationPattern<Connector>,
+                      private paludis::InstantiationPolicy<Connector, paludis::instantiation_method::NonCopyableTag>
+    {
+        public:
+            // Host and port pairs, in the order to try them.
+            typedef std::vector<std::pair<std::string, std::string> > ServerList;
+
+            // Given the socket, non-blocking and close-on-exec, and the
+            // server it's connected to.
+            typedef std::function<void (int, std::string, std::string)> Connected;
+            typedef std::function<void (std::string)> Failed;
+
+            // Starts straight away on the calling thread's reactor, where
+            // the handlers are called. Either may destroy the Connector.
+            Connector(const ServerList &, int timeout, const Connected &, const Failed &, Bot *);
+
+            // Abandons any attempt still going.
+            ~Connector();
+    };
+}
+
+#endif
@@ -10,5 +10,8 @@
 #include "handler.h"
 #include "logger.h"
 #include "settings.h"
+#include "setting_handle.h"
+#include "worker_pool.h"
+#include "reactor.h"
 
 #endif
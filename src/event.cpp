@@ -1,30 +1,48 @@
 #include "event_internal.h"
+#include "reactor.h"
+#include "trace.h"
 
 using namespace eir;
 
 EventManager *EventManager::get_instance()
 {
-    static EventManagerImpl _instance;
-    return &_instance;
+    // The worker pool's threads have no reactor; what they schedule runs on
+    // the main one.
+    Reactor *r = Reactor::current();
+    return (r ? r : Reactor::main())->events();
 }
 
-static EventManager::id next_id = 1;
+EventManagerImpl::EventManagerImpl(unsigned int index)
+    : _index(index), _next_seq(1)
+{
+}
 
 EventManager::id EventManagerImpl::add_event(time_t t, EventManager::event_func f)
 {
-    event::ptr e(new event(next_id++, t, 0, f));
+    event::ptr e(new event((_next_seq++ << index_bits) | _index, t, 0, f, TraceOwner::current()));
     events.push_back(e);
     return e->_id;
 }
 
 EventManager::id EventManagerImpl::add_recurring_event(time_t i, EventManager::event_func f)
 {
-    event::ptr e(new event(next_id++, time(NULL) + i, i, f));
+    event::ptr e(new event((_next_seq++ << index_bits) | _index, time(NULL) + i, i, f, TraceOwner::current()));
     events.push_back(e);
     return e->_id;
 }
 
 void EventManagerImpl::remove_event(EventManager::id id)
+{
+    Reactor *owner = Reactor::get(id & ((1 << index_bits) - 1));
+    if (!owner || owner->events() == this)
+        remove_own_event(id);
+    else if (owner->in_thread())
+        owner->events()->remove_own_event(id);
+    else
+        owner->post(std::bind(&EventManagerImpl::remove_own_event, owner->events(), id));
+}
+
+void EventManagerImpl::remove_own_event(EventManager::id id)
 {
     event_list::iterator it = events.begin();
     while (it != events.end())
@@ -44,6 +62,11 @@ time_t EventManagerImpl::next_event_time() const
     return t;
 }
 
+void EventManagerImpl::clear()
+{
+    events.clear();
+}
+
 void EventManagerImpl::run_events()
 {
     time_t current_time = time(NULL);
@@ -51,7 +74,11 @@ void EventManagerImpl::run_events()
     {
         if ((*it)->next_time <= current_time)
         {
-            (*it)->func();
+            {
+                TraceOwner owner((*it)->owner.c_str());
+                TraceSpan span("event", "event");
+                (*it)->func();
+            }
 
             if ((*it)->interval)
                 (*it)->next_time += (*it)->interval;
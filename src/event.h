@@ -10,7 +10,7 @@ namespace eir
     {
         public:
             typedef std::function<void ()> event_func;
-            typedef unsigned int id;
+            typedef unsigned long id;
 
             virtual id add_event(time_t t, event_func f) = 0;
             virtual id add_recurring_event(time_t interval, event_func f) = 0;
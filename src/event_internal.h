@@ -1,12 +1,22 @@
 #include "event.h"
 #include <list>
 #include <memory>
+#include <string>
 
 namespace eir
 {
+    /*
+     * Each reactor has one of these, and EventManager::get_instance() is the
+     * calling thread's. Its ids say which it is, so that an event can be
+     * removed from anywhere.
+     */
     class EventManagerImpl : public EventManager
     {
         public:
+            enum { index_bits = 6 };
+
+            explicit EventManagerImpl(unsigned int index);
+
             virtual id add_event(time_t t, event_func f);
             virtual id add_recurring_event(time_t interval, event_func f);
 
@@ -15,14 +25,24 @@ namespace eir
             time_t next_event_time() const;
             void run_events();
 
+            // Forgets every event without running it, for a forked process
+            // that shouldn't repeat its parent's timers.
+            void clear();
+
         private:
+            void remove_own_event(id);
+
+            unsigned int _index;
+            id _next_seq;
+
             struct event {
                 id _id;
                 time_t next_time;
                 time_t interval;
                 event_func func;
-                event(id i, time_t t, time_t in, event_func f)
-                    : _id(i), next_time(t), interval(in), func(f)
+                std::string owner;
+                event(id i, time_t t, time_t in, event_func f, std::string o)
+                    : _id(i), next_time(t), interval(in), func(f), owner(o)
                 { }
                 typedef std::shared_ptr<event> ptr;
             };
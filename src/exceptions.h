@@ -11,6 +11,71 @@
 namespace eir {
     using paludis::Context;
 
+    /*
+     * One piece of a LazyContext. Only refers to its argument, so it can't be
+     * built from a temporary string; those won't be around when it's rendered.
+     */
+    class ContextArg
+    {
+        private:
+            const char *_literal;
+            const std::string *_string;
+
+        public:
+            ContextArg() : _literal(0), _string(0) { }
+            ContextArg(const char *s) : _literal(s), _string(0) { }
+            ContextArg(const std::string & s) : _literal(0), _string(&s) { }
+            ContextArg(std::string &&) = delete;
+
+            void append_to(std::string & s) const
+            {
+                if (_literal)
+                    s += _literal;
+                else if (_string)
+                    s += *_string;
+            }
+    };
+
+    /*
+     * A drop-in replacement for Context on hot paths. Instead of building the
+     * context string on every call, it remembers where its pieces are and only
+     * concatenates them if a backtrace is taken while it is in scope.
+     *
+     * Building with EIR_NO_BREADCRUMBS defined compiles these out entirely.
+     */
+#ifndef EIR_NO_BREADCRUMBS
+    class LazyContext : public paludis::DeferredContext
+    {
+        private:
+            enum { max_parts = 6 };
+            ContextArg _parts[max_parts];
+
+        public:
+            LazyContext(ContextArg a, ContextArg b = ContextArg(), ContextArg c = ContextArg(),
+                        ContextArg d = ContextArg(), ContextArg e = ContextArg(), ContextArg f = ContextArg())
+            {
+                _parts[0] = a; _parts[1] = b; _parts[2] = c;
+                _parts[3] = d; _parts[4] = e; _parts[5] = f;
+            }
+
+            std::string render() const
+            {
+                std::string ret;
+                for (int i = 0; i < max_parts; ++i)
+                    _parts[i].append_to(ret);
+                return ret;
+            }
+    };
+#else
+    class LazyContext
+    {
+        public:
+            LazyContext(ContextArg, ContextArg = ContextArg(), ContextArg = ContextArg(),
+                        ContextArg = ContextArg(), ContextArg = ContextArg(), ContextArg = ContextArg())
+            { }
+    };
+#endif
+
     struct Exception : public paludis::Exception
     {
         private:
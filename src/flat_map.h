@@ -0,0 +1,207 @@
+#ifndef flat_map_h
+#define flat_map_h
+
+#include "string_util.h"
+
+#include <vector>
+#include <string>
+#include <utility>
+#include <iterator>
+#include <cstddef>
+
+namespace eir
+{
+    namespace cistring
+    {
+        /*
+         * Open-addressing hash map keyed on case-insensitive names, for the
+         * small per-client and per-channel indexes where std::map's node
+         * allocations and string comparisons dominate. Uses linear probing;
+         * erase shifts later entries back instead of leaving tombstones.
+         *
+         * Any insert or erase invalidates iterators and pointers into the map.
+         */
+        template <typename V_>
+        class flat_map
+        {
+            public:
+                struct value_type
+                {
+                    std::string first;
+                    V_ second;
+                };
+
+            private:
+                struct Slot
+                {
+                    std::size_t hash;
+                    bool used;
+                    value_type entry;
+
+                    Slot() : hash(0), used(false), entry() { }
+                };
+
+                std::vector<Slot> _slots;
+                std::size_t _size;
+
+                std::size_t _mask() const { return _slots.size() - 1; }
+
+                std::size_t _find_slot(const std::string & key, std::size_t h) const
+                {
+                    for (std::size_t i = h & _mask(); ; i = (i + 1) & _mask())
+                    {
+                        const Slot & s = _slots[i];
+                        if (!s.used)
+                            return _slots.size();
+                        if (s.hash == h && equal(s.entry.first, key))
+                            return i;
+                    }
+                }
+
+                void _rehash(std::size_t capacity)
+                {
+                    std::vector<Slot> old(capacity);
+                    old.swap(_slots);
+                    for (typename std::vector<Slot>::iterator it = old.begin(); it != old.end(); ++it)
+                    {
+                        if (!it->used)
+                            continue;
+                        std::size_t i = it->hash & _mask();
+                        while (_slots[i].used)
+                            i = (i + 1) & _mask();
+                        _slots[i].hash = it->hash;
+                        _slots[i].used = true;
+                        _slots[i].entry.first.swap(it->entry.first);
+                        _slots[i].entry.second = std::move(it->entry.second);
+                    }
+                }
+
+            public:
+                template <typename Slot_, typename Value_>
+                class basic_iterator
+                {
+                    public:
+                        typedef std::forward_iterator_tag iterator_category;
+                        typedef Value_ value_type;
+                        typedef std::ptrdiff_t difference_type;
+                        typedef Value_ * pointer;
+                        typedef Value_ & reference;
+
+                    private:
+                        Slot_ *_p, *_end;
+
+                        void _skip() { while (_p != _end && !_p->used) ++_p; }
+
+                    public:
+                        basic_iterator() : _p(0), _end(0) { }
+                        basic_iterator(Slot_ *p, Slot_ *e) : _p(p), _end(e) { _skip(); }
+
+                        Value_ & operator* () const { return _p->entry; }
+                        Value_ * operator-> () const { return &_p->entry; }
+                        basic_iterator & operator++ () { ++_p; _skip(); return *this; }
+                        basic_iterator operator++ (int) { basic_iterator r(*this); ++*this; return r; }
+                        bool operator== (const basic_iterator & o) const { return _p == o._p; }
+                        bool operator!= (const basic_iterator & o) const { return _p != o._p; }
+
+                        friend class flat_map;
+                };
+
+                typedef basic_iterator<Slot, value_type> iterator;
+                typedef basic_iterator<const Slot, const value_type> const_iterator;
+
+                flat_map() : _slots(8), _size(0) { }
+
+                iterator begin() { return iterator(_slots.data(), _slots.data() + _slots.size()); }
+                iterator end() { return iterator(_slots.data() + _slots.size(), _slots.data() + _slots.size()); }
+                const_iterator begin() const { return const_iterator(_slots.data(), _slots.data() + _slots.size()); }
+                const_iterator end() const { return const_iterator(_slots.data() + _slots.size(), _slots.data() + _slots.size()); }
+
+                std::size_t size() const { return _size; }
+                bool empty() const { return _size == 0; }
+
+                // Makes room for n entries without further rehashing.
+                void reserve(std::size_t n)
+                {
+                    std::size_t capacity = _slots.size();
+                    while (capacity * 3 < n * 4)
+                        capacity *= 2;
+                    if (capacity != _slots.size())
+                        _rehash(capacity);
+                }
+
+                iterator find(const std::string & key)
+                {
+                    std::size_t i = _find_slot(key, hash(key));
+                    return iterator(_slots.data() + i, _slots.data() + _slots.size());
+                }
+
+                const_iterator find(const std::string & key) const
+                {
+                    std::size_t i = _find_slot(key, hash(key));
+                    return const_iterator(_slots.data() + i, _slots.data() + _slots.size());
+                }
+
+                std::pair<iterator, bool> insert(const std::string & key, const V_ & value)
+                {
+                    std::size_t h = hash(key);
+                    std::size_t i = _find_slot(key, h);
+                    if (i != _slots.size())
+                        return std::make_pair(iterator(_slots.data() + i, _slots.data() + _slots.size()), false);
+
+                    reserve(_size + 1);
+
+                    for (i = h & _mask(); _slots[i].used; i = (i + 1) & _mask())
+                        ;
+                    _slots[i].hash = h;
+                    _slots[i].used = true;
+                    _slots[i].entry.first = key;
+                    _slots[i].entry.second = value;
+                    ++_size;
+                    return std::make_pair(iterator(_slots.data() + i, _slots.data() + _slots.size()), true);
+                }
+
+                void erase(iterator it)
+                {
+                    std::size_t i = it._p - _slots.data();
+                    _slots[i].used = false;
+                    --_size;
+
+                    // Pull back any following entries that would no longer be
+                    // reachable from their home slot.
+                    for (std::size_t j = (i + 1) & _mask(); _slots[j].used; j = (j + 1) & _mask())
+                    {
+                        std::size_t home = _slots[j].hash & _mask();
+                        bool movable = (i <= j) ? (home <= i || home > j) : (home <= i && home > j);
+                        if (!movable)
+                            continue;
+
+                        _slots[i].hash = _slots[j].hash;
+                        _slots[i].used = true;
+                        _slots[i].entry.first.swap(_slots[j].entry.first);
+                        _slots[i].entry.second = std::move(_slots[j].entry.second);
+                        _slots[j].used = false;
+                        i = j;
+                    }
+
+                    _slots[i].entry = value_type();
+                }
+
+                std::size_t erase(const std::string & key)
+                {
+                    iterator it = find(key);
+                    if (it == end())
+                        return 0;
+                    erase(it);
+                    return 1;
+                }
+
+                void clear()
+                {
+                    std::vector<Slot>(8).swap(_slots);
+                    _size = 0;
+                }
+        };
+    }
+}
+
+#endif
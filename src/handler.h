@@ -5,6 +5,7 @@
 #include "event.h"
 #include "logger.h"
 #include "storage.h"
+#include "privilege_index.h"
 #include <functional>
 
 
@@ -21,6 +22,14 @@ namespace eir
                     quiet, o);
         }
 
+        template <class F_>
+        CommandRegistry::id add_async_handler(Filter f, F_ h, bool quiet = false, Message::Order o = Message::normal)
+        {
+            return eir::CommandRegistry::get_instance()->add_async_handler(f,
+                    std::bind(h, static_cast<T_*>(this), std::placeholders::_1),
+                    quiet, o);
+        }
+
         template <class F_>
         EventManager::id add_event(time_t t, F_ h)
         {
@@ -112,6 +121,25 @@ namespace eir
             ~StorageBackendHolder() { _release(); }
     };
 
+    class PrivilegeMatcherHolder :
+        public paludis::InstantiationPolicy<PrivilegeMatcherHolder, paludis::instantiation_method::NonCopyableTag>
+    {
+        private:
+            PrivilegeIndex::MatcherId _id;
+
+            void _release() { if (_id) PrivilegeIndex::get_instance()->unregister_matcher(_id); _id = 0; }
+
+        public:
+            PrivilegeMatcherHolder() : _id(0)
+            { }
+            PrivilegeMatcherHolder(PrivilegeIndex::MatcherId id) : _id(id)
+            { }
+            const PrivilegeMatcherHolder & operator= (PrivilegeIndex::MatcherId id)
+            { _release(); _id = id; return *this; }
+
+            ~PrivilegeMatcherHolder() { _release(); }
+    };
+
     inline void dispatch_internal_message(Bot *b, std::string cmd)
     {
         Message m(b, cmd, sourceinfo::Internal);
@@ -0,0 +1,153 @@
+#include "handoff.h"
+
+#include <paludis/util/stringify.hh>
+#include <paludis/util/destringify.hh>
+#include <paludis/util/tokeniser.hh>
+
+#include <vector>
+#include <iostream>
+#include <iterator>
+#include <cstdio>
+#include <cstdlib>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+using namespace eir;
+
+namespace
+{
+    const char *env_name = "EIR_HANDOFF";
+    const std::string magic = "eir-handoff";
+
+    std::vector<int> kept;
+    int saved = -1;
+
+    void close_all(const std::vector<int> & fds)
+    {
+        for (std::vector<int>::const_iterator it = fds.begin(); it != fds.end(); ++it)
+            ::close(*it);
+    }
+}
+
+void Handoff::keep_open(int fd)
+{
+    int flags = fcntl(fd, F_GETFD, 0);
+    fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC);
+    kept.push_back(fd);
+}
+
+bool Handoff::save(const Value & state)
+{
+    std::string data = magic + " " + paludis::stringify(int(version));
+    for (std::vector<int>::iterator it = kept.begin(); it != kept.end(); ++it)
+        data += " " + paludis::stringify(*it);
+    data += "\n" + serialise(state);
+
+    FILE *f = tmpfile();
+    if (!f || fwrite(data.data(), 1, data.size(), f) != data.size() || fflush(f) != 0
+            || lseek(fileno(f), 0, SEEK_SET) != 0)
+    {
+        if (f)
+            fclose(f);
+        close_all(kept);
+        kept.clear();
+        return false;
+    }
+
+    // The FILE is abandoned; only its descriptor matters from here.
+    int fd = fileno(f);
+    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) & ~FD_CLOEXEC);
+    setenv(env_name, paludis::stringify(fd).c_str(), 1);
+    saved = fd;
+    return true;
+}
+
+void Handoff::abandon()
+{
+    unsetenv(env_name);
+    if (saved >= 0)
+        ::close(saved);
+    saved = -1;
+    kept.clear();
+}
+
+Value Handoff::take()
+{
+    const char *env = getenv(env_name);
+    if (!env)
+        return Value();
+
+    int fd = atoi(env);
+    unsetenv(env_name);
+
+    std::string data;
+    char buf[65536];
+    ssize_t r;
+    while ((r = read(fd, buf, sizeof(buf))) > 0)
+        data.append(buf, r);
+    ::close(fd);
+
+    std::string::size_type eol = data.find('\n');
+    std::vector<std::string> header;
+    paludis::tokenise_whitespace(data.substr(0, eol), std::back_inserter(header));
+
+    if (eol == std::string::npos || header.size() < 2 || header[0] != magic)
+    {
+        std::cerr << "Ignoring unrecognised restart state" << std::endl;
+        return Value();
+    }
+
+    std::vector<int> fds;
+    try
+    {
+        // Nothing else started from here should inherit them.
+        for (std::vector<std::string>::iterator it = header.begin() + 2; it != header.end(); ++it)
+        {
+            fds.push_back(paludis::destringify<int>(*it));
+            fcntl(fds.back(), F_SETFD, FD_CLOEXEC);
+        }
+
+        if (paludis::destringify<int>(header[1]) != version)
+        {
+            std::cerr << "Restart state is version " << header[1] << ", not " << int(version)
+                      << "; reconnecting instead" << std::endl;
+            close_all(fds);
+            return Value();
+        }
+
+        return unserialise(data.substr(eol + 1));
+    }
+    catch (paludis::DestringifyError &)
+    {
+        std::cerr << "Couldn't read restart state header; reconnecting instead" << std::endl;
+    }
+    catch (MalformedValueError & e)
+    {
+        std::cerr << "Couldn't read restart state (" << e.message() << "); reconnecting instead" << std::endl;
+    }
+
+    close_all(fds);
+    return Value();
+}
+
+const Value & Handoff::get(const Value & state, const std::string & key)
+{
+    static const Value none;
+    if (state.Type() != Value::kvarray)
+        return none;
+    KeyValueArray::const_iterator it = state.KV().find(key);
+    return it == state.KV().end() ? none : it->second;
+}
+
+int Handoff::get_int(const Value & state, const std::string & key, int def)
+{
+    const Value & v = get(state, key);
+    return v.Type() == Value::integer ? v.Int() : def;
+}
+
+std::string Handoff::get_string(const Value & state, const std::string & key, const std::string & def)
+{
+    const Value & v = get(state, key);
+    return v.Type() == Value::string ? v.String() : def;
+}
@@ -0,0 +1,57 @@
+#ifndef handoff_h
+#define handoff_h
+
+#include "value.h"
+
+namespace eir
+{
+    /*
+     * Carries state across the execv of a restart, so that the new image can
+     * take over the old one's connections instead of making its own.
+     *
+     * The state is a Value, written to an unlinked temporary file whose
+     * descriptor, like those of the connections, is left open across the
+     * exec; EIR_HANDOFF in the environment says which one it is. A header
+     * line ahead of the state gives the format version and every descriptor
+     * passed on, so that an image which can't read the state can at least
+     * close them.
+     *
+     * Readers ignore keys they don't know and supply defaults for ones that
+     * are missing, so adding to the state doesn't need a new version. Bump
+     * it only when an existing key changes meaning.
+     */
+    class Handoff
+    {
+        public:
+            enum { version = 1 };
+
+            // In the old image. Leaves fd open across the exec, and lists it
+            // in the header.
+            static void keep_open(int fd);
+
+            // In the old image, just before the exec. False if the state
+            // couldn't be written, in which case the descriptors passed to
+            // keep_open() have been closed.
+            static bool save(const Value & state);
+
+            // In the old image, if the exec failed after save() succeeded:
+            // closes the state's file and takes it out of the environment.
+            // The descriptors passed to keep_open() are left to be closed
+            // by whatever handed them over.
+            static void abandon();
+
+            // In the new image. What save() was given, or an empty Value if
+            // there was nothing, or nothing usable. Only the first call finds
+            // anything.
+            static Value take();
+
+            // For reading the state: what's under key, or the default if
+            // it's missing or of some other type.
+            static const Value & get(const Value &, const std::string & key);
+            static int get_int(const Value &, const std::string & key, int def = 0);
+            static std::string get_string(const Value &, const std::string & key,
+                                          const std::string & def = "");
+    };
+}
+
+#endif
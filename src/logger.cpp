@@ -1,4 +1,6 @@
 #include "logger.h"
+#include "reactor.h"
+#include "trace.h"
 
 #include <paludis/util/private_implementation_pattern-impl.hh>
 #include <paludis/util/instantiation_policy-impl.hh>
@@ -7,6 +9,8 @@ using namespace eir;
 using namespace paludis;
 
 #include <list>
+#include <map>
+#include <vector>
 
 template class paludis::InstantiationPolicy<Logger, paludis::instantiation_method::SingletonTag>;
 
@@ -18,8 +22,9 @@ namespace
         Logger::DestinationId id;
         LogDestination *dest;
         Logger::Type typemask;
-        LogDestinationInfo(Logger::BackendId b, Logger::DestinationId i, LogDestination *d, Logger::Type t)
-            : backend(b), id(i), dest(d), typemask(t)
+        Bot *owner;
+        LogDestinationInfo(Logger::BackendId b, Logger::DestinationId i, LogDestination *d, Logger::Type t, Bot *o)
+            : backend(b), id(i), dest(d), typemask(t), owner(o)
         { }
     };
 
@@ -46,6 +51,7 @@ namespace paludis
 
 Logger::BackendId Logger::register_backend(std::string name, LogBackend *b)
 {
+    ExclusiveSection exclusive;
     static unsigned int next_id = 0;
     _imp->backends.push_back(LogBackendInfo(++next_id, name, b));
     return next_id;
@@ -53,6 +59,7 @@ Logger::BackendId Logger::register_backend(std::string name, LogBackend *b)
 
 void Logger::unregister_backend(BackendId id)
 {
+    ExclusiveSection exclusive;
     std::list<LogDestinationInfo>::iterator it = _imp->destinations.begin();
 
     while (it != _imp->destinations.end())
@@ -80,8 +87,9 @@ void Logger::unregister_backend(BackendId id)
     }
 }
 
-Logger::DestinationId Logger::add_destination(std::string type, std::string arg, Type types)
+Logger::DestinationId Logger::add_destination(std::string type, std::string arg, Type types, Bot *owner)
 {
+    ExclusiveSection exclusive;
     std::list<LogBackendInfo>::iterator backend = _imp->backends.begin(); 
 
     for ( ; backend != _imp->backends.end(); ++backend)
@@ -97,19 +105,23 @@ Logger::DestinationId Logger::add_destination(std::string type, std::string arg,
 
     LogDestination *d = backend->backend->create_destination(arg);
 
-    _imp->destinations.push_back(LogDestinationInfo(backend->id, ++next_id, d, types));
+    _imp->destinations.push_back(LogDestinationInfo(backend->id, ++next_id, d, types, owner));
 
     return next_id;
 }
 
 void Logger::remove_destination(DestinationId id)
 {
+    ExclusiveSection exclusive;
     std::list<LogDestinationInfo>::iterator it = _imp->destinations.begin();
 
     while (it != _imp->destinations.end())
     {
         if (it->id == id)
+        {
+            delete it->dest;
             _imp->destinations.erase(it++);
+        }
         else
             ++it;
     }
@@ -117,13 +129,16 @@ void Logger::remove_destination(DestinationId id)
 
 void Logger::Log(Bot *bot, Client *source, Type type, std::string text)
 {
+    TraceSpan span("logger", "log", bot);
+
     for (std::list<LogDestinationInfo>::iterator it = _imp->destinations.begin();
             it != _imp->destinations.end(); ++it)
     {
-        if (it->typemask & type)
-        {
-            it->dest->Log(bot, source, text);
-        }
+        if (!(it->typemask & type))
+            continue;
+        if (bot && it->owner && it->owner != bot)
+            continue;
+        it->dest->Log(bot, source, text);
     }
 }
 
@@ -134,6 +149,7 @@ void Logger::Log(Bot *b, std::shared_ptr<Client> s, Type t, std::string text)
 
 void Logger::clear_logs()
 {
+    ExclusiveSection exclusive;
     for (std::list<LogDestinationInfo>::iterator it = _imp->destinations.begin();
             it != _imp->destinations.end(); it = _imp->destinations.erase(it))
     {
@@ -176,6 +192,10 @@ namespace
     {
         CommandHolder add_log_id, clear_log_id;
 
+        // By the bot whose config added them, so that one bot's rehash
+        // leaves the others' alone.
+        std::map<Bot *, std::vector<Logger::DestinationId> > added;
+
         void add_log(const Message *m)
         {
             std::vector<std::string>::const_iterator it = m->args.begin();
@@ -189,12 +209,15 @@ namespace
                 types |= TypeFromString(*it);
             }
 
-            Logger::get_instance()->add_destination(type, arg, types);
+            added[m->bot].push_back(Logger::get_instance()->add_destination(type, arg, types, m->bot));
         }
 
-        void clear_logs(const Message *)
+        void clear_logs(const Message *m)
         {
-            Logger::get_instance()->clear_logs();
+            std::vector<Logger::DestinationId> & ids = added[m->bot];
+            for (std::vector<Logger::DestinationId>::iterator it = ids.begin(); it != ids.end(); ++it)
+                Logger::get_instance()->remove_destination(*it);
+            ids.clear();
         }
 
         LogCreator()
@@ -53,8 +53,10 @@ namespace eir
             BackendId register_backend(std::string, LogBackend *);
             void unregister_backend(BackendId);
 
+            // A destination with an owner only gets that bot's lines, and
+            // those that aren't any bot's; one without gets every bot's.
             typedef unsigned int DestinationId;
-            DestinationId add_destination(std::string type, std::string arg, Type types);
+            DestinationId add_destination(std::string type, std::string arg, Type types, Bot *owner = 0);
             void remove_destination(DestinationId);
 
             void clear_logs();
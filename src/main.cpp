@@ -5,13 +5,23 @@
 #include "message.h"
 #include "modules.h"
 #include "command.h"
+#include "handler.h"
+#include "reactor.h"
+#include "handoff.h"
+#include "trace.h"
 
 #include <unistd.h>
 #include "exceptions.h"
 
 #include <signal.h>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
 
 #include <iostream>
+#include <deque>
+#include <vector>
+#include <algorithm>
 
 using namespace eir;
 
@@ -20,43 +30,317 @@ void print_cerr(std::string s)
     std::cerr << s << std::endl;
 }
 
-int main(int, char **argv)
+// A trace covers the whole process, so it's written once, as that ends,
+// rather than when any one bot does.
+static void finish_trace()
 {
-    std::string botname("eir");
+    try
+    {
+        Tracer::get_instance()->finish();
+    }
+    catch (eir::Exception & e)
+    {
+        std::cerr << "Couldn't write trace: " << e.message() << std::endl;
+    }
+}
+
+namespace
+{
+    /*
+     * Creates the bots named on the command line, and any further ones
+     * named by 'bots' lines in their config files. They all share the
+     * modules, scripts and storage loaded into the process; with -t, they're
+     * spread across that many reactor threads. A bot first named by a rehash
+     * is created from the main loop. After a restart, bots carry on with the
+     * connections the previous image handed over rather than reconnecting.
+     */
+    struct Launcher : CommandHandlerBase<Launcher>
+    {
+        std::vector<std::shared_ptr<Bot> > bots;
+        std::deque<std::string> pending;
+        bool running;
+
+        EventManager::id create_id;
+        CommandHolder bots_id;
+
+        void add_bots(const Message *m)
+        {
+            for (std::vector<std::string>::const_iterator it = m->args.begin(); it != m->args.end(); ++it)
+                if (!BotManager::get_instance()->find(*it) &&
+                        std::find(pending.begin(), pending.end(), *it) == pending.end())
+                    pending.push_back(*it);
+
+            if (running && !pending.empty() && !create_id)
+                create_id = add_event(time(NULL), &Launcher::create_later);
+        }
+
+        // Creating a bot reads its config file, which may name more.
+        void create_pending()
+        {
+            while (!pending.empty())
+            {
+                std::string name = pending.front();
+                pending.pop_front();
+                bots.push_back(std::make_shared<Bot>(name));
+            }
+        }
+
+        void create_later()
+        {
+            create_id = 0;
+            while (!pending.empty())
+            {
+                std::string name = pending.front();
+                pending.pop_front();
+                try
+                {
+                    std::shared_ptr<Bot> bot;
+                    {
+                        ExclusiveSection exclusive;
+                        bot = std::make_shared<Bot>(name);
+                        bots.push_back(bot);
+                    }
+                    start_on(Reactor::assign(), bot);
+                }
+                catch (eir::Exception & e)
+                {
+                    if (e.fatal())
+                        throw;
+                    Logger::get_instance()->Log(0, 0, Logger::Warning,
+                            "Couldn't start bot " + name + ": " + e.message());
+                }
+            }
+        }
+
+        // Connections handed over by the image before a restart, by bot name.
+        Value resumed;
+
+        // A bot connects, or takes up where it left off before a restart,
+        // from the reactor that's to run it.
+        static void start_or_resume(std::shared_ptr<Bot> bot, const Value & state)
+        {
+            if (state.Type() == Value::kvarray)
+            {
+                try
+                {
+                    bot->resume(state);
+                    return;
+                }
+                catch (ConnectionError & e)
+                {
+                    Logger::get_instance()->Log(bot.get(), 0, Logger::Warning,
+                            "Couldn't resume connection, reconnecting: " + e.message());
+                }
+            }
+            bot->start();
+        }
+
+        // Only on the main reactor, and so before anything is running, is
+        // failing fatal.
+        void start_on(Reactor *r, std::shared_ptr<Bot> bot)
+        {
+            Value state;
+            if (resumed.Type() == Value::kvarray)
+            {
+                KeyValueArray::iterator it = resumed.KV().find(bot->name());
+                if (it != resumed.KV().end())
+                {
+                    state = it->second;
+                    resumed.KV().erase(it);
+                }
+            }
+
+            if (r->in_thread())
+            {
+                start_or_resume(bot, state);
+                return;
+            }
+
+            r->post([bot, state] () {
+                try
+                {
+                    start_or_resume(bot, state);
+                }
+                catch (eir::Exception & e)
+                {
+                    if (e.fatal())
+                        throw;
+                    Logger::get_instance()->Log(bot.get(), 0, Logger::Warning,
+                            "Couldn't start bot " + bot->name() + ": " + e.message());
+                }
+            });
+        }
+
+        // Anything handed over that no bot took up.
+        void discard_resumed()
+        {
+            if (resumed.Type() == Value::kvarray)
+                for (KeyValueArray::iterator it = resumed.KV().begin(); it != resumed.KV().end(); ++it)
+                    Bot::discard(it->second, "Restarting");
+            resumed = Value();
+        }
+
+        // Registered connections are passed on to the next image, which
+        // carries on with them; the rest are closed as usual.
+        void hand_off()
+        {
+            Value state(Value::kvarray);
+            for (std::vector<std::shared_ptr<Bot> >::iterator it = bots.begin(); it != bots.end(); ++it)
+            {
+                Value s = (*it)->hand_off();
+                if (s.Type() == Value::kvarray)
+                    state[(*it)->name()] = s;
+            }
+
+            if (state.KV().empty())
+                return;
+            if (Handoff::save(state))
+                handed_off = state;
+            else
+                std::cerr << "Couldn't save state for restart; reconnecting instead" << std::endl;
+        }
 
-    if (argv[1] && argv[1][0])
-        botname = argv[1];
+        // What hand_off() passed on, in case the exec fails and it has to
+        // be taken back.
+        Value handed_off;
 
+        // The handed-over connections are quit rather than taken up again,
+        // and the bots reconnect as they would after losing them.
+        void take_back()
+        {
+            Handoff::abandon();
+            resumed = handed_off;
+            handed_off = Value();
+            discard_resumed();
+        }
+
+        void disconnect_all(std::string reason)
+        {
+            for (std::vector<std::shared_ptr<Bot> >::iterator it = bots.begin(); it != bots.end(); ++it)
+                if ((*it)->connected())
+                    (*it)->disconnect(reason);
+        }
+
+        Launcher() : running(false), create_id(0)
+        {
+            bots_id = add_handler(filter_command_type("bots", sourceinfo::ConfigFile), &Launcher::add_bots);
+        }
+
+        ~Launcher()
+        {
+            if (create_id)
+                EventManager::get_instance()->remove_event(create_id);
+        }
+    };
+}
+
+int main(int argc, char **argv)
+{
     // We want a regular write error, not a SIGPIPE, if the socket is closed.
     signal(SIGPIPE, SIG_IGN);
 
-    std::shared_ptr<Bot> bot;
+    // Started by a module as a helper, such as a perl script host: that
+    // module runs the process, with no bots or config of its own.
+    if (const char *helper = getenv("EIR_HELPER"))
+    {
+        std::string module = helper;
+        unsetenv("EIR_HELPER");
+        try
+        {
+            ModuleRegistry::get_instance()->load(module);
+            Reactor::main()->run();
+        }
+        catch (DieException &)
+        {
+        }
+        catch (paludis::Exception & e)
+        {
+            std::cerr << "Helper " << module << " failed: " << e.message() << " (" << e.what() << ")" << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    Launcher launcher;
+    launcher.resumed = Handoff::take();
+    unsigned int threads = 1;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-t") && i + 1 < argc)
+            threads = std::max(atoi(argv[++i]), 1);
+        else if (argv[i][0])
+            launcher.pending.push_back(argv[i]);
+    }
+    if (launcher.pending.empty())
+        launcher.pending.push_back("eir");
+
+    bool restart_all = false;
 
     while (true)
     {
         try
         {
-            if (!bot)
-                bot.reset(new Bot(botname));
+            if (restart_all)
+            {
+                restart_all = false;
+                std::vector<std::shared_ptr<Bot> > bots;
+                {
+                    ExclusiveSection exclusive;
+                    bots = launcher.bots;
+                }
+                for (std::vector<std::shared_ptr<Bot> >::iterator it = bots.begin(); it != bots.end(); ++it)
+                    launcher.start_on((*it)->reactor(), *it);
+            }
+
+            if (!launcher.running)
+            {
+                launcher.create_pending();
+                Reactor::start_threads(threads);
+                for (std::vector<std::shared_ptr<Bot> >::iterator it = launcher.bots.begin();
+                        it != launcher.bots.end(); ++it)
+                    launcher.start_on(Reactor::assign(), *it);
+                launcher.discard_resumed();
+                launcher.running = true;
+            }
 
-            bot->run();
+            Reactor::main()->run();
         }
         catch (DisconnectedException &e)
         {
+            // Bots deal with their own connections failing; this came from
+            // somewhere else, so start everything again as we always have.
             std::cerr << "Reconnecting due to error: " << e.message() << std::endl;
+            restart_all = launcher.running;
             continue;
         }
         catch (RestartException &e)
         {
+            Reactor::stop_threads();
+            launcher.hand_off();
+            launcher.disconnect_all("Restarting");
+            finish_trace();
             execv(argv[0], argv);
+
+            int error = errno;
+            std::cerr << "Couldn't restart (" << strerror(error) << "); reconnecting instead" << std::endl;
+            launcher.take_back();
+            Reactor::start_threads(threads);
+            restart_all = true;
+            continue;
         }
         catch (DieException &e)
         {
+            Reactor::stop_threads();
+            launcher.disconnect_all("Shutting down");
+            finish_trace();
             std::cerr << "Shutting down. " << e.message() << std::endl;
             return 0;
         }
         catch (paludis::Exception & e)
         {
+            Reactor::stop_threads();
+            finish_trace();
             std::cerr << "Aborting due to exception:" << std::endl
                       << e.backtrace("\n  * ")
                       << e.message() << " (" << e.what() << ")" << std::endl;
@@ -5,8 +5,67 @@
 
 using namespace eir;
 
+const std::shared_ptr<const sourceinfo> & sourceinfo::none()
+{
+    static const std::shared_ptr<const sourceinfo> empty(std::make_shared<const sourceinfo>());
+    return empty;
+}
+
+void sourceinfo::reply(std::string text) const
+{
+    if (reply_func)
+        reply_func(text);
+    else if (irc_bot)
+    {
+        bool channel = destination.find_first_of("#&") != std::string::npos;
+        irc_bot->send("NOTICE " + (channel ? destination : name) + " :" + text);
+    }
+}
+
+void sourceinfo::error(std::string text) const
+{
+    if (error_func)
+        error_func(text);
+    else
+        reply(text);
+}
+
+void Message::rebind_client(Client::ptr c)
+{
+    if (c == source->client)
+        return;
+
+    std::shared_ptr<sourceinfo> s(std::make_shared<sourceinfo>(*source));
+    s->client = c;
+    source = s;
+}
+
+bool Message::is_netsplit_quit() const
+{
+    if (!cistring::equal(command, "QUIT"))
+        return false;
+
+    // Users can't choose a quit reason that looks like this, since the
+    // server prefixes theirs with "Quit: ".
+    const std::string & reason = source->destination;
+    std::string::size_type space = reason.find(' ');
+    if (space == std::string::npos || space == 0 || space == reason.size() - 1)
+        return false;
+
+    if (reason.find('.') > space || reason.find('.', space) == std::string::npos)
+        return false;
+
+    for (std::string::size_type i = 0; i < reason.size(); ++i)
+    {
+        char c = reason[i];
+        if (i != space && !isalnum(static_cast<unsigned char>(c)) && c != '.' && c != '-' && c != '*' && c != '_')
+            return false;
+    }
+    return true;
+}
+
 Filter::Filter()
-    : matches(0), bot(0), sourcetype(0)
+    : matches(0), privilege_id(0), bot(0), sourcetype(0)
 {
 }
 
@@ -55,6 +114,7 @@ Filter& Filter::requires_privilege(std::string p)
 {
     matches |= match_privilege;
     privilege = p;
+    privilege_id = PrivilegeSet::privilege_id(p);
     return *this;
 }
 
@@ -64,24 +124,41 @@ Filter& Filter::or_config()
     return *this;
 }
 
+Filter& Filter::for_modes(std::string letters)
+{
+    matches |= match_mode;
+    modeletters = letters;
+    return *this;
+}
+
 bool Filter::match(const Message *m) const
 {
-    if (matches & match_source_type && 0 == (sourcetype & m->source.type))
+    if (matches & match_source_type && 0 == (sourcetype & m->source_type))
         return false;
     if (matches & match_command && ! cistring::equal(commandname, m->command))
         return false;
     if (matches & match_bot && bot != m->bot)
         return false;
-    if (matches & match_config_overrides && m->source.type == sourceinfo::ConfigFile)
+    if (matches & match_config_overrides && m->source_type == sourceinfo::ConfigFile)
         return true;
-    if (matches & match_privilege && ! ( m->source.client && m->source.client->privs().has_privilege(privilege)))
+    if (matches & match_privilege && ! ( m->source->client && m->source->client->privs().has_privilege(privilege_id)))
         return false;
-    if (matches & match_private && m->source.destination != m->bot->nick())
+    if (matches & match_private && m->source->destination != m->bot->nick())
         return false;
-    if (matches & match_in_channel && m->source.destination != channel)
+    if (matches & match_in_channel && m->source->destination != channel)
         return false;
-    if (matches & match_source_name && ! ::match(source, m->source.name))
+    if (matches & match_source_name && ! ::match(source, m->source->name))
         return false;
+    if (matches & match_mode)
+    {
+        if (!m->modes)
+            return false;
+        std::vector<ModeChange>::const_iterator it = m->modes->begin();
+        while (it != m->modes->end() && modeletters.find(it->mode) == std::string::npos)
+            ++it;
+        if (it == m->modes->end())
+            return false;
+    }
 
     return true;
 }
@@ -3,6 +3,7 @@
 
 #include <vector>
 #include <string>
+#include <map>
 #include <memory>
 #include <functional>
 
@@ -11,9 +12,14 @@
 namespace eir {
     class Bot;
 
+    /*
+     * Where a message came from. Built once as a line is parsed (or an
+     * internal event raised), then shared, unchanged, by every message
+     * derived from it, so passing an event on costs a reference count.
+     */
     struct sourceinfo {
-        // If non-zero, this message came from somewhere other than the server,
-        // and the value tells us where.
+        // Message::source_type is one of these, telling us where the message
+        // came from.
         enum {
             RawIrc        = 0x01,
             ConfigFile    = 0x02,
@@ -23,7 +29,6 @@ namespace eir {
             IrcCommand    = 0x20,
             Any           = 0xff
         };
-        unsigned int type;
 
         // If client is null, source was a server or doesn't share
         // any channels with us.
@@ -36,20 +41,34 @@ namespace eir {
         // The raw destination string.
         std::string destination;
 
-        // Function to send a reply to this.
+        // If set, replies are sent as NOTICEs via this bot: to the channel
+        // for channel messages, otherwise to the sender. Worked out only when
+        // a reply is actually sent.
+        Bot *irc_bot;
+
+        // Explicit reply functions, which take precedence over irc_bot.
+        // Errors go wherever replies do unless error_func is set.
         std::function<void(std::string)> reply_func, error_func;
-        void reply(std::string text) const {
-            if(reply_func) reply_func(text);
-        }
-        void error(std::string text) const {
-            if(error_func) error_func(text);
-        }
-
-        sourceinfo(unsigned int t, Client::ptr c)
-            : type(t), client(c), name(c->nick())
+        void reply(std::string text) const;
+        void error(std::string text) const;
+
+        sourceinfo(Client::ptr c)
+            : client(c), name(c->nick()), irc_bot(0)
         { }
-        sourceinfo() : type(Internal)
+        sourceinfo() : irc_bot(0)
         { }
+
+        // The shared source for messages with no particular origin.
+        static const std::shared_ptr<const sourceinfo> & none();
+    };
+
+    typedef std::shared_ptr<const sourceinfo> SourcePtr;
+
+    // One change from a MODE line.
+    struct ModeChange {
+        bool adding;
+        char mode;
+        std::string param;
     };
 
     struct Message {
@@ -62,21 +81,51 @@ namespace eir {
         };
 
         Bot *bot;
-        sourceinfo source;
+        SourcePtr source;
+        unsigned int source_type;
         std::string command;
         std::vector<std::string> args;
 
+        // The line as the server sent it, less any message tags.
         std::string raw;
 
-        Message(Bot *b) : bot(b) { }
-        Message(Bot *b, std::string c) : bot(b), command(c) { }
+        // IRCv3 message tags, unescaped. Valueless tags map to "".
+        std::map<std::string, std::string> tags;
+
+        // For batch_<type> events, the messages making up the batch, in
+        // order, including those of any batches nested in it. Each was
+        // dispatched on its own as it arrived.
+        std::shared_ptr<const std::vector<Message> > batch;
+
+        // For mode_changes events, each change from the MODE line, in order.
+        std::shared_ptr<const std::vector<ModeChange> > modes;
+
+        Message(Bot *b)
+            : bot(b), source(sourceinfo::none()), source_type(sourceinfo::Internal)
+        { }
+        Message(Bot *b, std::string c, unsigned int t = sourceinfo::Internal)
+            : bot(b), source(sourceinfo::none()), source_type(t), command(c)
+        { }
         Message(Bot *b, std::string cmd, unsigned int t, Client::ptr cl)
-            : bot(b), source(t, cl), command(cmd)
+            : bot(b), source(cl ? std::make_shared<const sourceinfo>(cl) : sourceinfo::none()),
+              source_type(t), command(cmd)
+        { }
+        Message(Bot *b, std::string cmd, unsigned int t, SourcePtr s)
+            : bot(b), source(s), source_type(t), command(cmd)
         { }
 
+        // A new event derived from m, sharing its source.
         Message(const Message& m, std::string c, unsigned int type)
-            : bot(m.bot), source(m.source), command(c)
-        { source.type = type; }
+            : bot(m.bot), source(m.source), source_type(type), command(c)
+        { }
+
+        // Points this message at a copy of its source naming a different
+        // client. Does nothing if the client is unchanged.
+        void rebind_client(Client::ptr);
+
+        // True for a QUIT whose reason is the "server1 server2" a netsplit
+        // leaves behind.
+        bool is_netsplit_quit() const;
     };
 
     class Filter {
@@ -88,10 +137,12 @@ namespace eir {
             match_in_channel = 16,
             match_source_type = 32,
             match_source_name = 64,
-            match_config_overrides = 128
+            match_config_overrides = 128,
+            match_mode = 256
         };
         unsigned matches;
-        std::string commandname, privilege, channel, source;
+        std::string commandname, privilege, channel, source, modeletters;
+        PrivilegeSet::Id privilege_id;
         Bot *bot;
         unsigned sourcetype;
 
@@ -105,6 +156,8 @@ namespace eir {
             Filter& in_channel(std::string);
             Filter& requires_privilege(std::string);
             Filter& or_config();
+            // Only matches messages whose mode changes include one of these letters.
+            Filter& for_modes(std::string);
 
             bool match(const Message *) const;
             const std::string & command() const { return commandname; }
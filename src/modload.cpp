@@ -12,16 +12,16 @@ struct Modloader : public CommandHandlerBase<Modloader>
     {
         if (ModuleRegistry::get_instance()->is_loaded(m->args[0]))
         {
-            m->source.reply(m->args[0] + " is already loaded.");
+            m->source->reply(m->args[0] + " is already loaded.");
         }
 
         ModuleRegistry::get_instance()->load(m->args[0]);
-        m->source.reply("Loaded " + m->args[0]);
+        m->source->reply("Loaded " + m->args[0]);
 
-        if (m->source.client)
-            Logger::get_instance()->Log(m->bot, m->source.client, Logger::Command,
+        if (m->source->client)
+            Logger::get_instance()->Log(m->bot, m->source->client, Logger::Command,
                                         "MODLOAD " + m->args[0]);
-        Logger::get_instance()->Log(m->bot, m->source.client, Logger::Admin,
+        Logger::get_instance()->Log(m->bot, m->source->client, Logger::Admin,
                                     "Loaded " + m->args[0]);
     }
 
@@ -30,12 +30,12 @@ struct Modloader : public CommandHandlerBase<Modloader>
         Context ctx("Processing MODUNLOAD " + m->args[0]);
 
         ModuleRegistry::get_instance()->unload(m->args[0]);
-        m->source.reply("Unloaded " + m->args[0]);
+        m->source->reply("Unloaded " + m->args[0]);
 
-        if (m->source.client)
-            Logger::get_instance()->Log(m->bot, m->source.client, Logger::Command,
+        if (m->source->client)
+            Logger::get_instance()->Log(m->bot, m->source->client, Logger::Command,
                                         "MODUNLOAD " + m->args[0]);
-        Logger::get_instance()->Log(m->bot, m->source.client, Logger::Admin,
+        Logger::get_instance()->Log(m->bot, m->source->client, Logger::Admin,
                                     "Unloaded " + m->args[0]);
      }
 
@@ -46,15 +46,15 @@ struct Modloader : public CommandHandlerBase<Modloader>
         if (ModuleRegistry::get_instance()->is_loaded(m->args[0]))
         {
             ModuleRegistry::get_instance()->unload(m->args[0]);
-            m->source.reply("Unloaded " + m->args[0]);
+            m->source->reply("Unloaded " + m->args[0]);
         }
         ModuleRegistry::get_instance()->load(m->args[0]);
-        m->source.reply("Loaded " + m->args[0]);
+        m->source->reply("Loaded " + m->args[0]);
 
-        if (m->source.client)
-            Logger::get_instance()->Log(m->bot, m->source.client, Logger::Command,
+        if (m->source->client)
+            Logger::get_instance()->Log(m->bot, m->source->client, Logger::Command,
                                         "MODRELOAD " + m->args[0]);
-        Logger::get_instance()->Log(m->bot, m->source.client, Logger::Admin,
+        Logger::get_instance()->Log(m->bot, m->source->client, Logger::Admin,
                                     "Reloaded " + m->args[0]);
      }
 
@@ -1,4 +1,6 @@
 #include "modules.h"
+#include "reactor.h"
+#include "trace.h"
 
 #include <paludis/util/instantiation_policy-impl.hh>
 #include <paludis/util/private_implementation_pattern-impl.hh>
@@ -44,6 +46,8 @@ namespace paludis
 
 void ModuleRegistry::load(std::string name) throw(ModuleError)
 {
+    ExclusiveSection exclusive;
+
     if (is_loaded(name))
         return;
 
@@ -70,6 +74,7 @@ void ModuleRegistry::load(std::string name) throw(ModuleError)
         if (!create)
             throw ModuleError("Module " + name + " does not contain a create() function.");
 
+        TraceOwner owner(name);
         mod.obj = create();
         if (!mod.obj)
             throw ModuleError("Module initialisation failed in " + name);
@@ -98,6 +103,8 @@ void ModuleRegistry::load(std::string name) throw(ModuleError)
 
 bool ModuleRegistry::unload(std::string name)
 {
+    ExclusiveSection exclusive;
+
     std::list<loaded_module>::iterator mod = _imp->modules.end();
     for (std::list<loaded_module>::iterator it = _imp->modules.begin(); it != _imp->modules.end(); ++it)
     {
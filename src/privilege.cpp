@@ -1,55 +1,184 @@
 #include "privilege.h"
 
-#include <set>
+#include <unordered_map>
+#include <mutex>
 
 #include <paludis/util/private_implementation_pattern-impl.hh>
 #include <paludis/util/wrapped_forward_iterator-impl.hh>
 
 using namespace eir;
 
+namespace
+{
+    typedef std::vector<uint64_t> Bits;
+
+    bool test(const Bits & bits, PrivilegeSet::Id id)
+    {
+        return (id >> 6) < bits.size() && (bits[id >> 6] & (uint64_t(1) << (id & 63)));
+    }
+
+    void set(Bits & bits, PrivilegeSet::Id id)
+    {
+        if ((id >> 6) >= bits.size())
+            bits.resize((id >> 6) + 1);
+        bits[id >> 6] |= uint64_t(1) << (id & 63);
+    }
+
+    // Names are never forgotten, so ids stay valid for the life of the process.
+    struct InternTable
+    {
+        std::mutex lock;
+        std::unordered_map<std::string, PrivilegeSet::Id> ids;
+
+        PrivilegeSet::Id intern(const std::string & name)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            std::unordered_map<std::string, PrivilegeSet::Id>::iterator it = ids.find(name);
+            if (it != ids.end())
+                return it->second;
+            PrivilegeSet::Id id = ids.size() + 1;
+            ids.insert(std::make_pair(name, id));
+            return id;
+        }
+
+        PrivilegeSet::Id find(const std::string & name)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            std::unordered_map<std::string, PrivilegeSet::Id>::iterator it = ids.find(name);
+            return it == ids.end() ? 0 : it->second;
+        }
+    };
+
+    InternTable & privilege_names()
+    {
+        static InternTable table;
+        return table;
+    }
+
+    InternTable & channel_names()
+    {
+        static InternTable table;
+        return table;
+    }
+}
+
 namespace paludis
 {
     template <>
     struct Implementation<PrivilegeSet>
     {
-        std::set<std::pair<std::string, std::string> > privs;
+        // Channel privileges, one small bitset per channel. Clients rarely
+        // have privileges in more than a handful.
+        std::vector<std::pair<PrivilegeSet::Id, Bits> > channels;
+
+        std::vector<std::pair<std::string, std::string> > list;
+
+        Bits *channel_bits(PrivilegeSet::Id channel)
+        {
+            for (auto it = channels.begin(); it != channels.end(); ++it)
+                if (it->first == channel)
+                    return &it->second;
+            return 0;
+        }
     };
 }
 
+PrivilegeSet::Id PrivilegeSet::privilege_id(const std::string & name)
+{
+    return privilege_names().intern(name);
+}
+
+PrivilegeSet::Id PrivilegeSet::find_privilege_id(const std::string & name)
+{
+    return privilege_names().find(name);
+}
+
+PrivilegeSet::Id PrivilegeSet::channel_id(const std::string & name)
+{
+    return channel_names().intern(name);
+}
+
+PrivilegeSet::Id PrivilegeSet::find_channel_id(const std::string & name)
+{
+    return channel_names().find(name);
+}
+
 PrivilegeSet::iterator PrivilegeSet::begin()
 {
-    return _imp->privs.begin();
+    return _imp->list.begin();
 }
 
 PrivilegeSet::iterator PrivilegeSet::end()
 {
-    return _imp->privs.end();
+    return _imp->list.end();
+}
+
+bool PrivilegeSet::has_privilege(Id channel, Id priv) const
+{
+    if (has_privilege(priv))
+        return true;
+
+    for (auto it = _imp->channels.begin(); it != _imp->channels.end(); ++it)
+        if (it->first == channel)
+            return test(it->second, priv);
+    return false;
 }
 
 bool PrivilegeSet::has_privilege(std::string c, std::string p)
 {
-    return _imp->privs.find(make_pair(c, p)) != _imp->privs.end() ||
-           _imp->privs.find(make_pair("", p)) != _imp->privs.end();
+    Id priv = find_privilege_id(p);
+    if (!priv)
+        return false;
+    if (c.empty())
+        return has_privilege(priv);
+    return has_privilege(find_channel_id(c), priv);
 }
 
 void PrivilegeSet::add_privilege(std::string c, std::string p)
 {
-    _imp->privs.insert(make_pair(c, p));
+    if (c.empty())
+    {
+        add_privilege(p);
+        return;
+    }
+
+    Id channel = channel_id(c), priv = privilege_id(p);
+
+    Bits *bits = _imp->channel_bits(channel);
+    if (!bits)
+    {
+        _imp->channels.push_back(std::make_pair(channel, Bits()));
+        bits = &_imp->channels.back().second;
+    }
+
+    if (test(*bits, priv))
+        return;
+
+    set(*bits, priv);
+    _imp->list.push_back(make_pair(c, p));
 }
 
 bool PrivilegeSet::has_privilege(std::string p)
 {
-    return _imp->privs.find(make_pair("", p)) != _imp->privs.end();
+    Id priv = find_privilege_id(p);
+    return priv && has_privilege(priv);
 }
 
 void PrivilegeSet::add_privilege(std::string p)
 {
-    _imp->privs.insert(make_pair("", p));
+    Id priv = privilege_id(p);
+    if (has_privilege(priv))
+        return;
+
+    set(_global, priv);
+    _imp->list.push_back(make_pair(std::string(), p));
 }
 
 void PrivilegeSet::clear()
 {
-    _imp->privs.clear();
+    _global.clear();
+    _imp->channels.clear();
+    _imp->list.clear();
 }
 
 PrivilegeSet::PrivilegeSet()
@@ -63,4 +192,3 @@ PrivilegeSet::~PrivilegeSet()
 
 template class paludis::WrappedForwardIterator<eir::PrivilegeSet::PrivilegeIteratorTag,
                                                const std::pair<std::string, std::string> >;
-
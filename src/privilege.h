@@ -2,18 +2,37 @@
 #define privilege_h
 
 #include <string>
+#include <vector>
+#include <stdint.h>
 #include <paludis/util/wrapped_forward_iterator.hh>
 #include <paludis/util/private_implementation_pattern.hh>
 
 namespace eir
 {
+    /*
+     * The privileges a client holds. Privilege and channel names are
+     * interned to small ids the first time they're used, and each client
+     * keeps one bitset of global privileges plus one per channel it has
+     * privileges in, so that checking an id is a shift and a mask.
+     */
     class PrivilegeSet : public paludis::PrivateImplementationPattern<PrivilegeSet>
     {
         public:
+            // Zero is never a valid id; the find_ functions return it for a
+            // name nobody has interned, which therefore nobody can hold.
+            typedef uint32_t Id;
+
+            static Id privilege_id(const std::string &);
+            static Id find_privilege_id(const std::string &);
+            static Id channel_id(const std::string &);
+            static Id find_channel_id(const std::string &);
+
             struct PrivilegeIteratorTag;
             typedef paludis::WrappedForwardIterator<PrivilegeIteratorTag,
                                                     const std::pair<std::string, std::string> > iterator;
 
+            // Each (channel, privilege) held, with an empty channel for
+            // global privileges, in the order they were added.
             iterator begin();
             iterator end();
 
@@ -24,10 +43,19 @@ namespace eir
             bool has_privilege(std::string, std::string);
             void add_privilege(std::string, std::string);
 
+            bool has_privilege(Id priv) const
+            {
+                return (priv >> 6) < _global.size() && (_global[priv >> 6] & (uint64_t(1) << (priv & 63)));
+            }
+            bool has_privilege(Id channel, Id priv) const;
+
             void clear();
 
             PrivilegeSet();
             ~PrivilegeSet();
+
+        private:
+            std::vector<uint64_t> _global;
     };
 }
 
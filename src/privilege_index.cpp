@@ -0,0 +1,111 @@
+#include "privilege_index.h"
+#include "client.h"
+#include "bot.h"
+#include "reactor.h"
+
+#include <paludis/util/private_implementation_pattern-impl.hh>
+#include <paludis/util/instantiation_policy-impl.hh>
+
+#include <deque>
+#include <list>
+
+using namespace eir;
+using namespace paludis;
+
+template class paludis::InstantiationPolicy<PrivilegeIndex, paludis::instantiation_method::SingletonTag>;
+
+namespace
+{
+    struct MatcherInfo
+    {
+        PrivilegeIndex::MatcherId id;
+        std::string type;
+        PrivilegeMatcher *matcher;
+        MatcherInfo(PrivilegeIndex::MatcherId i, std::string t, PrivilegeMatcher *m)
+            : id(i), type(t), matcher(m)
+        { }
+    };
+}
+
+namespace paludis
+{
+    template <>
+    struct Implementation<PrivilegeIndex>
+    {
+        // A deque, so that matchers can hold on to pointers as rules are added.
+        std::deque<PrivilegeRule> rules;
+        std::list<MatcherInfo> matchers;
+    };
+}
+
+PrivilegeIndex::MatcherId PrivilegeIndex::register_matcher(std::string type, PrivilegeMatcher *m)
+{
+    ExclusiveSection exclusive;
+    static unsigned int next_id = 0;
+    _imp->matchers.push_back(MatcherInfo(++next_id, type, m));
+
+    for (auto it = _imp->rules.begin(); it != _imp->rules.end(); ++it)
+        if (it->type == type)
+            m->add_rule(&*it);
+
+    return next_id;
+}
+
+void PrivilegeIndex::unregister_matcher(MatcherId id)
+{
+    ExclusiveSection exclusive;
+    for (auto it = _imp->matchers.begin(); it != _imp->matchers.end(); ++it)
+    {
+        if (it->id == id)
+        {
+            delete it->matcher;
+            _imp->matchers.erase(it);
+            return;
+        }
+    }
+}
+
+void PrivilegeIndex::add_rule(const PrivilegeRule & rule)
+{
+    ExclusiveSection exclusive;
+    _imp->rules.push_back(rule);
+    const PrivilegeRule *r = &_imp->rules.back();
+
+    for (auto it = _imp->matchers.begin(); it != _imp->matchers.end(); ++it)
+        if (it->type == r->type)
+            it->matcher->add_rule(r);
+}
+
+void PrivilegeIndex::clear_rules()
+{
+    ExclusiveSection exclusive;
+    for (auto it = _imp->matchers.begin(); it != _imp->matchers.end(); ++it)
+        it->matcher->clear_rules();
+    _imp->rules.clear();
+}
+
+void PrivilegeIndex::apply(Client & c)
+{
+    // Called from every reactor at once, so nothing shared to collect into.
+    std::vector<const PrivilegeRule *> found;
+    for (auto it = _imp->matchers.begin(); it != _imp->matchers.end(); ++it)
+    {
+        found.clear();
+        it->matcher->find_rules(c, found);
+
+        for (auto r = found.begin(); r != found.end(); ++r)
+            if ((*r)->bot.empty() || (c.bot() && (*r)->bot == c.bot()->name()))
+                c.privs().add_privilege((*r)->channel, (*r)->priv);
+    }
+}
+
+PrivilegeIndex::PrivilegeIndex()
+    : PrivateImplementationPattern<PrivilegeIndex>(new Implementation<PrivilegeIndex>)
+{
+}
+
+PrivilegeIndex::~PrivilegeIndex()
+{
+    for (auto it = _imp->matchers.begin(); it != _imp->matchers.end(); ++it)
+        delete it->matcher;
+}
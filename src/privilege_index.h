@@ -0,0 +1,60 @@
+#ifndef privilege_index_h
+#define privilege_index_h
+
+#include <paludis/util/private_implementation_pattern.hh>
+#include <paludis/util/instantiation_policy.hh>
+
+#include <string>
+#include <vector>
+
+namespace eir
+{
+    struct Client;
+
+    // A rule with a bot applies only to that bot's clients; one without
+    // applies on every bot.
+    struct PrivilegeRule
+    {
+        std::string type, match, channel, priv, bot;
+    };
+
+    /*
+     * Indexes the rules of one privilege type, and finds the ones that apply
+     * to a given client. Rule pointers remain valid until clear_rules().
+     */
+    class PrivilegeMatcher
+    {
+        public:
+            virtual void add_rule(const PrivilegeRule *) = 0;
+            virtual void clear_rules() = 0;
+            virtual void find_rules(const Client &, std::vector<const PrivilegeRule *> &) = 0;
+            virtual ~PrivilegeMatcher() { }
+    };
+
+    /*
+     * The privilege rule list, as maintained by the privileges module, and
+     * the matchers that index it by type. Types without a registered matcher
+     * are still stored, and get indexed if one turns up later.
+     */
+    class PrivilegeIndex : public paludis::PrivateImplementationPattern<PrivilegeIndex>,
+                           public paludis::InstantiationPolicy<PrivilegeIndex, paludis::instantiation_method::SingletonTag>
+    {
+        public:
+            typedef unsigned int MatcherId;
+
+            // Takes ownership of the matcher.
+            MatcherId register_matcher(std::string type, PrivilegeMatcher *);
+            void unregister_matcher(MatcherId);
+
+            void add_rule(const PrivilegeRule &);
+            void clear_rules();
+
+            // Grants the client everything from the rules that match it.
+            void apply(Client &);
+
+            PrivilegeIndex();
+            ~PrivilegeIndex();
+    };
+}
+
+#endif
@@ -0,0 +1,668 @@
+#include "reactor.h"
+#include "event_internal.h"
+#include "exceptions.h"
+#include "logger.h"
+
+#include <paludis/util/private_implementation_pattern-impl.hh>
+
+#include <list>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+using namespace eir;
+using namespace paludis;
+
+namespace
+{
+    struct Source
+    {
+        Reactor::SourceId id;
+        int fd;
+        bool writable;
+        Reactor::Callback callback;
+        Source(Reactor::SourceId i, int f, bool w, Reactor::Callback c) : id(i), fd(f), writable(w), callback(c) { }
+    };
+
+    struct Posted
+    {
+        Reactor::Callback f;
+        WorkerPool::Token token;
+        Posted(Reactor::Callback c, WorkerPool::Token t) : f(std::move(c)), token(std::move(t)) { }
+
+        bool live() const { return !token || *token; }
+    };
+
+    void after_fork();
+
+    // Allocated once and never freed, so that it's still there for whatever
+    // is destroyed at exit.
+    struct World
+    {
+        std::atomic<Reactor *> reactors[Reactor::max_reactors];
+        paludis::Implementation<Reactor> *imps[Reactor::max_reactors];
+        std::atomic<unsigned int> count, next_assigned;
+        std::thread::id main_thread;
+
+        // For ExclusiveSection: how many threads are in Reactor::run(), and
+        // how many of those are held.
+        std::mutex lock;
+        std::condition_variable parked_changed, resumed;
+        std::atomic<bool> stop_requested;
+        unsigned int looping, parked;
+
+        World()
+            : count(0), next_assigned(0), main_thread(std::this_thread::get_id()),
+              stop_requested(false), looping(0), parked(0)
+        {
+            for (unsigned int i = 0; i < Reactor::max_reactors; ++i)
+            {
+                reactors[i] = 0;
+                imps[i] = 0;
+            }
+            pthread_atfork(0, 0, &after_fork);
+        }
+
+        unsigned int others_looping(bool self) const
+        {
+            return looping - (self ? 1 : 0);
+        }
+    };
+
+    World & world()
+    {
+        static World *w = new World;
+        return *w;
+    }
+
+    PALUDIS_TLS Reactor *current_reactor = 0;
+    PALUDIS_TLS bool thread_looping = false;
+    PALUDIS_TLS int exclusive_depth = 0;
+    PALUDIS_TLS bool thread_in_pass = false;
+
+    struct Looping
+    {
+        Looping()
+        {
+            std::lock_guard<std::mutex> guard(world().lock);
+            ++world().looping;
+            thread_looping = true;
+        }
+
+        ~Looping()
+        {
+            std::lock_guard<std::mutex> guard(world().lock);
+            --world().looping;
+            thread_looping = false;
+            world().parked_changed.notify_all();
+        }
+    };
+
+    struct InPass
+    {
+        InPass() { thread_in_pass = true; }
+        ~InPass() { thread_in_pass = false; }
+    };
+}
+
+namespace paludis
+{
+    template <>
+    struct Implementation<Reactor>
+    {
+        unsigned int index;
+        std::list<Source> sources;
+        Reactor::SourceId next_id;
+        EventManagerImpl events;
+
+        std::mutex post_lock;
+        std::deque<Posted> posted, posted_exclusive;
+        int wake_pipe[2];
+
+        std::thread thread;
+        std::atomic<bool> stopping, stopped;
+
+        Implementation(unsigned int i)
+            : index(i), next_id(1), events(i), stopping(false), stopped(false)
+        {
+            if (pipe(wake_pipe) < 0)
+                throw eir::InternalError(std::string("Couldn't create reactor pipe: ") + strerror(errno));
+            for (int j = 0; j < 2; ++j)
+            {
+                fcntl(wake_pipe[j], F_SETFL, O_NONBLOCK);
+                fcntl(wake_pipe[j], F_SETFD, FD_CLOEXEC);
+            }
+        }
+
+        ~Implementation()
+        {
+            close(wake_pipe[0]);
+            close(wake_pipe[1]);
+        }
+
+        void wake()
+        {
+            char c = 0;
+            if (write(wake_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+                Logger::get_instance()->Log(0, 0, Logger::Warning,
+                        std::string("Couldn't wake reactor: ") + strerror(errno));
+        }
+
+        void wait(std::vector<Reactor::SourceId> & ready)
+        {
+            fd_set read, write;
+            FD_ZERO(&read);
+            FD_ZERO(&write);
+            FD_SET(wake_pipe[0], &read);
+            int maxfd = wake_pipe[0];
+            for (std::list<Source>::iterator it = sources.begin(); it != sources.end(); ++it)
+            {
+                FD_SET(it->fd, it->writable ? &write : &read);
+                maxfd = std::max(maxfd, it->fd);
+            }
+
+            // With nothing scheduled, only a source or a post can wake us.
+            time_t next = events.next_event_time();
+            timeval timeout;
+            timeout.tv_sec = timeout.tv_usec = 0;
+            if (next > time(NULL))
+                timeout.tv_sec = next - time(NULL);
+
+            if (select(maxfd + 1, &read, &write, NULL, next ? &timeout : NULL) <= 0)
+                return;
+
+            for (std::list<Source>::iterator it = sources.begin(); it != sources.end(); ++it)
+                if (FD_ISSET(it->fd, it->writable ? &write : &read))
+                    ready.push_back(it->id);
+        }
+
+        void dispatch(const std::vector<Reactor::SourceId> & ready)
+        {
+            // A callback may remove any source, including the one it's for,
+            // so work from ids rather than iterators.
+            for (std::vector<Reactor::SourceId>::const_iterator id = ready.begin(); id != ready.end(); ++id)
+            {
+                for (std::list<Source>::iterator it = sources.begin(); it != sources.end(); ++it)
+                {
+                    if (it->id != *id)
+                        continue;
+                    Reactor::Callback callback = it->callback;
+                    run_guarded(callback, "Error handling input");
+                    break;
+                }
+            }
+        }
+
+        void run_posted()
+        {
+            char buf[64];
+            while (read(wake_pipe[0], buf, sizeof(buf)) > 0)
+                ;
+
+            std::deque<Posted> done;
+            {
+                std::lock_guard<std::mutex> guard(post_lock);
+                done.swap(posted);
+            }
+
+            for (std::deque<Posted>::iterator it = done.begin(); it != done.end(); ++it)
+                if (it->live())
+                    run_guarded(it->f, "Error running completion");
+        }
+
+        // Between passes, so that whoever's stopped is stopped at the top of
+        // its loop rather than in the middle of something.
+        void run_exclusive()
+        {
+            std::deque<Posted> done;
+            {
+                std::lock_guard<std::mutex> guard(post_lock);
+                done.swap(posted_exclusive);
+            }
+            if (done.empty())
+                return;
+
+            ExclusiveSection exclusive;
+            for (std::deque<Posted>::iterator it = done.begin(); it != done.end(); ++it)
+                if (it->live())
+                    run_guarded(it->f, "Error running exclusive work");
+        }
+
+        void run_guarded(const std::function<void ()> & f, const char *what)
+        {
+            try
+            {
+                f();
+            }
+            catch (eir::Exception & e)
+            {
+                if (e.fatal())
+                    throw;
+
+                Logger::get_instance()->Log(0, 0, Logger::Warning,
+                        std::string(what) + ": " + e.message() + " (" + e.what() + ")");
+            }
+            // One bad handler mustn't take the reactor, and every bot on it,
+            // down with it.
+            catch (std::exception & e)
+            {
+                Logger::get_instance()->Log(0, 0, Logger::Warning, std::string(what) + ": " + e.what());
+            }
+            catch (...)
+            {
+                Logger::get_instance()->Log(0, 0, Logger::Warning, std::string(what) + ": unknown exception");
+            }
+        }
+
+        void park_if_requested()
+        {
+            World & w = world();
+            if (!w.stop_requested.load(std::memory_order_acquire))
+                return;
+
+            std::unique_lock<std::mutex> guard(w.lock);
+            if (!w.stop_requested)
+                return;
+            ++w.parked;
+            w.parked_changed.notify_all();
+            w.resumed.wait(guard, [&w] () { return !w.stop_requested; });
+            --w.parked;
+        }
+
+        // Fatal errors end this thread's loop and are thrown again on the
+        // main thread, which decides what happens to everything.
+        void thread_main(Reactor *self)
+        {
+            current_reactor = self;
+            while (!stopping)
+            {
+                try
+                {
+                    self->run();
+                }
+                catch (DisconnectedException &)
+                {
+                    forward(std::current_exception());
+                    continue;
+                }
+                catch (...)
+                {
+                    forward(std::current_exception());
+                }
+                break;
+            }
+            stopped = true;
+        }
+
+        static void forward(std::exception_ptr error)
+        {
+            Reactor::main()->post([error] () { std::rethrow_exception(error); });
+        }
+    };
+}
+
+namespace
+{
+    // Only the forking thread exists in the child, so every other reactor is
+    // as good as stopped. Forking while other reactors run is only safe from
+    // inside an ExclusiveSection, which leaves the world's lock free.
+    void after_fork()
+    {
+        World & w = world();
+        for (unsigned int i = 0; i < w.count; ++i)
+            if (w.reactors[i] != current_reactor)
+                w.imps[i]->stopped = true;
+        w.looping = thread_looping ? 1 : 0;
+        w.parked = 0;
+    }
+}
+
+Reactor *Reactor::current()
+{
+    if (!current_reactor && std::this_thread::get_id() == world().main_thread)
+        current_reactor = main();
+    return current_reactor;
+}
+
+Reactor *Reactor::main()
+{
+    World & w = world();
+    Reactor *r = w.reactors[0];
+    if (!r)
+    {
+        w.reactors[0] = r = new Reactor(0);
+        w.count = std::max(w.count.load(), 1u);
+    }
+    return r;
+}
+
+Reactor *Reactor::get(unsigned int index)
+{
+    return index < world().count ? world().reactors[index].load() : 0;
+}
+
+unsigned int Reactor::count()
+{
+    main();
+    return world().count;
+}
+
+void Reactor::start_threads(unsigned int n)
+{
+    World & w = world();
+    main();
+    n = std::min(n, unsigned(max_reactors));
+
+    // Any stopped by stop_threads() carry on where they were.
+    for (unsigned int i = 1; i < w.count; ++i)
+    {
+        Reactor *r = w.reactors[i];
+        if (r->_imp->thread.joinable())
+            continue;
+        r->_imp->stopping = false;
+        r->_imp->stopped = false;
+        r->_imp->thread = std::thread(&Implementation<Reactor>::thread_main, r->_imp.get(), r);
+    }
+
+    while (w.count < n)
+    {
+        unsigned int i = w.count;
+        Reactor *r = new Reactor(i);
+        w.reactors[i] = r;
+        ++w.count;
+        r->_imp->thread = std::thread(&Implementation<Reactor>::thread_main, r->_imp.get(), r);
+    }
+}
+
+void Reactor::stop_threads()
+{
+    World & w = world();
+    for (unsigned int i = 1; i < w.count; ++i)
+    {
+        w.reactors[i].load()->_imp->stopping = true;
+        w.reactors[i].load()->_imp->wake();
+    }
+    for (unsigned int i = 1; i < w.count; ++i)
+        if (w.reactors[i].load()->_imp->thread.joinable())
+            w.reactors[i].load()->_imp->thread.join();
+}
+
+Reactor *Reactor::assign()
+{
+    return get(world().next_assigned++ % count());
+}
+
+unsigned int Reactor::index() const
+{
+    return _imp->index;
+}
+
+bool Reactor::in_thread() const
+{
+    return current() == this || _imp->stopped || ExclusiveSection::held();
+}
+
+EventManagerImpl *Reactor::events()
+{
+    return &_imp->events;
+}
+
+Reactor::SourceId Reactor::add_source(int fd, Callback f, bool writable)
+{
+    _imp->sources.push_back(Source(_imp->next_id++, fd, writable, f));
+    return _imp->sources.back().id;
+}
+
+void Reactor::remove_source(SourceId id)
+{
+    for (std::list<Source>::iterator it = _imp->sources.begin(); it != _imp->sources.end(); ++it)
+    {
+        if (it->id == id)
+        {
+            _imp->sources.erase(it);
+            return;
+        }
+    }
+}
+
+void Reactor::post(Callback f, WorkerPool::Token token)
+{
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> guard(_imp->post_lock);
+        was_empty = _imp->posted.empty();
+        _imp->posted.push_back(Posted(std::move(f), std::move(token)));
+    }
+    if (was_empty)
+        _imp->wake();
+}
+
+void Reactor::post_exclusive(Callback f, WorkerPool::Token token)
+{
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> guard(_imp->post_lock);
+        was_empty = _imp->posted_exclusive.empty();
+        _imp->posted_exclusive.push_back(Posted(std::move(f), std::move(token)));
+    }
+    if (was_empty && current() != this)
+        _imp->wake();
+}
+
+bool Reactor::in_pass()
+{
+    return thread_in_pass && !ExclusiveSection::held();
+}
+
+void Reactor::cancel(const WorkerPool::Token & token)
+{
+    // Dropped here rather than whenever the loops get to them, since they
+    // may hold code from a module that's about to be unloaded.
+    std::deque<Posted> dropped;
+    for (unsigned int i = 0; i < count(); ++i)
+    {
+        Implementation<Reactor> & imp = *get(i)->_imp.get();
+        std::lock_guard<std::mutex> guard(imp.post_lock);
+        std::deque<Posted> *queues[] = { &imp.posted, &imp.posted_exclusive };
+        for (unsigned int q = 0; q < 2; ++q)
+        {
+            for (std::deque<Posted>::iterator it = queues[q]->begin(); it != queues[q]->end(); )
+            {
+                if (it->token == token)
+                {
+                    dropped.push_back(std::move(*it));
+                    it = queues[q]->erase(it);
+                }
+                else
+                    ++it;
+            }
+        }
+    }
+}
+
+void Reactor::run()
+{
+    LazyContext c("In main message loop");
+
+    Looping looping;
+    std::vector<SourceId> ready;
+
+    while (!_imp->stopping)
+    {
+        _imp->run_exclusive();
+        _imp->park_if_requested();
+
+        ready.clear();
+        _imp->wait(ready);
+
+        _imp->park_if_requested();
+
+        InPass pass;
+        _imp->dispatch(ready);
+        _imp->run_posted();
+        _imp->run_guarded(std::bind(&EventManagerImpl::run_events, &_imp->events), "Error running events");
+    }
+}
+
+Reactor::Reactor(unsigned int index)
+    : PrivateImplementationPattern<Reactor>(new Implementation<Reactor>(index))
+{
+    world().imps[index] = _imp.get();
+}
+
+Reactor::~Reactor()
+{
+}
+
+ExclusiveSection::ExclusiveSection(bool wanted)
+    : _entered(wanted), _held(false)
+{
+    if (!_entered || exclusive_depth++ > 0)
+        return;
+
+    World & w = world();
+    if (w.count <= 1)
+        return;
+
+    std::unique_lock<std::mutex> guard(w.lock);
+
+    // Someone else got there first; wait as though parked.
+    while (w.stop_requested)
+    {
+        if (thread_looping)
+        {
+            ++w.parked;
+            w.parked_changed.notify_all();
+        }
+        w.resumed.wait(guard, [&w] () { return !w.stop_requested; });
+        if (thread_looping)
+            --w.parked;
+    }
+
+    w.stop_requested = true;
+    _held = true;
+
+    for (unsigned int i = 0; i < w.count; ++i)
+        if (w.reactors[i] != current_reactor)
+            w.imps[i]->wake();
+
+    w.parked_changed.wait(guard, [&w] () { return w.parked >= w.others_looping(thread_looping); });
+}
+
+ExclusiveSection::~ExclusiveSection()
+{
+    if (!_entered)
+        return;
+    --exclusive_depth;
+    if (!_held)
+        return;
+
+    std::lock_guard<std::mutex> guard(world().lock);
+    world().stop_requested = false;
+    world().resumed.notify_all();
+}
+
+bool ExclusiveSection::held()
+{
+    return exclusive_depth > 0;
+}
+
+SharedLock::SharedLock()
+    : _depth(0), _lent_depth(0)
+{
+}
+
+void SharedLock::lock()
+{
+    std::thread::id self = std::this_thread::get_id();
+    {
+        std::lock_guard<std::mutex> guard(_mutex);
+        if (_depth && _owner == self)
+        {
+            ++_depth;
+            return;
+        }
+        if (!_depth)
+        {
+            _owner = self;
+            _depth = 1;
+            return;
+        }
+
+        // Whoever has it is stopped until our section is over, so is done
+        // with it until then.
+        if (ExclusiveSection::held() && !_lent_depth)
+        {
+            _lent_owner = _owner;
+            _lent_depth = _depth;
+            _owner = self;
+            _depth = 1;
+            return;
+        }
+    }
+
+    World & w = world();
+    bool parked = thread_looping && w.count > 1;
+    if (parked)
+    {
+        std::lock_guard<std::mutex> guard(w.lock);
+        ++w.parked;
+        w.parked_changed.notify_all();
+    }
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> guard(_mutex);
+            _released.wait(guard, [this] () { return _depth == 0; });
+            if (!parked)
+            {
+                _owner = self;
+                _depth = 1;
+                return;
+            }
+        }
+
+        // Only stop counting as parked while nobody needs us to be.
+        std::unique_lock<std::mutex> world_guard(w.lock);
+        w.resumed.wait(world_guard, [&w] () { return !w.stop_requested; });
+        std::lock_guard<std::mutex> guard(_mutex);
+        if (!_depth)
+        {
+            _owner = self;
+            _depth = 1;
+            --w.parked;
+            return;
+        }
+    }
+}
+
+void SharedLock::unlock()
+{
+    std::lock_guard<std::mutex> guard(_mutex);
+    if (--_depth)
+        return;
+
+    if (_lent_depth)
+    {
+        _owner = _lent_owner;
+        _depth = _lent_depth;
+        _lent_depth = 0;
+        return;
+    }
+
+    _owner = std::thread::id();
+    _released.notify_all();
+}
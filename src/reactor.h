@@ -0,0 +1,146 @@
+#ifndef reactor_h
+#define reactor_h
+
+#include "worker_pool.h"
+
+#include <paludis/util/private_implementation_pattern.hh>
+#include <paludis/util/instantiation_policy.hh>
+
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+namespace eir
+{
+    class EventManagerImpl;
+
+    /*
+     * A main loop. The main thread has one, and by default every bot runs on
+     * it. start_threads() adds more, each on a thread of its own, and bots
+     * are spread across them. A bot's connection, the events it sets and
+     * anything posted to it all run on its reactor's thread.
+     *
+     * Everything else in the process (the command registry, modules, the
+     * logger, storage and global settings) is shared. Reading it needs no
+     * lock; changing it needs an ExclusiveSection. What a module shares
+     * between bots and changes on every line has a SharedLock of its own.
+     */
+    class Reactor : public paludis::PrivateImplementationPattern<Reactor>,
+                    private paludis::InstantiationPolicy<Reactor, paludis::instantiation_method::NonCopyableTag>
+    {
+        public:
+            typedef unsigned int SourceId;
+            typedef std::function<void ()> Callback;
+
+            enum { max_reactors = 64 };
+
+            // The calling thread's reactor, or null on a thread without one,
+            // such as the worker pool's.
+            static Reactor *current();
+            static Reactor *main();
+            static Reactor *get(unsigned int index);
+            static unsigned int count();
+
+            // Main thread only. Brings the number of reactors up to n, and
+            // restarts any that stop_threads() stopped.
+            static void start_threads(unsigned int n);
+            // Main thread only. Stops the others and waits for them; their
+            // reactors stay, so that what was on them can still be closed.
+            static void stop_threads();
+
+            // Takes each reactor in turn, for placing new bots.
+            static Reactor *assign();
+
+            unsigned int index() const;
+
+            // Whether this reactor's state can be touched from here: on its
+            // own thread, once its thread has stopped, or in an
+            // ExclusiveSection.
+            bool in_thread() const;
+
+            EventManagerImpl *events();
+
+            // Calls f whenever fd is readable, or if writable is set,
+            // whenever it's writable. Sources may be added and removed from
+            // inside a callback.
+            SourceId add_source(int fd, Callback f, bool writable = false);
+            void remove_source(SourceId);
+
+            // From any thread. f runs on this reactor's thread the next time
+            // round its loop, unless the token has been cancelled by then.
+            void post(Callback f, WorkerPool::Token = WorkerPool::Token());
+
+            // From any thread. f runs on this reactor's thread in an
+            // ExclusiveSection, once the pass of its loop that's under way is
+            // finished and before the next one starts.
+            void post_exclusive(Callback f, WorkerPool::Token = WorkerPool::Token());
+
+            // Throws away anything posted to any reactor with this token.
+            static void cancel(const WorkerPool::Token &);
+
+            // Whether the calling thread is part way through a pass of its
+            // reactor's loop, where stopping the others would leave them
+            // waiting wherever they'd got to. Work that needs them stopped is
+            // best posted with post_exclusive() from there.
+            static bool in_pass();
+
+            // Runs until something fatal is thrown. Fatal errors on the other
+            // reactors' threads are thrown from the main one's.
+            void run();
+
+        private:
+            Reactor(unsigned int index);
+            ~Reactor();
+    };
+
+    /*
+     * While one of these exists, every other reactor thread is held between
+     * passes of its loop, so that shared state can be changed. They nest, and
+     * cost nothing while there is only one reactor.
+     *
+     * Commands and config lines get one between passes; see
+     * Reactor::post_exclusive(). Anything else should only need one to change
+     * something rarely, since a thread that asks for one part way through a
+     * pass while another has it waits there as though it were parked.
+     */
+    class ExclusiveSection : private paludis::InstantiationPolicy<ExclusiveSection, paludis::instantiation_method::NonCopyableTag>
+    {
+        private:
+            bool _entered, _held;
+
+        public:
+            explicit ExclusiveSection(bool wanted = true);
+            ~ExclusiveSection();
+
+            // Whether the calling thread is inside one.
+            static bool held();
+    };
+
+    /*
+     * A recursive lock for state a module shares between reactors and
+     * changes on every line, so that its handlers needn't stop the others.
+     * For reactor threads only.
+     *
+     * The holder may still enter an ExclusiveSection: a thread waiting for
+     * the lock counts as parked, and the one in the section may take the
+     * lock from a holder it has stopped until it's done. So don't wait for
+     * one of these while holding another.
+     */
+    class SharedLock : private paludis::InstantiationPolicy<SharedLock, paludis::instantiation_method::NonCopyableTag>
+    {
+        private:
+            std::mutex _mutex;
+            std::condition_variable _released;
+            std::thread::id _owner, _lent_owner;
+            unsigned int _depth, _lent_depth;
+
+        public:
+            SharedLock();
+
+            void lock();
+            void unlock();
+    };
+}
+
+#endif
@@ -2,27 +2,31 @@
 #include "exceptions.h"
 #include "event_internal.h"
 #include "logger.h"
+#include "trace.h"
+#include "reactor.h"
+#include "handoff.h"
+#include "setting_handle.h"
 
 #include <paludis/util/private_implementation_pattern-impl.hh>
 
 #include <queue>
+#include <deque>
+#include <memory>
 #include <cstdlib>
 
 #include <unistd.h>
-#include <sys/socket.h>
-#ifdef __FreeBSD__
-#  include <netinet/in.h>
-#endif
-#include <sys/select.h>
-#include <sys/types.h>
-#include <sys/time.h>
-#include <netdb.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 
 using namespace eir;
 using paludis::Implementation;
+using namespace std::placeholders;
+
+namespace
+{
+    SettingHandle<int> connect_timeout("connect_timeout", 30);
+}
 
 namespace paludis
 {
@@ -32,29 +36,49 @@ namespace paludis
         int socketfd;
         int port;
         std::string servername;
-        hostent *host;
-        sockaddr_in server;
+
+        // Only while connecting.
+        std::unique_ptr<Connector> connector;
 
         std::queue<std::string> _send_queue;
 
-        Server::Handler _handler;
+        Server::Handler _handler, _connected, _lost, _failed;
         Bot *_bot;
 
+        // The reactor whose thread reads this connection.
+        Reactor *_reactor;
+        Reactor::SourceId _source_id;
+        EventManager::id _send_id;
+        bool _started;
+
+        void connected(int fd, std::string host, std::string port);
+        void connect_failed(std::string reason);
+        void watch();
+
         void maybe_send_stuff();
         void io_event();
         void do_receive_stuff();
-        void run();
+        void readable();
+        void stop();
+        void close_socket();
 
-        enum { bufsize = 1024 };
+        // Room for 8191 bytes of message tags plus a 512-byte message.
+        enum { bufsize = 8191 + 512 };
         char recvbuf[bufsize];
         int recvpos;
+        bool discarding;
+
+        // Complete lines read but not yet handled. They're kept here rather
+        // than on the stack, so that a restart thrown by one of them hands
+        // the rest over to the next image.
+        std::deque<std::string> recv_lines;
 
         int cur_burst;
         int max_burst, rate_time, rate_num;
 
-        Implementation(Server::Handler h, Bot *b)
-                : _handler(h), _bot(b),
-                  recvpos(0), cur_burst(0), max_burst(4), rate_time(2), rate_num(1)
+        Implementation(Server::Handler h, Server::Handler c, Server::Handler l, Server::Handler f, Bot *b)
+                : socketfd(-1), port(0), _handler(h), _connected(c), _lost(l), _failed(f), _bot(b), _reactor(0), _source_id(0),
+                  _send_id(0), _started(false), recvpos(0), discarding(false), cur_burst(0), max_burst(4), rate_time(2), rate_num(1)
         {
         }
 
@@ -64,13 +88,14 @@ namespace paludis
     };
 }
 
-Server::Server(const Handler& handler, Bot *bot)
-    : paludis::PrivateImplementationPattern<Server>(new paludis::Implementation<Server>(handler, bot))
+Server::Server(const Handler& handler, const Handler& connected, const Handler& lost, const Handler& failed, Bot *bot)
+    : paludis::PrivateImplementationPattern<Server>(new paludis::Implementation<Server>(handler, connected, lost, failed, bot))
 {
 }
 
 Server::~Server()
 {
+    close();
 }
 
 void Server::set_throttle(int burst, int time, int number)
@@ -80,41 +105,144 @@ void Server::set_throttle(int burst, int time, int number)
     _imp->rate_num  = number;
 }
 
-void Server::connect(std::string host, std::string port)
+void Server::connect(const Connector::ServerList & servers)
 {
-    _imp->servername = host;
-    _imp->port = std::atoi(port.c_str());
+    // Whatever was queued was for a connection that's gone or never was.
+    close();
+    purge();
+    _imp->connector.reset(new Connector(servers, connect_timeout(_imp->_bot),
+                    std::bind(&Implementation<Server>::connected, _imp.get(), _1, _2, _3),
+                    std::bind(&Implementation<Server>::connect_failed, _imp.get(), _1), _imp->_bot));
+}
 
-    if ((_imp->socketfd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1)
-        throw ConnectionError(strerror(errno));
+void Implementation<Server>::connected(int fd, std::string h, std::string p)
+{
+    connector.reset();
+    socketfd = fd;
+    servername = h;
+    port = std::atoi(p.c_str());
+    if (_started)
+        watch();
+    _connected(h);
+}
 
-    if (! (_imp->host = gethostbyname(_imp->servername.c_str())))
+void Implementation<Server>::connect_failed(std::string reason)
+{
+    connector.reset();
+    _failed(reason);
+}
+
+void Server::disconnect(std::string reason)
+{
+    if (_imp->socketfd < 0)
     {
-        if (! (_imp->host = gethostbyaddr(_imp->servername.c_str(), _imp->servername.length(), AF_INET)))
-            throw ConnectionError(strerror(errno));
+        close();
+        return;
     }
 
-    _imp->server.sin_family = AF_INET;
-    _imp->server.sin_port = htons(_imp->port);
-    memcpy(&_imp->server.sin_addr, _imp->host->h_addr, _imp->host->h_length);
+    std::string line = "QUIT :" + reason + "\r\n";
+    int flags = fcntl(_imp->socketfd, F_GETFL, 0);
+    fcntl(_imp->socketfd, F_SETFL, flags & ~O_NONBLOCK);
+    write(_imp->socketfd, line.c_str(), line.length());
+    close();
+}
 
-    if ((::connect(_imp->socketfd, reinterpret_cast<sockaddr*>(&_imp->server), sizeof(_imp->server))) == -1)
-        throw ConnectionError(strerror(errno));
+void Server::close()
+{
+    _imp->close_socket();
+}
 
-    int flags = fcntl(_imp->socketfd, F_GETFL, 0);
-    fcntl(_imp->socketfd, F_SETFL, flags | O_NONBLOCK);
-    fcntl(_imp->socketfd, F_SETFD, FD_CLOEXEC);
+Value Server::release()
+{
+    Value ret(Value::kvarray);
+    if (_imp->socketfd < 0)
+        return ret;
+
+    _imp->stop();
+
+    ret["fd"] = _imp->socketfd;
+    ret["host"] = _imp->servername;
+    ret["port"] = _imp->port;
+    std::string unread;
+    for (std::deque<std::string>::iterator it = _imp->recv_lines.begin(); it != _imp->recv_lines.end(); ++it)
+        unread += *it;
+    ret["unread"] = unread + std::string(_imp->recvbuf, _imp->recvpos);
+    ret["discarding"] = _imp->discarding ? 1 : 0;
+    ret["burst"] = _imp->cur_burst;
+
+    Value unsent(Value::array);
+    for ( ; !_imp->_send_queue.empty(); _imp->_send_queue.pop())
+        unsent.push_back(_imp->_send_queue.front());
+    ret["unsent"] = unsent;
+
+    Handoff::keep_open(_imp->socketfd);
+    _imp->socketfd = -1;
+    _imp->recvpos = 0;
+    _imp->discarding = false;
+    _imp->recv_lines.clear();
 
+    return ret;
 }
 
-void Server::disconnect(std::string reason)
+void Server::adopt(const Value & state)
+{
+    close();
+
+    int fd = Handoff::get_int(state, "fd", -1);
+    if (fd < 0)
+        throw ConnectionError("No connection to take over");
+
+    _imp->socketfd = fd;
+    _imp->servername = Handoff::get_string(state, "host");
+    _imp->port = Handoff::get_int(state, "port");
+
+    // Whole lines are those the previous image had read but not handled,
+    // and come first; only what follows them can be part of a line being
+    // discarded.
+    std::string unread = Handoff::get_string(state, "unread");
+    std::string::size_type nl = unread.rfind('\n');
+    if (nl != std::string::npos)
+    {
+        std::string::size_type start = 0;
+        for (std::string::size_type end = unread.find('\n'); end <= nl; end = unread.find('\n', start))
+        {
+            _imp->recv_lines.push_back(unread.substr(start, end + 1 - start));
+            start = end + 1;
+        }
+        unread.erase(0, nl + 1);
+    }
+
+    _imp->discarding = Handoff::get_int(state, "discarding");
+    if (unread.size() >= sizeof(_imp->recvbuf))
+    {
+        unread.clear();
+        _imp->discarding = true;
+    }
+    memcpy(_imp->recvbuf, unread.data(), unread.size());
+    _imp->recvpos = unread.size();
+    _imp->cur_burst = Handoff::get_int(state, "burst");
+
+    const Value & unsent = Handoff::get(state, "unsent");
+    if (unsent.Type() == Value::array)
+        for (ValueArray::const_iterator it = unsent.Array().begin(); it != unsent.Array().end(); ++it)
+            _imp->_send_queue.push(it->String());
+}
+
+void Server::discard(const Value & state, std::string reason)
 {
+    int fd = Handoff::get_int(state, "fd", -1);
+    if (fd < 0)
+        return;
+
     std::string line = "QUIT :" + reason + "\r\n";
-    int flags = fcntl(_imp->socketfd, F_GETFL, 0);
-    fcntl(_imp->socketfd, F_SETFL, flags & ~O_NONBLOCK);
-    write(_imp->socketfd, line.c_str(), line.length());
-    close(_imp->socketfd);
-    _imp->socketfd = -1;
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    ssize_t written = write(fd, line.c_str(), line.length());
+    if (written != ssize_t(line.length()))
+        Logger::get_instance()->Log(0, 0, Logger::Warning, "Couldn't send QUIT to " +
+                Handoff::get_string(state, "host") + ": " +
+                (written < 0 ? std::string(strerror(errno)) : std::string("short write")));
+    ::close(fd);
 }
 
 void Server::purge()
@@ -125,7 +253,8 @@ void Server::purge()
 
 void Server::send(std::string line)
 {
-    Context c("Sending line " + line);
+    LazyContext c("Sending line ", line);
+    TraceSpan span("server", "send", _imp->_bot);
     std::string::size_type p;
 
     p = line.rfind("\r\n");
@@ -146,6 +275,11 @@ void Server::send(std::string line)
 
 void Implementation<Server>::maybe_send_stuff()
 {
+    if (_send_queue.empty() || socketfd < 0)
+        return;
+
+    TraceSpan span("server", "flush", _bot);
+
     while(cur_burst < max_burst && ! _send_queue.empty())
     {
         std::string line = _send_queue.front();
@@ -164,7 +298,7 @@ void Implementation<Server>::io_event()
 
 void Implementation<Server>::do_receive_stuff()
 {
-    std::queue<std::string> recv_lines;
+    bool closed = false;
 
     while(true)
     {
@@ -172,7 +306,10 @@ void Implementation<Server>::do_receive_stuff()
         int r = read(socketfd, recvbuf + recvpos, bufsize - recvpos);
 
         if (r == 0)
+        {
+            closed = true;
             break;
+        }
         else if (r == -1)
         {
             error = errno;
@@ -195,8 +332,10 @@ void Implementation<Server>::do_receive_stuff()
                 break;
 
             ++end;
-            std::string line(recvbuf + start, end - start);
-            recv_lines.push(line);
+            if (discarding)
+                discarding = false;
+            else
+                recv_lines.push_back(std::string(recvbuf + start, end - start));
 
             start = end;
         }
@@ -204,64 +343,88 @@ void Implementation<Server>::do_receive_stuff()
         memmove(recvbuf, recvbuf + start, end - start);
         recvpos -= start;
 
+        // A line too long for the buffer can't be valid; drop it rather
+        // than stalling.
+        if (recvpos == bufsize)
+        {
+            Logger::get_instance()->Log(_bot, 0, Logger::Warning, "Discarding overlong line from server");
+            recvpos = 0;
+            discarding = true;
+        }
     }
 
     while (! recv_lines.empty())
     {
-        _handler(recv_lines.front());
-        recv_lines.pop();
+        std::string line = recv_lines.front();
+        recv_lines.pop_front();
+        _handler(line);
     }
+
+    // Now that select() watches the socket, an unnoticed EOF would spin.
+    if (closed)
+        throw DisconnectedException("Connection closed by server");
 }
 
-void Server::run()
+void Server::start()
 {
-    _imp->run();
+    _imp->stop();
+    _imp->_reactor = Reactor::current();
+    _imp->_started = true;
+    _imp->_send_id = EventManager::get_instance()->add_recurring_event(_imp->rate_time,
+                                    std::bind(&Implementation<Server>::io_event, _imp.get()));
+
+    if (_imp->socketfd >= 0)
+        _imp->watch();
 }
 
-void Implementation<Server>::run()
+void Implementation<Server>::watch()
 {
-    Context c("In main message loop");
-
-    EventManager::id _send_id = EventManager::get_instance()->add_recurring_event(rate_time,
-                                    std::bind(&Implementation<Server>::io_event, this));
+    _source_id = _reactor->add_source(socketfd, std::bind(&Implementation<Server>::readable, this));
+    maybe_send_stuff();
+    readable();
+}
 
-    do_receive_stuff();
+void Implementation<Server>::stop()
+{
+    if (_source_id)
+        _reactor->remove_source(_source_id);
+    if (_send_id)
+        EventManager::get_instance()->remove_event(_send_id);
+    _source_id = _send_id = 0;
+    _started = false;
+}
 
-    while(true)
+void Implementation<Server>::readable()
+{
+    std::string reason;
+    try
     {
-        timeval timeout;
-        timeout.tv_sec = timeout.tv_usec = 0;
-
-        fd_set read, write, except;
-        FD_ZERO(&read);
-        FD_ZERO(&write);
-        FD_ZERO(&except);
-        FD_SET(socketfd, &read);
-        FD_SET(socketfd, &write);
-        FD_SET(socketfd, &except);
-
-        timeout.tv_sec = static_cast<EventManagerImpl*>(EventManager::get_instance())->next_event_time() - time(NULL);
-
-        if (timeout.tv_sec < 0)
-            timeout.tv_sec = 0;
-
-        select(1, &read, NULL, NULL, &timeout);
-
         do_receive_stuff();
-
-        try
-        {
-            static_cast<EventManagerImpl*>(EventManager::get_instance())->run_events();
-        }
-        catch (eir::Exception &e)
-        {
-            if (e.fatal())
-                throw;
-
-            Logger::get_instance()->Log(_bot, 0, Logger::Warning,
-                    "Error running events: " + e.message() + " (" + e.what() + ")");
-        }
+        return;
     }
+    catch (DisconnectedException & e)
+    {
+        reason = e.message();
+    }
+    catch (ConnectionError & e)
+    {
+        reason = e.message();
+    }
+
+    // Closed before anyone hears about it, so that nothing tries to
+    // write to a dead socket.
+    close_socket();
+    _lost(reason);
+}
 
-    EventManager::get_instance()->remove_event(_send_id);
+void Implementation<Server>::close_socket()
+{
+    stop();
+    connector.reset();
+    if (socketfd >= 0)
+        ::close(socketfd);
+    socketfd = -1;
+    recvpos = 0;
+    discarding = false;
+    recv_lines.clear();
 }
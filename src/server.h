@@ -7,6 +7,7 @@
 #include <ctime>
 
 #include "bot.h"
+#include "connector.h"
 
 namespace eir
 {
@@ -14,18 +15,45 @@ namespace eir
     {
         public:
             typedef std::function<void(std::string)> Handler;
-            Server(const Handler&, Bot *);
+
+            // Lines received go to the first handler. The second is given
+            // the server's name once connect() has a connection. If the
+            // connection is lost, it's closed and the reason given to the
+            // third. If connect() can't reach any server, the fourth is told
+            // why.
+            Server(const Handler&, const Handler&, const Handler&, const Handler&, Bot *);
             ~Server();
 
-            void connect(std::string host, std::string port);
+            // Starts connecting to the first of the servers that can be
+            // reached, on the calling thread's reactor, and returns.
+            void connect(const Connector::ServerList &);
+
+            // Registers the connection with the reactor, once there is one.
+            void start();
 
+            // Lines sent while still connecting wait until it's done.
             void send(std::string);
 
             void purge();
 
             void disconnect(std::string message);
 
-            void run();
+            // Closes the connection without a QUIT.
+            void close();
+
+            // Gives up the connection without closing it, leaving it open
+            // across a restart's exec, and describes it for adopt(): the
+            // socket, and whatever was read but not handled or queued but
+            // not sent.
+            Value release();
+
+            // Takes over a connection given up by release(). start() it as
+            // for a new one.
+            void adopt(const Value &);
+
+            // Sends a QUIT on a connection given up by release(), and closes
+            // it.
+            static void discard(const Value &, std::string reason);
 
             void set_throttle(int burst, int time, int num);
 
@@ -0,0 +1,107 @@
+#ifndef setting_handle_h
+#define setting_handle_h
+
+#include "bot.h"
+#include "times.h"
+
+#include <paludis/util/instantiation_policy.hh>
+
+#include <memory>
+#include <string>
+#include <cstdlib>
+#include <ctime>
+
+namespace eir
+{
+    // Conversions from a setting's text. A value that doesn't parse leaves
+    // the default in place.
+    inline void parse_setting(const std::string & s, std::string & out)
+    {
+        out = s;
+    }
+
+    inline void parse_setting(const std::string & s, int & out)
+    {
+        char *end;
+        long l = std::strtol(s.c_str(), &end, 10);
+        if (!s.empty() && *end == '\0')
+            out = l;
+    }
+
+    // Empty, 0, no, off and false are false; anything else is true.
+    inline void parse_setting(const std::string & s, bool & out)
+    {
+        out = !(s.empty() || s == "0" || s == "no" || s == "off" || s == "false");
+    }
+
+    // time_t settings are durations, as understood by parse_time: "30m" is
+    // thirty minutes, "1d" a day.
+    inline void parse_setting(const std::string & s, time_t & out)
+    {
+        if (!s.empty())
+            out = parse_time(s);
+    }
+
+    /*
+     * A per-bot setting, looked up and parsed once and then cached until
+     * something changes a setting. Declare one per setting, usually at
+     * namespace scope or as a module member, and call get() on the hot path:
+     * that costs a slot lookup on the bot and a generation comparison rather
+     * than a map lookup and a parse, and never throws for a missing setting.
+     * Each bot keeps its own cached value, so like the rest of the bot it's
+     * for the bot's reactor to ask after.
+     */
+    template <typename T_>
+    class SettingHandle : private paludis::InstantiationPolicy<SettingHandle<T_>, paludis::instantiation_method::NonCopyableTag>
+    {
+        private:
+            struct Cached
+            {
+                unsigned long generation;
+                T_ value;
+            };
+
+            std::string _name;
+            T_ _default;
+            unsigned int _slot;
+
+            void _refresh(Bot *b, Cached & c) const
+            {
+                c.generation = Bot::settings_generation();
+                c.value = _default;
+
+                Bot::SettingsIterator it = b->find_setting(_name);
+                if (it != b->end_settings())
+                    parse_setting(it->second.String(), c.value);
+            }
+
+        public:
+            SettingHandle(std::string name, T_ def = T_())
+                : _name(name), _default(def), _slot(Bot::new_slot())
+            { }
+
+            ~SettingHandle()
+            {
+                Bot::clear_slot(_slot);
+            }
+
+            const std::string & name() const { return _name; }
+
+            T_ get(Bot *b) const
+            {
+                Bot::Slot & slot = b->slot(_slot);
+                if (!slot)
+                    slot = std::make_shared<Cached>(Cached{ 0, _default });
+
+                Cached & c = *static_cast<Cached *>(slot.get());
+                if (c.generation != Bot::settings_generation())
+                    _refresh(b, c);
+
+                return c.value;
+            }
+
+            T_ operator() (Bot *b) const { return get(b); }
+    };
+}
+
+#endif
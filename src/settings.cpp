@@ -1,4 +1,5 @@
 #include "settings.h"
+#include "reactor.h"
 
 #include <map>
 
@@ -38,6 +39,11 @@ GlobalSettingsManager::iterator GlobalSettingsManager::find(std::string name)
 
 Value& GlobalSettingsManager::get(std::string name)
 {
+    std::map<std::string, Value>::iterator it = _imp->_map.find(name);
+    if (it != _imp->_map.end())
+        return it->second;
+
+    ExclusiveSection exclusive;
     return _imp->_map[name];
 }
 
@@ -51,16 +57,19 @@ Value GlobalSettingsManager::get_with_default(std::string name, Value _default)
 
 bool GlobalSettingsManager::add(std::string name, Value v)
 {
+    ExclusiveSection exclusive;
     return _imp->_map.insert(std::make_pair(name, v)).second;
 }
 
 size_t GlobalSettingsManager::remove(std::string n)
 {
+    ExclusiveSection exclusive;
     return _imp->_map.erase(n);
 }
 
 void GlobalSettingsManager::remove(GlobalSettingsManager::iterator it)
 {
+    ExclusiveSection exclusive;
     _imp->_map.erase(it.underlying_iterator<std::map<std::string, Value>::iterator>());
 }
 
@@ -1,5 +1,6 @@
 #include "storage.h"
 #include "handler.h"
+#include "reactor.h"
 
 #include <paludis/util/private_implementation_pattern-impl.hh>
 #include <paludis/util/instantiation_policy-impl.hh>
@@ -81,16 +82,30 @@ namespace paludis
             auto_saves.insert(make_pair(v, dest));
         }
 
+        // The saved values belong to everyone, so the regular save is done
+        // between passes with the other reactors stopped.
+        void auto_save_due()
+        {
+            Reactor::current()->post_exclusive(std::bind(&Implementation<StorageManager>::do_auto_saves, this,
+                                                         (const Message *)0));
+        }
+
         void do_auto_saves(const Message *)
         {
+            ExclusiveSection exclusive;
             for (auto it = auto_saves.begin(); it != auto_saves.end(); ++it)
             {
                 do_save(*it->first, it->second);
             }
         }
 
+        StorageManager::SaveFilter save_filter;
+
         void do_save(const eir::Value & v, std::string dest)
         {
+            if (save_filter && !save_filter(dest))
+                return;
+
             std::string type, destination;
             split_storage_dest(dest, type, destination);
 
@@ -109,7 +124,7 @@ namespace paludis
             : default_backend(0)
         {
             auto_save_event = EventManager::get_instance()->add_recurring_event(120,
-                                std::bind(&Implementation<StorageManager>::do_auto_saves, this, (const Message *)0));
+                                std::bind(&Implementation<StorageManager>::auto_save_due, this));
             shutdown_save_command = CommandRegistry::get_instance()->add_handler(
                                 filter_command_type("shutting_down", sourceinfo::Internal),
                                 std::bind(&Implementation<StorageManager>::do_auto_saves, this, std::placeholders::_1));
@@ -128,6 +143,7 @@ StorageManager::~StorageManager()
 
 void StorageManager::unregister_backend(StorageManager::BackendId id)
 {
+    ExclusiveSection exclusive;
     BackendList::iterator it = _imp->find_by_id(id);
     if (it != _imp->backends.end())
         _imp->backends.erase(it);
@@ -135,6 +151,7 @@ void StorageManager::unregister_backend(StorageManager::BackendId id)
 
 StorageManager::BackendId StorageManager::register_backend(std::string type, StorageBackend *be)
 {
+    ExclusiveSection exclusive;
     static StorageManager::BackendId next_id = 1;
 
     if (_imp->find_by_type(type) != _imp->backends.end())
@@ -152,11 +169,19 @@ StorageManager::BackendId StorageManager::register_backend(std::string type, Sto
 
 void StorageManager::auto_save(const eir::Value * v, std::string dest)
 {
+    ExclusiveSection exclusive;
     _imp->do_auto_save(v, dest);
 }
 
+void StorageManager::filter_saves(SaveFilter f)
+{
+    ExclusiveSection exclusive;
+    _imp->save_filter = f;
+}
+
 void StorageManager::Save(const eir::Value & v, std::string dest)
 {
+    ExclusiveSection exclusive;
     _imp->do_save(v, dest);
 }
 
@@ -175,11 +200,12 @@ eir::Value StorageManager::Load(std::string src)
 
 std::string StorageManager::default_backend()
 {
-    return _imp->default_backend->type;
+    return _imp->default_backend ? _imp->default_backend->type : std::string();
 }
 
 void StorageManager::default_backend(std::string type)
 {
+    ExclusiveSection exclusive;
     BackendList::iterator it = _imp->find_by_type(type);
 
     if (it == _imp->backends.end())
@@ -3,6 +3,8 @@
 
 #include "value.h"
 
+#include <functional>
+
 namespace eir
 {
     class StorageBackend
@@ -22,10 +24,16 @@ namespace eir
             eir::Value Load(std::string);
             void auto_save(const eir::Value *, std::string);
 
+            // While set, saves the function rejects are quietly skipped. For
+            // processes that mirror eir's state but don't own its files.
+            typedef std::function<bool (const std::string &)> SaveFilter;
+            void filter_saves(SaveFilter);
+
             typedef unsigned int BackendId;
             BackendId register_backend(std::string, StorageBackend *);
             void unregister_backend(BackendId);
 
+            // Empty if none has been chosen.
             std::string default_backend();
             void default_backend(std::string);
 
@@ -20,7 +20,7 @@ namespace eir
     {
         extern unsigned char tolowertab[256];
 
-        inline bool equal(std::string lhs, std::string rhs)
+        inline bool equal(const std::string & lhs, const std::string & rhs)
         {
             if (lhs.size() != rhs.size()) return false;
 
@@ -31,19 +31,19 @@ namespace eir
             return true;
         }
 
-        inline bool less(std::string lhs, std::string rhs)
+        inline bool less(const std::string & lhs, const std::string & rhs)
         {
             for (std::string::size_type i=0; ; i++)
             {
-                if (i == lhs.size()) return true;
                 if (i == rhs.size()) return false;
+                if (i == lhs.size()) return true;
                 if (tolowertab[(unsigned char)lhs[i]] < tolowertab[(unsigned char)rhs[i]]) return true;
                 if (tolowertab[(unsigned char)lhs[i]] > tolowertab[(unsigned char)rhs[i]]) return false;
             }
             return false;
         }
 
-        inline unsigned long hash(std::string arg)
+        inline unsigned long hash(const std::string & arg)
         {
             unsigned long ret = 5381;
             for (std::string::size_type i=0; i < arg.size(); ++i)
@@ -53,15 +53,15 @@ namespace eir
 
         struct is_equal
         {
-            bool operator() (std::string l, std::string r) const { return equal(l, r); }
+            bool operator() (const std::string & l, const std::string & r) const { return equal(l, r); }
         };
         struct is_less
         {
-            bool operator() (std::string l, std::string r) const { return less(l, r); }
+            bool operator() (const std::string & l, const std::string & r) const { return less(l, r); }
         };
         struct hasher
         {
-            bool operator() (std::string s) const { return hash(s); }
+            std::size_t operator() (const std::string & s) const { return hash(s); }
         };
     }
 }
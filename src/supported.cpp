@@ -1,9 +1,12 @@
 #include "supported.h"
 #include "exceptions.h"
 #include "handler.h"
+#include "bot.h"
+#include "client.h"
 
 #include <paludis/util/private_implementation_pattern-impl.hh>
 #include <cstdlib>
+#include <algorithm>
 
 using namespace eir;
 using namespace paludis;
@@ -13,6 +16,8 @@ namespace paludis
     template <>
     struct Implementation<ISupport> : public CommandHandlerBase<Implementation<ISupport> >
     {
+        Bot *_bot;
+
         std::set<std::string> simple_tokens;
         std::map<std::string, std::string> kv_tokens;
         int _max_modes;
@@ -26,14 +31,25 @@ namespace paludis
 
         std::string _chantypes;
 
+        // Lookup tables indexed by character, rebuilt whenever the strings
+        // above change so that per-mode queries are a single load.
+        signed char _prefix_index[256];
+        unsigned char _mode_type[256];
+        char _prefix_to_mode[256], _mode_to_prefix[256];
+        bool _is_chantype[256];
+
         void _populate(const Message *m);
+        void _add_token(std::string token);
         void _populate_prefix_modes(std::string);
+        void _remap_mode_bits(const std::string & old_modes);
         void _populate_chanmodes(std::string);
+        void _build_tables();
 
         CommandHolder _handler_id;
 
-        Implementation(Bot *b)
+        Implementation(Bot *b) : _bot(b)
         {
+            _build_tables();
             _handler_id = add_handler(filter_command("005").from_bot(b), &Implementation<ISupport>::_populate);
         }
         ~Implementation()
@@ -42,6 +58,41 @@ namespace paludis
     };
 }
 
+void Implementation<ISupport>::_build_tables()
+{
+    std::fill(_prefix_index, _prefix_index + 256, -1);
+    std::fill(_mode_type, _mode_type + 256, ISupport::unknown_mode);
+    std::fill(_prefix_to_mode, _prefix_to_mode + 256, 0);
+    std::fill(_mode_to_prefix, _mode_to_prefix + 256, 0);
+    std::fill(_is_chantype, _is_chantype + 256, false);
+
+    // Where a letter appears in more than one list, the earlier checks in
+    // the old string search won; filling in reverse keeps that.
+    const std::pair<const std::string *, ISupport::ModeType> types[] = {
+        std::make_pair(&_prefix_modes, ISupport::prefix_mode),
+        std::make_pair(&_oneparam_modes_2, ISupport::oneparam2_mode),
+        std::make_pair(&_oneparam_modes, ISupport::oneparam_mode),
+        std::make_pair(&_simple_modes, ISupport::simple_mode),
+        std::make_pair(&_list_modes, ISupport::list_mode)
+    };
+    for (unsigned int t = 0; t < sizeof(types) / sizeof(types[0]); ++t)
+        for (std::string::const_iterator it = types[t].first->begin(); it != types[t].first->end(); ++it)
+            _mode_type[(unsigned char)*it] = types[t].second;
+
+    for (std::string::size_type i = _prefix_modes.size(); i-- > 0; )
+    {
+        _prefix_index[(unsigned char)_prefix_modes[i]] = i;
+        if (i < _prefixes.size())
+        {
+            _mode_to_prefix[(unsigned char)_prefix_modes[i]] = _prefixes[i];
+            _prefix_to_mode[(unsigned char)_prefixes[i]] = _prefix_modes[i];
+        }
+    }
+
+    for (std::string::const_iterator it = _chantypes.begin(); it != _chantypes.end(); ++it)
+        _is_chantype[(unsigned char)*it] = true;
+}
+
 bool ISupport::mode_has_param(char mode_letter, bool adding /*= true*/) const
 {
     switch(get_mode_type(mode_letter))
@@ -59,24 +110,14 @@ bool ISupport::mode_has_param(char mode_letter, bool adding /*= true*/) const
     return false;
 }
 
-bool ISupport::is_channel_name(std::string name) const
+bool ISupport::is_channel_name(const std::string & name) const
 {
-    return _imp->_chantypes.find(name[0]) != std::string::npos;
+    return !name.empty() && _imp->_is_chantype[(unsigned char)name[0]];
 }
 
 ISupport::ModeType ISupport::get_mode_type(char mode_letter) const
 {
-    if(_imp->_list_modes.find(mode_letter) != std::string::npos)
-        return list_mode;
-    if(_imp->_simple_modes.find(mode_letter) != std::string::npos)
-        return simple_mode;
-    if(_imp->_oneparam_modes.find(mode_letter) != std::string::npos)
-        return oneparam_mode;
-    if(_imp->_oneparam_modes_2.find(mode_letter) != std::string::npos)
-        return oneparam2_mode;
-    if(_imp->_prefix_modes.find(mode_letter) != std::string::npos)
-        return prefix_mode;
-    return unknown_mode;
+    return ModeType(_imp->_mode_type[(unsigned char)mode_letter]);
 }
 
 void Implementation<ISupport>::_populate(const eir::Message *m)
@@ -86,41 +127,66 @@ void Implementation<ISupport>::_populate(const eir::Message *m)
     std::vector<std::string>::const_iterator it, ite;
     for(it = m->args.begin(), ite = m->args.end(); it != ite; ++it)
     {
-        std::string token = *it;
-        std::string::size_type idx;
-
-        if (token.find("are supported") != std::string::npos)
+        if (it->find("are supported") != std::string::npos)
             continue;
 
-        Message isupport_enabled(m->bot, "isupport_enabled", sourceinfo::Internal);
+        _add_token(*it);
+    }
+}
 
-        if ((idx = token.find('=')) != std::string::npos)
-        {
-            std::string name = token.substr(0, idx);
-            std::string value = token.substr(idx+1);
-
-            if (name == "CHANMODES")
-                _populate_chanmodes(value);
-            else if (name == "CHANTYPES")
-                _chantypes = value;
-            else if (name == "PREFIX")
-                _populate_prefix_modes(value);
-            else if (name == "MODES")
-                _max_modes = atoi(value.c_str());
-
-            kv_tokens[name] = value;
-
-            isupport_enabled.args.push_back(name);
-            isupport_enabled.args.push_back(value);
-        }
-        else
+void Implementation<ISupport>::_add_token(std::string token)
+{
+    std::string::size_type idx;
+
+    Message isupport_enabled(_bot, "isupport_enabled", sourceinfo::Internal);
+
+    if ((idx = token.find('=')) != std::string::npos)
+    {
+        std::string name = token.substr(0, idx);
+        std::string value = token.substr(idx+1);
+
+        if (name == "CHANMODES")
+            _populate_chanmodes(value);
+        else if (name == "CHANTYPES")
         {
-            simple_tokens.insert(simple_tokens.end(), token);
-            isupport_enabled.args.push_back(token);
+            _chantypes = value;
+            _build_tables();
         }
+        else if (name == "PREFIX")
+            _populate_prefix_modes(value);
+        else if (name == "MODES")
+            _max_modes = atoi(value.c_str());
+
+        kv_tokens[name] = value;
 
-        CommandRegistry::get_instance()->dispatch(&isupport_enabled);
+        isupport_enabled.args.push_back(name);
+        isupport_enabled.args.push_back(value);
     }
+    else
+    {
+        simple_tokens.insert(simple_tokens.end(), token);
+        isupport_enabled.args.push_back(token);
+    }
+
+    CommandRegistry::get_instance()->dispatch(&isupport_enabled);
+}
+
+Value ISupport::save() const
+{
+    Value ret(Value::array);
+    for (std::set<std::string>::const_iterator it = _imp->simple_tokens.begin(); it != _imp->simple_tokens.end(); ++it)
+        ret.push_back(*it);
+    for (std::map<std::string, std::string>::const_iterator it = _imp->kv_tokens.begin(); it != _imp->kv_tokens.end(); ++it)
+        ret.push_back(it->first + "=" + it->second);
+    return ret;
+}
+
+void ISupport::restore(const Value & tokens)
+{
+    if (tokens.Type() != Value::array)
+        return;
+    for (ValueArray::const_iterator it = tokens.Array().begin(); it != tokens.Array().end(); ++it)
+        _imp->_add_token(it->String());
 }
 
 void Implementation<ISupport>::_populate_prefix_modes(std::string value)
@@ -133,29 +199,60 @@ void Implementation<ISupport>::_populate_prefix_modes(std::string value)
     if (idx == std::string::npos)
         return;
 
+    std::string old_modes = _prefix_modes;
     _prefix_modes = value.substr(1, idx-1);
     _prefixes = value.substr(idx + 1);
+
+    _build_tables();
+
+    if (_prefix_modes != old_modes)
+        _remap_mode_bits(old_modes);
+}
+
+// Membership::mode_bits are by position in PREFIX, so they have to follow
+// each mode to its new place. Modes no longer listed are dropped.
+void Implementation<ISupport>::_remap_mode_bits(const std::string & old_modes)
+{
+    if (!_bot)
+        return;
+
+    uint32_t map[32] = { 0 };
+    for (std::string::size_type i = 0; i < old_modes.size() && i < 32; ++i)
+    {
+        int j = _prefix_index[(unsigned char)old_modes[i]];
+        if (j >= 0 && j < 32)
+            map[i] = uint32_t(1) << j;
+    }
+
+    for (Bot::ChannelIterator ch = _bot->begin_channels(); ch != _bot->end_channels(); ++ch)
+        for (Channel::MemberIterator m = (*ch)->begin_members(); m != (*ch)->end_members(); ++m)
+        {
+            uint32_t bits = 0;
+            for (int i = 0; i < 32; ++i)
+                if ((*m)->mode_bits & (uint32_t(1) << i))
+                    bits |= map[i];
+            (*m)->mode_bits = bits;
+        }
 }
 
-char ISupport::get_prefix_mode(char m) const
+int ISupport::prefix_mode_index(char m) const
 {
-    std::string::size_type i = _imp->_prefixes.find(m);
-    if (i == std::string::npos)
-        return 0;
-    return _imp->_prefix_modes[i];
+    return _imp->_prefix_index[(unsigned char)m];
+}
+
+char ISupport::get_prefix_mode(char p) const
+{
+    return _imp->_prefix_to_mode[(unsigned char)p];
 }
 
 char ISupport::get_mode_prefix(char m) const
 {
-    std::string::size_type i = _imp->_prefix_modes.find(m);
-    if (i == std::string::npos)
-        return 0;
-    return _imp->_prefixes[i];
+    return _imp->_mode_to_prefix[(unsigned char)m];
 }
 
 bool ISupport::is_mode_prefix(char p) const
 {
-    return _imp->_prefixes.find(p) != std::string::npos;
+    return _imp->_prefix_to_mode[(unsigned char)p] != 0;
 }
 
 void Implementation<ISupport>::_populate_chanmodes(std::string value)
@@ -172,6 +269,8 @@ void Implementation<ISupport>::_populate_chanmodes(std::string value)
     _oneparam_modes = value.substr(begin, end - begin);
     begin = end + 1;
     _simple_modes = value.substr(begin);
+
+    _build_tables();
 }
 
 ISupport::simple_iterator ISupport::begin_simple_tokens() const
@@ -209,6 +308,14 @@ ISupport::kv_iterator ISupport::find_kv(std::string s) const
     return _imp->kv_tokens.find(s);
 }
 
+std::pair<bool, std::string> ISupport::get_value(std::string s) const
+{
+    kv_iterator it = _imp->kv_tokens.find(s);
+    if (it == _imp->kv_tokens.end())
+        return std::make_pair(false, std::string());
+    return std::make_pair(true, it->second);
+}
+
 std::string ISupport::list_modes() const { return _imp->_list_modes; }
 std::string ISupport::simple_modes() const { return _imp->_simple_modes; }
 std::string ISupport::oneparam_modes() const { return _imp->_oneparam_modes; }
@@ -7,6 +7,8 @@
 #include <set>
 #include <map>
 
+#include "value.h"
+
 namespace eir
 {
     struct Message;
@@ -47,6 +49,9 @@ namespace eir
             std::string oneparam_modes() const;
             std::string prefix_modes() const;
 
+            // Position of a prefix mode in the PREFIX token, or -1.
+            int prefix_mode_index(char mode) const;
+
             char get_prefix_mode(char prefix) const;
             char get_mode_prefix(char mode) const;
 
@@ -56,7 +61,13 @@ namespace eir
 
             bool mode_has_param(char modeletter, bool adding = true) const;
 
-            bool is_channel_name(std::string) const;
+            bool is_channel_name(const std::string &) const;
+
+            // Every token the server has sent, and taking them back as
+            // though it had sent them again, for carrying them across a
+            // restart.
+            Value save() const;
+            void restore(const Value &);
 
             ISupport(Bot*);
             ~ISupport();
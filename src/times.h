@@ -10,10 +10,13 @@
 namespace eir
 {
     /* Parses "<number><unit>" into a number of seconds.
-     * h == hour, d == day, m == month (four weeks, for simplicity)
+     * m == minute, h == hour, d == day; no unit means seconds.
      */
-    time_t parse_time(std::string ts)
+    inline time_t parse_time(std::string ts)
     {
+        if (ts.empty())
+            return 0;
+
         std::string::iterator b = ts.begin(), e = ts.end();
         int val = 0, mult;
 
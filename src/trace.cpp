@@ -0,0 +1,342 @@
+#include "trace.h"
+#include "exceptions.h"
+#include "bot.h"
+
+#include <paludis/util/private_implementation_pattern-impl.hh>
+#include <paludis/util/instantiation_policy-impl.hh>
+
+#include <list>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include <unistd.h>
+
+using namespace eir;
+using namespace paludis;
+
+template class paludis::InstantiationPolicy<Tracer, paludis::instantiation_method::SingletonTag>;
+
+std::atomic<bool> Tracer::_enabled(false);
+
+namespace
+{
+    // Past this many spans a thread's buffer drops new ones, counting them,
+    // until it's next written out.
+    const std::size_t max_events_per_thread = 100000;
+
+    struct TraceEvent
+    {
+        const char *category;
+        std::string name;
+        uint64_t start, duration;
+        std::string args;
+    };
+
+    struct ThreadBuffer
+    {
+        std::mutex lock;
+        unsigned int tid;
+        std::vector<TraceEvent> events;
+        unsigned long dropped;
+
+        ThreadBuffer() : tid(0), dropped(0) { }
+    };
+
+    PALUDIS_TLS ThreadBuffer * thread_buffer = 0;
+    PALUDIS_TLS const char * current_owner = 0;
+
+    std::string json_escape(const std::string & s)
+    {
+        std::string ret;
+        ret.reserve(s.size());
+        for (std::string::const_iterator it = s.begin(); it != s.end(); ++it)
+        {
+            switch (*it)
+            {
+                case '"':  ret += "\\\""; break;
+                case '\\': ret += "\\\\"; break;
+                case '\n': ret += "\\n"; break;
+                case '\r': ret += "\\r"; break;
+                case '\t': ret += "\\t"; break;
+                default:
+                    if (static_cast<unsigned char>(*it) < 0x20)
+                    {
+                        char buf[8];
+                        snprintf(buf, sizeof(buf), "\\u%04x", *it);
+                        ret += buf;
+                    }
+                    else
+                        ret += *it;
+            }
+        }
+        return ret;
+    }
+}
+
+namespace paludis
+{
+    template <>
+    struct Implementation<Tracer>
+    {
+        std::mutex lock;
+        std::list<std::shared_ptr<ThreadBuffer> > buffers;
+        unsigned int next_tid;
+        std::string filename;
+
+        ThreadBuffer *buffer()
+        {
+            if (thread_buffer)
+                return thread_buffer;
+
+            std::shared_ptr<ThreadBuffer> b(new ThreadBuffer);
+            std::lock_guard<std::mutex> guard(lock);
+            b->tid = next_tid++;
+            buffers.push_back(b);
+            return thread_buffer = b.get();
+        }
+
+        Implementation() : next_tid(1)
+        { }
+    };
+}
+
+Tracer::Tracer()
+    : PrivateImplementationPattern<Tracer>(new Implementation<Tracer>)
+{
+}
+
+Tracer::~Tracer()
+{
+    _enabled = false;
+}
+
+uint64_t Tracer::now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void Tracer::start(std::string filename)
+{
+    std::lock_guard<std::mutex> guard(_imp->lock);
+    if (!filename.empty())
+        _imp->filename = filename;
+    if (_imp->filename.empty())
+        throw ConfigurationError("No trace output file specified");
+    _enabled = true;
+}
+
+void Tracer::stop()
+{
+    std::lock_guard<std::mutex> guard(_imp->lock);
+    _enabled = false;
+}
+
+void Tracer::finish()
+{
+    std::string filename;
+    {
+        std::lock_guard<std::mutex> guard(_imp->lock);
+        if (!_enabled.exchange(false) || _imp->filename.empty())
+            return;
+        filename = _imp->filename;
+    }
+    write(filename);
+}
+
+const std::string & Tracer::filename() const
+{
+    return _imp->filename;
+}
+
+void Tracer::record(const char *category, const std::string & name,
+                    uint64_t start, uint64_t duration, const std::string & args)
+{
+    ThreadBuffer *b = _imp->buffer();
+
+    std::lock_guard<std::mutex> guard(b->lock);
+    if (b->events.size() >= max_events_per_thread)
+    {
+        ++b->dropped;
+        return;
+    }
+
+    TraceEvent e;
+    e.category = category;
+    e.name = name;
+    e.start = start;
+    e.duration = duration;
+    e.args = args;
+    b->events.push_back(std::move(e));
+}
+
+void Tracer::write(std::string filename)
+{
+    if (filename.empty())
+        filename = _imp->filename;
+    if (filename.empty())
+        throw ConfigurationError("No trace output file specified");
+
+    std::ofstream out(filename.c_str());
+    if (!out)
+        throw IOError("Couldn't open trace file " + filename);
+
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+    bool first = true;
+    pid_t pid = getpid();
+
+    std::lock_guard<std::mutex> guard(_imp->lock);
+    for (auto b = _imp->buffers.begin(); b != _imp->buffers.end(); ++b)
+    {
+        std::vector<TraceEvent> events;
+        unsigned long dropped;
+        {
+            std::lock_guard<std::mutex> buffer_guard((*b)->lock);
+            std::swap(events, (*b)->events);
+            dropped = (*b)->dropped;
+            (*b)->dropped = 0;
+        }
+
+        if (first)
+            first = false;
+        else
+            out << ",";
+        out << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << (*b)->tid
+            << ",\"args\":{\"name\":\"eir-" << (*b)->tid << "\"}}";
+        if (dropped)
+            out << ",\n{\"name\":\"dropped_events\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << (*b)->tid
+                << ",\"args\":{\"count\":" << dropped << "}}";
+
+        for (auto e = events.begin(); e != events.end(); ++e)
+        {
+            out << ",\n{\"name\":\"" << json_escape(e->name) << "\",\"cat\":\"" << e->category
+                << "\",\"ph\":\"X\",\"ts\":" << e->start << ",\"dur\":" << e->duration
+                << ",\"pid\":" << pid << ",\"tid\":" << (*b)->tid
+                << ",\"args\":{" << e->args << "}}";
+        }
+    }
+
+    out << "\n]}\n";
+}
+
+void TraceSpan::_init(Bot *b)
+{
+    _start = Tracer::now();
+    if (b)
+        arg("bot", b->name());
+}
+
+TraceSpan & TraceSpan::arg(const char *key, const std::string & value)
+{
+    if (!_active)
+        return *this;
+
+    if (!_args.empty())
+        _args += ",";
+    _args += "\"";
+    _args += key;
+    _args += "\":\"" + json_escape(value) + "\"";
+    return *this;
+}
+
+void TraceSpan::finish()
+{
+    if (!_active || !Tracer::enabled())
+        return;
+
+    _active = false;
+
+    uint64_t end = Tracer::now();
+    Tracer::get_instance()->record(_category, _name ? std::string(_name) : _dynamic_name,
+                                   _start, end - _start, _args);
+}
+
+TraceSpan::~TraceSpan()
+{
+    finish();
+}
+
+TraceOwner::TraceOwner(std::string owner)
+    : _previous(current_owner), _owner(owner)
+{
+    current_owner = _owner.c_str();
+}
+
+TraceOwner::TraceOwner(const char *owner)
+    : _previous(current_owner)
+{
+    current_owner = owner;
+}
+
+TraceOwner::~TraceOwner()
+{
+    current_owner = _previous;
+}
+
+const char *TraceOwner::current()
+{
+    return current_owner ? current_owner : "core";
+}
+
+#include "handler.h"
+
+namespace
+{
+    struct TraceControl : public CommandHandlerBase<TraceControl>
+    {
+        CommandHolder trace_id;
+
+        void trace(const Message *m)
+        {
+            if (m->args.empty())
+            {
+                m->source->error("trace start [file] | stop | dump [file]");
+                return;
+            }
+
+            std::string file = m->args.size() > 1 ? m->args[1] : "";
+
+            if (m->args[0] == "start")
+            {
+                if (file.empty() && Tracer::get_instance()->filename().empty())
+                {
+                    m->source->error("Tracing needs an output file the first time: trace start <file>");
+                    return;
+                }
+                Tracer::get_instance()->start(file);
+                m->source->reply("Tracing enabled, writing to " + Tracer::get_instance()->filename() + ".");
+            }
+            else if (m->args[0] == "stop")
+            {
+                Tracer::get_instance()->stop();
+                m->source->reply("Tracing disabled.");
+            }
+            else if (m->args[0] == "dump")
+            {
+                Tracer::get_instance()->write(file);
+                m->source->reply("Trace written.");
+            }
+            else
+                m->source->error("Unknown trace subcommand " + m->args[0]);
+        }
+
+        TraceControl()
+        {
+            trace_id = add_handler(filter_command("trace").requires_privilege("admin").or_config(),
+                                   &TraceControl::trace);
+
+            const char *env = getenv("EIR_TRACE");
+            if (env && *env)
+                Tracer::get_instance()->start(env);
+        }
+    };
+
+    TraceControl tc;
+}
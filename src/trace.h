@@ -0,0 +1,119 @@
+#ifndef trace_h
+#define trace_h
+
+#include <paludis/util/private_implementation_pattern.hh>
+#include <paludis/util/instantiation_policy.hh>
+
+#include <string>
+#include <atomic>
+#include <stdint.h>
+
+namespace eir
+{
+    class Bot;
+
+    /*
+     * Collects timed spans and writes them out in the Chrome trace-event
+     * format, which chrome://tracing and Perfetto can both load.
+     *
+     * Spans are appended to a buffer belonging to the thread that recorded
+     * them. Nothing is recorded unless tracing has been switched on, either
+     * with the 'trace' command or by setting EIR_TRACE to an output file name
+     * in the environment. Each buffer holds a bounded number of spans between
+     * writes; any past that are counted and left out.
+     */
+    class Tracer : public paludis::PrivateImplementationPattern<Tracer>,
+                   public paludis::InstantiationPolicy<Tracer, paludis::instantiation_method::SingletonTag>
+    {
+        public:
+            static bool enabled() { return _enabled.load(std::memory_order_relaxed); }
+
+            // Microseconds since an arbitrary fixed point.
+            static uint64_t now();
+
+            // Keeps the previous file if none is given; there must be one.
+            void start(std::string filename = "");
+            void stop();
+
+            // Writes everything recorded so far to the given file (or the one
+            // given to start() if empty), and empties the buffers.
+            void write(std::string filename = "");
+
+            // For when the process is going away: stops tracing and, if it
+            // was on, writes it out. Safe to call from several threads; only
+            // the one that stops it writes.
+            void finish();
+
+            const std::string & filename() const;
+
+            void record(const char *category, const std::string & name,
+                        uint64_t start, uint64_t duration, const std::string & args);
+
+            Tracer();
+            ~Tracer();
+
+        private:
+            // Read by every reactor on every span.
+            static std::atomic<bool> _enabled;
+    };
+
+    /*
+     * RAII span. Records the time between construction and destruction as one
+     * complete event. When tracing is disabled this does nothing beyond testing
+     * a flag, so callers should avoid building argument strings unless
+     * the span is active.
+     */
+    class TraceSpan : private paludis::InstantiationPolicy<TraceSpan, paludis::instantiation_method::NonCopyableTag>
+    {
+        private:
+            const char *_category;
+            const char *_name;
+            std::string _dynamic_name;
+            std::string _args;
+            uint64_t _start;
+            bool _active;
+
+            void _init(Bot *);
+
+        public:
+            TraceSpan(const char *category, const char *name, Bot *b = 0)
+                : _category(category), _name(name), _start(0), _active(Tracer::enabled())
+            { if (_active) _init(b); }
+
+            TraceSpan(const char *category, const std::string & name, Bot *b = 0)
+                : _category(category), _name(0), _start(0), _active(Tracer::enabled())
+            { if (_active) { _dynamic_name = name; _init(b); } }
+
+            TraceSpan & arg(const char *key, const std::string & value);
+
+            bool active() const { return _active; }
+
+            // Records the span now rather than at destruction.
+            void finish();
+
+            ~TraceSpan();
+    };
+
+    /*
+     * While one of these is alive, handlers registered on this thread are
+     * attributed to the given owner in trace output. Handlers and events run
+     * with their owner current, so current() also says on whose behalf the
+     * running code is working.
+     */
+    class TraceOwner : private paludis::InstantiationPolicy<TraceOwner, paludis::instantiation_method::NonCopyableTag>
+    {
+        private:
+            const char *_previous;
+            std::string _owner;
+
+        public:
+            TraceOwner(std::string owner);
+            // Doesn't copy; the name must outlive this object.
+            explicit TraceOwner(const char *owner);
+            ~TraceOwner();
+
+            static const char *current();
+    };
+}
+
+#endif
@@ -8,6 +8,7 @@
 #include <paludis/util/wrapped_forward_iterator-impl.hh>
 
 #include <paludis/util/destringify.hh>
+#include <paludis/util/stringify.hh>
 
 using namespace eir;
 using namespace paludis;
@@ -603,6 +604,149 @@ std::ostream& eir::operator<<(std::ostream & os, const Value & v)
     return os;
 }
 
+// Each value is a type letter and what follows it: 'n' for empty, 'i'
+// and a number ended by ';', 's' and a length, ':' and that many bytes,
+// and 'a' or 'k' with a count and ':' ahead of the elements. Keys in 'k'
+// are encoded as strings without the 's'.
+namespace
+{
+    void encode_string(std::string & out, const std::string & s)
+    {
+        out += stringify(s.size());
+        out += ':';
+        out += s;
+    }
+
+    void encode(std::string & out, const Value & v)
+    {
+        switch (v.Type())
+        {
+            case Value::empty:
+                out += 'n';
+                return;
+            case Value::integer:
+                out += 'i';
+                out += stringify(v.Int());
+                out += ';';
+                return;
+            case Value::string:
+                out += 's';
+                encode_string(out, v.String());
+                return;
+            case Value::array:
+                out += 'a';
+                out += stringify(v.Array().size());
+                out += ':';
+                for (ValueArray::const_iterator it = v.Array().begin(); it != v.Array().end(); ++it)
+                    encode(out, *it);
+                return;
+            case Value::kvarray:
+                out += 'k';
+                out += stringify(v.KV().size());
+                out += ':';
+                for (KeyValueArray::const_iterator it = v.KV().begin(); it != v.KV().end(); ++it)
+                {
+                    encode_string(out, it->first);
+                    encode(out, it->second);
+                }
+                return;
+        }
+    }
+
+    struct Decoder
+    {
+        const std::string & in;
+        std::string::size_type pos;
+
+        Decoder(const std::string & s) : in(s), pos(0) { }
+
+        std::string::size_type read_number(char terminator)
+        {
+            std::string::size_type end = in.find(terminator, pos);
+            if (end == std::string::npos || end == pos)
+                throw MalformedValueError("expected a number at offset " + stringify(pos));
+            std::string digits = in.substr(pos, end - pos);
+            pos = end + 1;
+            return destringify<std::string::size_type>(digits);
+        }
+
+        std::string read_string()
+        {
+            std::string::size_type len = read_number(':');
+            if (len > in.size() - pos)
+                throw MalformedValueError("string runs past the end");
+            std::string ret = in.substr(pos, len);
+            pos += len;
+            return ret;
+        }
+
+        Value read()
+        {
+            if (pos >= in.size())
+                throw MalformedValueError("unexpected end");
+
+            switch (in[pos++])
+            {
+                case 'n':
+                    return Value();
+                case 'i':
+                    {
+                        std::string::size_type end = in.find(';', pos);
+                        if (end == std::string::npos)
+                            throw MalformedValueError("unterminated integer");
+                        int i = destringify<int>(in.substr(pos, end - pos));
+                        pos = end + 1;
+                        return Value(i);
+                    }
+                case 's':
+                    return Value(read_string());
+                case 'a':
+                    {
+                        Value ret(Value::array);
+                        for (std::string::size_type n = read_number(':'); n > 0; --n)
+                            ret.push_back(read());
+                        return ret;
+                    }
+                case 'k':
+                    {
+                        Value ret(Value::kvarray);
+                        for (std::string::size_type n = read_number(':'); n > 0; --n)
+                        {
+                            std::string key = read_string();
+                            ret.KV().insert(key, read());
+                        }
+                        return ret;
+                    }
+            }
+            throw MalformedValueError("unknown type at offset " + stringify(pos - 1));
+        }
+    };
+}
+
+std::string eir::serialise(const Value & v)
+{
+    std::string out;
+    encode(out, v);
+    return out;
+}
+
+Value eir::unserialise(const std::string & s)
+{
+    Decoder d(s);
+    Value ret;
+    try
+    {
+        ret = d.read();
+    }
+    catch (DestringifyError &)
+    {
+        throw MalformedValueError("bad number");
+    }
+    if (d.pos != s.size())
+        throw MalformedValueError("trailing data");
+    return ret;
+}
+
 namespace
 {
     const std::string & ValueTypeToString(Value::ValueType t)
@@ -146,6 +146,12 @@ namespace eir
 
     std::ostream & operator<<(std::ostream&, const Value&);
 
+    // A compact, length-prefixed encoding of a Value and everything in it,
+    // for passing state between processes. Strings may hold any bytes.
+    std::string serialise(const Value &);
+    // Throws MalformedValueError if the input isn't a whole encoded Value.
+    Value unserialise(const std::string &);
+
     inline std::string operator+(std::string lhs, const Value& rhs)
     { return lhs + rhs.String(); }
 
@@ -187,6 +193,12 @@ namespace eir
         public:
             TypeMismatchException(Value::ValueType expected, Value::ValueType found);
     };
+
+    class MalformedValueError : public Exception
+    {
+        public:
+            MalformedValueError(const std::string & what) : Exception("Malformed value: " + what) { }
+    };
 }
 
 #endif
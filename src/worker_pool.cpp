@@ -0,0 +1,220 @@
+#include "worker_pool.h"
+#include "reactor.h"
+#include "logger.h"
+
+#include <paludis/util/private_implementation_pattern-impl.hh>
+#include <paludis/util/instantiation_policy-impl.hh>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+
+using namespace eir;
+using namespace paludis;
+
+template class paludis::InstantiationPolicy<WorkerPool, paludis::instantiation_method::SingletonTag>;
+
+namespace
+{
+    struct QueuedJob
+    {
+        WorkerPool::Job job;
+        WorkerPool::Token token;
+        Reactor *origin;
+        QueuedJob(WorkerPool::Job j, WorkerPool::Token t, Reactor *o)
+            : job(std::move(j)), token(std::move(t)), origin(o) { }
+        QueuedJob() : origin(0) { }
+
+        bool live() const { return !token || *token; }
+    };
+
+    // Each worker takes from the back of its own queue, and steals from the
+    // front of the others' when that's empty.
+    struct Worker
+    {
+        std::mutex lock;
+        std::deque<QueuedJob> jobs;
+        std::thread thread;
+    };
+
+    // Which worker this thread is, or -1 off the pool, and the token and
+    // reactor of the job it's running.
+    PALUDIS_TLS int current_worker = -1;
+    PALUDIS_TLS const WorkerPool::Token *current_token = 0;
+    PALUDIS_TLS Reactor *current_origin = 0;
+}
+
+namespace paludis
+{
+    template <>
+    struct Implementation<WorkerPool>
+    {
+        std::vector<std::unique_ptr<Worker> > workers;
+        std::once_flag started;
+        std::atomic<unsigned> next_worker;
+
+        std::mutex sleep_lock;
+        std::condition_variable wake;
+        std::atomic<unsigned> queued;
+        bool stopping;
+
+        Implementation() : next_worker(0), queued(0), stopping(false)
+        {
+        }
+
+        bool take(unsigned self, QueuedJob & job)
+        {
+            {
+                std::lock_guard<std::mutex> guard(workers[self]->lock);
+                if (!workers[self]->jobs.empty())
+                {
+                    job = std::move(workers[self]->jobs.back());
+                    workers[self]->jobs.pop_back();
+                    return true;
+                }
+            }
+            for (unsigned i = 1; i < workers.size(); ++i)
+            {
+                Worker & victim = *workers[(self + i) % workers.size()];
+                std::lock_guard<std::mutex> guard(victim.lock);
+                if (!victim.jobs.empty())
+                {
+                    job = std::move(victim.jobs.front());
+                    victim.jobs.pop_front();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void work(unsigned self)
+        {
+            current_worker = self;
+            while (true)
+            {
+                QueuedJob job;
+                if (take(self, job))
+                {
+                    --queued;
+                    if (!job.live())
+                        continue;
+
+                    current_token = &job.token;
+                    current_origin = job.origin;
+                    try
+                    {
+                        job.job();
+                    }
+                    catch (std::exception & e)
+                    {
+                        std::string what = e.what();
+                        WorkerPool::get_instance()->complete([what] () {
+                            Logger::get_instance()->Log(0, 0, Logger::Warning, "Uncaught error in worker job: " + what);
+                        });
+                    }
+                    catch (...)
+                    {
+                        WorkerPool::get_instance()->complete([] () {
+                            Logger::get_instance()->Log(0, 0, Logger::Warning, "Uncaught unknown error in worker job");
+                        });
+                    }
+                    current_token = 0;
+                    current_origin = 0;
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> guard(sleep_lock);
+                wake.wait(guard, [this] () { return stopping || queued > 0; });
+                if (stopping)
+                    return;
+            }
+        }
+
+        void start()
+        {
+            unsigned n = std::thread::hardware_concurrency();
+            n = n < 2 ? 2 : n > 8 ? 8 : n;
+            for (unsigned i = 0; i < n; ++i)
+                workers.push_back(std::unique_ptr<Worker>(new Worker));
+            for (unsigned i = 0; i < n; ++i)
+                workers[i]->thread = std::thread(&Implementation<WorkerPool>::work, this, i);
+        }
+    };
+}
+
+WorkerPool::Token WorkerPool::new_token()
+{
+    return std::make_shared<std::atomic<bool> >(true);
+}
+
+void WorkerPool::cancel(const Token & token)
+{
+    *token = false;
+
+    // Dropped here rather than whenever the queues get to them, since they
+    // may hold code from a module that's about to be unloaded.
+    std::deque<QueuedJob> dropped;
+    for (auto w = _imp->workers.begin(); w != _imp->workers.end(); ++w)
+    {
+        std::lock_guard<std::mutex> guard((*w)->lock);
+        for (auto it = (*w)->jobs.begin(); it != (*w)->jobs.end(); )
+        {
+            if (it->token == token)
+            {
+                dropped.push_back(std::move(*it));
+                it = (*w)->jobs.erase(it);
+                --_imp->queued;
+            }
+            else
+                ++it;
+        }
+    }
+
+    Reactor::cancel(token);
+}
+
+void WorkerPool::submit(Job job, Token token)
+{
+    std::call_once(_imp->started, &Implementation<WorkerPool>::start, _imp.get());
+
+    // Jobs submitted by jobs report back to wherever the first one came from.
+    Reactor *origin = current_worker >= 0 ? current_origin : Reactor::current();
+
+    unsigned target = current_worker >= 0 ? current_worker : _imp->next_worker++ % _imp->workers.size();
+    {
+        std::lock_guard<std::mutex> guard(_imp->workers[target]->lock);
+        _imp->workers[target]->jobs.push_back(QueuedJob(std::move(job), std::move(token), origin));
+    }
+    {
+        std::lock_guard<std::mutex> guard(_imp->sleep_lock);
+        ++_imp->queued;
+    }
+    _imp->wake.notify_one();
+}
+
+void WorkerPool::complete(Job f, Token token)
+{
+    if (!token && current_token)
+        token = *current_token;
+
+    Reactor *target = current_worker >= 0 ? current_origin : Reactor::current();
+    (target ? target : Reactor::main())->post(std::move(f), std::move(token));
+}
+
+WorkerPool::WorkerPool()
+    : PrivateImplementationPattern<WorkerPool>(new Implementation<WorkerPool>)
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(_imp->sleep_lock);
+        _imp->stopping = true;
+    }
+    _imp->wake.notify_all();
+    for (auto it = _imp->workers.begin(); it != _imp->workers.end(); ++it)
+        (*it)->thread.join();
+}
@@ -0,0 +1,50 @@
+#ifndef worker_pool_h
+#define worker_pool_h
+
+#include <paludis/util/private_implementation_pattern.hh>
+#include <paludis/util/instantiation_policy.hh>
+
+#include <functional>
+#include <memory>
+#include <atomic>
+
+namespace eir
+{
+    /*
+     * A small work-stealing thread pool for work that shouldn't hold up a
+     * reactor, and the completions that bring results back to it.
+     *
+     * Jobs run on the pool and must not touch bots, clients, settings or
+     * anything else belonging to a reactor. Whatever they need to do there
+     * goes through complete(), whose functions are posted back to the
+     * reactor that submitted the job.
+     */
+    class WorkerPool : public paludis::PrivateImplementationPattern<WorkerPool>,
+                       public paludis::InstantiationPolicy<WorkerPool, paludis::instantiation_method::SingletonTag>
+    {
+        public:
+            typedef std::function<void ()> Job;
+
+            // Jobs and completions queued with a token are thrown away,
+            // not run, once it has been cancelled, so that whoever queued them
+            // can go away.
+            typedef std::shared_ptr<std::atomic<bool> > Token;
+            static Token new_token();
+
+            // Jobs already running aren't waited for.
+            void cancel(const Token &);
+
+            // Threads are started on first use.
+            void submit(Job, Token = Token());
+
+            // Runs f on the reactor the current job came from, or the
+            // calling thread's own. Called from a pool job, f takes on the
+            // job's token unless given one.
+            void complete(Job f, Token = Token());
+
+            WorkerPool();
+            ~WorkerPool();
+    };
+}
+
+#endif